@@ -0,0 +1,500 @@
+/******************************************************************************\
+* gptgen_bench                                                                 *
+* Micro- and end-to-end benchmarks of libgptgen, with results in JSON.         *
+*                                                                              *
+* Permission to use, copy, modify, and/or distribute this software for any     *
+* purpose with or without fee is hereby granted, provided that the above       *
+* copyright notice and this permission notice appear in all copies.            *
+*                                                                              *
+* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES     *
+* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF             *
+* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR      *
+* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES       *
+* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN        *
+* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF      *
+* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.               *
+\******************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+#include "libgptgen_internal.h"
+#include "synthdisk.h"
+
+using namespace std;
+
+/******************************************************************************\
+* bench_result: the outcome of one benchmark                                   *
+\******************************************************************************/
+struct bench_result {
+	string name;
+	string params; // JSON members describing the case, e.g. "\"size\": 92"
+	uint64_t iterations;
+	double ns_per_op;
+	double bytes_per_op; // for throughput, 0 if not meaningful
+	double items_per_op; // e.g. conversions per batch, 0 if not meaningful
+};
+
+static double min_time = 0.5; // seconds each benchmark runs for, at least
+static volatile uint32_t sink; // keeps results from being optimized away
+
+/******************************************************************************\
+* run_bench: time an operation, repeating it until min_time has passed         *
+* name, params: identify the benchmark in the results                          *
+* bytes, items: data processed and items completed by one operation            *
+* op: the operation                                                            *
+\******************************************************************************/
+template <typename F>
+static bench_result run_bench(const string &name, const string &params,
+							  double bytes, double items, F op)
+{
+	typedef chrono::steady_clock clock;
+	bench_result r = {name, params, 0, 0, bytes, items};
+	uint64_t n = 1;
+
+	op(); // warm up caches, and the CRC32 engine selection
+	for (;;) {
+		clock::time_point start = clock::now();
+
+		for (uint64_t i = 0; i < n; i++)
+			op();
+
+		double secs = chrono::duration<double>(clock::now() - start).count();
+
+		if (secs >= min_time || n >= (1ULL << 40)) {
+			r.iterations = n;
+			r.ns_per_op = secs * 1e9 / n;
+			break;
+		}
+		n = (secs > 0.01) ? (uint64_t)(n * min_time / secs * 1.1) + 1 : n*10;
+	}
+
+	cerr << name << " " << params << ": " << r.ns_per_op << " ns/op" << endl;
+	return r;
+}
+
+/******************************************************************************\
+* layout_params: describe a synthetic layout as JSON members                   *
+\******************************************************************************/
+static string layout_params(const synth_layout &l)
+{
+	ostringstream s;
+
+	s << "\"block_size\": " << l.block_size << ", \"disk_len\": "
+	  << l.disk_len << ", \"primaries\": " << l.primaries
+	  << ", \"logicals\": " << l.logicals;
+	return s.str();
+}
+
+/******************************************************************************\
+* make_layout: a synthetic layout on a disk large enough for its partitions    *
+\******************************************************************************/
+static synth_layout make_layout(uint32_t block_size, uint32_t logicals)
+{
+	synth_layout l = {0, block_size, 1, logicals, false};
+	uint64_t mib = 1024*1024 / block_size;
+
+	// 64 MiB, plus 1 MiB per 64 logical partitions
+	l.disk_len = (64 + logicals/64) * mib;
+	return l;
+}
+
+/******************************************************************************\
+* to_sectors: point gptgen_sector entries at synthetic boot records            *
+\******************************************************************************/
+static vector<gptgen_sector> to_sectors(const vector<synth_record> &records)
+{
+	vector<gptgen_sector> sectors(records.size());
+
+	for (size_t i = 0; i < records.size(); i++) {
+		sectors[i].lba = records[i].lba;
+		sectors[i].data = &records[i].data[0];
+	}
+	return sectors;
+}
+
+/******************************************************************************\
+* convert: run one in-memory conversion, return its status                     *
+\******************************************************************************/
+static int convert(const synth_layout &l, const vector<gptgen_sector> &sectors,
+				   vector<unsigned char> &primary,
+				   vector<unsigned char> &secondary)
+{
+	gptgen_geometry geom = {l.disk_len, l.block_size,
+							max<uint32_t>(128, l.primaries + l.logicals),
+							false, 0, NULL, NULL, 0};
+	gptgen_result res;
+
+	memset(&res, 0, sizeof(res));
+	res.primary = primary.empty() ? NULL : &primary[0];
+	res.primary_size = primary.size();
+	res.secondary = secondary.empty() ? NULL : &secondary[0];
+	res.secondary_size = secondary.size();
+
+	int ret = gptgen_convert(&geom, &sectors[0], sectors.size(), &res);
+
+	if (ret == GPTGEN_ENOSPACE) {
+		primary.resize(res.primary_len);
+		secondary.resize(res.secondary_len);
+		return convert(l, sectors, primary, secondary);
+	}
+	return ret;
+}
+
+/******************************************************************************\
+* bench_crc32: CRC32 throughput over a GPT header, array and larger buffers    *
+\******************************************************************************/
+static void bench_crc32(vector<bench_result> &results)
+{
+	static const size_t sizes[] = {92, 16384, 1024*1024};
+	vector<unsigned char> buf(64*1024*1024);
+
+	for (size_t i = 0; i < buf.size(); i++)
+		buf[i] = (unsigned char)(i * 2654435761U >> 24);
+
+	for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+		size_t len = sizes[i];
+
+		results.push_back(run_bench("crc32", "\"size\": " + to_string(len),
+			(double)len, 0, [&]() { sink = crc32(&buf[0], len); }));
+	}
+	results.push_back(run_bench("crc32_parallel",
+		"\"size\": " + to_string(buf.size()), (double)buf.size(), 0,
+		[&]() { sink = crc32_parallel(&buf[0], buf.size()); }));
+}
+
+/******************************************************************************\
+* bench_parse: parsing an MBR and its EBR chain with parse_tbl()               *
+\******************************************************************************/
+static void bench_parse(vector<bench_result> &results)
+{
+	static const uint32_t counts[] = {0, 100, 4000};
+
+	for (size_t i = 0; i < sizeof(counts)/sizeof(counts[0]); i++) {
+		synth_layout l = make_layout(512, counts[i]);
+		vector<synth_record> records;
+		vector<part> parts;
+
+		synth_records(l, records);
+		results.push_back(run_bench("parse_tbl", layout_params(l), 0,
+			(double)records.size(), [&]() {
+				uint32_t first = 0;
+
+				parts.clear();
+				for (size_t r = 0; r < records.size(); r++) {
+					const mbrpart *tbl =
+						(const mbrpart *)&records[r].data[446];
+					uint32_t next = parse_tbl(tbl, (uint32_t)records[r].lba,
+											  first, parts);
+
+					if (!r)
+						first = next;
+				}
+				sink = (uint32_t)parts.size();
+			}));
+	}
+}
+
+/******************************************************************************\
+* bench_types: mapping every MBR type to its GPT entry                         *
+\******************************************************************************/
+static void bench_types(vector<bench_result> &results)
+{
+	results.push_back(run_bench("type_mapping", "\"types\": 256", 0, 256,
+		[&]() {
+			uint32_t acc = 0;
+
+			for (int t = 0; t < 256; t++) {
+				part p = {(unsigned char)t, false, 2048, 4096};
+
+				if (lookup_type(p.type).action <= TYPE_GENERIC)
+					acc += make_gptpart(p).type.data1;
+			}
+			sink = acc;
+		}));
+}
+
+/******************************************************************************\
+* bench_assembly: building the partition array, headers and write plan         *
+\******************************************************************************/
+static void bench_assembly(vector<bench_result> &results)
+{
+	static const uint32_t counts[] = {4, 128, 4000};
+
+	for (size_t i = 0; i < sizeof(counts)/sizeof(counts[0]); i++) {
+		uint32_t count = counts[i], record_count = max<uint32_t>(128, count);
+		uint64_t disk_len = 1ULL << 30;
+		vector<gptpart> entries;
+		char mbr[446] = {0};
+
+		for (uint32_t k = 0; k < count; k++) {
+			part p = {0x83, false, 2048 + k*2048, 2048};
+
+			entries.push_back(make_gptpart(p));
+		}
+
+		ostringstream params;
+		params << "\"entries\": " << count << ", \"record_count\": "
+			   << record_count;
+		results.push_back(run_bench("table_assembly", params.str(), 0, 0,
+			[&]() {
+				PartitionArray table(entries, record_count, 512);
+				AlignedBuffer head(1024, 512), tail(512, 512);
+				WritePlan plan;
+
+				if (!table.ok() || !head.get() || !tail.get())
+					return;
+				build_gpt(table, mbr, false, disk_len, record_count, 512,
+						  empty_record.id, NULL, head.get(), tail.get(), plan);
+				sink = table.crc();
+			}));
+	}
+}
+
+/******************************************************************************\
+* bench_convert: gptgen_convert() on layouts supplied in memory                *
+\******************************************************************************/
+static void bench_convert(vector<bench_result> &results)
+{
+	static const uint32_t counts[] = {0, 100, 1000, 4000};
+	static const uint32_t sizes[] = {512, 4096};
+
+	for (size_t b = 0; b < 2; b++) {
+		for (size_t i = 0; i < sizeof(counts)/sizeof(counts[0]); i++) {
+			synth_layout l = make_layout(sizes[b], counts[i]);
+			vector<synth_record> records;
+			vector<unsigned char> primary, secondary;
+
+			synth_records(l, records);
+			vector<gptgen_sector> sectors = to_sectors(records);
+
+			results.push_back(run_bench("convert", layout_params(l), 0, 1,
+				[&]() { sink = convert(l, sectors, primary, secondary); }));
+		}
+	}
+}
+
+/******************************************************************************\
+* read_block: read one block of an image file                                  *
+\******************************************************************************/
+static bool read_block(ifstream &in, uint64_t lba, uint32_t block_size,
+					   vector<unsigned char> &buf)
+{
+	buf.resize(block_size);
+	in.seekg((streamoff)(lba * block_size));
+	in.read((char *)&buf[0], block_size);
+	return !in.fail();
+}
+
+/******************************************************************************\
+* bench_image: single-image latency, from a sparse image file to GPT files     *
+* Every iteration opens the image, reads the MBR and follows the EBR chain     *
+* one block at a time with gptgen_chain (as gptgen does), converts it once and *
+* writes both GPT copies out to files.                                         *
+\******************************************************************************/
+static void bench_image(vector<bench_result> &results, const string &dir)
+{
+	static const uint32_t counts[] = {0, 1000};
+	static const uint32_t sizes[] = {512, 4096};
+
+	for (size_t b = 0; b < 2; b++) {
+		for (size_t i = 0; i < sizeof(counts)/sizeof(counts[0]); i++) {
+			synth_layout l = make_layout(sizes[b], counts[i]);
+			string img = dir + "/gptgen_bench.img";
+			string out = dir + "/gptgen_bench.gpt";
+
+			if (synth_write(l, img) < 0) {
+				cerr << "Unable to write " << img << endl;
+				continue;
+			}
+
+			results.push_back(run_bench("image", layout_params(l), 0, 1,
+				[&]() {
+					vector<vector<unsigned char> > blocks(1);
+					vector<gptgen_sector> sectors;
+					vector<unsigned char> primary, secondary;
+					ifstream in(img.c_str(), ios_base::binary);
+					gptgen_chain *chain = gptgen_chain_new(0);
+					gptgen_sector s = {0, NULL};
+					uint64_t next;
+					int ret;
+
+					read_block(in, 0, l.block_size, blocks[0]);
+					sectors.push_back(s);
+					while (chain && gptgen_chain_next(chain,
+							   &blocks.back()[0], &next) == 1) {
+						blocks.push_back(vector<unsigned char>());
+						read_block(in, next, l.block_size, blocks.back());
+						s.lba = next;
+						sectors.push_back(s);
+					}
+					gptgen_chain_free(chain);
+					for (size_t k = 0; k < sectors.size(); k++)
+						sectors[k].data = &blocks[k][0];
+					ret = convert(l, sectors, primary, secondary);
+
+					ofstream gpt(out.c_str(), ios_base::binary);
+					gpt.write((const char *)&primary[0], primary.size());
+					gpt.write((const char *)&secondary[0], secondary.size());
+					sink = ret;
+				}));
+			remove(img.c_str());
+			remove(out.c_str());
+		}
+	}
+}
+
+/******************************************************************************\
+* bench_batch: conversions per second with one thread per hardware thread      *
+\******************************************************************************/
+static void bench_batch(vector<bench_result> &results)
+{
+	static const uint32_t counts[] = {4, 1000};
+	unsigned int nthreads = max(thread::hardware_concurrency(), 1U);
+	const unsigned int per_thread = 64;
+
+	for (size_t i = 0; i < sizeof(counts)/sizeof(counts[0]); i++) {
+		synth_layout l = make_layout(512, counts[i]);
+		vector<synth_record> records;
+
+		synth_records(l, records);
+		vector<gptgen_sector> sectors = to_sectors(records);
+
+		ostringstream params;
+		params << layout_params(l) << ", \"threads\": " << nthreads;
+		results.push_back(run_bench("batch", params.str(), 0,
+			(double)nthreads * per_thread, [&]() {
+				vector<thread> workers;
+
+				for (unsigned int t = 0; t < nthreads; t++) {
+					workers.push_back(thread([&]() {
+						vector<unsigned char> primary, secondary;
+
+						for (unsigned int k = 0; k < per_thread; k++)
+							convert(l, sectors, primary, secondary);
+					}));
+				}
+				for (size_t t = 0; t < workers.size(); t++)
+					workers[t].join();
+			}));
+	}
+}
+
+/******************************************************************************\
+* write_json: write the results as a JSON document                             *
+\******************************************************************************/
+static void write_json(ostream &out, const vector<bench_result> &results)
+{
+	out << "{" << endl;
+	out << "  \"version\": \"1.3\"," << endl;
+	out << "  \"crc32_engine\": \"" << crc32_engine_name() << "\"," << endl;
+	out << "  \"hardware_threads\": " << thread::hardware_concurrency()
+		<< "," << endl;
+	out << "  \"min_time\": " << min_time << "," << endl;
+	out << "  \"results\": [" << endl;
+	for (size_t i = 0; i < results.size(); i++) {
+		const bench_result &r = results[i];
+
+		out << "    {\"name\": \"" << r.name << "\", " << r.params
+			<< ", \"iterations\": " << r.iterations
+			<< ", \"ns_per_op\": " << r.ns_per_op;
+		if (r.bytes_per_op)
+			out << ", \"mb_per_s\": "
+				<< r.bytes_per_op / r.ns_per_op * 1e9 / (1024*1024);
+		if (r.items_per_op)
+			out << ", \"items_per_s\": " << r.items_per_op / r.ns_per_op * 1e9;
+		out << "}" << (i+1 < results.size() ? "," : "") << endl;
+	}
+	out << "  ]" << endl;
+	out << "}" << endl;
+}
+
+/******************************************************************************\
+* usage: print usage information.                                              *
+* name: name of the program, call with argv[0]                                 *
+\******************************************************************************/
+static void usage(char *name)
+{
+	cout << "Usage: " << name << " [<arguments>] [<benchmark>...]" << endl;
+	cout << "Benchmarks: crc32, parse, types, assembly, convert, image, "
+		 << "batch (default=all)" << endl;
+	cout << "-o <file>, --output <file>: write the JSON "
+		 << "results to <file>, not stdout" << endl;
+	cout << "-t <secs>, --min-time <secs>: run each "
+		 << "benchmark for at least <secs> (default=0.5)" << endl;
+	cout << "-d <dir>, --dir <dir>: create the image "
+		 << "benchmark's files in <dir> (default=.)" << endl;
+	cout << "--quick: same as --min-time 0.05" << endl;
+}
+
+/******************************************************************************\
+* main: run the selected benchmarks                                            *
+\******************************************************************************/
+int main(int argc, char *argv[])
+{
+	vector<bench_result> results;
+	vector<string> selected;
+	string output, dir = ".";
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		} else if (!strcmp(argv[i], "--quick")) {
+			min_time = 0.05;
+		} else if (argv[i][0] == '-' && i+1 >= argc) {
+			usage(argv[0]);
+			cout << argv[0] << ": Missing argument for " << argv[i] << "."
+				 << endl;
+			return EXIT_FAILURE;
+		} else if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
+			output = argv[++i];
+		} else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--min-time")) {
+			min_time = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--dir")) {
+			dir = argv[++i];
+		} else if (argv[i][0] == '-') {
+			usage(argv[0]);
+			cout << argv[0] << ": Invalid argument: " << argv[i] << "." << endl;
+			return EXIT_FAILURE;
+		} else {
+			selected.push_back(argv[i]);
+		}
+	}
+
+	crc32_init();
+
+#define SELECTED(x) (selected.empty() || \
+		find(selected.begin(), selected.end(), x) != selected.end())
+	if (SELECTED("crc32")) bench_crc32(results);
+	if (SELECTED("parse")) bench_parse(results);
+	if (SELECTED("types")) bench_types(results);
+	if (SELECTED("assembly")) bench_assembly(results);
+	if (SELECTED("convert")) bench_convert(results);
+	if (SELECTED("image")) bench_image(results, dir);
+	if (SELECTED("batch")) bench_batch(results);
+#undef SELECTED
+
+	if (output.length()) {
+		ofstream out(output.c_str());
+
+		write_json(out, results);
+		if (out.fail()) {
+			cout << "Unable to write " << output << "." << endl;
+			return EXIT_FAILURE;
+		}
+	} else {
+		write_json(cout, results);
+	}
+	return EXIT_SUCCESS;
+}
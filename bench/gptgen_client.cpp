@@ -0,0 +1,211 @@
+/******************************************************************************\
+* gptgen_client                                                                *
+* Sends requests to a gptgen --serve daemon and prints its answers, for        *
+* testing the daemon and as an example of the protocol.                        *
+*                                                                              *
+* Permission to use, copy, modify, and/or distribute this software for any     *
+* purpose with or without fee is hereby granted, provided that the above       *
+* copyright notice and this permission notice appear in all copies.            *
+*                                                                              *
+* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES     *
+* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF             *
+* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR      *
+* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES       *
+* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN        *
+* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF      *
+* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.               *
+\******************************************************************************/
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "gptgen_serve.h"
+
+using namespace std;
+
+/******************************************************************************\
+* transfer: read or write a whole buffer on a socket                           *
+* return value: 0 on success, -1 on error or if the daemon hung up             *
+\******************************************************************************/
+static int transfer(int fd, void *buf, size_t len, bool write)
+{
+	char *p = (char *)buf;
+
+	while (len) {
+		ssize_t n = write ? ::write(fd, p, len) : ::read(fd, p, len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/******************************************************************************\
+* absolute: make a path absolute, as the daemon doesn't share our directory    *
+\******************************************************************************/
+static string absolute(const string &path)
+{
+	char cwd[PATH_MAX];
+
+	if (path.empty() || path[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+		return path;
+	return string(cwd) + "/" + path;
+}
+
+/******************************************************************************\
+* request: send one request, and print the answers until its result            *
+* fd: the socket                                                               *
+* req: the request, without path_len and file_len                              *
+* path: the device                                                             *
+* file: the plan file of a SERVE_PLAN request, empty otherwise                 *
+* return value: the serve_status of the result, -1 if the connection failed    *
+\******************************************************************************/
+static int request(int fd, serve_request req, const string &path,
+				   const string &file)
+{
+	serve_msg msg = {SERVE_MAGIC, SERVE_REQUEST, 0, 0, 0};
+	string out;
+
+	req.path_len = (uint32_t)path.length();
+	req.file_len = (uint32_t)file.length();
+	msg.len = (uint32_t)(sizeof(req) + path.length() + file.length());
+	out.append((const char *)&msg, sizeof(msg));
+	out.append((const char *)&req, sizeof(req));
+	out += path + file;
+	if (transfer(fd, &out[0], out.length(), true) < 0)
+		return -1;
+
+	for (;;) {
+		string payload;
+
+		if (transfer(fd, &msg, sizeof(msg), false) < 0 ||
+			msg.len > SERVE_MSG_MAX)
+			return -1;
+		payload.resize(msg.len);
+		if (msg.len && transfer(fd, &payload[0], msg.len, false) < 0)
+			return -1;
+		cout << payload << endl;
+		if (msg.type == SERVE_RESULT)
+			return (int)msg.status;
+	}
+}
+
+/******************************************************************************\
+* usage: print usage information.                                              *
+* name: name of the program, call with argv[0]                                 *
+\******************************************************************************/
+static void usage(char *name)
+{
+	cout << "Usage: " << name << " [<arguments>] <socket> "
+		 << "scan|plan|convert|verify <device>..." << endl;
+	cout << "Every device is sent as a request, one after the other, on "
+		 << "a single connection." << endl;
+	cout << "-c nnn, --count nnn: GPT entries (default=the daemon's)" << endl;
+	cout << "--block-size nnn: block size (default=the daemon's, "
+		 << "or the device's)" << endl;
+	cout << "-d, --direct: bypass the OS cache" << endl;
+	cout << "-k, --keep-going: convert disks with boot partitions" << endl;
+	cout << "-m, --keepmbr: keep the existing MBR" << endl;
+	cout << "--max-ebrs n: limit on the EBR chain (default=the daemon's)"
+		 << endl;
+	cout << "-o <file>: with plan, the plan file to save (one device only)"
+		 << endl;
+	cout << "--verify: with convert, read the GPT back and check it" << endl;
+}
+
+/******************************************************************************\
+* main: send the requests                                                      *
+\******************************************************************************/
+int main(int argc, char *argv[])
+{
+	static const char *ops[] = {"", "scan", "plan", "convert", "verify"};
+	serve_request req;
+	struct sockaddr_un addr;
+	vector<string> args;
+	string file;
+	int fd, failed = 0;
+
+	memset(&req, 0, sizeof(req));
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--direct")) {
+			req.flags |= SERVE_DIRECT;
+		} else if (!strcmp(argv[i], "-k") ||
+				   !strcmp(argv[i], "--keep-going")) {
+			req.flags |= SERVE_BOOT;
+		} else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--keepmbr")) {
+			req.flags |= SERVE_KEEPMBR;
+		} else if (!strcmp(argv[i], "--verify")) {
+			req.flags |= SERVE_CHECK;
+		} else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		} else if (argv[i][0] == '-' && i+1 >= argc) {
+			usage(argv[0]);
+			cout << argv[0] << ": Missing argument for " << argv[i] << "."
+				 << endl;
+			return EXIT_FAILURE;
+		} else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--count")) {
+			req.record_count = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--block-size")) {
+			req.block_size = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--max-ebrs")) {
+			req.max_ebrs = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-o")) {
+			file = argv[++i];
+		} else if (argv[i][0] == '-') {
+			usage(argv[0]);
+			cout << argv[0] << ": Invalid argument: " << argv[i] << "." << endl;
+			return EXIT_FAILURE;
+		} else {
+			args.push_back(argv[i]);
+		}
+	}
+
+	for (uint32_t op = SERVE_SCAN; args.size() > 1 && op <= SERVE_VERIFY; op++)
+		if (args[1] == ops[op])
+			req.op = op;
+	if (args.size() < 3 || !req.op ||
+		(req.op == SERVE_PLAN) != (file.length() > 0) ||
+		(file.length() && args.size() > 3)) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, args[0].c_str(), sizeof(addr.sun_path)-1);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		cout << "Unable to connect to " << args[0] << "." << endl;
+		return EXIT_FAILURE;
+	}
+
+	for (size_t i = 2; i < args.size(); i++) {
+		int status = request(fd, req, absolute(args[i]), absolute(file));
+
+		if (status < 0) {
+			cout << "Lost the connection to " << args[0] << "." << endl;
+			close(fd);
+			return EXIT_FAILURE;
+		}
+		if (status != SERVE_OK)
+			failed++;
+	}
+	close(fd);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/******************************************************************************\
+* gptgen_mkdisk                                                                *
+* Generates sparse MBR/EBR-partitioned raw disk images for benchmarking and    *
+* testing gptgen.                                                              *
+*                                                                              *
+* Permission to use, copy, modify, and/or distribute this software for any     *
+* purpose with or without fee is hereby granted, provided that the above       *
+* copyright notice and this permission notice appear in all copies.            *
+*                                                                              *
+* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES     *
+* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF             *
+* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR      *
+* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES       *
+* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN        *
+* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF      *
+* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.               *
+\******************************************************************************/
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <stdint.h>
+
+#include "synthdisk.h"
+
+using namespace std;
+
+/******************************************************************************\
+* parse_size: parse a size in bytes, with an optional K, M, G or T suffix      *
+* return value: the size, 0 if it can't be parsed                              *
+\******************************************************************************/
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t n = strtoull(s, &end, 10);
+
+	switch (*end) {
+	case 'T': case 't': n <<= 10; // fall through
+	case 'G': case 'g': n <<= 10; // fall through
+	case 'M': case 'm': n <<= 10; // fall through
+	case 'K': case 'k': n <<= 10; end++; break;
+	case '\0': break;
+	default: return 0;
+	}
+	return *end ? 0 : n;
+}
+
+/******************************************************************************\
+* usage: print usage information.                                              *
+* name: name of the program, call with argv[0]                                 *
+\******************************************************************************/
+static void usage(char *name)
+{
+	cout << "Usage: " << name << " [<arguments>] <image>" << endl;
+	cout << "-s <size>, --size <size>: size of the disk, "
+		 << "with a K/M/G/T suffix (default=64M)" << endl;
+	cout << "-b nnn, --block-size nnn: block size, "
+		 << "512 (default) or 4096" << endl;
+	cout << "-p n, --primaries n: number of primary "
+		 << "partitions, 0 to 3 (default=1)" << endl;
+	cout << "-l n, --logicals n: number of logical "
+		 << "partitions (default=0)" << endl;
+	cout << "--boot: mark the first partition active" << endl;
+}
+
+/******************************************************************************\
+* main: write a synthetic disk image                                           *
+\******************************************************************************/
+int main(int argc, char *argv[])
+{
+	synth_layout layout = {0, 512, 1, 0, false};
+	uint64_t size = 64ULL*1024*1024;
+	string path;
+
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--boot")) {
+			layout.boot = true;
+		} else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		} else if (argv[i][0] == '-' && i+1 >= argc) {
+			usage(argv[0]);
+			cout << argv[0] << ": Missing argument for " << argv[i] << "."
+				 << endl;
+			return EXIT_FAILURE;
+		} else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--size")) {
+			size = parse_size(argv[++i]);
+		} else if (!strcmp(argv[i], "-b") ||
+				   !strcmp(argv[i], "--block-size")) {
+			layout.block_size = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-p") ||
+				   !strcmp(argv[i], "--primaries")) {
+			layout.primaries = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--logicals")) {
+			layout.logicals = atoi(argv[++i]);
+		} else if (argv[i][0] == '-' || path.length()) {
+			usage(argv[0]);
+			cout << argv[0] << ": Invalid argument: " << argv[i] << "." << endl;
+			return EXIT_FAILURE;
+		} else {
+			path = argv[i];
+		}
+	}
+
+	if (!path.length()) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	layout.disk_len = layout.block_size ? size / layout.block_size : 0;
+	if (synth_write(layout, path) < 0) {
+		cout << "Unable to write " << path << " (is the layout valid, and "
+			 << "does it fit on the disk?)" << endl;
+		return EXIT_FAILURE;
+	}
+
+	cout << path << ": " << layout.disk_len << " blocks of "
+		 << layout.block_size << " bytes, " << layout.primaries
+		 << " primary and " << layout.logicals << " logical partition(s)"
+		 << endl;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,161 @@
+/******************************************************************************\
+* synthdisk                                                                    *
+* Synthetic MBR/EBR disk layouts for benchmarking gptgen.                      *
+*                                                                              *
+* Permission to use, copy, modify, and/or distribute this software for any     *
+* purpose with or without fee is hereby granted, provided that the above       *
+* copyright notice and this permission notice appear in all copies.            *
+*                                                                              *
+* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES     *
+* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF             *
+* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR      *
+* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES       *
+* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN        *
+* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF      *
+* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.               *
+\******************************************************************************/
+
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "libgptgen_internal.h"
+#include "synthdisk.h"
+
+using namespace std;
+
+// Partition types handed out round-robin, so that the type mapping sees a mix
+// of MS, Linux, Apple and unknown (generic GUID) types.
+static const unsigned char synth_types[] = {
+	0x83, 0x07, 0x0C, 0x82, 0x8E, 0xAF, 0x27, 0x99
+};
+
+#define SYNTH_TYPE_COUNT (sizeof(synth_types)/sizeof(synth_types[0]))
+
+/******************************************************************************\
+* put_entry: fill in one of the four partition table entries of a boot record  *
+* rec: the boot record                                                         *
+* slot: index of the entry, 0 to 3                                             *
+* active, type, start, len: contents of the entry                              *
+\******************************************************************************/
+static void put_entry(vector<unsigned char> &rec, int slot, bool active,
+					  unsigned char type, uint32_t start, uint32_t len)
+{
+	struct mbrpart p;
+
+	memset(&p, 0, sizeof(p));
+	p.active = active ? 0x80 : 0x00;
+	p.type = type;
+	p.start = cpu_to_le32(start);
+	p.len = cpu_to_le32(len);
+	memcpy(&rec[446 + slot*sizeof(p)], &p, sizeof(p));
+}
+
+/******************************************************************************\
+* new_record: append an empty (signed) boot record to a list                   *
+\******************************************************************************/
+static vector<unsigned char> &new_record(vector<synth_record> &records,
+										 uint64_t lba, uint32_t block_size)
+{
+	synth_record r;
+
+	r.lba = lba;
+	r.data.assign(block_size, 0);
+	r.data[510] = 0x55;
+	r.data[511] = 0xAA;
+	records.push_back(r);
+	return records.back().data;
+}
+
+/******************************************************************************\
+* synth_records: generate the boot records of a synthetic disk                 *
+* layout: the shape of the disk                                                *
+* records: receives the MBR and the EBR chain, in disk order                   *
+* return value: 0 on success, -1 if the layout doesn't fit on the disk         *
+\******************************************************************************/
+int synth_records(const synth_layout &layout,
+				  vector<synth_record> &records)
+{
+	uint32_t bs = layout.block_size;
+	uint64_t mib = 1024*1024 / bs;
+	uint64_t first = mib, end = layout.disk_len - mib;
+	uint32_t slots = layout.primaries + (layout.logicals ? 1 : 0);
+	uint64_t slot, ext_start, ext_len, per;
+	unsigned int type = 0;
+
+	records.clear();
+	if ((bs != 512 && bs != 4096) || layout.primaries > 3 ||
+		layout.disk_len < 4*mib || layout.disk_len > 0xFFFFFFFFULL)
+		return -1;
+
+	vector<unsigned char> &mbr = new_record(records, 0, bs);
+
+	if (!slots)
+		return 0;
+	slot = (end - first) / slots;
+	if (slot >= mib)
+		slot -= slot % mib; // keep partitions MiB-aligned where possible
+	if (!slot)
+		return -1;
+
+	for (uint32_t i = 0; i < layout.primaries; i++) {
+		put_entry(mbr, i, layout.boot && i == 0,
+				  synth_types[type++ % SYNTH_TYPE_COUNT],
+				  (uint32_t)(first + i*slot), (uint32_t)slot);
+	}
+	if (!layout.logicals)
+		return 0;
+
+	ext_start = first + layout.primaries*slot;
+	ext_len = end - ext_start;
+	per = ext_len / layout.logicals;
+	if (per < 2)
+		return -1;
+	put_entry(mbr, layout.primaries, false, 0x0F, (uint32_t)ext_start,
+			  (uint32_t)ext_len);
+
+	// Every logical partition is preceded by its EBR, which points at the
+	// partition (relative to itself) and at the next EBR (relative to the
+	// start of the extended partition).
+	for (uint32_t i = 0; i < layout.logicals; i++) {
+		vector<unsigned char> &ebr = new_record(records, ext_start + i*per, bs);
+
+		put_entry(ebr, 0, layout.boot && !layout.primaries && i == 0,
+				  synth_types[type++ % SYNTH_TYPE_COUNT], 1,
+				  (uint32_t)(per - 1));
+		if (i+1 < layout.logicals)
+			put_entry(ebr, 1, false, 0x05, (uint32_t)((i+1)*per),
+					  (uint32_t)per);
+	}
+
+	return 0;
+}
+
+/******************************************************************************\
+* synth_write: write a synthetic disk to a sparse raw image                    *
+* layout: the shape of the disk                                                *
+* path: the image to create (or overwrite)                                     *
+* Only the boot records and the last byte of the image are written, so on      *
+* filesystems with sparse file support the image takes up next to no space.    *
+\******************************************************************************/
+int synth_write(const synth_layout &layout, const string &path)
+{
+	vector<synth_record> records;
+	ofstream out;
+
+	if (synth_records(layout, records) < 0)
+		return -1;
+
+	out.open(path.c_str(), ios_base::binary | ios_base::trunc);
+	for (size_t i = 0; i < records.size(); i++) {
+		out.seekp((streamoff)(records[i].lba * layout.block_size));
+		out.write((const char *)&records[i].data[0], records[i].data.size());
+	}
+	out.seekp((streamoff)(layout.disk_len * layout.block_size - 1));
+	out.put(0);
+	out.close();
+
+	return out.fail() ? -1 : 0;
+}
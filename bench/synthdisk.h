@@ -0,0 +1,51 @@
+/******************************************************************************\
+* synthdisk                                                                    *
+* Synthetic MBR/EBR disk layouts for benchmarking gptgen.                      *
+*                                                                              *
+* Permission to use, copy, modify, and/or distribute this software for any     *
+* purpose with or without fee is hereby granted, provided that the above       *
+* copyright notice and this permission notice appear in all copies.            *
+*                                                                              *
+* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES     *
+* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF             *
+* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR      *
+* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES       *
+* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN        *
+* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF      *
+* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.               *
+\******************************************************************************/
+
+#ifndef SYNTHDISK_H
+#define SYNTHDISK_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/******************************************************************************\
+* synth_layout: the shape of a synthetic disk                                  *
+* The disk has up to three primary partitions, followed by an extended         *
+* partition holding the logical partitions (if there are any). The first and   *
+* last MiB are left free, so the result always converts with 128 GPT entries.  *
+\******************************************************************************/
+struct synth_layout {
+	uint64_t disk_len; // capacity, in blocks
+	uint32_t block_size; // 512 or 4096
+	uint32_t primaries; // 0 to 3 primary partitions
+	uint32_t logicals; // 0 or more logical partitions
+	bool boot; // mark the first partition active
+};
+
+/******************************************************************************\
+* synth_record: one boot record (MBR or EBR) of a synthetic disk               *
+\******************************************************************************/
+struct synth_record {
+	uint64_t lba;
+	std::vector<unsigned char> data; // a whole block
+};
+
+int synth_records(const synth_layout &layout,
+				  std::vector<synth_record> &records);
+int synth_write(const synth_layout &layout, const std::string &path);
+
+#endif // SYNTHDISK_H
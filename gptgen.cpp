@@ -19,668 +19,5813 @@
 \******************************************************************************/
 
 #include <algorithm>
-#include <cmath>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
+#include <condition_variable>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 #include <stdint.h>
 
 #ifdef WINDOWS_BUILD
 #include <windows.h>
 #include <winioctl.h>
+#include <bcrypt.h>
+#include <fcntl.h>
+#include <io.h>
 #elif MACOS_BUILD
 #include <sys/ioctl.h>
+#include <sys/clonefile.h>
 #include <sys/disk.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <unistd.h>
 #else
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <linux/fs.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <unistd.h>
 #endif
 
-// We don't have unistd.h on Windows, so define the missing integer types.
-#ifdef WINDOWS_BUILD
-typedef uint64_t __be64;
-#elif MACOS_BUILD
-typedef uint64_t __u64;
-typedef uint64_t __be64;
+#include "libgptgen_internal.h"
+#include "gptgen_serve.h"
+
+#ifdef MACOS_BUILD
 #define BLKSSZGET DKIOCGETBLOCKSIZE
+#define BLKPBSZGET DKIOCGETPHYSICALBLOCKSIZE
 #define BLKGETSIZE DKIOCGETBLOCKCOUNT
 #endif
 
-#if defined(__GNUC__)
-#define ATTRIBUTE_PACKED __attribute__((packed))
-#elif defined(_MSC_VER)
-#define ATTRIBUTE_PACKED __pragma(pack(pop, r1))
-#else
-#error "Cannot eliminate structure padding"
+// io_uring needs both the kernel's header and the C library's syscall number.
+#if defined(HAVE_IO_URING) && defined(__NR_io_uring_setup)
+#define USE_IO_URING
+#endif
+
+#if !defined(WINDOWS_BUILD) && !defined(IOV_MAX)
+#define IOV_MAX 1024
 #endif
 
 using namespace std;
 
-#define GPT_MAGIC {0x45, 0x46, 0x49, 0x20, 0x50, 0x41, 0x52, 0x54} // "EFI PART"
-#define GPT_V1 {0x00, 0x00, 0x01, 0x00}
+#ifndef WINDOWS_BUILD
+/******************************************************************************\
+* pwritev_extent: write one extent of a write plan with pwritev                *
+* fd: file descriptor to write to                                              *
+* offset: byte offset to write the extent at                                   *
+* e: the extent                                                                *
+* calls: incremented for every pwritev issued, may be NULL                     *
+* Extents with more than IOV_MAX segments take several calls.                  *
+\******************************************************************************/
+int pwritev_extent(int fd, uint64_t offset, const plan_extent &e,
+				   unsigned long *calls)
+{
+	vector<struct iovec> iov;
+
+	for (size_t i = 0; i < e.segs.size(); i += IOV_MAX) {
+		size_t n = min<size_t>(IOV_MAX, e.segs.size() - i);
+		ssize_t len = 0;
 
-#define PART_FLAG_SYSTEM (1ULL<<0)
-#define PART_FLAG_RDONLY (1ULL<<60)
-#define PART_FLAG_HIDDEN (1ULL<<62)
-#define PART_FLAG_NOMOUNT (1ULL<<63)
+		iov.resize(n);
+		for (size_t j = 0; j < n; j++) {
+			iov[j].iov_base = (void *)e.segs[i+j].buf;
+			iov[j].iov_len = e.segs[i+j].len;
+			len += e.segs[i+j].len;
+		}
+		if (calls)
+			(*calls)++;
+		if (pwritev(fd, &iov[0], (int)n, offset) != len)
+			return -1;
+		offset += len;
+	}
+
+	return 0;
+}
+#endif
 
+#ifdef USE_IO_URING
 /******************************************************************************\
-* swapXX, keepXX, cpu_to_XeXX: endianness helper functions/pointers            *
+* IoRing: a minimal io_uring submission/completion queue pair                  *
+* Requests are queued with prep(), handed to the kernel (all at once) with     *
+* submit(), and their completions collected with reap(). Only the raw system   *
+* calls are used, so there is no dependency on liburing. init() fails if the   *
+* kernel doesn't support io_uring (or it is disabled, e.g. by seccomp), and    *
+* the caller is expected to fall back to plain blocking I/O then. A single     *
+* buffer can be registered with the kernel for IORING_OP_*_FIXED requests.     *
 \******************************************************************************/
+class IoRing {
+public:
+	IoRing();
+	~IoRing();
+
+	int init(unsigned int entries);
+	unsigned int depth() const { return sq_entries; }
+	struct io_uring_sqe *prep(uint8_t op, int fd, void *buf, uint32_t len,
+							  uint64_t off, uint64_t data);
+	int submit(unsigned int wait);
+	bool reap(uint64_t *data, int *res);
+	int register_buffer(void *buf, size_t len);
+	void unregister_buffer();
+
+private:
+	IoRing(const IoRing &);
+	IoRing &operator=(const IoRing &);
+
+	int ring;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	unsigned int sq_entries;
+	unsigned int sqe_tail; // tail of the queue, published by submit()
+	unsigned int queued; // prepared but not yet submitted
+	bool registered;
+};
+
+IoRing::IoRing()
+	: ring(-1), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), sq_ring_len(0),
+	  cq_ring_len(0), sqes((struct io_uring_sqe *)MAP_FAILED), sqes_len(0),
+	  sq_entries(0), sqe_tail(0), queued(0), registered(false)
+{
+}
 
-inline uint16_t swap16(uint16_t x)
+IoRing::~IoRing()
 {
-	return ((x)<<8)|((x)>>8);
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqes_len);
+	if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_len);
+	if (sq_ring != MAP_FAILED)
+		munmap(sq_ring, sq_ring_len);
+	if (ring >= 0)
+		::close(ring);
 }
 
-inline uint16_t keep16(uint16_t x)
+/******************************************************************************\
+* IoRing::init: set up the rings                                               *
+* entries: number of submission queue entries, rounded up by the kernel        *
+\******************************************************************************/
+int IoRing::init(unsigned int entries)
 {
-	return x;
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	ring = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (ring < 0)
+		return -1;
+
+	sq_ring_len = p.sq_off.array + p.sq_entries*sizeof(unsigned int);
+	cq_ring_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_len = cq_ring_len = max(sq_ring_len, cq_ring_len);
+	sq_ring = mmap(NULL, sq_ring_len, PROT_READ|PROT_WRITE,
+				   MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	if (sq_ring == MAP_FAILED)
+		return -1;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ring = sq_ring;
+	else
+		cq_ring = mmap(NULL, cq_ring_len, PROT_READ|PROT_WRITE,
+					   MAP_SHARED|MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+	if (cq_ring == MAP_FAILED)
+		return -1;
+	sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe *)mmap(NULL, sqes_len, PROT_READ|PROT_WRITE,
+									   MAP_SHARED|MAP_POPULATE, ring,
+									   IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return -1;
+
+	sq = (char *)sq_ring;
+	sq_head = (unsigned int *)(sq + p.sq_off.head);
+	sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	sq_array = (unsigned int *)(sq + p.sq_off.array);
+	cq = (char *)cq_ring;
+	cq_head = (unsigned int *)(cq + p.cq_off.head);
+	cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	sq_entries = p.sq_entries;
+	sqe_tail = *sq_tail;
+	return 0;
 }
 
-inline uint32_t swap32(uint32_t x)
+/******************************************************************************\
+* IoRing::prep: queue one request                                              *
+* op: the IORING_OP_* operation                                                *
+* fd, buf, len, off: its file descriptor, buffer, length and byte offset       *
+* data: handed back by reap() when the request completes                       *
+* return value: the queue entry, for the caller to set any flags on until      *
+* submit(); NULL if the submission queue is full                               *
+\******************************************************************************/
+struct io_uring_sqe *IoRing::prep(uint8_t op, int fd, void *buf,
+								  uint32_t len, uint64_t off, uint64_t data)
 {
-	return (x<<24) |
-		   ((x<<8) & 0x00FF0000) |
-		   ((x>>8) & 0x0000FF00) |
-		   (x>>24);
+	struct io_uring_sqe *sqe;
+
+	if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+		return NULL;
+	sqe = &sqes[sqe_tail & *sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = data;
+	sq_array[sqe_tail & *sq_mask] = sqe_tail & *sq_mask;
+	sqe_tail++;
+	queued++;
+	return sqe;
 }
 
-uint32_t keep32(uint32_t x)
+/******************************************************************************\
+* IoRing::submit: hand the queued requests to the kernel                       *
+* wait: number of completions to wait for, 0 to return right away              *
+\******************************************************************************/
+int IoRing::submit(unsigned int wait)
 {
-	return x;
+	int ret;
+
+	__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+	do {
+		ret = (int)syscall(__NR_io_uring_enter, ring, queued, wait,
+						   wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
+	queued -= min<unsigned int>(queued, (unsigned int)ret);
+	return 0;
 }
 
-uint64_t swap64(uint64_t x)
+/******************************************************************************\
+* IoRing::reap: collect one completion, if there is any                        *
+* data: receives the data the request was queued with                          *
+* res: receives its result, as the matching system call would return it        *
+* return value: false if no request has completed                              *
+\******************************************************************************/
+bool IoRing::reap(uint64_t *data, int *res)
 {
-	return (x<<56) |
-		   ((x<<40) & 0x00FF000000000000ULL) |
-		   ((x<<24) & 0x0000FF0000000000ULL) |
-		   ((x<<8)  & 0x000000FF00000000ULL) |
-		   ((x>>8)  & 0x00000000FF000000ULL) |
-		   ((x>>24) & 0x0000000000FF0000ULL) |
-		   ((x>>40) & 0x000000000000FF00ULL) |
-		   (x>>56);
+	unsigned int head = *cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+	cqe = &cqes[head & *cq_mask];
+	*data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
 }
 
-uint64_t keep64(uint64_t x)
+/******************************************************************************\
+* IoRing::register_buffer: pin a buffer for IORING_OP_*_FIXED requests         *
+* buf, len: the buffer; requests may use any part of it, with buf_index 0      *
+* return value: -1 if the kernel refused (e.g. over RLIMIT_MEMLOCK), in which  *
+* case the plain (non-fixed) requests still work                               *
+\******************************************************************************/
+int IoRing::register_buffer(void *buf, size_t len)
 {
-	return x;
+	struct iovec iov;
+
+	unregister_buffer();
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	if (syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS, &iov,
+				1) < 0)
+		return -1;
+	registered = true;
+	return 0;
 }
 
-uint16_t (*cpu_to_be16) (uint16_t x);
-uint32_t (*cpu_to_be32) (uint32_t x);
-uint64_t (*cpu_to_be64) (uint64_t x);
-uint16_t (*cpu_to_le16) (uint16_t x);
-uint32_t (*cpu_to_le32) (uint32_t x);
-uint64_t (*cpu_to_le64) (uint64_t x);
+/******************************************************************************\
+* IoRing::unregister_buffer: release the buffer pinned by register_buffer()    *
+\******************************************************************************/
+void IoRing::unregister_buffer()
+{
+	if (registered)
+		syscall(__NR_io_uring_register, ring, IORING_UNREGISTER_BUFFERS, NULL,
+				0);
+	registered = false;
+}
+#endif
 
-#define be16_to_cpu cpu_to_be16
-#define be32_to_cpu cpu_to_be32
-#define be64_to_cpu cpu_to_be64
-#define le16_to_cpu cpu_to_le16
-#define le32_to_cpu cpu_to_le32
-#define le64_to_cpu cpu_to_le64
+/******************************************************************************\
+* io_stats: counters for the system calls issued against a device              *
+* Reads, writes and syncs issued through io_uring are counted like the rest,   *
+* but also in ring_ops, since they are requests rather than system calls; the  *
+* io_uring_enter calls that carried them are counted in submits.               *
+\******************************************************************************/
+struct io_stats {
+	unsigned long opens;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long syncs;
+	unsigned long queries; // ioctl/fstat/DeviceIoControl
+	unsigned long maps; // mmap/madvise/posix_fadvise/munmap/buffer pinning
+	unsigned long submits; // io_uring_enter
+	unsigned long ring_ops; // reads/writes/syncs issued through io_uring
+	uint64_t read_bytes; // transferred by the reads above
+	uint64_t write_bytes; // transferred by the writes above
+	double sync_secs; // total time spent in the syncs above
+	double sync_max_secs; // the slowest of them
+};
 
 /******************************************************************************\
-* setup_endian: set up the endianness helper mapping for the running system    *
+* note_sync: account for one flush barrier in a set of I/O counters            *
+* st: the counters                                                             *
+* start: when the barrier was issued                                           *
 \******************************************************************************/
-void setup_endian() {
-	unsigned char test[2] = {0x00, 0xFF};
+static void note_sync(io_stats &st, chrono::steady_clock::time_point start)
+{
+	double secs = chrono::duration<double>(chrono::steady_clock::now() -
+										   start).count();
 
-	if (*(uint16_t *)test == 0xFF00) { // little endian
-		cpu_to_be16 = swap16;
-		cpu_to_be32 = swap32;
-		cpu_to_be64 = swap64;
-		cpu_to_le16 = keep16;
-		cpu_to_le32 = keep32;
-		cpu_to_le64 = keep64;
-	} else { // big endian
-		cpu_to_be16 = keep16;
-		cpu_to_be32 = keep32;
-		cpu_to_be64 = keep64;
-		cpu_to_le16 = swap16;
-		cpu_to_le32 = swap32;
-		cpu_to_le64 = swap64;
-	}
+	st.syncs++;
+	st.sync_secs += secs;
+	st.sync_max_secs = max(st.sync_max_secs, secs);
 }
 
-struct __guid {
-	uint32_t data1;
-	uint16_t data2;
-	uint16_t data3;
-	__be64 data4;
-}ATTRIBUTE_PACKED;
+/******************************************************************************\
+* sync_mode: how the final flush barrier commits writes to stable storage      *
+\******************************************************************************/
+enum sync_mode {
+	SYNC_FSYNC, // fsync (which covers mapped regions too), the default
+	SYNC_FDATASYNC, // fdatasync, skipping file metadata where possible
+	SYNC_NONE // no barrier, leave write-back to the operating system
+};
 
-#define NULL_GUID {0x00000000, 0x0000, 0x0000, 0x0000000000000000}
-#define EFI_SYS_GUID {cpu_to_le32(0xC12A7328), cpu_to_le16(0xF81F),\
-	cpu_to_le16(0x11D2), cpu_to_be64(0xBA4B00A0C93EC93BULL)}
-#define MS_DATA_GUID {cpu_to_le32(0xEBD0A0A2), cpu_to_le16(0xB9E5),\
-	cpu_to_le16(0x4433), cpu_to_be64(0x87C068B6B72699C7ULL)}
-#define MS_META_GUID {cpu_to_le32(0x5808C8AA), cpu_to_le16(0x7E8F),\
-	cpu_to_le16(0x42E0), cpu_to_be64(0x85D2E1E90434CFB3ULL)}
-#define MS_DYN_GUID {cpu_to_le32(0xAF9B60A0), cpu_to_le16(0x1431),\
-	cpu_to_le16(0x4F62), cpu_to_be64(0xBC683311714A69ADULL)}
-#define MS_WINRE_GUID {cpu_to_le32(0xDE94BBA4), cpu_to_le16(0x06D1),\
-	cpu_to_le16(0x4D40), cpu_to_be64(0xA16ABFD50179D6ACULL)}
-#define LINUX_SWAP_GUID {cpu_to_le32(0x0657FD6D), cpu_to_le16(0xA4AB),\
-	cpu_to_le16(0x43C4), cpu_to_be64(0x84E50933C84B4F4FULL)}
-#define LINUX_DATA_GUID {cpu_to_le32(0xEBD0A0A2), cpu_to_le16(0xB9E5),\
-	cpu_to_le16(0x4433), cpu_to_be64(0x87C068B6B72699C7ULL)}
-#define LINUX_RAID_GUID {cpu_to_le32(0xA19D880F), cpu_to_le16(0x05FC),\
-	cpu_to_le16(0x4D3B), cpu_to_be64(0xA006743F0F84911EULL)}
-#define LINUX_LVM_GUID {cpu_to_le32(0xE6D6D379), cpu_to_le16(0xF507),\
-	cpu_to_le16(0x44C2), cpu_to_be64(0xA23C238F2A3DF928ULL)}
-#define APPLE_HFS_GUID {cpu_to_le32(0x48465300), cpu_to_le16(0x0000),\
-	cpu_to_le16(0x11AA), cpu_to_be64(0xAA1100306543ECACULL)}
-#define APPLE_UFS_GUID {cpu_to_le32(0x55465300), cpu_to_le16(0x0000),\
-	cpu_to_le16(0x11AA), cpu_to_be64(0xAA1100306543ECACULL)}
-#define APPLE_BOOT_GUID {cpu_to_le32(0x426F6F74), cpu_to_le16(0x0000),\
-	cpu_to_le16(0x11AA), cpu_to_be64(0xAA1100306543ECACULL)}
-#define SUN_BOOT_GUID {cpu_to_le32(0x6A82CB45), cpu_to_le16(0x1DD2),\
-	cpu_to_le16(0x11B2), cpu_to_be64(0x99A6080020736631ULL)}
-#define SUN_ROOT_GUID {cpu_to_le32(0x6A85CF4D), cpu_to_le16(0x1DD2),\
-	cpu_to_le16(0x11B2), cpu_to_be64(0x99A6080020736631ULL)}
-
-#define MBR2GUID(x) {cpu_to_le32(0x1575DA16), cpu_to_le16(0xF2E2),\
-	cpu_to_le16(0x40DE), (cpu_to_be64(0xB715C6E376663B00ULL + x))}
-
-struct part {
-	unsigned char type;
-	bool active;
-	uint32_t start;
-	uint32_t len;
+/******************************************************************************\
+* io_engine: how a device's reads and writes are issued                        *
+\******************************************************************************/
+enum io_engine {
+	ENGINE_AUTO, // io_uring for --scan, POSIX calls for everything else
+	ENGINE_POSIX, // one blocking system call per request
+	ENGINE_URING // requests batched through io_uring, where available
 };
 
-struct mbrpart {
-	unsigned char active;
-	unsigned char shead; // CHS start value, not used by program
-	unsigned char ssect; // CHS start value, not used by program
-	unsigned char scyl; // CHS start value, not used by program
-	unsigned char type;
-	unsigned char ehead; // CHS end value, not used by program
-	unsigned char esect; // CHS end value, not used by program
-	unsigned char ecyl; // CHS end value, not used by program
-	uint32_t start;
-	uint32_t len;
-}ATTRIBUTE_PACKED;
+// Submission queue entries of a device's io_uring.
+#define RING_DEPTH 64
 
-struct gptpart {
-	struct __guid type;
-	struct __guid id;
-	uint64_t start;
-	uint64_t end;
-	uint64_t flags;
-	char name[72];
-}ATTRIBUTE_PACKED;
+/******************************************************************************\
+* block_run: a run of blocks to read, see BlockDevice::read_runs()             *
+\******************************************************************************/
+struct block_run {
+	uint64_t lba;
+	uint64_t count;
+	char *buf; // count*block_size bytes
+};
+
+// Size of the bounce buffer used to write unaligned data with direct I/O.
+#define DIRECT_BOUNCE_CHUNK (1024*1024)
 
-const static gptpart empty_record = {
-	NULL_GUID,
-	NULL_GUID,
-	0,
-	0,
-	0,
-	"",
+// Extended partitions up to this size are prefetched in full when mapped,
+// larger ones are only touched one EBR page at a time.
+#define EXT_PREFETCH_LIMIT (64ULL*1024*1024)
+
+/******************************************************************************\
+* mapping: a range of blocks of a disk image that is memory-mapped             *
+\******************************************************************************/
+struct mapping {
+	uint64_t lba; // first block covered by the mapping
+	uint64_t count; // number of blocks covered by the mapping
+	char *base; // page-aligned start of the mapped area
+	size_t maplen; // length of the mapped area
+	size_t delta; // offset of the first block within the mapped area
+	bool dirty; // written to since the last flush
 };
 
-struct gpthdr {
-	unsigned char magic[8];
-	unsigned char version[4];
-	uint32_t hdrlen;
-	uint32_t hdrsum;
-	uint32_t pad;
-	uint64_t this_hdr;
-	uint64_t other_hdr;
-	uint64_t data_start;
-	uint64_t data_end;
-	struct __guid guid;
-	uint64_t first_entry;
-	uint32_t entry_cnt;
-	uint32_t entry_len;
-	uint32_t part_sum;
-}ATTRIBUTE_PACKED;
+// qcow2 header, L1/L2 table entry and refcount table entry fields
+#define QCOW2_MAGIC 0x514649FBU // "QFI\xfb"
+#define QCOW2_OFLAG_COPIED (1ULL<<63) // refcount is exactly 1
+#define QCOW2_OFLAG_COMPRESSED (1ULL<<62)
+#define QCOW2_OFLAG_ZERO (1ULL<<0) // reads as zeroes (version 3)
+#define QCOW2_OFFSET_MASK 0x00FFFFFFFFFFFE00ULL
+#define QCOW2_RC_OFFSET_MASK 0xFFFFFFFFFFFFFE00ULL
+#define QCOW2_INCOMPAT_DIRTY (1ULL<<0)
+#define QCOW2_INCOMPAT_COMPRESSION (1ULL<<3) // compression type field used
+#define QCOW2_MAX_L1_SIZE (32ULL*1024*1024) // bytes, as qemu allows
+#define QCOW2_MAX_RCTABLE_SIZE (8ULL*1024*1024) // bytes, as qemu allows
 
-vector<struct part> parts;
-
-// table for CRC32 calculation, polynomial 0x04C11DB7
-static uint32_t crc32_tbl[256] = {
-	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
-	0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
-	0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
-	0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
-	0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
-	0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
-	0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
-	0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
-	0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
-	0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
-	0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
-	0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
-	0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
-	0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
-	0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
-	0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
-	0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
-	0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
-	0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
-	0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
-	0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
-	0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
-	0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
-	0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
-	0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
-	0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
-	0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
-	0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
-	0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
-	0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
-	0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
-	0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
-	0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
-	0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
-	0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
-	0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
-	0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
-	0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
-	0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
-	0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
-	0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
-	0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
-	0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
-	0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
-	0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
-	0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
-	0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
-	0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
-	0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
-	0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
-	0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
-	0x2d02ef8dL
+/******************************************************************************\
+* qcow2: the state of a qcow2 disk image opened by a BlockDevice               *
+* The whole L1 table and refcount table are loaded when the image is opened,   *
+* L2 tables as the guest blocks they map are first accessed. All table         *
+* entries are kept in host byte order.                                         *
+\******************************************************************************/
+struct qcow2 {
+	bool active; // the device is a qcow2 image
+	uint32_t version;
+	uint32_t cluster_bits;
+	uint64_t cluster_size;
+	uint32_t refcount_bits;
+	uint64_t size; // virtual size of the disk, in bytes
+	uint32_t nb_snapshots;
+	uint64_t autoclear; // autoclear feature bits, cleared on the first write
+	uint64_t l1_offset;
+	vector<uint64_t> l1;
+	uint64_t rctable_offset;
+	vector<uint64_t> rctable;
+	map<uint64_t, vector<uint64_t> > l2; // keyed by host offset
+	uint64_t file_end; // where the next cluster gets allocated
 };
 
 /******************************************************************************\
-* crc32: calculate an EFI-style CRC32 checksum                                 *
-* buf: buffer holding the data to be CRCed                                     *
-* len: length of the data                                                      *
+* BlockDevice: a device (or disk image) opened once for the whole run          *
+* All reads are positional and go through a small LBA-keyed sector cache, so   *
+* every sector is fetched from the device at most once per run, no matter how  *
+* many times the MBR/EBR/backup code paths ask for it.                         *
+* Regular-file disk images can additionally have the regions gptgen touches    *
+* memory-mapped with map_region(); those blocks are then served from (and      *
+* written to) the page cache directly, and flush() commits them along with     *
+* everything else, in the same single barrier.                                 *
+* Alternatively, the device can be opened for direct I/O, bypassing the page   *
+* cache entirely; data that isn't block-aligned then goes through an aligned   *
+* bounce buffer.                                                               *
+* qcow2 disk images are detected when opened, and then read and written in     *
+* guest terms: only the clusters holding the blocks asked for are touched, and *
+* clusters are allocated as the GPT is written to them.                        *
+* With the io_uring engine, writes are only staged until flush(), which copies *
+* them into one registered buffer and submits them all, linked, with the       *
+* flush barrier linked last: a single io_uring_enter for the whole GPT.        *
+* read_runs() likewise reads several runs with one submission. Nothing is      *
+* mapped then, and qcow2 images always use the POSIX engine.                   *
 \******************************************************************************/
-uint32_t crc32(const unsigned char *buf, int len)
+class BlockDevice {
+public:
+	BlockDevice();
+	~BlockDevice();
+
+	int open(string drive, bool writable, bool direct = false);
+	void close();
+
+	int get_block_size();
+	uint64_t get_capacity();
+	void get_io_hints(io_hints &hints);
+	void set_block_size(int size) { block_size = size; }
+
+	int read_block(uint64_t lba, char *buf);
+	int read_blocks(uint64_t lba, uint64_t count, char *buf);
+	int read_runs(const vector<block_run> &runs);
+	int write_data(uint64_t lba, const char *buf, int len);
+	int write_extent(const plan_extent &e);
+	int flush(sync_mode mode = SYNC_FSYNC);
+
+	bool is_image() const { return image; }
+	bool is_direct() const { return direct; }
+	void set_engine(io_engine e) { engine = e; } // before open()
+	int map_region(uint64_t lba, uint64_t count, bool prefetch);
+
+	const io_stats &stats() const { return iostats; }
+	unsigned long syscalls() const;
+#ifndef WINDOWS_BUILD
+	// The descriptor, for I/O issued around this class (e.g. io_uring);
+	// -1 if its offsets aren't the disk's, as for qcow2 images.
+	int raw_fd() const { return qcow.active ? -1 : fd; }
+	void count_ring_read(size_t len)
+	{
+		iostats.reads++;
+		iostats.ring_ops++;
+		iostats.read_bytes += len;
+	}
+#endif
+
+private:
+	BlockDevice(const BlockDevice &);
+	BlockDevice &operator=(const BlockDevice &);
+
+	bool aligned(const char *buf, size_t len) const;
+	int read_at(uint64_t offset, char *buf, size_t len);
+	int write_at(uint64_t offset, const char *buf, size_t len);
+	int writev_at(uint64_t offset, const plan_extent &e);
+	void drop_direct();
+
+	int pread_raw(uint64_t offset, char *buf, size_t len);
+	int pwrite_raw(uint64_t offset, const char *buf, size_t len);
+	int pwritev_raw(uint64_t offset, const plan_extent &e);
+	int sync_raw(sync_mode mode);
+	mapping *find_mapping(uint64_t lba, uint64_t count);
+	void unmap_all();
+
+	int qcow2_probe();
+	int qcow2_entry(uint64_t offset, bool alloc, uint64_t **entry,
+					uint64_t *pos);
+	int qcow2_put64(uint64_t pos, uint64_t val);
+	uint64_t qcow2_alloc();
+	bool qcow2_valid(uint64_t host) const;
+	int qcow2_set_refcount(uint64_t host, uint64_t val);
+	int qcow2_read(uint64_t offset, char *buf, size_t len);
+	int qcow2_write(uint64_t offset, const char *buf, size_t len);
+#ifdef USE_IO_URING
+	void ring_stage(uint64_t offset, const char *buf, size_t len);
+	int ring_read(const vector<block_run> &runs);
+	int ring_flush(sync_mode mode);
+	bool ring_wait(unsigned int n, uint64_t *data, int *res);
+#endif
+
+#ifdef WINDOWS_BUILD
+	HANDLE fd;
+#else
+	int fd;
+#endif
+	int block_size;
+	bool writable;
+	bool unsynced;
+	bool image;
+	uint64_t image_size;
+	map<uint64_t, vector<char> > cache;
+	vector<mapping> maps;
+	bool direct;
+	AlignedBuffer bounce;
+	io_stats iostats;
+	qcow2 qcow;
+	io_engine engine;
+#ifdef USE_IO_URING
+	IoRing *ring; // NULL unless the io_uring engine is in use
+	vector<pair<uint64_t, vector<char> > > staged; // writes, by byte offset
+#endif
+};
+
+BlockDevice::BlockDevice()
+#ifdef WINDOWS_BUILD
+	: fd(INVALID_HANDLE_VALUE), block_size(0), writable(false),
+	  unsynced(false), image(false), image_size(0), direct(false),
+	  engine(ENGINE_AUTO)
+#else
+	: fd(-1), block_size(0), writable(false), unsynced(false), image(false),
+	  image_size(0), direct(false), engine(ENGINE_AUTO)
+#ifdef USE_IO_URING
+	  , ring(NULL)
+#endif
+#endif
 {
-	uint32_t crc32val;
+	memset(&iostats, 0, sizeof(iostats));
+	qcow.active = false;
+}
 
-	crc32val = ~0L;
-	for (int i = 0; i < len; i++)
-		crc32val = crc32_tbl[(crc32val ^ buf[i]) & 0xff] ^ (crc32val >> 8);
-	return ~crc32val;
+BlockDevice::~BlockDevice()
+{
+	close();
 }
 
 /******************************************************************************\
-* cmp: compare the starting offsets of two partitions                          *
-* a, b: the partitions to be compared                                          *
-* Primarily for internal use for sorting the partition vector.                 *
+* BlockDevice::syscalls: total number of device syscalls issued so far         *
 \******************************************************************************/
-bool cmp(part a, part b)
+unsigned long BlockDevice::syscalls() const
 {
-	return a.start < b.start;
+	return iostats.opens + iostats.reads + iostats.writes +
+		   iostats.syncs + iostats.queries + iostats.maps +
+		   iostats.submits - iostats.ring_ops;
 }
 
-#ifdef WINDOWS_BUILD
 /******************************************************************************\
-* read_block: read a logical block of data from a device                       *
-* drive: filename of the device (e.g. \\.\physicaldrive0)                      *
-* lba: logical address of the block to parse                                   *
-* block_size: size of a block on the device                                    *
-* buf: buffer to read data into                                                *
+* BlockDevice::find_mapping: find the mapping that holds a range of blocks     *
+* lba: logical address of the first block                                      *
+* count: number of blocks                                                      *
+* Returns NULL if no single mapping covers the whole range.                    *
 \******************************************************************************/
-int read_block(string drive, uint64_t lba, int block_size, char *buf)
+mapping *BlockDevice::find_mapping(uint64_t lba, uint64_t count)
 {
-	HANDLE fin;
-	DWORD writelen;
-	LARGE_INTEGER offset;
+	for (size_t i = 0; i < maps.size(); i++) {
+		if (lba >= maps[i].lba && lba+count <= maps[i].lba+maps[i].count)
+			return &maps[i];
+	}
+	return NULL;
+}
 
-	offset.QuadPart = lba*block_size;
+/******************************************************************************\
+* BlockDevice::read_block: read a logical block of data from the device        *
+* lba: logical address of the block to read                                    *
+* buf: buffer to read data into (block_size bytes)                             *
+\******************************************************************************/
+int BlockDevice::read_block(uint64_t lba, char *buf)
+{
+	mapping *m = find_mapping(lba, 1);
+	if (m) {
+		memcpy(buf, m->base+m->delta+(lba-m->lba)*block_size, block_size);
+		return 0;
+	}
 
-	fin = CreateFile(drive.c_str(), GENERIC_READ,
-					 FILE_SHARE_READ|FILE_SHARE_WRITE,
-					 NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	map<uint64_t, vector<char> >::iterator it = cache.find(lba);
 
-	if (fin == INVALID_HANDLE_VALUE) {
-		CloseHandle(fin);
-		return -1;
+	if (it == cache.end()) {
+		vector<char> sector(block_size);
+
+		if (read_at(lba*block_size, &sector[0], block_size) < 0)
+			return -1;
+		it = cache.insert(make_pair(lba, sector)).first;
 	}
+	memcpy(buf, &it->second[0], block_size);
+
+	return 0;
+}
 
-	SetFilePointerEx(fin, offset, NULL, FILE_BEGIN);
-	ReadFile(fin, buf, block_size, &writelen, NULL);
-	CloseHandle(fin);
+/******************************************************************************\
+* BlockDevice::read_blocks: read a run of blocks straight from the device      *
+* lba: logical address of the first block to read                              *
+* count: number of blocks to read                                              *
+* buf: buffer to read data into (count*block_size bytes)                       *
+* Unlike read_block(), this always reads the device, in a single request       *
+* where possible, and neither consults nor fills the sector cache or the       *
+* mappings. Opened for direct I/O, it sees what actually reached the disk.     *
+\******************************************************************************/
+int BlockDevice::read_blocks(uint64_t lba, uint64_t count, char *buf)
+{
+	return read_at(lba*block_size, buf, (size_t)(count*block_size));
+}
 
+/******************************************************************************\
+* BlockDevice::read_runs: read several runs of blocks straight from the device *
+* runs: the runs, each read as by read_blocks()                                *
+* With the io_uring engine, all of the runs are read with one submission.      *
+\******************************************************************************/
+int BlockDevice::read_runs(const vector<block_run> &runs)
+{
+#ifdef USE_IO_URING
+	if (ring)
+		return ring_read(runs);
+#endif
+	for (size_t i = 0; i < runs.size(); i++) {
+		if (read_blocks(runs[i].lba, runs[i].count, runs[i].buf) < 0)
+			return -1;
+	}
 	return 0;
 }
 
 /******************************************************************************\
-* write_data: write blocks to a device                                         *
-* drive: filename of the device (e.g. \\.\physicaldrive0)                      *
+* BlockDevice::write_data: write blocks to the device                          *
 * lba: logical address of the first block to write                             *
-* block_size: size of a block on the device                                    *
 * buf: buffer holding the data to be written                                   *
 * len: number of blocks to write                                               *
+* The data only reaches stable storage once flush() is called. Cached copies   *
+* of the overwritten sectors are updated so that later reads see the new data. *
 \******************************************************************************/
-int write_data(string drive, uint64_t lba, int block_size, char *buf, int len)
+int BlockDevice::write_data(uint64_t lba, const char *buf, int len)
 {
-	HANDLE fout;
-	DWORD writelen;
-	LARGE_INTEGER offset;
+	mapping *m = find_mapping(lba, len);
 
-	offset.QuadPart = lba*block_size;
-
-	fout = CreateFile(drive.c_str(), GENERIC_READ|GENERIC_WRITE,
-					  FILE_SHARE_READ|FILE_SHARE_WRITE,
-					  NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m && writable) {
+		memcpy(m->base+m->delta+(lba-m->lba)*block_size, buf,
+			   (size_t)len*block_size);
+		m->dirty = true;
+#ifdef USE_IO_URING
+	} else if (ring) {
+		ring_stage(lba*block_size, buf, (size_t)len*block_size);
+#endif
+	} else {
+		if (write_at(lba*block_size, buf, (size_t)len*block_size) < 0)
+			return -1;
+		unsynced = true;
+	}
 
-	if (fout == INVALID_HANDLE_VALUE) {
-		CloseHandle(fout);
-		return -1;
+	for (int i = 0; i < len; i++) {
+		map<uint64_t, vector<char> >::iterator it = cache.find(lba+i);
+		if (it != cache.end())
+			memcpy(&it->second[0], buf+(size_t)i*block_size, block_size);
 	}
 
-	SetFilePointerEx(fout, offset, NULL, FILE_BEGIN);
-	WriteFile(fout, buf, len*block_size, &writelen, NULL);
-	CloseHandle(fout);
 	return 0;
 }
 
 /******************************************************************************\
-* get_block_size: return the block size of a drive in bytes, or 0 on error     *
-* drive: filename of the device (e.g. \\.\physicaldrive0)                      *
+* BlockDevice::write_extent: write one extent of a write plan to the device    *
+* e: the extent, which must cover whole blocks                                 *
+* Like write_data(), this only reaches stable storage once flush() is called.  *
 \******************************************************************************/
-int get_block_size(string drive)
+int BlockDevice::write_extent(const plan_extent &e)
 {
-	HANDLE fin;
-	DWORD writelen;
-	DISK_GEOMETRY geom;
+	uint64_t blocks = e.len / block_size;
+	mapping *m = find_mapping(e.lba, blocks);
 
-	fin = CreateFile(drive.c_str(), GENERIC_READ,
-					 FILE_SHARE_READ|FILE_SHARE_WRITE,
-					 NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (m && writable) {
+		char *dst = m->base+m->delta+(e.lba-m->lba)*block_size;
 
-	if (fin == INVALID_HANDLE_VALUE) {
-		CloseHandle(fin);
-		return 0;
+		for (size_t i = 0; i < e.segs.size(); i++) {
+			memcpy(dst, e.segs[i].buf, e.segs[i].len);
+			dst += e.segs[i].len;
+		}
+		m->dirty = true;
+#ifdef USE_IO_URING
+	} else if (ring) {
+		uint64_t offset = e.lba*block_size;
+
+		for (size_t i = 0; i < e.segs.size(); i++) {
+			ring_stage(offset, e.segs[i].buf, e.segs[i].len);
+			offset += e.segs[i].len;
+		}
+#endif
+	} else {
+		if (writev_at(e.lba*block_size, e) < 0)
+			return -1;
+		unsynced = true;
 	}
 
-	DeviceIoControl(fin, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &geom,
-					sizeof(DISK_GEOMETRY), &writelen, NULL);
-	CloseHandle(fin);
+	cache.erase(cache.lower_bound(e.lba), cache.lower_bound(e.lba+blocks));
 
-	return geom.BytesPerSector;
+	return 0;
 }
 
 /******************************************************************************\
-* get_capacity: return the capacity of a drive in bytes, or 0 on error         *
-* drive: filename of the device (e.g. \\.\physicaldrive0)                      *
+* BlockDevice::aligned: check whether a buffer can be used for direct I/O      *
 \******************************************************************************/
-uint64_t get_capacity(string drive)
+bool BlockDevice::aligned(const char *buf, size_t len) const
 {
-	HANDLE fin;
-	DWORD writelen;
-	GET_LENGTH_INFORMATION capacity;
-
-	fin = CreateFile(drive.c_str(), GENERIC_READ,
-					 FILE_SHARE_READ|FILE_SHARE_WRITE,
-					 NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-
-	if (fin == INVALID_HANDLE_VALUE) {
-		CloseHandle(fin);
-		return 0;
-	}
-
-	DeviceIoControl(fin, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &capacity,
-					sizeof(GET_LENGTH_INFORMATION), &writelen, NULL);
-	CloseHandle(fin);
+	size_t align = io_align(block_size);
 
-	return capacity.Length.QuadPart;
+	return ((uintptr_t)buf % align) == 0 && (len % block_size) == 0;
 }
-#else
+
 /******************************************************************************\
-* read_block: read a logical block of data from a device                       *
-* drive: filename of the device (e.g. /dev/sda or /dev/mmcblk0)                *
-* lba: logical address of the block to parse                                   *
-* block_size: size of a block on the device                                    *
+* BlockDevice::read_at: read from the device, bouncing unaligned direct I/O    *
+* offset: byte offset to read from                                             *
 * buf: buffer to read data into                                                *
+* len: number of bytes to read                                                 *
 \******************************************************************************/
-int read_block(string drive, uint64_t lba, int block_size, char *buf)
+int BlockDevice::read_at(uint64_t offset, char *buf, size_t len)
 {
-	int fin = open(drive.c_str(), O_RDONLY);
-	if (!fin)
-		return -1;
+	if (qcow.active)
+		return qcow2_read(offset, buf, len);
+	if (!direct || aligned(buf, len))
+		return pread_raw(offset, buf, len);
 
-	if (lseek(fin, lba*block_size, SEEK_SET) < 0) {
-		close(fin);
+	if (bounce.size() < len && !bounce.alloc(max<size_t>(len,
+			DIRECT_BOUNCE_CHUNK), io_align(block_size)))
 		return -1;
-	}
-	if (read(fin, buf, block_size) != block_size) {
-		close(fin);
+	if (pread_raw(offset, bounce.get(), len) < 0)
 		return -1;
-	}
-	close(fin);
+	memcpy(buf, bounce.get(), len);
 
 	return 0;
 }
 
 /******************************************************************************\
-* write_data: write blocks to a device                                         *
-* drive: filename of the device (e.g. /dev/sda or /dev/mmcblk0)                *
-* lba: logical address of the first block to write                             *
-* block_size: size of a block on the device                                    *
+* BlockDevice::write_at: write to the device, bouncing unaligned direct I/O    *
+* offset: byte offset to write to                                              *
 * buf: buffer holding the data to be written                                   *
-* len: number of blocks to write                                               *
+* len: number of bytes to write                                                *
 \******************************************************************************/
-int write_data(string drive, uint64_t lba, int block_size, char *buf, int len)
+int BlockDevice::write_at(uint64_t offset, const char *buf, size_t len)
 {
-	int fout = open(drive.c_str(), O_WRONLY);
-	if (!fout)
-		return -1;
+	if (qcow.active)
+		return qcow2_write(offset, buf, len);
+	if (!direct || aligned(buf, len))
+		return pwrite_raw(offset, buf, len);
 
-	if (lseek(fout, lba*block_size, SEEK_SET) < 0) {
-		close(fout);
-		return -1;
-	}
-	if (write(fout, buf, len*block_size) != (len*block_size)) {
-		close(fout);
+	if (bounce.size() < len && !bounce.alloc(max<size_t>(len,
+			DIRECT_BOUNCE_CHUNK), io_align(block_size)))
 		return -1;
-	}
-	if (fsync(fout) < 0) {
-		close(fout);
-		return -1;
-	}
-	close(fout);
+	memcpy(bounce.get(), buf, len);
 
-	return 0;
+	return pwrite_raw(offset, bounce.get(), len);
 }
 
 /******************************************************************************\
-* get_capacity: return the capacity of a drive in bytes, or 0 on error         *
-* drive: filename of the device (e.g. /dev/sda or /dev/mmcblk0)                *
+* BlockDevice::writev_at: write an extent, bouncing unaligned direct I/O       *
+* offset: byte offset to write the extent at                                   *
+* e: the extent                                                                *
+* With direct I/O, an extent with any unaligned segment is gathered into the   *
+* bounce buffer and written one DIRECT_BOUNCE_CHUNK at a time.                 *
 \******************************************************************************/
-uint64_t get_capacity(string drive)
+int BlockDevice::writev_at(uint64_t offset, const plan_extent &e)
 {
-#if defined(BLKGETSIZE64) || defined(MACOS_BUILD)
-	uint64_t ret = 0;
-#else
-	uint32_t ret = 0;
-#endif
-	int fin = open(drive.c_str(), O_RDONLY);
-	if (!fin)
-		return 0;
-
-	struct stat statbuf;
-	memset(&statbuf, 0, sizeof(struct stat));
-	if (fstat(fin, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
-		close(fin);
-		return statbuf.st_size;
-	}
+	size_t chunk, fill = 0;
+	bool ok = true;
 
-#ifdef BLKGETSIZE64
-	if (ioctl(fin, BLKGETSIZE64, &ret)) {
-		close(fin);
-		return 0;
-	}
-#else
-	if (ioctl(fin, BLKGETSIZE, &ret)) {
-		close(fin);
+	if (qcow.active) {
+		for (size_t i = 0; i < e.segs.size(); i++) {
+			if (qcow2_write(offset, e.segs[i].buf, e.segs[i].len) < 0)
+				return -1;
+			offset += e.segs[i].len;
+		}
 		return 0;
 	}
-	ret *= 512;
-#endif
-	close(fin);
 
-	return ret;
-}
+	for (size_t i = 0; direct && ok && i < e.segs.size(); i++)
+		ok = aligned(e.segs[i].buf, e.segs[i].len);
+	if (!direct || ok)
+		return pwritev_raw(offset, e);
 
-/******************************************************************************\
-* get_block_size: return the block size of a drive in bytes, or 0 on error     *
-* drive: filename of the device (e.g. /dev/sda or /dev/mmcblk0)                *
-\******************************************************************************/
-int get_block_size(string drive)
-{
-	int ret = 0;
-	int fin = open(drive.c_str(), O_RDONLY);
-	if (fin == -1)
-		return 0;
+	chunk = max<size_t>(DIRECT_BOUNCE_CHUNK / block_size, 1) * block_size;
+	if (bounce.size() < chunk && !bounce.alloc(chunk, io_align(block_size)))
+		return -1;
 
-	if (ioctl(fin, BLKSSZGET, &ret) < 0) {
-		close(fin);
-		return 0;
+	for (size_t i = 0; i < e.segs.size(); i++) {
+		const char *p = e.segs[i].buf;
+		size_t left = e.segs[i].len;
+
+		while (left) {
+			size_t n = min(left, chunk - fill);
+
+			memcpy(bounce.get() + fill, p, n);
+			fill += n;
+			p += n;
+			left -= n;
+			if (fill == chunk) {
+				if (pwrite_raw(offset, bounce.get(), fill) < 0)
+					return -1;
+				offset += fill;
+				fill = 0;
+			}
+		}
 	}
-	close(fin);
+	if (fill && pwrite_raw(offset, bounce.get(), fill) < 0)
+		return -1;
 
-	return ret;
+	return 0;
 }
-#endif
 
 /******************************************************************************\
-* read_tbl: read an MSDOS-style partition table from a block of a device       *
-* drive: filename of the device (e.g. \\.\physicaldrive0 or /dev/sda)          *
-* lba: logical address of the block to parse                                   *
-* block_size: size of a block on the device                                    *
-* buf: buffer to read data into                                                *
+* get_be32, get_be64: read a big-endian (qcow2) field from a buffer            *
 \******************************************************************************/
-int read_tbl(string drive, uint64_t lba, int block_size, char *buf)
+static uint32_t get_be32(const char *p)
 {
-	char *tmpbuf = (char *)calloc(block_size, sizeof(char));
-	int ret;
+	uint32_t v;
 
-	ret = read_block(drive, lba, block_size, tmpbuf);
-	if (ret >= 0) memcpy(buf, tmpbuf+446, 64);
-	free(tmpbuf);
-	return ret;
+	memcpy(&v, p, sizeof(v));
+	return be32_to_cpu(v);
 }
 
-/******************************************************************************\
-* read_mbr: read an MBR-style (446 byte) boot code from a block of a device    *
-* drive: filename of the device (e.g. \\.\physicaldrive0 or /dev/sda)          *
-* lba: logical address of the block to parse                                   *
-* block_size: size of a block on the device                                    *
-* buf: buffer to read data into                                                *
-\******************************************************************************/
-int read_mbr(string drive, uint64_t lba, int block_size, char *buf)
+static uint64_t get_be64(const char *p)
 {
-	char *tmpbuf = (char *)calloc(block_size, sizeof(char));
-	int ret;
+	uint64_t v;
 
-	ret = read_block(drive, lba, block_size, tmpbuf);
-	if (ret >= 0) memcpy(buf, tmpbuf, 446);
-	free(tmpbuf);
-	return ret;
+	memcpy(&v, p, sizeof(v));
+	return be64_to_cpu(v);
 }
 
 /******************************************************************************\
-* parse_tbl: parse an MSDOS-style partition table extracted from a boot record *
-* curr: buffer holding the partition table data                                *
-* curr_lba: logical address of the block holding the table being parsed        *
-* first_ebr_lba: logical addr. of the first EBR on the drive, 0 if parsing MBR *
-* return value if an EBR is found: logical address of the next EBR             *
-* return value if no EBR is found: 0                                           *
+* BlockDevice::qcow2_probe: check for a qcow2 image, and load its metadata     *
+* Returns 0 if the device isn't a qcow2 image, or if it is one that can be     *
+* used; -1 (after saying why) if it is one that can't.                         *
 \******************************************************************************/
-uint32_t parse_tbl(struct mbrpart *curr,
-						uint32_t curr_lba, uint32_t first_ebr_lba)
+int BlockDevice::qcow2_probe()
 {
-	struct part tmp;
-	uint64_t ret = 0;
+	AlignedBuffer hdr(4096, 4096);
+	uint64_t backing, incompat, l1_size, rc_clusters, csize, l1_span, l1_need;
+	uint32_t hdr_len = 72;
 
-	for (int i = 0; i < 4; i++) {
-		if (curr[i].type == 0x0f || curr[i].type == 0x05) {
-			ret = first_ebr_lba + curr[i].start;
-		}
-		else if (curr[i].type != 0x00) {
-			tmp.active = (curr[i].active == 0x80 ? true : false);
-			tmp.type = curr[i].type;
-			tmp.start = curr[i].start + curr_lba;
-			tmp.len = curr[i].len;
-			parts.push_back(tmp);
-		}
+	qcow.active = false;
+	if (pread_raw(0, hdr.get(), hdr.size()) < 0 ||
+		get_be32(hdr.get()) != QCOW2_MAGIC)
+		return 0;
+
+	qcow.version = get_be32(hdr.get()+4);
+	backing = get_be64(hdr.get()+8);
+	qcow.cluster_bits = get_be32(hdr.get()+20);
+	qcow.size = get_be64(hdr.get()+24);
+	l1_size = get_be32(hdr.get()+36);
+	qcow.l1_offset = get_be64(hdr.get()+40);
+	qcow.rctable_offset = get_be64(hdr.get()+48);
+	rc_clusters = get_be32(hdr.get()+56);
+	qcow.nb_snapshots = get_be32(hdr.get()+60);
+	incompat = 0;
+	qcow.autoclear = 0;
+	qcow.refcount_bits = 16;
+	if (qcow.version >= 3) {
+		incompat = get_be64(hdr.get()+72);
+		qcow.autoclear = get_be64(hdr.get()+88);
+		qcow.refcount_bits = 1U << get_be32(hdr.get()+96);
+		hdr_len = get_be32(hdr.get()+100);
 	}
-	return ret;
-}
 
-/******************************************************************************\
-* usage: print usage information.                                              *
-* name: name of the program, call with argv[0]                                 *
-\******************************************************************************/
-void usage(char *name)
-{
-	cout << "Usage: " << name << " [<arguments>] <device_path>" << endl;
-	cout << "where device_path is the full path to the device file," << endl;
-	cout << "e.g. "
-#ifdef WINDOWS_BUILD
-		 << "\\\\.\\physicaldrive0."
-#elif MACOS_BUILD
-		 << "/dev/disk0"
+	if (qcow.version < 2 || qcow.version > 3 || qcow.cluster_bits < 9 ||
+		qcow.cluster_bits > 21 || hdr_len > 4096) {
+		cout << "Unsupported qcow2 header." << endl;
+		return -1;
+	}
+	if (get_be32(hdr.get()+32)) {
+		cout << "Encrypted qcow2 images are not supported." << endl;
+		return -1;
+	}
+	if (backing) {
+		cout << "qcow2 images with a backing file are not supported." << endl;
+		return -1;
+	}
+	if (incompat & ~(QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_COMPRESSION)) {
+		cout << "qcow2 image uses unsupported features (0x" << hex
+			 << incompat << dec << ")." << endl;
+		return -1;
+	}
+	if (writable && (incompat & QCOW2_INCOMPAT_DIRTY)) {
+		cout << "qcow2 image was not closed cleanly, "
+			 << "repair it (qemu-img check -r all) first." << endl;
+		return -1;
+	}
+	if (writable && qcow.nb_snapshots) {
+		cout << "qcow2 images with internal snapshots can only be read." << endl;
+		return -1;
+	}
+	if (qcow.refcount_bits < 8) {
+		cout << "qcow2 refcount width of " << qcow.refcount_bits
+			 << " bits is not supported." << endl;
+		return -1;
+	}
+
+	if (direct) {
+#ifdef WINDOWS_BUILD
+		cout << "Direct I/O is not supported on qcow2 images." << endl;
+		return -1;
+#else
+		drop_direct();
+#endif
+	}
+
+	csize = 1ULL << qcow.cluster_bits;
+	qcow.cluster_size = csize;
+	// Both tables are loaded whole, so their sizes must be checked before
+	// anything is allocated for them; and the L1 table must map the whole
+	// virtual disk, or a conversion would fail halfway through its writes.
+	l1_span = qcow.cluster_bits + (qcow.cluster_bits - 3);
+	l1_need = (qcow.size >> l1_span) +
+			  ((qcow.size & ((1ULL << l1_span) - 1)) ? 1 : 0);
+	if (l1_size*8 > QCOW2_MAX_L1_SIZE || l1_size*8 > image_size ||
+		qcow.l1_offset > image_size - l1_size*8 ||
+		rc_clusters*csize > QCOW2_MAX_RCTABLE_SIZE ||
+		rc_clusters*csize > image_size ||
+		qcow.rctable_offset > image_size - rc_clusters*csize) {
+		cout << "qcow2 tables don't fit in the image." << endl;
+		return -1;
+	}
+	if (l1_size < l1_need) {
+		cout << "qcow2 L1 table doesn't cover the virtual size of the "
+			 << "image." << endl;
+		return -1;
+	}
+	qcow.l1.resize(l1_size);
+	qcow.rctable.resize(rc_clusters*csize/8);
+	if ((l1_size && pread_raw(qcow.l1_offset, (char *)&qcow.l1[0],
+							  l1_size*8) < 0) ||
+		(rc_clusters && pread_raw(qcow.rctable_offset,
+								  (char *)&qcow.rctable[0],
+								  rc_clusters*csize) < 0)) {
+		cout << "Unable to read the qcow2 tables." << endl;
+		return -1;
+	}
+	for (size_t i = 0; i < qcow.l1.size(); i++)
+		qcow.l1[i] = be64_to_cpu(qcow.l1[i]);
+	for (size_t i = 0; i < qcow.rctable.size(); i++)
+		qcow.rctable[i] = be64_to_cpu(qcow.rctable[i]);
+
+	qcow.file_end = (image_size + csize - 1) & ~(csize - 1);
+	qcow.l2.clear();
+	qcow.active = true;
+
+	cout << "qcow2 image, version " << qcow.version << ", " << csize
+		 << "-byte clusters, " << qcow.size << " bytes." << endl;
+
+	return 0;
+}
+
+/******************************************************************************\
+* BlockDevice::qcow2_entry: find the L2 table entry mapping a guest offset     *
+* offset: guest byte offset                                                    *
+* alloc: allocate the L2 table if there isn't one yet                          *
+* entry: receives a pointer to the (cached) entry, NULL if unallocated         *
+* pos: receives the host offset of the entry                                   *
+* return value: 0 on success, -1 (after saying why) on error                   *
+\******************************************************************************/
+int BlockDevice::qcow2_entry(uint64_t offset, bool alloc, uint64_t **entry,
+							 uint64_t *pos)
+{
+	uint32_t l2_bits = qcow.cluster_bits - 3;
+	uint64_t l1_index = offset >> (qcow.cluster_bits + l2_bits);
+	uint64_t l2_index = (offset >> qcow.cluster_bits) & ((1ULL << l2_bits) - 1);
+	uint64_t l2_offset;
+
+	*entry = NULL;
+	if (offset >= qcow.size || l1_index >= qcow.l1.size()) {
+		cout << "Offset " << offset << " is beyond the qcow2 image." << endl;
+		return -1;
+	}
+
+	l2_offset = qcow.l1[l1_index] & QCOW2_OFFSET_MASK;
+	if (!l2_offset) {
+		if (!alloc)
+			return 0;
+
+		vector<char> zeros(qcow.cluster_size);
+
+		// The new table and its refcount must be on the disk before the L1
+		// entry pointing at them is.
+		l2_offset = qcow2_alloc();
+		if (!l2_offset ||
+			pwrite_raw(l2_offset, &zeros[0], zeros.size()) < 0 ||
+			sync_raw(SYNC_FDATASYNC) < 0) {
+			cout << "Unable to allocate a qcow2 L2 table." << endl;
+			return -1;
+		}
+		qcow.l1[l1_index] = l2_offset | QCOW2_OFLAG_COPIED;
+		if (qcow2_put64(qcow.l1_offset + l1_index*8, qcow.l1[l1_index]) < 0) {
+			cout << "Unable to update the qcow2 L1 table." << endl;
+			return -1;
+		}
+		qcow.l2[l2_offset].assign(qcow.cluster_size/8, 0);
+	} else if (!qcow2_valid(l2_offset)) {
+		cout << "qcow2 L1 table is corrupt (L2 table at offset "
+			 << l2_offset << ")." << endl;
+		return -1;
+	} else if (alloc && !(qcow.l1[l1_index] & QCOW2_OFLAG_COPIED)) {
+		cout << "qcow2 L2 table is shared, refusing to modify it." << endl;
+		return -1;
+	}
+
+	map<uint64_t, vector<uint64_t> >::iterator it = qcow.l2.find(l2_offset);
+
+	if (it == qcow.l2.end()) {
+		vector<uint64_t> table(qcow.cluster_size/8);
+
+		if (pread_raw(l2_offset, (char *)&table[0], qcow.cluster_size) < 0) {
+			cout << "Unable to read a qcow2 L2 table." << endl;
+			return -1;
+		}
+		for (size_t i = 0; i < table.size(); i++)
+			table[i] = be64_to_cpu(table[i]);
+		it = qcow.l2.insert(make_pair(l2_offset, table)).first;
+	}
+
+	*entry = &it->second[l2_index];
+	*pos = l2_offset + l2_index*8;
+	return 0;
+}
+
+/******************************************************************************\
+* BlockDevice::qcow2_put64: write a big-endian 64-bit table entry              *
+\******************************************************************************/
+int BlockDevice::qcow2_put64(uint64_t pos, uint64_t val)
+{
+	val = cpu_to_be64(val);
+	return pwrite_raw(pos, (const char *)&val, sizeof(val));
+}
+
+/******************************************************************************\
+* BlockDevice::qcow2_alloc: allocate a cluster at the end of the image         *
+* return value: host offset of the cluster, 0 on error                         *
+* Only the refcount is written; the caller writes the cluster itself, and      *
+* syncs both before any table entry points at it.                              *
+\******************************************************************************/
+uint64_t BlockDevice::qcow2_alloc()
+{
+	uint64_t host = qcow.file_end;
+
+	qcow.file_end += qcow.cluster_size;
+	if (qcow2_set_refcount(host, 1) < 0)
+		return 0;
+	return host;
+}
+
+/******************************************************************************\
+* BlockDevice::qcow2_valid: check a host offset read from an L1 or L2 table    *
+* host: host offset of a cluster                                               *
+* return value: true if it is cluster-aligned and clear of the header, the L1  *
+* table and the refcount table, false if the table entry is corrupt            *
+\******************************************************************************/
+bool BlockDevice::qcow2_valid(uint64_t host) const
+{
+	uint64_t end = host + qcow.cluster_size;
+	uint64_t l1_end = qcow.l1_offset + qcow.l1.size()*8;
+	uint64_t rc_end = qcow.rctable_offset + qcow.rctable.size()*8;
+
+	if (host & (qcow.cluster_size - 1) || host < qcow.cluster_size)
+		return false;
+	if (host < l1_end && end > qcow.l1_offset)
+		return false;
+	if (host < rc_end && end > qcow.rctable_offset)
+		return false;
+	return true;
+}
+
+/******************************************************************************\
+* BlockDevice::qcow2_set_refcount: set the refcount of a cluster               *
+* host: host offset of the cluster                                             *
+* val: the new refcount                                                        *
+* A missing refcount block is allocated (and counts itself). The refcount      *
+* table itself is never grown; images whose table is full are refused.         *
+\******************************************************************************/
+int BlockDevice::qcow2_set_refcount(uint64_t host, uint64_t val)
+{
+	uint64_t cluster = host >> qcow.cluster_bits;
+	uint64_t per_block = qcow.cluster_size*8 / qcow.refcount_bits;
+	uint64_t index = cluster / per_block;
+	size_t width = qcow.refcount_bits / 8;
+	uint64_t block;
+	char be[8];
+
+	if (index >= qcow.rctable.size()) {
+		cout << "qcow2 refcount table is full." << endl;
+		return -1;
+	}
+
+	block = qcow.rctable[index] & QCOW2_RC_OFFSET_MASK;
+	if (!block) {
+		vector<char> zeros(qcow.cluster_size);
+
+		block = qcow.file_end;
+		qcow.file_end += qcow.cluster_size;
+		if (pwrite_raw(block, &zeros[0], zeros.size()) < 0 ||
+			sync_raw(SYNC_FDATASYNC) < 0)
+			return -1;
+		qcow.rctable[index] = block;
+		if (qcow2_put64(qcow.rctable_offset + index*8, block) < 0 ||
+			qcow2_set_refcount(block, 1) < 0)
+			return -1;
+	}
+
+	for (size_t i = 0; i < width; i++)
+		be[i] = (char)(val >> (8*(width-1-i)));
+	return pwrite_raw(block + (cluster % per_block)*width, be, width);
+}
+
+/******************************************************************************\
+* BlockDevice::qcow2_read: read guest data from a qcow2 image                  *
+* offset: guest byte offset to read from                                       *
+* buf: buffer to read data into                                                *
+* len: number of bytes to read                                                 *
+* Unallocated and zero clusters read as zeroes without touching the image.     *
+\******************************************************************************/
+int BlockDevice::qcow2_read(uint64_t offset, char *buf, size_t len)
+{
+	while (len) {
+		uint64_t in = offset & (qcow.cluster_size - 1);
+		size_t n = (size_t)min<uint64_t>(len, qcow.cluster_size - in);
+		uint64_t *entry, pos, host;
+
+		if (qcow2_entry(offset, false, &entry, &pos) < 0)
+			return -1;
+		if (entry && (*entry & QCOW2_OFLAG_COMPRESSED)) {
+			cout << "Compressed qcow2 clusters are not supported." << endl;
+			return -1;
+		}
+		host = entry ? (*entry & QCOW2_OFFSET_MASK) : 0;
+		if (host && !qcow2_valid(host)) {
+			cout << "qcow2 L2 table is corrupt (cluster at offset " << host
+				 << ")." << endl;
+			return -1;
+		}
+		if (!host || (*entry & QCOW2_OFLAG_ZERO))
+			memset(buf, 0, n);
+		else if (pread_raw(host + in, buf, n) < 0)
+			return -1;
+
+		offset += n;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/******************************************************************************\
+* BlockDevice::qcow2_write: write guest data to a qcow2 image                  *
+* offset: guest byte offset to write to                                        *
+* buf: buffer holding the data to be written                                   *
+* len: number of bytes to write                                                *
+* Allocated clusters are written in place. Unallocated and zero clusters get   *
+* a new cluster (or their preallocated one), written in full: the refcount     *
+* and the data first, then a barrier, then the L2 entry, so an interrupted     *
+* write can only leak a cluster, never expose a half-written one. New L2       *
+* tables and refcount blocks are ordered before the entries pointing at them   *
+* the same way.                                                                *
+\******************************************************************************/
+int BlockDevice::qcow2_write(uint64_t offset, const char *buf, size_t len)
+{
+	// The image no longer matches whatever the autoclear features describe.
+	if (qcow.autoclear) {
+		if (qcow2_put64(88, 0) < 0)
+			return -1;
+		qcow.autoclear = 0;
+	}
+
+	while (len) {
+		uint64_t in = offset & (qcow.cluster_size - 1);
+		size_t n = (size_t)min<uint64_t>(len, qcow.cluster_size - in);
+		uint64_t *entry, pos, host;
+
+		if (qcow2_entry(offset, true, &entry, &pos) < 0)
+			return -1;
+		if (*entry & QCOW2_OFLAG_COMPRESSED) {
+			cout << "Compressed qcow2 clusters are not supported." << endl;
+			return -1;
+		}
+		host = *entry & QCOW2_OFFSET_MASK;
+		if (host && !qcow2_valid(host)) {
+			cout << "qcow2 L2 table is corrupt (cluster at offset " << host
+				 << ")." << endl;
+			return -1;
+		}
+		if (host && !(*entry & QCOW2_OFLAG_COPIED)) {
+			cout << "qcow2 cluster is shared, refusing to modify it." << endl;
+			return -1;
+		}
+
+		if (host && !(*entry & QCOW2_OFLAG_ZERO)) {
+			if (pwrite_raw(host + in, buf, n) < 0)
+				return -1;
+		} else {
+			vector<char> cluster(qcow.cluster_size);
+
+			if (!host)
+				host = qcow2_alloc();
+			if (!host)
+				return -1;
+			memcpy(&cluster[in], buf, n);
+			if (pwrite_raw(host, &cluster[0], cluster.size()) < 0 ||
+				sync_raw(SYNC_FDATASYNC) < 0)
+				return -1;
+			*entry = host | QCOW2_OFLAG_COPIED;
+			if (qcow2_put64(pos, *entry) < 0)
+				return -1;
+		}
+
+		offset += n;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+#ifdef WINDOWS_BUILD
+/******************************************************************************\
+* BlockDevice::open: open a device for the rest of the run                     *
+* drive: filename of the device (e.g. \\.\physicaldrive0)                      *
+* writable: open the device for writing as well as reading                     *
+* direct: bypass the system cache (falls back to cached I/O if refused)        *
+\******************************************************************************/
+int BlockDevice::open(string drive, bool writable, bool direct)
+{
+	LARGE_INTEGER size;
+
+	close();
+	this->writable = writable;
+	this->direct = direct;
+	fd = CreateFile(drive.c_str(),
+					GENERIC_READ|(writable ? GENERIC_WRITE : 0),
+					FILE_SHARE_READ|FILE_SHARE_WRITE,
+					NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL|(direct ?
+					FILE_FLAG_NO_BUFFERING|FILE_FLAG_WRITE_THROUGH : 0), NULL);
+	iostats.opens++;
+	if (fd == INVALID_HANDLE_VALUE && direct) {
+		drop_direct();
+		fd = CreateFile(drive.c_str(),
+						GENERIC_READ|(writable ? GENERIC_WRITE : 0),
+						FILE_SHARE_READ|FILE_SHARE_WRITE,
+						NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		iostats.opens++;
+	}
+	if (fd == INVALID_HANDLE_VALUE)
+		return -1;
+
+	// only succeeds for files, which is all qcow2_probe() needs it for
+	iostats.queries++;
+	if (GetFileSizeEx(fd, &size))
+		image_size = size.QuadPart;
+
+	if (qcow2_probe() < 0) {
+		close();
+		return -1;
+	}
+
+	return 0;
+}
+
+/******************************************************************************\
+* BlockDevice::drop_direct: fall back from direct I/O to cached I/O            *
+\******************************************************************************/
+void BlockDevice::drop_direct()
+{
+	cout << "WARNING: Direct I/O was refused, using cached I/O instead."
+		 << endl;
+	direct = false;
+}
+
+/******************************************************************************\
+* BlockDevice::close: close the device and drop the sector cache               *
+\******************************************************************************/
+void BlockDevice::close()
+{
+	if (fd != INVALID_HANDLE_VALUE)
+		CloseHandle(fd);
+	fd = INVALID_HANDLE_VALUE;
+	image_size = 0;
+	cache.clear();
+	qcow.active = false;
+	qcow.l2.clear();
+}
+
+/******************************************************************************\
+* BlockDevice::map_region: not supported on Windows, always fails              *
+\******************************************************************************/
+int BlockDevice::map_region(uint64_t, uint64_t, bool)
+{
+	return -1;
+}
+
+void BlockDevice::unmap_all()
+{
+}
+
+/******************************************************************************\
+* BlockDevice::flush: commit the writes made so far to stable storage          *
+* mode: the kind of barrier to issue                                           *
+\******************************************************************************/
+int BlockDevice::flush(sync_mode mode)
+{
+	if (!unsynced || mode == SYNC_NONE)
+		return 0;
+	if (sync_raw(mode) < 0)
+		return -1;
+	unsynced = false;
+
+	return 0;
+}
+
+int BlockDevice::pread_raw(uint64_t offset, char *buf, size_t len)
+{
+	OVERLAPPED ov;
+	DWORD readlen = 0;
+
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	iostats.reads++;
+	if (!ReadFile(fd, buf, (DWORD)len, &readlen, &ov) || readlen != len)
+		return -1;
+	iostats.read_bytes += len;
+
+	return 0;
+}
+
+int BlockDevice::pwrite_raw(uint64_t offset, const char *buf, size_t len)
+{
+	OVERLAPPED ov;
+	DWORD writelen = 0;
+
+	memset(&ov, 0, sizeof(ov));
+	ov.Offset = (DWORD)offset;
+	ov.OffsetHigh = (DWORD)(offset >> 32);
+	iostats.writes++;
+	if (!WriteFile(fd, buf, (DWORD)len, &writelen, &ov) || writelen != len)
+		return -1;
+	iostats.write_bytes += len;
+
+	return 0;
+}
+
+int BlockDevice::pwritev_raw(uint64_t offset, const plan_extent &e)
+{
+	for (size_t i = 0; i < e.segs.size(); i++) {
+		if (pwrite_raw(offset, e.segs[i].buf, e.segs[i].len) < 0)
+			return -1;
+		offset += e.segs[i].len;
+	}
+
+	return 0;
+}
+
+int BlockDevice::sync_raw(sync_mode)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	BOOL ret = FlushFileBuffers(fd);
+
+	note_sync(iostats, start);
+	return ret ? 0 : -1;
+}
+
+/******************************************************************************\
+* BlockDevice::get_block_size: return the block size in bytes, or 0 on error   *
+\******************************************************************************/
+int BlockDevice::get_block_size()
+{
+	DWORD writelen;
+	DISK_GEOMETRY geom;
+
+	iostats.queries++;
+	if (!DeviceIoControl(fd, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &geom,
+						 sizeof(DISK_GEOMETRY), &writelen, NULL))
+		return 0;
+
+	return geom.BytesPerSector;
+}
+
+/******************************************************************************\
+* BlockDevice::get_io_hints: return the I/O topology, 0 for anything unknown   *
+* Windows only reports the physical sector size.                               *
+\******************************************************************************/
+void BlockDevice::get_io_hints(io_hints &hints)
+{
+	DWORD writelen;
+	STORAGE_PROPERTY_QUERY query;
+	STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR align;
+
+	memset(&hints, 0, sizeof(hints));
+	if (image)
+		return;
+	memset(&query, 0, sizeof(query));
+	query.PropertyId = StorageAccessAlignmentProperty;
+	query.QueryType = PropertyStandardQuery;
+	iostats.queries++;
+	if (DeviceIoControl(fd, IOCTL_STORAGE_QUERY_PROPERTY, &query,
+						sizeof(query), &align, sizeof(align), &writelen, NULL))
+		hints.physical = align.BytesPerPhysicalSector;
+}
+
+/******************************************************************************\
+* BlockDevice::get_capacity: return the capacity in bytes, or 0 on error       *
+\******************************************************************************/
+uint64_t BlockDevice::get_capacity()
+{
+	DWORD writelen;
+	GET_LENGTH_INFORMATION capacity;
+
+	if (qcow.active)
+		return qcow.size;
+
+	iostats.queries++;
+	if (!DeviceIoControl(fd, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &capacity,
+						 sizeof(GET_LENGTH_INFORMATION), &writelen, NULL))
+		return 0;
+
+	return capacity.Length.QuadPart;
+}
+#else
+/******************************************************************************\
+* BlockDevice::open: open a device for the rest of the run                     *
+* drive: filename of the device (e.g. /dev/sda or /dev/mmcblk0)                *
+* writable: open the device for writing as well as reading                     *
+* direct: bypass the page cache (falls back to buffered I/O if refused)        *
+\******************************************************************************/
+int BlockDevice::open(string drive, bool writable, bool direct)
+{
+	struct stat statbuf;
+	int flags = writable ? O_RDWR : O_RDONLY;
+
+	close();
+	this->writable = writable;
+	this->direct = direct;
+#ifdef O_DIRECT
+	fd = ::open(drive.c_str(), flags|(direct ? O_DIRECT : 0));
+	iostats.opens++;
+	if (fd < 0 && direct && errno == EINVAL) {
+		drop_direct();
+		fd = ::open(drive.c_str(), flags);
+		iostats.opens++;
+	}
+#else
+	fd = ::open(drive.c_str(), flags);
+	iostats.opens++;
+#endif
+	if (fd < 0)
+		return -1;
+#if defined(F_NOCACHE) && !defined(O_DIRECT)
+	iostats.queries++;
+	if (direct && fcntl(fd, F_NOCACHE, 1) < 0)
+		drop_direct();
+#endif
+
+	memset(&statbuf, 0, sizeof(struct stat));
+	iostats.queries++;
+	if (fstat(fd, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+		image = true;
+		image_size = statbuf.st_size;
+	}
+
+	if (image && qcow2_probe() < 0) {
+		close();
+		return -1;
+	}
+
+#ifdef USE_IO_URING
+	if (engine == ENGINE_URING && !qcow.active) {
+		ring = new IoRing;
+		if (ring->init(RING_DEPTH) < 0) {
+			delete ring;
+			ring = NULL;
+			cout << "WARNING: io_uring is unavailable, using POSIX I/O "
+				 << "instead." << endl;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+/******************************************************************************\
+* BlockDevice::close: close the device and drop the sector cache               *
+\******************************************************************************/
+void BlockDevice::close()
+{
+	unmap_all();
+#ifdef USE_IO_URING
+	if (ring) {
+		ring_flush(SYNC_NONE); // the writes still staged, if any
+		delete ring;
+		ring = NULL;
+	}
+#endif
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+	image = false;
+	image_size = 0;
+	cache.clear();
+	qcow.active = false;
+	qcow.l2.clear();
+}
+
+/******************************************************************************\
+* BlockDevice::map_region: memory-map a range of blocks of a disk image        *
+* lba: logical address of the first block to map                               *
+* count: number of blocks to map                                               *
+* prefetch: ask the kernel to read the whole range ahead of time               *
+* Only raw disk images can be mapped, and the range must lie within the file.  *
+* Returns -1 if the range was not mapped; the caller can carry on regardless,  *
+* since unmapped blocks are simply read and written through the file handle.   *
+\******************************************************************************/
+int BlockDevice::map_region(uint64_t lba, uint64_t count, bool prefetch)
+{
+	mapping m;
+	uint64_t offset, aligned;
+	long page = sysconf(_SC_PAGESIZE);
+	void *addr;
+
+	if (!image || direct || qcow.active || !count || !block_size ||
+		(lba+count)*block_size > image_size)
+		return -1;
+#ifdef USE_IO_URING
+	if (ring)
+		return -1;
+#endif
+	if (find_mapping(lba, count))
+		return 0;
+
+	offset = lba*block_size;
+	aligned = offset - offset % page;
+	m.lba = lba;
+	m.count = count;
+	m.delta = offset - aligned;
+	m.maplen = m.delta + count*block_size;
+	m.dirty = false;
+
+#ifdef POSIX_FADV_WILLNEED
+	if (prefetch) {
+		iostats.maps++;
+		posix_fadvise(fd, aligned, m.maplen, POSIX_FADV_WILLNEED);
+	}
+#endif
+
+	iostats.maps++;
+	addr = mmap(NULL, m.maplen, PROT_READ|(writable ? PROT_WRITE : 0),
+				MAP_SHARED, fd, aligned);
+	if (addr == MAP_FAILED)
+		return -1;
+	m.base = (char *)addr;
+
+	iostats.maps++;
+	madvise(m.base, m.maplen, prefetch ? MADV_WILLNEED : MADV_RANDOM);
+
+	maps.push_back(m);
+	return 0;
+}
+
+/******************************************************************************\
+* BlockDevice::unmap_all: drop all mappings, without committing them           *
+\******************************************************************************/
+void BlockDevice::unmap_all()
+{
+	for (size_t i = 0; i < maps.size(); i++) {
+		iostats.maps++;
+		munmap(maps[i].base, maps[i].maplen);
+	}
+	maps.clear();
+}
+
+/******************************************************************************\
+* BlockDevice::flush: commit the writes made so far to stable storage          *
+* mode: the kind of barrier to issue                                           *
+* A single fsync or fdatasync covers every write, those made to mapped regions *
+* of a disk image included: it also writes back the file's dirty shared pages. *
+\******************************************************************************/
+int BlockDevice::flush(sync_mode mode)
+{
+#ifdef USE_IO_URING
+	if (ring)
+		return ring_flush(mode);
+#endif
+	if (mode == SYNC_NONE)
+		return 0;
+
+	for (size_t i = 0; i < maps.size(); i++) {
+		if (maps[i].dirty)
+			unsynced = true;
+	}
+	if (!unsynced)
+		return 0;
+	if (sync_raw(mode) < 0)
+		return -1;
+	unsynced = false;
+	for (size_t i = 0; i < maps.size(); i++)
+		maps[i].dirty = false;
+
+	return 0;
+}
+
+#ifdef USE_IO_URING
+/******************************************************************************\
+* BlockDevice::ring_stage: stage a write for the next flush()                  *
+* offset: byte offset to write to                                              *
+* buf, len: the data, copied                                                   *
+* A write that continues the previous one is merged into it.                   *
+\******************************************************************************/
+void BlockDevice::ring_stage(uint64_t offset, const char *buf, size_t len)
+{
+	if (staged.empty() || staged.back().first +
+		staged.back().second.size() != offset)
+		staged.push_back(make_pair(offset, vector<char>()));
+	staged.back().second.insert(staged.back().second.end(), buf, buf+len);
+}
+
+/******************************************************************************\
+* BlockDevice::ring_wait: collect one completion, waiting for it if need be    *
+* n: number of completions outstanding, 0 if there is nothing to wait for      *
+* data, res: as for IoRing::reap()                                             *
+\******************************************************************************/
+bool BlockDevice::ring_wait(unsigned int n, uint64_t *data, int *res)
+{
+	while (n && !ring->reap(data, res)) {
+		iostats.submits++;
+		if (ring->submit(1) < 0)
+			return false;
+	}
+	return n > 0;
+}
+
+/******************************************************************************\
+* BlockDevice::ring_read: read_runs() for the io_uring engine                  *
+\******************************************************************************/
+int BlockDevice::ring_read(const vector<block_run> &runs)
+{
+	size_t next = 0;
+	int ret = 0;
+	bool einval = false;
+
+	for (size_t i = 0; direct && i < runs.size(); i++) {
+		if (!aligned(runs[i].buf, runs[i].count*block_size)) {
+			for (i = 0; i < runs.size(); i++) {
+				if (read_blocks(runs[i].lba, runs[i].count, runs[i].buf) < 0)
+					return -1;
+			}
+			return 0;
+		}
+	}
+
+	while (next < runs.size()) {
+		unsigned int n = 0;
+		uint64_t i;
+		int res;
+
+		while (next + n < runs.size() &&
+			   ring->prep(IORING_OP_READ, fd, runs[next+n].buf,
+						  (uint32_t)(runs[next+n].count*block_size),
+						  runs[next+n].lba*block_size, next+n))
+			n++;
+		iostats.submits++;
+		if (ring->submit(n) < 0)
+			return -1;
+		next += n;
+		for (; ring_wait(n, &i, &res); n--) {
+			uint64_t len = runs[i].count*block_size;
+
+			iostats.reads++;
+			iostats.ring_ops++;
+			if (res == (int)len) {
+				iostats.read_bytes += len;
+			} else {
+				einval = einval || res == -EINVAL;
+				ret = -1;
+			}
+		}
+		if (n)
+			return -1;
+	}
+
+	if (ret < 0 && einval && direct) {
+		drop_direct();
+		for (size_t i = 0; i < runs.size(); i++) {
+			if (read_blocks(runs[i].lba, runs[i].count, runs[i].buf) < 0)
+				return -1;
+		}
+		return 0;
+	}
+	return ret;
+}
+
+/******************************************************************************\
+* BlockDevice::ring_flush: flush() for the io_uring engine                     *
+* mode: the barrier to link after the writes; SYNC_NONE only submits them      *
+* The staged writes are gathered into one aligned buffer, which is registered  *
+* with the kernel so that it isn't mapped for every request, and submitted as  *
+* a single chain of linked requests ending in the barrier: if one fails, the   *
+* rest are cancelled. Chains longer than the ring are split.                   *
+\******************************************************************************/
+int BlockDevice::ring_flush(sync_mode mode)
+{
+	AlignedBuffer buf;
+	size_t total = 0, pos = 0, next = 0, count;
+	chrono::steady_clock::time_point start;
+	bool fixed, einval = false;
+	int ret = 0;
+
+	if (staged.empty())
+		return 0;
+	for (size_t i = 0; i < staged.size(); i++)
+		total += staged[i].second.size();
+	if (!buf.alloc(total, io_align(block_size)))
+		return -1;
+	for (size_t i = 0; i < staged.size(); i++) {
+		memcpy(buf.get() + pos, &staged[i].second[0],
+			   staged[i].second.size());
+		pos += staged[i].second.size();
+	}
+	iostats.maps++;
+	fixed = ring->register_buffer(buf.get(), total) == 0;
+
+	count = staged.size() + (mode != SYNC_NONE ? 1 : 0);
+	pos = 0;
+	start = chrono::steady_clock::now();
+	while (next < count && ret == 0) {
+		struct io_uring_sqe *sqe, *last = NULL;
+		unsigned int n = 0;
+		uint64_t i;
+		int res;
+
+		for (; next + n < count; n++, last = sqe) {
+			if (next + n < staged.size()) {
+				uint32_t len = (uint32_t)staged[next+n].second.size();
+
+				sqe = ring->prep(fixed ? IORING_OP_WRITE_FIXED :
+								 IORING_OP_WRITE, fd, buf.get() + pos, len,
+								 staged[next+n].first, next+n);
+				if (!sqe)
+					break;
+				pos += len;
+			} else {
+				sqe = ring->prep(IORING_OP_FSYNC, fd, NULL, 0, 0, next+n);
+				if (!sqe)
+					break;
+				if (mode == SYNC_FDATASYNC)
+					sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			}
+			sqe->flags |= IOSQE_IO_LINK;
+		}
+		last->flags &= ~IOSQE_IO_LINK;
+
+		iostats.submits++;
+		if (ring->submit(n) < 0) {
+			ret = -1;
+			break;
+		}
+		next += n;
+		for (; ring_wait(n, &i, &res); n--) {
+			iostats.ring_ops++;
+			if (i >= staged.size()) {
+				note_sync(iostats, start);
+				if (res < 0)
+					ret = -1;
+			} else {
+				iostats.writes++;
+				if (res == (int)staged[i].second.size()) {
+					iostats.write_bytes += res;
+				} else {
+					einval = einval || res == -EINVAL;
+					ret = -1;
+				}
+			}
+		}
+		if (n)
+			ret = -1;
+	}
+
+	if (fixed) {
+		iostats.maps++;
+		ring->unregister_buffer();
+	}
+
+	// Some filesystems only refuse direct I/O when it is first used.
+	if (ret < 0 && einval && direct) {
+		drop_direct();
+		ret = 0;
+		for (size_t i = 0; ret == 0 && i < staged.size(); i++)
+			ret = pwrite_raw(staged[i].first, &staged[i].second[0],
+							 staged[i].second.size());
+		if (ret == 0 && mode != SYNC_NONE)
+			ret = sync_raw(mode);
+	}
+	staged.clear();
+	return ret;
+}
+#endif
+
+/******************************************************************************\
+* BlockDevice::drop_direct: fall back from direct I/O to buffered I/O          *
+* Some filesystems (e.g. tmpfs) refuse O_DIRECT at open time, others only fail *
+* the first I/O with EINVAL; either way, the rest of the run is buffered.      *
+\******************************************************************************/
+void BlockDevice::drop_direct()
+{
+	cout << "WARNING: Direct I/O was refused, using buffered I/O instead."
+		 << endl;
+	direct = false;
+#ifdef O_DIRECT
+	if (fd >= 0) {
+		int flags = fcntl(fd, F_GETFL);
+
+		iostats.queries += 2;
+		if (flags >= 0)
+			fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+	}
+#endif
+}
+
+int BlockDevice::pread_raw(uint64_t offset, char *buf, size_t len)
+{
+	ssize_t ret;
+
+	iostats.reads++;
+	ret = pread(fd, buf, len, offset);
+	if (ret < 0 && direct && errno == EINVAL) {
+		drop_direct();
+		iostats.reads++;
+		ret = pread(fd, buf, len, offset);
+	}
+	if (ret != (ssize_t)len)
+		return -1;
+	iostats.read_bytes += len;
+
+	return 0;
+}
+
+int BlockDevice::pwrite_raw(uint64_t offset, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	iostats.writes++;
+	ret = pwrite(fd, buf, len, offset);
+	if (ret < 0 && direct && errno == EINVAL) {
+		drop_direct();
+		iostats.writes++;
+		ret = pwrite(fd, buf, len, offset);
+	}
+	if (ret != (ssize_t)len)
+		return -1;
+	iostats.write_bytes += len;
+
+	return 0;
+}
+
+int BlockDevice::pwritev_raw(uint64_t offset, const plan_extent &e)
+{
+	if (pwritev_extent(fd, offset, e, &iostats.writes) < 0) {
+		if (!direct || errno != EINVAL)
+			return -1;
+		drop_direct();
+		if (pwritev_extent(fd, offset, e, &iostats.writes) < 0)
+			return -1;
+	}
+	iostats.write_bytes += e.len;
+
+	return 0;
+}
+
+int BlockDevice::sync_raw(sync_mode mode)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+#ifdef MACOS_BUILD
+	(void)mode;
+	int ret = fsync(fd);
+#else
+	int ret = (mode == SYNC_FDATASYNC) ? fdatasync(fd) : fsync(fd);
+#endif
+
+	note_sync(iostats, start);
+	return ret;
+}
+
+/******************************************************************************\
+* BlockDevice::get_capacity: return the capacity in bytes, or 0 on error       *
+\******************************************************************************/
+uint64_t BlockDevice::get_capacity()
+{
+#if defined(BLKGETSIZE64) || defined(MACOS_BUILD)
+	uint64_t ret = 0;
+#else
+	uint32_t ret = 0;
+#endif
+
+	if (qcow.active)
+		return qcow.size;
+	if (image)
+		return image_size;
+
+	iostats.queries++;
+#ifdef BLKGETSIZE64
+	if (ioctl(fd, BLKGETSIZE64, &ret))
+		return 0;
+#else
+	if (ioctl(fd, BLKGETSIZE, &ret))
+		return 0;
+	ret *= 512;
+#endif
+
+	return ret;
+}
+
+/******************************************************************************\
+* BlockDevice::get_block_size: return the block size in bytes, or 0 on error   *
+\******************************************************************************/
+int BlockDevice::get_block_size()
+{
+	int ret = 0;
+
+	if (image)
+		return 0;
+
+	iostats.queries++;
+	if (ioctl(fd, BLKSSZGET, &ret) < 0)
+		return 0;
+
+	return ret;
+}
+
+/******************************************************************************\
+* BlockDevice::get_io_hints: return the I/O topology, 0 for anything unknown   *
+* Disk images have none; macOS only reports the physical block size.           *
+\******************************************************************************/
+void BlockDevice::get_io_hints(io_hints &hints)
+{
+	uint32_t val;
+
+	memset(&hints, 0, sizeof(hints));
+	if (image)
+		return;
+
+	iostats.queries++;
+	if (!ioctl(fd, BLKPBSZGET, &val))
+		hints.physical = val;
+#ifdef BLKIOMIN
+	iostats.queries++;
+	if (!ioctl(fd, BLKIOMIN, &val))
+		hints.io_min = val;
+#endif
+#ifdef BLKIOOPT
+	iostats.queries++;
+	if (!ioctl(fd, BLKIOOPT, &val))
+		hints.io_opt = val;
+#endif
+}
+#endif
+
+/******************************************************************************\
+* read_tbl: read an MSDOS-style partition table from a block of a device       *
+* dev: the device to read from                                                 *
+* lba: logical address of the block to parse                                   *
+* block_size: size of a block on the device                                    *
+* buf: buffer to read data into                                                *
+\******************************************************************************/
+int read_tbl(BlockDevice &dev, uint64_t lba, int block_size, char *buf)
+{
+	char *tmpbuf = (char *)calloc(block_size, sizeof(char));
+	int ret;
+
+	ret = dev.read_block(lba, tmpbuf);
+	if (ret >= 0) memcpy(buf, tmpbuf+446, 64);
+	free(tmpbuf);
+	return ret;
+}
+
+/******************************************************************************\
+* read_mbr: read an MBR-style (446 byte) boot code from a block of a device    *
+* dev: the device to read from                                                 *
+* lba: logical address of the block to parse                                   *
+* block_size: size of a block on the device                                    *
+* buf: buffer to read data into                                                *
+\******************************************************************************/
+int read_mbr(BlockDevice &dev, uint64_t lba, int block_size, char *buf)
+{
+	char *tmpbuf = (char *)calloc(block_size, sizeof(char));
+	int ret;
+
+	ret = dev.read_block(lba, tmpbuf);
+	if (ret >= 0) memcpy(buf, tmpbuf, 446);
+	free(tmpbuf);
+	return ret;
+}
+
+/******************************************************************************\
+* read_chain: read and parse the MBR and the EBR chain of a device             *
+* dev: the device to read from                                                 *
+* block_size: size of a block on the device                                    *
+* parts: receives the partitions found, in disk order                          *
+* sources: receives the logical addresses of the MBR and every EBR read        *
+* walk: follows the chain; check walk.error() after a successful return        *
+* The extended partition of a disk image is mapped before the chain is         *
+* followed, so that its EBRs are read from the page cache.                     *
+\******************************************************************************/
+int read_chain(BlockDevice &dev, int block_size, vector<part> &parts,
+			   vector<uint64_t> &sources, EbrWalk &walk)
+{
+	struct mbrpart curr[4];
+	uint32_t curr_ebr;
+
+	if (read_tbl(dev, 0, block_size, (char *)curr) < 0)
+		return -1;
+	if (dev.is_image()) {
+		uint32_t ext_start, ext_len;
+		if (find_extended(curr, &ext_start, &ext_len) && ext_len)
+			dev.map_region(ext_start, ext_len, (uint64_t)ext_len*block_size <=
+						   EXT_PREFETCH_LIMIT);
+	}
+	sources.push_back(0);
+	curr_ebr = walk.start(curr, parts);
+
+	// read and parse the EBR chain, if present
+	while (curr_ebr > 0) {
+		if (read_tbl(dev, curr_ebr, block_size, (char *)curr) < 0)
+			return -1;
+		sources.push_back(curr_ebr);
+		curr_ebr = walk.step(curr, parts);
+	}
+
+	return 0;
+}
+
+/******************************************************************************\
+* write_plan_file: write one extent of a write plan to a new file              *
+* name: name of the file to create (or truncate)                               *
+* e: the extent; the file receives its data starting at offset 0               *
+\******************************************************************************/
+int write_plan_file(string name, const plan_extent &e)
+{
+#ifdef WINDOWS_BUILD
+	ofstream fout(name.c_str(), ios_base::binary);
+
+	for (size_t i = 0; i < e.segs.size(); i++)
+		fout.write(e.segs[i].buf, e.segs[i].len);
+	fout.close();
+
+	return fout.fail() ? -1 : 0;
+#else
+	int fd = open(name.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+
+	if (fd < 0)
+		return -1;
+	if (pwritev_extent(fd, 0, e, NULL) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return close(fd);
+#endif
+}
+
+/******************************************************************************\
+* verify_buffers: what verify_disk() reads the two GPT copies into             *
+\******************************************************************************/
+struct verify_buffers {
+	AlignedBuffer head; // LBA 0 to the end of the primary array
+	AlignedBuffer tail; // the secondary array and header
+};
+
+/******************************************************************************\
+* verify_disk: read both GPT copies back from a device and check them          *
+* dev: the device, with its block size set (open it for direct I/O to check    *
+* what reached the disk rather than the OS cache)                              *
+* disk_len: capacity of the disk, in blocks                                    *
+* record_count: number of partition entries expected                           *
+* plan: what was written, to compare the disk with; NULL to only check that    *
+* the GPT is valid, taking the number of entries from the primary header       *
+* block_size: size of a block on the device                                    *
+* return value: a verify_error bitmask, -1 if the GPT couldn't be read         *
+* Each copy (the first including LBA 0) is fetched with a single read; with a  *
+* plan, both are read at once (see BlockDevice::read_runs()). A secondary      *
+* array moved down to an alignment boundary costs one more read.               *
+* bufs: buffers to read into, kept by the caller for the next disk; NULL to    *
+* allocate them for this call only                                             *
+\******************************************************************************/
+int verify_disk(BlockDevice &dev, uint64_t disk_len, uint32_t record_count,
+				const WritePlan *plan, int block_size,
+				verify_buffers *bufs = NULL)
+{
+	unsigned int table_len = gpt_table_len(record_count, block_size);
+	verify_buffers local;
+	AlignedBuffer &head = bufs ? bufs->head : local.head;
+	AlignedBuffer &tail = bufs ? bufs->tail : local.tail;
+	uint64_t tail_lba;
+	struct gpthdr hdr;
+	int ret;
+
+	if (disk_len < 2ULL*table_len+3 ||
+		!head.reserve((size_t)(table_len+2)*block_size, io_align(block_size)))
+		return -1;
+
+	if (plan) {
+		vector<block_run> runs(2);
+
+		if (!tail.reserve((size_t)(table_len+1)*block_size,
+						io_align(block_size)))
+			return -1;
+		runs[0].lba = 0;
+		runs[0].count = table_len+2;
+		runs[0].buf = head.get();
+		runs[1].lba = disk_len-(table_len+1);
+		runs[1].count = table_len+1;
+		runs[1].buf = tail.get();
+		if (dev.read_runs(runs) < 0)
+			return -1;
+	} else if (dev.read_blocks(0, table_len+2, head.get()) < 0) {
+		return -1;
+	}
+
+	// Without a plan, size the arrays from the primary header; if it's
+	// damaged, verify_gpt() reports that, whatever the size.
+	if (!plan) {
+		struct gpthdr hdr;
+		unsigned int len;
+
+		memcpy(&hdr, head.get()+block_size, sizeof(hdr));
+		len = gpt_table_len(le32_to_cpu(hdr.entry_cnt), block_size);
+		if (le32_to_cpu(hdr.entry_len) == sizeof(gptpart) &&
+			len != table_len && len && disk_len >= 2ULL*len+3) {
+			table_len = len;
+			if (!head.reserve((size_t)(table_len+2)*block_size,
+							io_align(block_size)) ||
+				dev.read_blocks(0, table_len+2, head.get()) < 0)
+				return -1;
+		}
+	}
+
+	if (!plan && (!tail.reserve((size_t)(table_len+1)*block_size,
+							  io_align(block_size)) ||
+				  dev.read_blocks(disk_len-(table_len+1), table_len+1,
+								  tail.get()) < 0))
+		return -1;
+
+	// The secondary header says where its array is; if that's below the
+	// usual place (see plan_area()), read the tail again from there.
+	tail_lba = disk_len-(table_len+1);
+	if (!load_gpt_header(tail.get() + (uint64_t)table_len*block_size,
+						 block_size, &hdr) &&
+		le64_to_cpu(hdr.first_entry) < tail_lba &&
+		(tail_lba - le64_to_cpu(hdr.first_entry))*block_size <= GPT_ALIGN_MAX) {
+		tail_lba = le64_to_cpu(hdr.first_entry);
+		if (!tail.reserve((size_t)(disk_len-tail_lba)*block_size,
+						io_align(block_size)) ||
+			dev.read_blocks(tail_lba, disk_len-tail_lba, tail.get()) < 0)
+			return -1;
+	}
+
+	ret = verify_gpt(head.get()+block_size, tail.get(), tail_lba, disk_len,
+					 block_size, table_len);
+
+	for (size_t i = 0; plan && i < plan->extents().size(); i++) {
+		const plan_extent &e = plan->extents()[i];
+		const char *disk;
+		vector<char> want(e.len);
+
+		if (e.lba + e.len/block_size <= table_len+2)
+			disk = head.get() + e.lba*block_size;
+		else if (e.lba >= tail_lba &&
+				 e.lba + e.len/block_size <= disk_len)
+			disk = tail.get() + (e.lba-tail_lba)*block_size;
+		else
+			return -1; // not a GPT region
+		plan_copy(e, &want[0]);
+		if (memcmp(disk, &want[0], e.len))
+			ret |= VERIFY_MISMATCH;
+	}
+
+	return ret;
+}
+
+/******************************************************************************\
+* clone_result: how clone_image() produced the copy                            *
+\******************************************************************************/
+enum clone_result {
+	CLONE_REFLINK, // shares all of its blocks with the source
+	CLONE_COPY // the source's data was copied, its holes were not
+};
+
+#ifndef WINDOWS_BUILD
+/******************************************************************************\
+* copy_range: copy a byte range between two files, at the same offset          *
+* in, out: file descriptors to copy from and to                                *
+* off, len: the range to copy                                                  *
+* copy_file_range lets the filesystem share or copy the blocks on its own      *
+* (server-side on NFS, reflinks on some filesystems); where it isn't           *
+* available, the range goes through a buffer.                                  *
+\******************************************************************************/
+int copy_range(int in, int out, off_t off, off_t len)
+{
+#ifdef __linux__
+	while (len > 0) {
+		loff_t ioff = off, ooff = off;
+		ssize_t n = copy_file_range(in, &ioff, out, &ooff, (size_t)len, 0);
+
+		if (n < 0 && (errno == ENOSYS || errno == EXDEV ||
+					  errno == EINVAL || errno == EOPNOTSUPP))
+			break;
+		if (n <= 0)
+			return -1;
+		off += n;
+		len -= n;
+	}
+#endif
+	if (len > 0) {
+		vector<char> buf(DIRECT_BOUNCE_CHUNK);
+
+		while (len > 0) {
+			size_t n = (size_t)min<off_t>(len, DIRECT_BOUNCE_CHUNK);
+
+			if (pread(in, &buf[0], n, off) != (ssize_t)n ||
+				pwrite(out, &buf[0], n, off) != (ssize_t)n)
+				return -1;
+			off += n;
+			len -= n;
+		}
+	}
+	return 0;
+}
+#endif
+
+/******************************************************************************\
+* clone_image: make a copy of a disk image that costs as little as possible    *
+* src: the image to copy, which must be a regular file                         *
+* dst: the copy to create (or overwrite)                                       *
+* return value: a clone_result, -1 on error                                    *
+* The copy is a reflink (FICLONE on Linux, clonefile on macOS) where the       *
+* filesystem supports it, so no data is copied at all. Otherwise only the      *
+* data extents of the source are copied (found with SEEK_DATA/SEEK_HOLE), and  *
+* its holes stay holes in the copy.                                            *
+\******************************************************************************/
+int clone_image(string src, string dst)
+{
+#ifdef WINDOWS_BUILD
+	return CopyFileA(src.c_str(), dst.c_str(), FALSE) ? CLONE_COPY : -1;
+#else
+	struct stat st, dst_st;
+	off_t data, hole = 0;
+	int in, out, ret = CLONE_COPY;
+
+	in = open(src.c_str(), O_RDONLY);
+	if (in < 0)
+		return -1;
+	if (fstat(in, &st) < 0 || !S_ISREG(st.st_mode) ||
+		(stat(dst.c_str(), &dst_st) == 0 && dst_st.st_dev == st.st_dev &&
+		 dst_st.st_ino == st.st_ino)) {
+		close(in);
+		return -1;
+	}
+
+#ifdef MACOS_BUILD
+	unlink(dst.c_str());
+	if (fclonefileat(in, AT_FDCWD, dst.c_str(), 0) == 0) {
+		close(in);
+		return CLONE_REFLINK;
+	}
+#endif
+
+	out = open(dst.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	if (out < 0) {
+		close(in);
+		return -1;
+	}
+
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0) {
+		close(in);
+		return close(out) < 0 ? -1 : CLONE_REFLINK;
+	}
+#endif
+
+	while (hole < st.st_size) {
+		data = lseek(in, hole, SEEK_DATA);
+		if (data < 0 && errno == ENXIO)
+			break; // nothing but a hole up to the end
+		if (data < 0) {
+			// no SEEK_DATA support, copy everything that's left
+			data = hole;
+			hole = st.st_size;
+		} else {
+			hole = lseek(in, data, SEEK_HOLE);
+			if (hole < 0 || hole > st.st_size)
+				hole = st.st_size;
+		}
+		if (copy_range(in, out, data, hole - data) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	if (ret >= 0 && ftruncate(out, st.st_size) < 0)
+		ret = -1;
+	close(in);
+	if (close(out) < 0)
+		ret = -1;
+	return ret;
+#endif
+}
+
+/******************************************************************************\
+* print_io_stats: print how many device syscalls the run issued                *
+* dev: the device the run operated on                                          *
+\******************************************************************************/
+void print_io_stats(const BlockDevice &dev)
+{
+	const io_stats &st = dev.stats();
+
+	cout << "Device I/O: " << dev.syscalls() << " syscalls ("
+		 << st.opens << " open, " << st.reads << " read, "
+		 << st.writes << " write, " << st.syncs << " sync, "
+		 << st.queries << " query, " << st.maps << " map";
+	if (st.submits)
+		cout << ", " << st.submits << " io_uring submit for "
+			 << st.ring_ops << " request(s)";
+	cout << ")" << endl;
+}
+
+/******************************************************************************\
+* RunStats: timings and I/O counters of a run, written out for --stats         *
+* The run is split into phases, timed back to back with a monotonic clock:     *
+* starting a phase ends the previous one. A phase that is entered more than    *
+* once (e.g. opening both the original and the clone) adds up its time. At     *
+* exit, everything is written as a single JSON object, whether the run         *
+* succeeded or not; a failed run names the phase it failed in.                 *
+\******************************************************************************/
+class RunStats {
+public:
+	RunStats();
+
+	void enable(string file) { path = file; }
+	bool enabled() const { return path.length() > 0; }
+	void set_device(string name) { device = name; }
+	void phase(const char *name);
+	int write(int status, const io_stats &dev);
+
+	io_stats stream; // pipe mode stdin/stdout, or the devices of a batch
+
+private:
+	typedef chrono::steady_clock clock;
+
+	void end_phase();
+
+	string path; // file to write to, "-" for stderr
+	string device;
+	clock::time_point start;
+	clock::time_point phase_start;
+	string current; // the phase running now, empty if none
+	vector<pair<string, double> > phases; // seconds per phase, in run order
+};
+
+RunStats::RunStats() : start(clock::now()), phase_start(start)
+{
+	memset(&stream, 0, sizeof(stream));
+}
+
+/******************************************************************************\
+* RunStats::end_phase: add the time since the current phase started to it      *
+\******************************************************************************/
+void RunStats::end_phase()
+{
+	clock::time_point now = clock::now();
+	double secs = chrono::duration<double>(now - phase_start).count();
+
+	phase_start = now;
+	if (!current.length())
+		return;
+	for (size_t i = 0; i < phases.size(); i++) {
+		if (phases[i].first == current) {
+			phases[i].second += secs;
+			return;
+		}
+	}
+	phases.push_back(make_pair(current, secs));
+}
+
+/******************************************************************************\
+* RunStats::phase: end the current phase and start another one                 *
+* name: name of the new phase                                                  *
+\******************************************************************************/
+void RunStats::phase(const char *name)
+{
+	end_phase();
+	current = name;
+}
+
+/******************************************************************************\
+* json_string: quote and escape a string for JSON output                       *
+\******************************************************************************/
+static string json_string(const string &s)
+{
+	ostringstream out;
+
+	out << '"';
+	for (size_t i = 0; i < s.length(); i++) {
+		unsigned char c = s[i];
+
+		if (c == '"' || c == '\\')
+			out << '\\' << c;
+		else if (c < 0x20)
+			out << "\\u" << hex << setw(4) << setfill('0') << (int)c << dec;
+		else
+			out << c;
+	}
+	out << '"';
+	return out.str();
+}
+
+/******************************************************************************\
+* RunStats::write: end the run, and write out its statistics                   *
+* status: exit status of the run                                               *
+* dev: I/O counters of the device the run used                                 *
+* Times are in milliseconds, I/O counters combine the device and the stream.   *
+\******************************************************************************/
+int RunStats::write(int status, const io_stats &dev)
+{
+	double total = chrono::duration<double>(clock::now() - start).count();
+	string failed = status ? current : "";
+	ostringstream out;
+	ofstream fout;
+
+	end_phase();
+	current = "";
+
+	out << fixed << setprecision(3);
+	out << "{\"version\": \"1.3\", \"device\": " << json_string(device)
+		<< ", \"status\": " << status << ", \"failed_phase\": "
+		<< (failed.length() ? json_string(failed) : "null")
+		<< ", \"total_ms\": " << total*1000 << ", \"phases_ms\": {";
+	for (size_t i = 0; i < phases.size(); i++) {
+		out << (i ? ", " : "") << json_string(phases[i].first) << ": "
+			<< phases[i].second*1000;
+	}
+	out << "}, \"io\": {\"opens\": " << dev.opens + stream.opens
+		<< ", \"reads\": " << dev.reads + stream.reads
+		<< ", \"writes\": " << dev.writes + stream.writes
+		<< ", \"syncs\": " << dev.syncs + stream.syncs
+		<< ", \"queries\": " << dev.queries + stream.queries
+		<< ", \"maps\": " << dev.maps + stream.maps
+		<< ", \"submits\": " << dev.submits + stream.submits
+		<< ", \"ring_ops\": " << dev.ring_ops + stream.ring_ops
+		<< ", \"read_bytes\": " << dev.read_bytes + stream.read_bytes
+		<< ", \"write_bytes\": " << dev.write_bytes + stream.write_bytes
+		<< "}, \"sync_ms\": {\"total\": "
+		<< (dev.sync_secs + stream.sync_secs)*1000 << ", \"max\": "
+		<< max(dev.sync_max_secs, stream.sync_max_secs)*1000 << "}}" << endl;
+
+	if (path == "-") {
+		cerr << out.str();
+		return cerr.fail() ? -1 : 0;
+	}
+	fout.open(path.c_str());
+	fout << out.str();
+	fout.close();
+	return fout.fail() ? -1 : 0;
+}
+
+/******************************************************************************\
+* print_layout_errors: explain why a partition layout can't be converted       *
+* layout: gptgen_layout_error bitmask returned by check_layout()               *
+* count: number of partitions on the disk                                      *
+* table_len: size of the partition entry array, in blocks                      *
+* record_count: number of entries in the partition entry array                 *
+* out: stream to print to                                                      *
+\******************************************************************************/
+void print_layout_errors(int layout, size_t count, unsigned int table_len,
+						 unsigned int record_count, ostream &out = cout)
+{
+	if (layout & GPTGEN_LAYOUT_HEAD) {
+		out << "Not enough space at the beginning of the disk (need at least "
+			 << table_len+2 << " sectors before "
+			 << "the start of the first partition)."
+			 << endl << "Re-partition the disk to meet this requirement, and "
+			 << "run this utility again." << endl;
+	}
+
+	if (layout & GPTGEN_LAYOUT_TAIL) {
+		if (layout & GPTGEN_LAYOUT_HEAD) out << endl;
+		out << "Not enough space at the end of the disk (need at least "
+			 << table_len+1 << " sectors after "
+			 << "the end of the last partition)."
+			 << endl << "Re-partition the disk to meet this requirement, and "
+			 << "run this utility again." << endl;
+	}
+
+	if (layout & GPTGEN_LAYOUT_COUNT) {
+		if (layout & (GPTGEN_LAYOUT_HEAD | GPTGEN_LAYOUT_TAIL)) out << endl;
+		out << "Too many partitions (" << count << ") for a GPT "
+			 << "containing " << record_count << " entries." << endl
+			 << "Run this utility again with a larger -c (--count)." << endl;
+	}
+}
+
+/******************************************************************************\
+* override_hints: replace what a disk reports of its topology where the user   *
+* gave a value                                                                 *
+* hints: the topology reported by the disk                                     *
+* overrides: the values given on the command line, 0 where not given           *
+\******************************************************************************/
+void override_hints(io_hints &hints, const io_hints &overrides)
+{
+	if (overrides.physical)
+		hints.physical = overrides.physical;
+	if (overrides.io_min)
+		hints.io_min = overrides.io_min;
+	if (overrides.io_opt)
+		hints.io_opt = overrides.io_opt;
+}
+
+/******************************************************************************\
+* print_alignment: warn about partitions that are misaligned on the disk       *
+* parts: the partitions                                                        *
+* block_size: size of a block on the disk                                      *
+* hints: the topology of the disk                                              *
+* out: stream to print to                                                      *
+* Nothing is printed unless the disk reports a boundary larger than a block.   *
+\******************************************************************************/
+void print_alignment(const vector<part> &parts, int block_size,
+					 const io_hints &hints, ostream &out = cout)
+{
+	int bad = 0;
+
+	if (hints.physical <= (uint32_t)block_size &&
+		hints.io_min <= (uint32_t)block_size &&
+		hints.io_opt <= (uint32_t)block_size)
+		return;
+
+	out << endl << "Physical block: " << hints.physical << " bytes, "
+		 << "minimum I/O: " << hints.io_min << " bytes, optimal I/O: "
+		 << hints.io_opt << " bytes." << endl;
+	for (size_t i = 0; i < parts.size(); i++) {
+		switch (check_alignment(parts[i].start, block_size, hints)) {
+		case ALIGN_PHYSICAL:
+			out << "WARNING: Partition " << i << " (sector " << parts[i].start
+				 << ") is not aligned to the physical block;" << endl
+				 << "every write to it is a read-modify-write (severe)."
+				 << endl;
+			bad++;
+			break;
+		case ALIGN_CHUNK:
+			out << "WARNING: Partition " << i << " (sector " << parts[i].start
+				 << ") is not aligned to the minimum I/O size;" << endl
+				 << "writes to it straddle two RAID chunks (moderate)." << endl;
+			bad++;
+			break;
+		case ALIGN_STRIPE:
+			out << "WARNING: Partition " << i << " (sector " << parts[i].start
+				 << ") is not aligned to the optimal I/O size;" << endl
+				 << "full-stripe writes to it span two stripes (minor)."
+				 << endl;
+			bad++;
+			break;
+		}
+	}
+	if (!bad)
+		out << "All partitions are aligned." << endl;
+	else
+		out << "The GPT keeps the partitions where they are; move them "
+			 << "with a partitioning tool." << endl;
+}
+
+/******************************************************************************\
+* print_verify_errors: explain what is wrong with a GPT read back from a disk  *
+* errors: verify_error bitmask returned by verify_disk()                       *
+* out: stream to print to                                                      *
+\******************************************************************************/
+void print_verify_errors(int errors, ostream &out = cout)
+{
+	if (errors & VERIFY_PRIMARY)
+		out << "Primary GPT header is damaged (bad signature, size or CRC)."
+			 << endl;
+	if (errors & VERIFY_SECONDARY)
+		out << "Secondary GPT header is damaged (bad signature, size or "
+			 << "CRC)." << endl;
+	if (errors & VERIFY_PRIMARY_ARRAY)
+		out << "Primary partition entry array fails its CRC." << endl;
+	if (errors & VERIFY_SECONDARY_ARRAY)
+		out << "Secondary partition entry array fails its CRC." << endl;
+	if (errors & VERIFY_LOCATION)
+		out << "The GPT headers don't point at each other, or at their "
+			 << "partition entry arrays." << endl;
+	if (errors & VERIFY_BOUNDS)
+		out << "The usable area overlaps a partition entry array, or "
+			 << "doesn't hold every partition." << endl;
+	if (errors & VERIFY_COPIES)
+		out << "The primary and secondary GPT differ." << endl;
+	if (errors & VERIFY_MISMATCH)
+		out << "The GPT on the disk differs from the one written." << endl;
+}
+
+/******************************************************************************\
+* print_chain_error: explain why the EBR chain was rejected                    *
+* error: gptgen_chain_error returned by EbrWalk::error()                       *
+* lba: the link that was rejected                                              *
+* limit: largest number of EBRs allowed                                        *
+* out: stream to print to                                                      *
+\******************************************************************************/
+void print_chain_error(int error, uint64_t lba, uint32_t limit,
+					   ostream &out = cout)
+{
+	switch (error) {
+	case GPTGEN_CHAIN_LOOP:
+		out << "ERROR: The EBR chain loops back to LBA " << lba << "."
+			 << endl;
+		break;
+	case GPTGEN_CHAIN_BOUNDS:
+		out << "ERROR: The EBR chain links to LBA " << lba << ", outside "
+			 << "the extended partition." << endl;
+		break;
+	case GPTGEN_CHAIN_LIMIT:
+		out << "ERROR: The EBR chain is longer than the limit of " << limit
+			 << " EBR(s)." << endl << "Run this utility again with a larger --max-ebrs "
+			 << "if this is expected." << endl;
+		return;
+	}
+	out << "The extended partition is damaged. Operation aborted." << endl;
+}
+
+/******************************************************************************\
+* print_type_error: explain why a partition type aborts the conversion         *
+* action: TYPE_PMAGIC, TYPE_DYNAMIC or TYPE_GPT                                *
+* out: stream to print to                                                      *
+\******************************************************************************/
+void print_type_error(type_action action, ostream &out = cout)
+{
+	switch (action) {
+	case TYPE_PMAGIC:
+		out << "ERROR: PartitionMagic work partition (ID 0x3C) detected."
+			 << endl
+			 << "This is a sign of an interrupted PartitionMagic session."
+			 << endl
+			 << "Correct this error, and run this utility again." << endl;
+		break;
+	case TYPE_DYNAMIC:
+		out << "FATAL: Dynamic disk detected. Support for dynamic disks is"
+			 << endl
+			 << "not yet implemented. Writing a GPT to a dynamic disk is"
+			 << endl
+			 << "dangerous. Operation aborted." << endl;
+		break;
+	case TYPE_GPT:
+		out << "ERROR: This drive already has a GUID partition table."
+			 << endl
+			 << "There is no need to run this utility "
+			 << "on this drive again; use --edit to change its entries."
+			 << endl;
+		break;
+	default:
+		break;
+	}
+}
+
+// Marker at the start of every frame of the pipe mode output stream.
+#define FRAME_MAGIC {'G', 'P', 'T', 'G', 'E', 'N', 'F', '1'}
+
+// Amount of the input stream read at once while skipping to the next EBR.
+#define PIPE_CHUNK (1024*1024)
+
+/******************************************************************************\
+* frame_hdr: header of a frame of the pipe mode output stream                  *
+* Every frame carries one region to be written to the disk: len bytes of data  *
+* that go to logical block lba. A frame with a len of 0 ends the stream.       *
+\******************************************************************************/
+struct frame_hdr {
+	char magic[8]; // FRAME_MAGIC
+	uint64_t lba; // logical address of the first block, little-endian
+	uint64_t len; // length of the data following the header, little-endian
+	uint32_t block_size; // size of a block, little-endian
+	uint32_t crc; // EFI-style CRC32 of the data, little-endian
+}ATTRIBUTE_PACKED;
+
+/******************************************************************************\
+* write_frame: write one frame of the pipe mode output stream                  *
+* out: stream to write to                                                      *
+* lba: logical address the data goes to                                        *
+* buf, len: the data                                                           *
+* block_size: size of a block on the disk                                      *
+\******************************************************************************/
+int write_frame(FILE *out, uint64_t lba, const unsigned char *buf,
+				uint64_t len, uint32_t block_size)
+{
+	struct frame_hdr hdr = {
+		FRAME_MAGIC,
+		cpu_to_le64(lba),
+		cpu_to_le64(len),
+		cpu_to_le32(block_size),
+		cpu_to_le32(crc32(buf, (size_t)len))
+	};
+
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		return -1;
+	if (len && fwrite(buf, (size_t)len, 1, out) != 1)
+		return -1;
+	return 0;
+}
+
+/******************************************************************************\
+* read_stream: read from a stream until the buffer is full or the stream ends  *
+* in: stream to read from                                                      *
+* buf, len: buffer receiving the data, NULL to discard it                      *
+* return value: number of bytes read, less than len only at the end of stream  *
+\******************************************************************************/
+uint64_t read_stream(FILE *in, char *buf, uint64_t len)
+{
+	static char sink[PIPE_CHUNK];
+	uint64_t done = 0;
+
+	while (done < len) {
+		size_t n = (size_t)min<uint64_t>(len - done, PIPE_CHUNK);
+		size_t got = fread(buf ? buf + done : sink, 1, n, in);
+
+		done += got;
+		if (got < n)
+			break;
+	}
+	return done;
+}
+
+/******************************************************************************\
+* convert_sectors: convert a set of boot records, sizing the output to fit     *
+* geom, sectors: as for gptgen_convert()                                       *
+* primary, secondary: receive the primary and secondary GPT regions            *
+* res: receives the result of the conversion                                   *
+* out: stream to explain a failure on                                          *
+* return value: the status returned by gptgen_convert()                        *
+* Buffers that are already large enough (e.g. kept from the previous disk of a *
+* batch) are used as they are; the others are grown to fit.                    *
+\******************************************************************************/
+int convert_sectors(const gptgen_geometry &geom,
+					const vector<gptgen_sector> &sectors,
+					vector<unsigned char> &primary,
+					vector<unsigned char> &secondary, gptgen_result &res,
+					ostream &out = cout)
+{
+	int ret;
+
+	memset(&res, 0, sizeof(res));
+	if (primary.size() && secondary.size()) {
+		res.primary = &primary[0];
+		res.primary_size = primary.size();
+		res.secondary = &secondary[0];
+		res.secondary_size = secondary.size();
+	}
+	ret = gptgen_convert(&geom, &sectors[0], sectors.size(), &res);
+	if (ret == GPTGEN_ENOSPACE) {
+		primary.resize(res.primary_len);
+		secondary.resize(res.secondary_len);
+		res.primary = &primary[0];
+		res.primary_size = primary.size();
+		res.secondary = &secondary[0];
+		res.secondary_size = secondary.size();
+		ret = gptgen_convert(&geom, &sectors[0], sectors.size(), &res);
+	}
+
+	switch (ret) {
+	case GPTGEN_OK:
+		break;
+	case GPTGEN_ELAYOUT:
+		print_layout_errors(res.layout, res.part_count,
+							gpt_table_len(geom.record_count, geom.block_size),
+							geom.record_count, out);
+		break;
+	case GPTGEN_EPMAGIC:
+		print_type_error(TYPE_PMAGIC, out);
+		break;
+	case GPTGEN_EDYNAMIC:
+		print_type_error(TYPE_DYNAMIC, out);
+		break;
+	case GPTGEN_EGPT:
+		print_type_error(TYPE_GPT, out);
+		break;
+	case GPTGEN_ECHAIN:
+		print_chain_error(res.chain, res.chain_lba, geom.max_ebrs ?
+						  geom.max_ebrs : GPTGEN_EBR_LIMIT_DEFAULT, out);
+		break;
+	case GPTGEN_EGUID:
+		out << "Unable to get random bytes for the GUIDs from the OS." << endl;
+		break;
+	case GPTGEN_ENOMEM:
+		out << "Out of memory!" << endl;
+		break;
+	default:
+		out << "The disk is too small to hold a GPT." << endl;
+		break;
+	}
+	return ret;
+}
+
+/******************************************************************************\
+* run_pipe: convert a disk image streamed on stdin, writing frames to stdout   *
+* geom: the GPT to build; the disk length is taken from the stream             *
+* bootnofail: go ahead if a boot partition is found (there is no one to ask)   *
+* backup: file to back up the MBR to, empty for none                           *
+* stats: timings of the run; only bytes are counted for the stream, as stdio   *
+* hides the syscalls                                                           *
+* The image is read in a single forward pass: the MBR and the EBRs are kept    *
+* as the chain reaches them, and the rest is only counted to find the length   *
+* of the disk. Messages go to stderr, the frames (primary GPT, secondary GPT   *
+* and the end of stream) to stdout.                                            *
+\******************************************************************************/
+int run_pipe(gptgen_geometry geom, bool bootnofail, string backup,
+			 RunStats &stats)
+{
+	vector<vector<unsigned char> > blocks;
+	vector<gptgen_sector> sectors;
+	vector<unsigned char> primary, secondary;
+	vector<part> parts;
+	gptgen_result res;
+	EbrWalk walk(geom.max_ebrs);
+	uint64_t pos = 0, want = 0, rest;
+	uint32_t bs = geom.block_size;
+
+#ifdef WINDOWS_BUILD
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	// Fetch the MBR and then each EBR, walking the chain as they arrive; a
+	// malformed chain ends the walk, and is reported by convert_sectors().
+	stats.phase("ebr_walk");
+	for (;;) {
+		uint32_t next;
+
+		if (want < pos) {
+			cout << "EBR at LBA " << want << " precedes LBA " << pos
+				 << ", and can't be read back from a stream." << endl;
+			return EXIT_FAILURE;
+		}
+		if (read_stream(stdin, NULL, (want-pos)*bs) != (want-pos)*bs) {
+			cout << "Unexpected end of stream before LBA " << want << "."
+				 << endl;
+			return EXIT_FAILURE;
+		}
+		blocks.push_back(vector<unsigned char>(bs));
+		if (read_stream(stdin, (char *)&blocks.back()[0], bs) != bs) {
+			cout << "Unexpected end of stream before LBA " << want << "."
+				 << endl;
+			return EXIT_FAILURE;
+		}
+		pos = want + 1;
+		stats.stream.read_bytes = pos*bs;
+
+		gptgen_sector sect = {want, NULL};
+		sectors.push_back(sect);
+
+		const struct mbrpart *tbl =
+			(const struct mbrpart *)(&blocks.back()[0] + 446);
+		next = (sectors.size() == 1) ? walk.start(tbl, parts) :
+									   walk.step(tbl, parts);
+		if (!next)
+			break;
+		want = next;
+	}
+	for (size_t i = 0; i < sectors.size(); i++)
+		sectors[i].data = &blocks[i][0];
+
+	stats.phase("read");
+	rest = read_stream(stdin, NULL, UINT64_MAX);
+	stats.stream.read_bytes += rest;
+	geom.disk_len = pos + rest/bs;
+	cout << "Read " << geom.disk_len << " blocks of " << bs
+		 << " bytes from the stream." << endl;
+
+	if (backup != "") {
+		stats.phase("backup");
+		cout << "Backing up original MBR to file " << backup << "..." << endl;
+		ofstream fout(backup.c_str(), ios_base::binary);
+		fout.write((const char *)&blocks[0][0], bs);
+	}
+
+	stats.phase("convert");
+	if (convert_sectors(geom, sectors, primary, secondary, res) != GPTGEN_OK)
+		return EXIT_FAILURE;
+
+	cout << "Found " << res.part_count << " partition(s)." << endl;
+	if (res.generic)
+		cout << "WARNING: " << res.generic << " partition(s) of unknown "
+			 << "type, a generic GUID will be used." << endl;
+	if (res.boot) {
+		cout << "WARNING: Boot partition(s) found. This tool cannot "
+			 << "guarantee that" << endl << "such partitions will remain "
+			 << "bootable after conversion." << endl;
+		if (!bootnofail) {
+			cout << "Run this utility again with -k (--keep-going) to "
+				 << "convert the disk anyway." << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	cout << "Writing primary GPT ";
+	if (!geom.keepmbr) cout << "and protective MBR ";
+	cout << "(LBA " << res.primary_lba << ") and secondary GPT (LBA "
+		 << res.secondary_lba << ") to stdout..." << endl;
+	stats.phase("write");
+	if (write_frame(stdout, res.primary_lba, res.primary, res.primary_len,
+					bs) < 0 ||
+		write_frame(stdout, res.secondary_lba, res.secondary,
+					res.secondary_len, bs) < 0 ||
+		write_frame(stdout, 0, NULL, 0, bs) < 0 ||
+		fflush(stdout)) {
+		cout << "Failed to write to stdout!" << endl;
+		return EXIT_FAILURE;
+	}
+	stats.stream.write_bytes = 3*sizeof(frame_hdr) + res.primary_len +
+							   res.secondary_len;
+	cout << "Success!" << endl;
+	return EXIT_SUCCESS;
+}
+
+/******************************************************************************\
+* run_verify: verify the GPT on a device, and report the result                *
+* dev: the device, open and with its block size set                            *
+* drive: name of the device, for messages                                      *
+* disk_len, record_count, plan, block_size: as for verify_disk()               *
+* stats: timings of the run                                                    *
+* return value: the exit status of the program                                 *
+\******************************************************************************/
+int run_verify(BlockDevice &dev, string drive, uint64_t disk_len,
+			   uint32_t record_count, const WritePlan *plan, int block_size,
+			   RunStats &stats)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	int ret;
+
+	stats.phase("verify");
+	cout << "Verifying the GPT on " << drive << "..." << endl;
+	ret = verify_disk(dev, disk_len, record_count, plan, block_size);
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() -
+												start).count();
+
+	if (ret < 0) {
+		cout << "Failed to read the GPT back from " << drive << "!" << endl;
+		return EXIT_FAILURE;
+	}
+	if (ret) {
+		print_verify_errors(ret);
+		cout << "Verification FAILED after " << ms << " ms!" << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "Verified both GPT copies in " << ms << " ms." << endl;
+	return EXIT_SUCCESS;
+}
+
+#define PLAN_MAGIC {'G', 'P', 'T', 'G', 'E', 'N', 'P', '1'}
+
+/******************************************************************************\
+* plan_hdr: header of a conversion plan file                                   *
+* A plan file holds everything --apply needs to finish a conversion prepared   *
+* by --plan: this header, sector_count fingerprints of the boot records the    *
+* GPT was derived from, then the regions to write, as pipe mode frames ending  *
+* with an empty one. All fields are little-endian.                             *
+\******************************************************************************/
+struct plan_hdr {
+	char magic[8]; // PLAN_MAGIC
+	uint64_t disk_len; // capacity of the disk, in blocks
+	uint32_t block_size; // size of a block
+	uint32_t record_count; // entries in the partition entry arrays
+	uint32_t sector_count; // fingerprints following the header
+	uint32_t crc; // CRC32 of the header (this field zeroed) and fingerprints
+}ATTRIBUTE_PACKED;
+
+/******************************************************************************\
+* plan_fingerprint: the CRC32 of a boot record a plan was derived from         *
+\******************************************************************************/
+struct plan_fingerprint {
+	uint64_t lba; // logical address of the MBR or EBR
+	uint32_t crc; // CRC32 of the whole block
+	uint32_t pad;
+}ATTRIBUTE_PACKED;
+
+/******************************************************************************\
+* saved_plan: a conversion plan, as loaded from a plan file                    *
+\******************************************************************************/
+struct saved_plan {
+	uint64_t disk_len;
+	uint32_t block_size;
+	uint32_t record_count;
+	vector<plan_fingerprint> sectors; // in host byte order
+	vector<pair<uint64_t, vector<char> > > regions; // LBA and data to write
+};
+
+/******************************************************************************\
+* save_plan: write a conversion plan file                                      *
+* name: name of the file to create (or truncate)                               *
+* dev: the device the plan is for; the boot records are fingerprinted from it  *
+* sources: logical addresses of the MBR and every EBR that was parsed          *
+* disk_len, record_count, block_size: geometry of the GPT                      *
+* plan: the regions to write                                                   *
+\******************************************************************************/
+int save_plan(string name, BlockDevice &dev, const vector<uint64_t> &sources,
+			  uint64_t disk_len, uint32_t record_count, int block_size,
+			  const WritePlan &plan)
+{
+	vector<plan_fingerprint> sectors(sources.size());
+	vector<char> block(block_size);
+	FILE *out;
+	int ret = 0;
+
+	for (size_t i = 0; i < sources.size(); i++) {
+		if (dev.read_block(sources[i], &block[0]) < 0)
+			return -1;
+		sectors[i].lba = cpu_to_le64(sources[i]);
+		sectors[i].crc = cpu_to_le32(crc32((unsigned char *)&block[0],
+										   block_size));
+		sectors[i].pad = 0;
+	}
+
+	struct plan_hdr hdr = {
+		PLAN_MAGIC,
+		cpu_to_le64(disk_len),
+		cpu_to_le32(block_size),
+		cpu_to_le32(record_count),
+		cpu_to_le32((uint32_t)sectors.size()),
+		0
+	};
+	uint32_t crc = crc32((unsigned char *)&hdr, sizeof(hdr));
+
+	if (sectors.size())
+		crc = crc32_combine(crc, crc32((unsigned char *)&sectors[0],
+				sectors.size()*sizeof(sectors[0])),
+				sectors.size()*sizeof(sectors[0]));
+	hdr.crc = cpu_to_le32(crc);
+
+	out = fopen(name.c_str(), "wb");
+	if (!out)
+		return -1;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 || (sectors.size() &&
+		fwrite(&sectors[0], sizeof(sectors[0]), sectors.size(), out) !=
+		sectors.size()))
+		ret = -1;
+	for (size_t i = 0; !ret && i < plan.extents().size(); i++) {
+		const plan_extent &e = plan.extents()[i];
+		vector<unsigned char> data(e.len);
+
+		plan_copy(e, (char *)&data[0]);
+		ret = write_frame(out, e.lba, &data[0], e.len, block_size);
+	}
+	if (!ret)
+		ret = write_frame(out, 0, NULL, 0, block_size);
+	if (fclose(out))
+		ret = -1;
+
+	return ret;
+}
+
+/******************************************************************************\
+* read_regions: read the frames that end a plan or journal file                *
+* in: the file, positioned at the first frame                                  *
+* block_size, disk_len: geometry the frames must agree with                    *
+* regions: receives the LBA and data of every frame, up to the empty one       *
+* return value: 0 on success, -1 if a frame is damaged or out of bounds        *
+\******************************************************************************/
+int read_regions(istream &in, uint32_t block_size, uint64_t disk_len,
+				 vector<pair<uint64_t, vector<char> > > &regions)
+{
+	static const char fmagic[8] = FRAME_MAGIC;
+
+	regions.clear();
+	for (;;) {
+		struct frame_hdr f;
+
+		if (!in.read((char *)&f, sizeof(f)) ||
+			memcmp(f.magic, fmagic, sizeof(fmagic)) ||
+			le32_to_cpu(f.block_size) != block_size)
+			return -1;
+
+		uint64_t lba = le64_to_cpu(f.lba), len = le64_to_cpu(f.len);
+
+		if (!len)
+			return 0;
+		if (len % block_size || lba + len/block_size > disk_len ||
+			len > 64ULL*1024*1024)
+			return -1;
+		regions.push_back(make_pair(lba, vector<char>((size_t)len)));
+
+		vector<char> &data = regions.back().second;
+		if (!in.read(&data[0], (streamsize)len) ||
+			crc32((unsigned char *)&data[0], (size_t)len) !=
+			le32_to_cpu(f.crc))
+			return -1;
+	}
+}
+
+/******************************************************************************\
+* load_plan: read and check a conversion plan file                             *
+* name: name of the file                                                       *
+* p: receives the plan                                                         *
+* return value: 0 on success, -1 if the file can't be read or is damaged       *
+\******************************************************************************/
+int load_plan(string name, saved_plan &p)
+{
+	static const char magic[8] = PLAN_MAGIC;
+	ifstream in(name.c_str(), ios_base::binary);
+	struct plan_hdr hdr;
+	uint32_t crc, count;
+
+	if (!in.read((char *)&hdr, sizeof(hdr)) ||
+		memcmp(hdr.magic, magic, sizeof(magic)))
+		return -1;
+	p.disk_len = le64_to_cpu(hdr.disk_len);
+	p.block_size = le32_to_cpu(hdr.block_size);
+	p.record_count = le32_to_cpu(hdr.record_count);
+	count = le32_to_cpu(hdr.sector_count);
+	crc = le32_to_cpu(hdr.crc);
+	if (p.block_size < 512 || count > (1U << 24))
+		return -1;
+
+	hdr.crc = 0;
+	p.sectors.resize(count);
+	if (count && !in.read((char *)&p.sectors[0], count*sizeof(p.sectors[0])))
+		return -1;
+	uint32_t sum = crc32((unsigned char *)&hdr, sizeof(hdr));
+	if (count)
+		sum = crc32_combine(sum, crc32((unsigned char *)&p.sectors[0],
+				count*sizeof(p.sectors[0])), count*sizeof(p.sectors[0]));
+	if (sum != crc)
+		return -1;
+	for (uint32_t i = 0; i < count; i++) {
+		p.sectors[i].lba = le64_to_cpu(p.sectors[i].lba);
+		p.sectors[i].crc = le32_to_cpu(p.sectors[i].crc);
+	}
+
+	if (read_regions(in, p.block_size, p.disk_len, p.regions) < 0)
+		return -1;
+	return p.regions.empty() ? -1 : 0;
+}
+
+#define JOURNAL_MAGIC {'G', 'P', 'T', 'G', 'E', 'N', 'J', '1'}
+
+/******************************************************************************\
+* journal_hdr: header of an undo journal                                       *
+* An undo journal holds what a conversion overwrote, so that --undo can put it *
+* back: this header, range_count fingerprints of what was written over each    *
+* range (to tell whether the disk has changed since), then the original data   *
+* of the ranges, in the same order, as pipe mode frames ending with an empty   *
+* one. All fields are little-endian.                                           *
+\******************************************************************************/
+struct journal_hdr {
+	char magic[8]; // JOURNAL_MAGIC
+	uint64_t disk_len; // capacity of the disk, in blocks
+	uint32_t block_size; // size of a block
+	uint32_t range_count; // fingerprints (and frames) following the header
+	uint32_t crc; // CRC32 of the header (this field zeroed) and fingerprints
+	uint32_t pad;
+}ATTRIBUTE_PACKED;
+
+/******************************************************************************\
+* saved_journal: an undo journal, as loaded from a file                        *
+\******************************************************************************/
+struct saved_journal {
+	uint64_t disk_len;
+	uint32_t block_size;
+	vector<plan_fingerprint> written; // in host byte order
+	vector<pair<uint64_t, vector<char> > > regions; // LBA and original data
+};
+
+/******************************************************************************\
+* save_journal: record what a write plan is about to overwrite                 *
+* name: name of the journal to create (or truncate)                            *
+* dev: the device, opened for writing but not yet written to                   *
+* disk_len, block_size: geometry of the device                                 *
+* plan: the regions about to be written                                        *
+* The journal is synced to stable storage before this returns, so it is safe   *
+* to start writing the device as soon as it succeeds.                          *
+\******************************************************************************/
+int save_journal(string name, BlockDevice &dev, uint64_t disk_len,
+				 int block_size, const WritePlan &plan)
+{
+	const vector<plan_extent> &ext = plan.extents();
+	vector<plan_fingerprint> written(ext.size());
+	vector<vector<char> > old(ext.size());
+	FILE *out;
+	int ret = 0;
+
+	for (size_t i = 0; i < ext.size(); i++) {
+		vector<char> data(ext[i].len);
+
+		old[i].resize(ext[i].len);
+		if (dev.read_blocks(ext[i].lba, ext[i].len/block_size,
+							&old[i][0]) < 0)
+			return -1;
+		plan_copy(ext[i], &data[0]);
+		written[i].lba = cpu_to_le64(ext[i].lba);
+		written[i].crc = cpu_to_le32(crc32((unsigned char *)&data[0],
+										   data.size()));
+		written[i].pad = 0;
+	}
+
+	struct journal_hdr hdr = {
+		JOURNAL_MAGIC,
+		cpu_to_le64(disk_len),
+		cpu_to_le32(block_size),
+		cpu_to_le32((uint32_t)written.size()),
+		0,
+		0
+	};
+	uint32_t crc = crc32((unsigned char *)&hdr, sizeof(hdr));
+
+	if (written.size())
+		crc = crc32_combine(crc, crc32((unsigned char *)&written[0],
+				written.size()*sizeof(written[0])),
+				written.size()*sizeof(written[0]));
+	hdr.crc = cpu_to_le32(crc);
+
+	out = fopen(name.c_str(), "wb");
+	if (!out)
+		return -1;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 || (written.size() &&
+		fwrite(&written[0], sizeof(written[0]), written.size(), out) !=
+		written.size()))
+		ret = -1;
+	for (size_t i = 0; !ret && i < old.size(); i++)
+		ret = write_frame(out, ext[i].lba, (unsigned char *)&old[i][0],
+						  old[i].size(), block_size);
+	if (!ret)
+		ret = write_frame(out, 0, NULL, 0, block_size);
+	if (!ret && fflush(out))
+		ret = -1;
+#ifdef WINDOWS_BUILD
+	if (!ret && _commit(_fileno(out)))
+		ret = -1;
+#else
+	if (!ret && fsync(fileno(out)))
+		ret = -1;
+#endif
+	if (fclose(out))
+		ret = -1;
+
+	return ret;
+}
+
+/******************************************************************************\
+* load_journal: read and check an undo journal                                 *
+* name: name of the file                                                       *
+* j: receives the journal                                                      *
+* return value: 0 on success, -1 if the file can't be read or is damaged       *
+\******************************************************************************/
+int load_journal(string name, saved_journal &j)
+{
+	static const char magic[8] = JOURNAL_MAGIC;
+	ifstream in(name.c_str(), ios_base::binary);
+	struct journal_hdr hdr;
+	uint32_t crc, count;
+
+	if (!in.read((char *)&hdr, sizeof(hdr)) ||
+		memcmp(hdr.magic, magic, sizeof(magic)))
+		return -1;
+	j.disk_len = le64_to_cpu(hdr.disk_len);
+	j.block_size = le32_to_cpu(hdr.block_size);
+	count = le32_to_cpu(hdr.range_count);
+	crc = le32_to_cpu(hdr.crc);
+	if (j.block_size < 512 || !count || count > (1U << 16))
+		return -1;
+
+	hdr.crc = 0;
+	j.written.resize(count);
+	if (!in.read((char *)&j.written[0], count*sizeof(j.written[0])))
+		return -1;
+	uint32_t sum = crc32((unsigned char *)&hdr, sizeof(hdr));
+	sum = crc32_combine(sum, crc32((unsigned char *)&j.written[0],
+			count*sizeof(j.written[0])), count*sizeof(j.written[0]));
+	if (sum != crc)
+		return -1;
+
+	if (read_regions(in, j.block_size, j.disk_len, j.regions) < 0 ||
+		j.regions.size() != count)
+		return -1;
+	for (uint32_t i = 0; i < count; i++) {
+		j.written[i].lba = le64_to_cpu(j.written[i].lba);
+		j.written[i].crc = le32_to_cpu(j.written[i].crc);
+		if (j.written[i].lba != j.regions[i].first)
+			return -1;
+	}
+
+	return 0;
+}
+
+/******************************************************************************\
+* run_apply: commit a conversion plan made with --plan to a device             *
+* dev: the device, not yet opened                                              *
+* drive: name of the device                                                    *
+* name: name of the plan file                                                  *
+* direct, sync, verify: as for a normal run with -w                            *
+* journal: name of an undo journal to save before writing, or empty            *
+* stats: timings of the run                                                    *
+* return value: the exit status of the program                                 *
+* Nothing is written unless the geometry of the device, and every boot record  *
+* the plan was derived from, are still what they were when it was made.        *
+\******************************************************************************/
+int run_apply(BlockDevice &dev, string drive, string name, bool direct,
+			  sync_mode sync, bool verify, string journal, RunStats &stats)
+{
+	saved_plan p;
+	WritePlan plan;
+	int block_size;
+	uint64_t capacity;
+
+	stats.phase("load_plan");
+	if (load_plan(name, p) < 0) {
+		cout << "Unable to read the plan " << name
+			 << " (is it a plan file, and undamaged?)" << endl;
+		return EXIT_FAILURE;
+	}
+
+	stats.phase("open");
+	if (dev.open(drive, true, direct) < 0) {
+		cout << "Unable to open " << drive << ", check permissions!" << endl;
+		return EXIT_FAILURE;
+	}
+
+	stats.phase("geometry");
+	block_size = dev.get_block_size();
+	if (block_size && block_size != (int)p.block_size) {
+		cout << "The plan is for " << p.block_size << "-byte blocks, but "
+			 << drive << " has " << block_size << "-byte blocks!" << endl;
+		return EXIT_FAILURE;
+	}
+	block_size = p.block_size;
+	dev.set_block_size(block_size);
+	capacity = dev.get_capacity() / block_size;
+	if (capacity && capacity != p.disk_len) {
+		cout << "The plan is for a disk of " << p.disk_len << " blocks, but "
+			 << drive << " has " << capacity << " blocks!" << endl;
+		return EXIT_FAILURE;
+	}
+
+	stats.phase("fingerprints");
+	vector<char> block(block_size);
+	for (size_t i = 0; i < p.sectors.size(); i++) {
+		if (dev.read_block(p.sectors[i].lba, &block[0]) < 0) {
+			cout << "Block read failed, check permissions!" << endl;
+			return EXIT_FAILURE;
+		}
+		if (crc32((unsigned char *)&block[0], block_size) != p.sectors[i].crc) {
+			cout << "The boot record at LBA " << p.sectors[i].lba
+				 << " has changed since the plan was made." << endl
+				 << "Make a new plan, and apply that instead." << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (size_t i = 0; i < p.regions.size(); i++) {
+		plan.begin(p.regions[i].first);
+		plan.add(&p.regions[i].second[0], p.regions[i].second.size());
+	}
+	if (journal.length()) {
+		stats.phase("journal");
+		cout << "Saving an undo journal to " << journal << "..." << endl;
+		if (save_journal(journal, dev, p.disk_len, block_size, plan) < 0) {
+			cout << "Failed to write " << journal << "!" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	stats.phase("write");
+	cout << "Applying the plan " << name << " to " << drive << "..." << endl;
+	for (size_t i = 0; i < plan.extents().size(); i++) {
+		const plan_extent &e = plan.extents()[i];
+
+		cout << "Writing " << e.len/block_size << " blocks to LBA address "
+			 << e.lba << "..." << endl;
+		if (dev.write_extent(e) < 0) {
+			cout << "Failed to write to LBA address " << e.lba << "!" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	stats.phase("flush");
+	if (dev.flush(sync) < 0) {
+		cout << "Failed to flush GPT to disk!" << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "Success!" << endl;
+
+	if (verify) {
+		dev.close();
+		if (dev.open(drive, false, true) < 0) {
+			cout << "Unable to reopen " << drive << " to verify it!" << endl;
+			return EXIT_FAILURE;
+		}
+		dev.set_block_size(block_size);
+		if (run_verify(dev, drive, p.disk_len, p.record_count, &plan,
+					   block_size, stats) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+	}
+	print_io_stats(dev);
+	return EXIT_SUCCESS;
+}
+
+/******************************************************************************\
+* run_undo: roll a device back with an undo journal                            *
+* dev: the device, not yet opened                                              *
+* drive: name of the device                                                    *
+* name: name of the journal                                                    *
+* direct, sync: as for a normal run with -w                                    *
+* stats: timings of the run                                                    *
+* return value: the exit status of the program                                 *
+* Nothing is written unless the device still holds exactly what the            *
+* conversion wrote. Ranges that touch are merged, so that the whole journal    *
+* usually goes back in two writes and a single flush, after which every range  *
+* is read back, bypassing the cache, and compared with the journal.            *
+\******************************************************************************/
+int run_undo(BlockDevice &dev, string drive, string name, bool direct,
+			 sync_mode sync, RunStats &stats)
+{
+	saved_journal j;
+	WritePlan plan;
+	vector<block_run> runs;
+	vector<AlignedBuffer *> bufs;
+	uint64_t capacity, blocks = 0;
+	int block_size, ret = EXIT_SUCCESS;
+
+	stats.phase("load_journal");
+	if (load_journal(name, j) < 0) {
+		cout << "Unable to read the undo journal " << name
+			 << " (is it a journal, and undamaged?)" << endl;
+		return EXIT_FAILURE;
+	}
+
+	stats.phase("open");
+	if (dev.open(drive, true, direct) < 0) {
+		cout << "Unable to open " << drive << ", check permissions!" << endl;
+		return EXIT_FAILURE;
+	}
+
+	stats.phase("geometry");
+	block_size = dev.get_block_size();
+	if (block_size && block_size != (int)j.block_size) {
+		cout << "The journal is for " << j.block_size << "-byte blocks, but "
+			 << drive << " has " << block_size << "-byte blocks!" << endl;
+		return EXIT_FAILURE;
+	}
+	block_size = j.block_size;
+	dev.set_block_size(block_size);
+	capacity = dev.get_capacity() / block_size;
+	if (capacity && capacity != j.disk_len) {
+		cout << "The journal is for a disk of " << j.disk_len << " blocks, "
+			 << "but " << drive << " has " << capacity << " blocks!" << endl;
+		return EXIT_FAILURE;
+	}
+
+	stats.phase("fingerprints");
+	for (size_t i = 0; i < j.regions.size(); i++) {
+		vector<char> now(j.regions[i].second.size());
+
+		if (dev.read_blocks(j.regions[i].first, now.size()/block_size,
+							&now[0]) < 0) {
+			cout << "Block read failed, check permissions!" << endl;
+			return EXIT_FAILURE;
+		}
+		if (crc32((unsigned char *)&now[0], now.size()) != j.written[i].crc) {
+			cout << "The blocks at LBA " << j.regions[i].first << " have "
+				 << "changed since the conversion." << endl
+				 << "Undoing it now would overwrite those changes. "
+				 << "Operation aborted." << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	stats.phase("write");
+	cout << "Undoing the conversion of " << drive << " with " << name
+		 << "..." << endl;
+	for (size_t i = 0; i < j.regions.size(); i++) {
+		uint64_t lba = j.regions[i].first;
+		const vector<char> &data = j.regions[i].second;
+
+		if (!i || lba != plan.extents().back().lba +
+			plan.extents().back().len/block_size)
+			plan.begin(lba);
+		plan.add(&data[0], data.size());
+		blocks += data.size()/block_size;
+	}
+	for (size_t i = 0; i < plan.extents().size(); i++) {
+		const plan_extent &e = plan.extents()[i];
+
+		if (dev.write_extent(e) < 0) {
+			cout << "Failed to write to LBA address " << e.lba << "!" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	stats.phase("flush");
+	if (dev.flush(sync) < 0) {
+		cout << "Failed to flush to disk!" << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "Restored " << blocks << " blocks in " << plan.extents().size()
+		 << " write(s)." << endl;
+
+	stats.phase("verify");
+	dev.close();
+	if (dev.open(drive, false, true) < 0) {
+		cout << "Unable to reopen " << drive << " to verify it!" << endl;
+		return EXIT_FAILURE;
+	}
+	dev.set_block_size(block_size);
+	for (size_t i = 0; i < plan.extents().size(); i++) {
+		const plan_extent &e = plan.extents()[i];
+		block_run r = {e.lba, e.len/block_size, NULL};
+
+		bufs.push_back(new AlignedBuffer((size_t)e.len, io_align(block_size)));
+		r.buf = bufs.back()->get();
+		runs.push_back(r);
+	}
+	if (dev.read_runs(runs) < 0) {
+		cout << "Unable to read " << drive << " back to verify it!" << endl;
+		ret = EXIT_FAILURE;
+	}
+	for (size_t i = 0; ret == EXIT_SUCCESS && i < plan.extents().size(); i++) {
+		vector<char> want(plan.extents()[i].len);
+
+		plan_copy(plan.extents()[i], &want[0]);
+		if (memcmp(runs[i].buf, &want[0], want.size())) {
+			cout << "Verification failed: the blocks at LBA " << runs[i].lba
+				 << " don't match the journal!" << endl;
+			ret = EXIT_FAILURE;
+		}
+	}
+	for (size_t i = 0; i < bufs.size(); i++)
+		delete bufs[i];
+	if (ret == EXIT_SUCCESS)
+		cout << "Verified, " << drive << " is back as it was." << endl;
+
+	print_io_stats(dev);
+	return ret;
+}
+
+/******************************************************************************\
+* entry_edit: the changes --edit makes to one entry of an existing GPT         *
+\******************************************************************************/
+struct entry_edit {
+	uint32_t index; // of the entry, from 0
+	bool set_type, set_flags, set_name;
+	__guid type; // in on-disk byte order
+	uint64_t flags; // in host byte order
+	char name[72]; // UTF-16LE, as on the disk
+};
+
+/******************************************************************************\
+* parse_guid: parse a GUID written as XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX     *
+* s: the text                                                                  *
+* guid: receives the GUID, in on-disk byte order                               *
+* return value: 0 on success, -1 if the text isn't a GUID                      *
+\******************************************************************************/
+int parse_guid(const char *s, __guid &guid)
+{
+	char hex[33];
+	int n = 0;
+
+	if (strlen(s) != 36)
+		return -1;
+	for (int i = 0; i < 36; i++) {
+		if (i == 8 || i == 13 || i == 18 || i == 23) {
+			if (s[i] != '-')
+				return -1;
+		} else if (!isxdigit((unsigned char)s[i])) {
+			return -1;
+		} else {
+			hex[n++] = s[i];
+		}
+	}
+	hex[n] = '\0';
+
+	uint64_t hi = strtoull(string(hex, 16).c_str(), NULL, 16);
+	uint64_t lo = strtoull(hex + 16, NULL, 16);
+
+	guid.data1 = cpu_to_le32((uint32_t)(hi >> 32));
+	guid.data2 = cpu_to_le16((uint16_t)(hi >> 16));
+	guid.data3 = cpu_to_le16((uint16_t)hi);
+	guid.data4 = cpu_to_be64(lo);
+	return 0;
+}
+
+/******************************************************************************\
+* format_guid: write a GUID out as XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX        *
+* guid: the GUID, in on-disk byte order                                        *
+\******************************************************************************/
+string format_guid(const __guid &guid)
+{
+	char text[40];
+	uint64_t lo = be64_to_cpu(guid.data4);
+
+	snprintf(text, sizeof(text), "%08X-%04X-%04X-%04X-%012llX",
+			 le32_to_cpu(guid.data1), le16_to_cpu(guid.data2),
+			 le16_to_cpu(guid.data3), (unsigned int)(lo >> 48),
+			 (unsigned long long)(lo & 0xFFFFFFFFFFFFULL));
+	return text;
+}
+
+// Random bytes fetched from the OS at once, enough for 256 GUIDs.
+#define GUID_POOL_SIZE 4096
+
+/******************************************************************************\
+* GuidPool: random bytes for GUIDs, fetched from the OS in bulk                *
+* Every refill takes one getrandom() call (BCryptGenRandom() on Windows), so   *
+* a batch of many disks costs a syscall per 256 GUIDs rather than one each.    *
+* Bytes are wiped from the pool as they are handed out, and the pool is shared *
+* by the worker threads of a batch.                                            *
+\******************************************************************************/
+class GuidPool {
+public:
+	GuidPool() : used(GUID_POOL_SIZE), fills(0) {}
+	~GuidPool() { memset(pool, 0, sizeof(pool)); }
+
+	int take(unsigned char *out, size_t len);
+	unsigned long refills() const { return fills; }
+
+private:
+	int fill();
+
+	mutex lock;
+	unsigned char pool[GUID_POOL_SIZE];
+	size_t used; // bytes of the pool already handed out
+	unsigned long fills;
+};
+
+/******************************************************************************\
+* GuidPool::fill: refill the pool from the OS                                  *
+* return value: 0 on success, -1 if the OS has no random bytes to give         *
+\******************************************************************************/
+int GuidPool::fill()
+{
+#ifdef WINDOWS_BUILD
+	if (BCryptGenRandom(NULL, pool, sizeof(pool),
+						BCRYPT_USE_SYSTEM_PREFERRED_RNG) != 0)
+		return -1;
+#elif MACOS_BUILD
+	for (size_t off = 0; off < sizeof(pool); off += 256) {
+		if (getentropy(pool + off, 256) < 0)
+			return -1;
+	}
+#else
+	for (size_t off = 0; off < sizeof(pool); ) {
+		ssize_t n = getrandom(pool + off, sizeof(pool) - off, 0);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		off += n;
+	}
+#endif
+	used = 0;
+	fills++;
+	return 0;
+}
+
+/******************************************************************************\
+* GuidPool::take: hand out random bytes                                        *
+* out: receives the bytes                                                      *
+* len: number of bytes wanted, at most GUID_POOL_SIZE                          *
+* return value: 0 on success, -1 if the pool can't be refilled                 *
+\******************************************************************************/
+int GuidPool::take(unsigned char *out, size_t len)
+{
+	lock_guard<mutex> hold(lock);
+
+	if (used + len > sizeof(pool) && fill() < 0)
+		return -1;
+	memcpy(out, pool + used, len);
+	memset(pool + used, 0, len);
+	used += len;
+	return 0;
+}
+
+static GuidPool guid_pool;
+
+/******************************************************************************\
+* guid_mode: where the GUIDs of a conversion come from                         *
+\******************************************************************************/
+enum guid_mode {
+	GUIDS_ZERO, // all zero, as gptgen has always written them
+	GUIDS_RANDOM, // RFC 4122 version 4, from guid_pool
+	GUIDS_KEYED // derived from a key, the disk and the entry, see guid_for
+};
+
+/******************************************************************************\
+* guid_source: what the GUIDs of one disk are made from                        *
+\******************************************************************************/
+struct guid_source {
+	guid_mode mode;
+	uint64_t key[2]; // the SipHash key, for GUIDS_KEYED
+	string id; // identity of the disk, for GUIDS_KEYED
+};
+
+/******************************************************************************\
+* guid_key: turn the argument of --guid-key into a SipHash key                 *
+\******************************************************************************/
+void guid_key(const string &text, uint64_t *key)
+{
+	static const uint64_t zero[2] = {0, 0};
+	unsigned char h[16];
+
+	siphash128(zero, (const unsigned char *)text.data(), text.size(), h);
+	memcpy(key, h, sizeof(h));
+	key[0] = le64_to_cpu(key[0]);
+	key[1] = le64_to_cpu(key[1]);
+}
+
+/******************************************************************************\
+* guid_for: make one GUID of a disk from a guid_source                         *
+* src: the guid_source                                                         *
+* index, guid: as for gptgen_guid_fn                                           *
+* Keyed GUIDs are the SipHash of the disk identity and the index, marked as    *
+* version 8 (custom) GUIDs: the same key, disk and layout always give the      *
+* same GUIDs, and different disks or keys give unrelated ones.                 *
+\******************************************************************************/
+int guid_for(const guid_source &src, uint32_t index, __guid *guid)
+{
+	unsigned char bytes[16];
+
+	switch (src.mode) {
+	case GUIDS_RANDOM:
+		if (guid_pool.take(bytes, sizeof(bytes)) < 0)
+			return -1;
+		*guid = guid_from_bytes(bytes, 4);
+		return 0;
+	case GUIDS_KEYED: {
+		string msg = src.id;
+		uint32_t le = cpu_to_le32(index);
+
+		msg.push_back('\0');
+		msg.append((const char *)&le, sizeof(le));
+		siphash128(src.key, (const unsigned char *)msg.data(), msg.size(),
+				   bytes);
+		*guid = guid_from_bytes(bytes, 8);
+		return 0;
+	}
+	default:
+		*guid = empty_record.id;
+		return 0;
+	}
+}
+
+/******************************************************************************\
+* make_guid: a gptgen_guid_fn, making the GUIDs of a disk from a guid_source   *
+* ctx: the guid_source                                                         *
+\******************************************************************************/
+int make_guid(void *ctx, uint32_t index, gptgen_guid *guid)
+{
+	__guid g;
+
+	if (guid_for(*(const guid_source *)ctx, index, &g) < 0)
+		return -1;
+	memcpy(guid->bytes, &g, sizeof(g));
+	return 0;
+}
+
+/******************************************************************************\
+* disk_identity: what keyed GUIDs of a disk are derived from                   *
+* drive: name of the device or image                                           *
+* return value: the serial number (WWID) of a whole disk, where the OS reports *
+* one, and otherwise the absolute path of the device or image                  *
+\******************************************************************************/
+string disk_identity(const string &drive)
+{
+#ifdef WINDOWS_BUILD
+	char full[_MAX_PATH];
+
+	return _fullpath(full, drive.c_str(), sizeof(full)) ? full : drive;
+#else
+	string path = drive, dir = ".", base = drive;
+	size_t slash = drive.rfind('/');
+	char *real;
+
+	// the file may not exist yet (e.g. a clone), so resolve its directory
+	if (slash != string::npos) {
+		dir = slash ? drive.substr(0, slash) : "/";
+		base = drive.substr(slash + 1);
+	}
+	real = realpath(drive.c_str(), NULL);
+	if (!real && (real = realpath(dir.c_str(), NULL)))
+		path = string(real) + (strcmp(real, "/") ? "/" : "") + base;
+	else if (real)
+		path = real;
+	free(real);
+
+#ifndef MACOS_BUILD
+	static const char *attrs[] = {"wwid", "device/wwid", "serial",
+								  "device/serial"};
+	struct stat st;
+
+	if (!stat(path.c_str(), &st) && S_ISBLK(st.st_mode)) {
+		string name = path.substr(path.rfind('/') + 1);
+
+		for (size_t i = 0; i < sizeof(attrs)/sizeof(attrs[0]); i++) {
+			ifstream in(("/sys/class/block/" + name + "/" + attrs[i]).c_str());
+			string serial;
+
+			if (getline(in, serial) &&
+				serial.find_first_not_of(" \t") != string::npos)
+				return "serial:" + serial;
+		}
+	}
+#endif
+	return path;
+#endif
+}
+
+/******************************************************************************\
+* parse_type: parse the argument of --type                                     *
+* s: a type GUID, or an MBR type ID (e.g. 0x07) standing for the GUID gptgen   *
+*    would convert it to                                                       *
+* type: receives the type GUID, in on-disk byte order                          *
+* return value: 0 on success, -1 if the argument is neither                    *
+\******************************************************************************/
+int parse_type(const char *s, __guid &type)
+{
+	char *end;
+	unsigned long id;
+
+	if (!parse_guid(s, type))
+		return 0;
+	id = strtoul(s, &end, 16);
+	if (!*s || *end || id > 0xFF)
+		return -1;
+
+	const type_map &map = lookup_type((unsigned char)id);
+
+	if (map.action != TYPE_MAP && map.action != TYPE_GENERIC)
+		return -1;
+	type = map.type;
+	return 0;
+}
+
+/******************************************************************************\
+* parse_name: parse the argument of --name into a GPT partition name           *
+* s: the name, at most 36 printable ASCII characters                           *
+* name: receives the name, in UTF-16LE and padded with zeros                   *
+* return value: 0 on success, -1 if the name is too long or not ASCII          *
+\******************************************************************************/
+int parse_name(const char *s, char *name)
+{
+	size_t len = strlen(s);
+
+	if (len > 36)
+		return -1;
+	memset(name, 0, 72);
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] < 0x20 || s[i] > 0x7E)
+			return -1;
+		name[2*i] = s[i];
+	}
+	return 0;
+}
+
+/******************************************************************************\
+* format_name: write a GPT partition name out, as ASCII                        *
+* Characters outside printable ASCII come out as '?'.                          *
+\******************************************************************************/
+string format_name(const char *name)
+{
+	string text;
+
+	for (int i = 0; i < 72; i += 2) {
+		uint16_t c = (uint16_t)((unsigned char)name[i] |
+								((unsigned char)name[i+1] << 8));
+
+		if (!c)
+			break;
+		text += (c >= 0x20 && c <= 0x7E) ? (char)c : '?';
+	}
+	return text;
+}
+
+/******************************************************************************\
+* run_edit: change the type, flags or name of entries of an existing GPT       *
+* dev: the device, not yet opened                                              *
+* drive: name of the device                                                    *
+* edits: the changes to make, in order                                         *
+* block_size: size of a block, 0 to ask the device                             *
+* direct, sync, verify: as for a normal run with -w                            *
+* journal: name of an undo journal to save before writing, or empty            *
+* stats: timings of the run                                                    *
+* return value: the exit status of the program                                 *
+* Only the two headers and the blocks holding the edited entries are read,     *
+* and only those are written, in both copies. The new array CRC is derived     *
+* from the old one and the changed entries with crc32_patch(), so the rest of  *
+* the array is never read. Both copies must agree on the blocks edited.        *
+\******************************************************************************/
+int run_edit(BlockDevice &dev, string drive, const vector<entry_edit> &edits,
+			 int block_size, bool direct, sync_mode sync, bool verify,
+			 string journal, RunStats &stats)
+{
+	map<uint64_t, vector<char> > primary, secondary; // by block of the array
+	vector<pair<uint64_t, const char *> > blocks;
+	struct gpthdr h1, h2;
+	uint64_t disk_len, array_len;
+	uint32_t entry_len, part_sum;
+	WritePlan plan;
+	bool changed = false;
+
+	stats.phase("open");
+	if (dev.open(drive, true, direct) < 0) {
+		cout << "Unable to open " << drive << ", check permissions!" << endl;
+		return EXIT_FAILURE;
+	}
+
+	stats.phase("geometry");
+	if (!block_size)
+		block_size = dev.get_block_size();
+	if (!block_size) {
+		cout << "Unable to auto-determine the block size of the disk, "
+			 << "use --block-size." << endl;
+		return EXIT_FAILURE;
+	}
+	dev.set_block_size(block_size);
+	disk_len = dev.get_capacity()/block_size;
+	if (disk_len < 3) {
+		cout << "Unable to auto-determine the capacity of the disk." << endl;
+		return EXIT_FAILURE;
+	}
+
+	stats.phase("headers");
+	vector<char> head(block_size), tail(block_size);
+	if (dev.read_blocks(1, 1, &head[0]) < 0 ||
+		dev.read_blocks(disk_len-1, 1, &tail[0]) < 0) {
+		cout << "Block read failed, check permissions!" << endl;
+		return EXIT_FAILURE;
+	}
+	if (load_gpt_header(&head[0], block_size, &h1) < 0 ||
+		load_gpt_header(&tail[0], block_size, &h2) < 0 ||
+		le64_to_cpu(h1.this_hdr) != 1 ||
+		le64_to_cpu(h1.other_hdr) != disk_len-1 ||
+		le64_to_cpu(h2.this_hdr) != disk_len-1) {
+		cout << drive << " doesn't have a valid GPT at both ends of the disk."
+			 << endl << "Use a full partitioning tool to repair it first."
+			 << endl;
+		return EXIT_FAILURE;
+	}
+	entry_len = le32_to_cpu(h1.entry_len);
+	array_len = (uint64_t)le32_to_cpu(h1.entry_cnt)*entry_len;
+	if (h1.entry_cnt != h2.entry_cnt || h1.entry_len != h2.entry_len ||
+		h1.part_sum != h2.part_sum || entry_len < sizeof(gptpart) ||
+		block_size % entry_len) {
+		cout << "The two GPT headers of " << drive << " disagree, or describe "
+			 << "entries gptgen can't edit." << endl
+			 << "Use a full partitioning tool to repair it first." << endl;
+		return EXIT_FAILURE;
+	}
+	part_sum = le32_to_cpu(h1.part_sum);
+
+	stats.phase("entries");
+	for (size_t i = 0; i < edits.size(); i++) {
+		uint64_t block = (uint64_t)edits[i].index*entry_len/block_size;
+
+		if (edits[i].index >= le32_to_cpu(h1.entry_cnt)) {
+			cout << "The GPT of " << drive << " has only "
+				 << le32_to_cpu(h1.entry_cnt) << " entries, there is no entry "
+				 << edits[i].index+1 << "!" << endl;
+			return EXIT_FAILURE;
+		}
+		if (primary.count(block))
+			continue;
+		primary[block].resize(block_size);
+		secondary[block].resize(block_size);
+		if (dev.read_blocks(le64_to_cpu(h1.first_entry)+block, 1,
+							&primary[block][0]) < 0 ||
+			dev.read_blocks(le64_to_cpu(h2.first_entry)+block, 1,
+							&secondary[block][0]) < 0) {
+			cout << "Block read failed, check permissions!" << endl;
+			return EXIT_FAILURE;
+		}
+		if (primary[block] != secondary[block]) {
+			cout << "The two copies of the entries to edit differ on "
+				 << drive << "." << endl
+				 << "Use a full partitioning tool to repair it first." << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (size_t i = 0; i < edits.size(); i++) {
+		const entry_edit &ed = edits[i];
+		uint64_t off = (uint64_t)ed.index*entry_len;
+		char *entry = &primary[off/block_size][off % block_size];
+		struct gptpart old, e;
+
+		memcpy(&old, entry, sizeof(old));
+		if (!memcmp(&old.type, &empty_record.type, sizeof(old.type))) {
+			cout << "Entry " << ed.index+1 << " of the GPT of " << drive
+				 << " is empty, there is nothing to edit!" << endl;
+			return EXIT_FAILURE;
+		}
+		e = old;
+		if (ed.set_type && memcmp(&e.type, &ed.type, sizeof(e.type))) {
+			cout << "Entry " << ed.index+1 << ": type "
+				 << format_guid(e.type) << " -> " << format_guid(ed.type)
+				 << endl;
+			e.type = ed.type;
+		}
+		if (ed.set_flags && le64_to_cpu(e.flags) != ed.flags) {
+			cout << "Entry " << ed.index+1 << ": flags 0x" << hex
+				 << le64_to_cpu(e.flags) << " -> 0x" << ed.flags << dec
+				 << endl;
+			e.flags = cpu_to_le64(ed.flags);
+		}
+		if (ed.set_name && memcmp(e.name, ed.name, sizeof(e.name))) {
+			cout << "Entry " << ed.index+1 << ": name \""
+				 << format_name(e.name) << "\" -> \"" << format_name(ed.name)
+				 << "\"" << endl;
+			memcpy(e.name, ed.name, sizeof(e.name));
+		}
+		if (!memcmp(&old, &e, sizeof(e)))
+			continue;
+		memcpy(entry, &e, sizeof(e));
+		part_sum = crc32_patch(part_sum, (unsigned char *)&old,
+							   (unsigned char *)&e, sizeof(e),
+							   array_len - off - sizeof(e));
+		changed = true;
+	}
+	if (!changed) {
+		cout << "The entries of " << drive << " are already as requested, "
+			 << "nothing to write." << endl;
+		return EXIT_SUCCESS;
+	}
+
+	// Both copies get the same entries, and both headers the new CRC; the
+	// blocks are then merged into as few writes as they allow.
+	stats.phase("assemble");
+	seal_gpt_header(&head[0], part_sum);
+	seal_gpt_header(&tail[0], part_sum);
+	blocks.push_back(make_pair(1ULL, (const char *)&head[0]));
+	for (map<uint64_t, vector<char> >::iterator it = primary.begin();
+		 it != primary.end(); ++it) {
+		secondary[it->first] = it->second;
+		blocks.push_back(make_pair(le64_to_cpu(h1.first_entry)+it->first,
+								   (const char *)&it->second[0]));
+		blocks.push_back(make_pair(le64_to_cpu(h2.first_entry)+it->first,
+								   (const char *)&secondary[it->first][0]));
+	}
+	blocks.push_back(make_pair(disk_len-1, (const char *)&tail[0]));
+	sort(blocks.begin(), blocks.end());
+	for (size_t i = 0; i < blocks.size(); i++) {
+		if (!i || blocks[i].first != blocks[i-1].first+1)
+			plan.begin(blocks[i].first);
+		plan.add(blocks[i].second, block_size);
+	}
+
+	if (journal.length()) {
+		stats.phase("journal");
+		cout << "Saving an undo journal to " << journal << "..." << endl;
+		if (save_journal(journal, dev, disk_len, block_size, plan) < 0) {
+			cout << "Failed to write " << journal << "!" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	stats.phase("write");
+	for (size_t i = 0; i < plan.extents().size(); i++) {
+		const plan_extent &e = plan.extents()[i];
+
+		cout << "Writing " << e.len/block_size << " blocks to LBA address "
+			 << e.lba << "..." << endl;
+		if (dev.write_extent(e) < 0) {
+			cout << "Failed to write to LBA address " << e.lba << "!" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	stats.phase("flush");
+	if (dev.flush(sync) < 0) {
+		cout << "Failed to flush GPT to disk!" << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "Success! Rewrote " << blocks.size() << " blocks of the GPT."
+		 << endl;
+
+	if (verify) {
+		dev.close();
+		if (dev.open(drive, false, true) < 0) {
+			cout << "Unable to reopen " << drive << " to verify it!" << endl;
+			return EXIT_FAILURE;
+		}
+		dev.set_block_size(block_size);
+		if (run_verify(dev, drive, disk_len, le32_to_cpu(h1.entry_cnt),
+					   &plan, block_size, stats) != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+	}
+	print_io_stats(dev);
+	return EXIT_SUCCESS;
+}
+
+/******************************************************************************\
+* batch_status: how the conversion of one device of a batch went               *
+\******************************************************************************/
+enum batch_status {
+	BATCH_OK, // converted (or, without -w, found convertible)
+	BATCH_SKIPPED, // left alone by policy, e.g. boot partitions without -k
+	BATCH_FAILED // an error, see the device's messages
+};
+
+/******************************************************************************\
+* batch_options: the settings shared by every conversion of a batch            *
+\******************************************************************************/
+struct batch_options {
+	bool write; // write the GPT, rather than only checking each device
+	bool keepmbr;
+	bool bootnofail; // convert disks with boot partitions, rather than skip
+	bool direct;
+	bool verify;
+	sync_mode sync;
+	uint32_t record_count;
+	unsigned int block_size; // 0 to ask each device
+	uint32_t max_ebrs;
+	io_engine engine;
+	guid_mode guids;
+	uint64_t guid_key[2]; // for GUIDS_KEYED
+	io_hints overrides; // topology given by hand, 0 to ask each device
+};
+
+/******************************************************************************\
+* batch_job: one device of a batch, and the outcome of its conversion          *
+\******************************************************************************/
+struct batch_job {
+	string drive;
+	batch_status status;
+	uint32_t parts; // partitions found
+	double ms; // wall time of the conversion
+	string reason; // one line for the summary table
+	io_stats io;
+	string plan_file; // save the plan here instead of writing (--serve)
+};
+
+/******************************************************************************\
+* job_buffers: the working storage of a conversion, kept by each worker so     *
+* that its next device reuses it rather than allocating its own                *
+\******************************************************************************/
+struct job_buffers {
+	vector<vector<unsigned char> > blocks; // the MBR and the EBRs
+	vector<unsigned char> primary, secondary; // the two GPT regions
+	verify_buffers verify;
+};
+
+/******************************************************************************\
+* prepared_job: a device read and checked, with its GPT built                  *
+\******************************************************************************/
+struct prepared_job {
+	BlockDevice dev; // open for writing, with opt.write
+	int block_size;
+	uint64_t disk_len;
+	vector<part> parts;
+	vector<uint64_t> sources; // the MBR and EBRs the GPT is derived from
+	gptgen_result res;
+	WritePlan plan; // the primary GPT, then the secondary GPT
+};
+
+/******************************************************************************\
+* prepare_job: read one device of a batch and build its GPT, without writing   *
+* opt: settings of the batch                                                   *
+* job: the device; receives the outcome if it can't be converted               *
+* log: stream for the messages of this device                                  *
+* bufs: working storage, reused from the worker's previous device; the plan    *
+* points into it                                                               *
+* p: receives the device and its GPT                                           *
+* return value: 0 if the device can be converted, -1 if not (the reason is in  *
+* job, which is marked skipped or failed)                                      *
+\******************************************************************************/
+int prepare_job(const batch_options &opt, batch_job &job, ostream &log,
+				job_buffers &bufs, prepared_job &p)
+{
+	BlockDevice &dev = p.dev;
+	vector<vector<unsigned char> > &blocks = bufs.blocks;
+	vector<gptgen_sector> sectors;
+	gptgen_result &res = p.res;
+	io_hints hints;
+	int ret;
+
+	job.status = BATCH_FAILED;
+	job.parts = 0;
+	memset(&job.io, 0, sizeof(job.io));
+
+	dev.set_engine(opt.engine);
+	if (dev.open(job.drive, opt.write, opt.direct) < 0) {
+		job.reason = "unable to open";
+		return -1;
+	}
+	p.block_size = opt.block_size ? opt.block_size : dev.get_block_size();
+	if (!p.block_size) {
+		job.reason = "unknown block size, use --block-size";
+		return -1;
+	}
+	dev.set_block_size(p.block_size);
+	p.disk_len = dev.get_capacity()/p.block_size;
+	if (!p.disk_len) {
+		job.reason = "unknown capacity";
+		return -1;
+	}
+	dev.get_io_hints(hints);
+	override_hints(hints, opt.overrides);
+
+	EbrWalk walk(opt.max_ebrs);
+	if (read_chain(dev, p.block_size, p.parts, p.sources, walk) < 0) {
+		job.reason = "block read failed";
+		job.io = dev.stats();
+		return -1;
+	}
+	if (blocks.size() < p.sources.size())
+		blocks.resize(p.sources.size());
+	for (size_t i = 0; i < p.sources.size(); i++) {
+		blocks[i].resize(p.block_size);
+		gptgen_sector sect = {p.sources[i], &blocks[i][0]};
+
+		dev.read_block(p.sources[i], (char *)&blocks[i][0]); // cached
+		sectors.push_back(sect);
+	}
+
+	guid_source guids = {opt.guids, {opt.guid_key[0], opt.guid_key[1]},
+						 opt.guids == GUIDS_KEYED ? disk_identity(job.drive) :
+						 ""};
+	gptgen_geometry geom = {p.disk_len, (uint32_t)p.block_size,
+							opt.record_count, opt.keepmbr, opt.max_ebrs,
+							make_guid, &guids,
+							gpt_alignment(hints, p.block_size)};
+
+	ret = convert_sectors(geom, sectors, bufs.primary, bufs.secondary, res,
+						  log);
+	job.parts = res.part_count;
+	if (ret != GPTGEN_OK) {
+		switch (ret) {
+		case GPTGEN_ELAYOUT: job.reason = "layout doesn't fit a GPT"; break;
+		case GPTGEN_EPMAGIC: job.reason = "PartitionMagic partition"; break;
+		case GPTGEN_EDYNAMIC: job.reason = "dynamic disk"; break;
+		case GPTGEN_EGPT: job.reason = "already GPT"; break;
+		case GPTGEN_EGUID: job.reason = "no random bytes for GUIDs"; break;
+		case GPTGEN_ENOMEM: job.reason = "out of memory"; break;
+		case GPTGEN_ECHAIN:
+			job.reason = (res.chain == GPTGEN_CHAIN_LIMIT) ?
+						 "too many EBRs, use --max-ebrs" : "damaged EBR chain";
+			break;
+		default: job.reason = "disk too small"; break;
+		}
+		job.io = dev.stats();
+		return -1;
+	}
+	log << "Found " << res.part_count << " partition(s)." << endl;
+	if (res.generic)
+		log << "WARNING: " << res.generic << " partition(s) of unknown "
+			<< "type, a generic GUID will be used." << endl;
+	print_alignment(p.parts, p.block_size, hints, log);
+	if (res.boot && !opt.bootnofail) {
+		log << "Boot partition(s) found, skipping the disk (-k converts "
+			<< "it anyway)." << endl;
+		job.status = BATCH_SKIPPED;
+		job.reason = "boot partition(s), use -k";
+		job.io = dev.stats();
+		return -1;
+	}
+
+	p.plan.begin(res.primary_lba);
+	p.plan.add((const char *)res.primary, res.primary_len);
+	p.plan.begin(res.secondary_lba);
+	p.plan.add((const char *)res.secondary, res.secondary_len);
+	return 0;
+}
+
+/******************************************************************************\
+* convert_job: convert one device of a batch, without any user interaction     *
+* opt: settings of the batch                                                   *
+* job: the device; receives the outcome                                        *
+* log: stream for the messages of this device                                  *
+* bufs: working storage, reused from the worker's previous device              *
+* Everything a normal run would ask the user is decided by the options: the    *
+* block size must be given with --block-size if the device can't report it,    *
+* and disks with boot partitions are skipped unless -k is given. With a plan   *
+* file, the plan is saved there and nothing is written to the device.          *
+\******************************************************************************/
+void convert_job(const batch_options &opt, batch_job &job, ostream &log,
+				 job_buffers &bufs)
+{
+	prepared_job p;
+	BlockDevice &dev = p.dev;
+	int ret;
+
+	if (prepare_job(opt, job, log, bufs, p) < 0)
+		return;
+
+	if (job.plan_file.length()) {
+		log << "Writing the conversion plan to " << job.plan_file << "..."
+			<< endl;
+		if (save_plan(job.plan_file, dev, p.sources, p.disk_len,
+					  opt.record_count, p.block_size, p.plan) < 0) {
+			job.reason = "unable to save the plan";
+			job.io = dev.stats();
+			return;
+		}
+		job.status = BATCH_OK;
+		job.reason = "planned";
+		job.io = dev.stats();
+		return;
+	}
+
+	if (!opt.write) {
+		log << "Convertible; nothing written (no -w)." << endl;
+		job.status = BATCH_OK;
+		job.reason = p.res.boot ? "checked, boot partition(s)" : "checked";
+		job.io = dev.stats();
+		return;
+	}
+
+	log << "Writing primary GPT at LBA " << p.res.primary_lba
+		<< " and secondary GPT at LBA " << p.res.secondary_lba << "..."
+		<< endl;
+	for (size_t i = 0; i < p.plan.extents().size(); i++) {
+		if (dev.write_extent(p.plan.extents()[i]) < 0) {
+			job.reason = "write failed";
+			job.io = dev.stats();
+			return;
+		}
+	}
+	if (dev.flush(opt.sync) < 0) {
+		job.reason = "flush failed";
+		job.io = dev.stats();
+		return;
+	}
+
+	if (opt.verify) {
+		dev.close();
+		if (dev.open(job.drive, false, true) < 0) {
+			job.reason = "unable to reopen to verify";
+			job.io = dev.stats();
+			return;
+		}
+		dev.set_block_size(p.block_size);
+		ret = verify_disk(dev, p.disk_len, opt.record_count, &p.plan,
+						  p.block_size, &bufs.verify);
+		if (ret) {
+			if (ret > 0)
+				print_verify_errors(ret, log);
+			job.reason = (ret < 0) ? "verify read failed" : "verify failed";
+			job.io = dev.stats();
+			return;
+		}
+		log << "Verified both GPT copies." << endl;
+	}
+
+	job.status = BATCH_OK;
+	job.reason = opt.verify ? "converted, verified" : "converted";
+	job.io = dev.stats();
+}
+
+/******************************************************************************\
+* verify_job: check the GPT already on one device, as --verify-only does       *
+* opt: settings of the batch                                                   *
+* job: the device; receives the outcome                                        *
+* log: stream for the messages of this device                                  *
+* bufs: working storage, reused from the worker's previous device              *
+\******************************************************************************/
+void verify_job(const batch_options &opt, batch_job &job, ostream &log,
+				job_buffers &bufs)
+{
+	BlockDevice dev;
+	uint64_t disk_len;
+	int block_size, ret;
+
+	job.status = BATCH_FAILED;
+	job.parts = 0;
+	memset(&job.io, 0, sizeof(job.io));
+
+	dev.set_engine(opt.engine);
+	if (dev.open(job.drive, false, true) < 0) {
+		job.reason = "unable to open";
+		return;
+	}
+	block_size = opt.block_size ? opt.block_size : dev.get_block_size();
+	if (!block_size) {
+		job.reason = "unknown block size, use --block-size";
+		return;
+	}
+	dev.set_block_size(block_size);
+	disk_len = dev.get_capacity()/block_size;
+	if (!disk_len) {
+		job.reason = "unknown capacity";
+		return;
+	}
+
+	ret = verify_disk(dev, disk_len, opt.record_count, NULL, block_size,
+					  &bufs.verify);
+	job.io = dev.stats();
+	if (ret) {
+		if (ret > 0)
+			print_verify_errors(ret, log);
+		job.reason = (ret < 0) ? "verify read failed" : "verify failed";
+		return;
+	}
+	log << "Verified both GPT copies." << endl;
+	job.status = BATCH_OK;
+	job.reason = "verified";
+}
+
+/******************************************************************************\
+* add_io_stats: add the I/O counters of one device to a total                  *
+\******************************************************************************/
+void add_io_stats(io_stats &total, const io_stats &io)
+{
+	total.opens += io.opens;
+	total.reads += io.reads;
+	total.writes += io.writes;
+	total.syncs += io.syncs;
+	total.queries += io.queries;
+	total.maps += io.maps;
+	total.submits += io.submits;
+	total.ring_ops += io.ring_ops;
+	total.read_bytes += io.read_bytes;
+	total.write_bytes += io.write_bytes;
+	total.sync_secs += io.sync_secs;
+	total.sync_max_secs = max(total.sync_max_secs, io.sync_max_secs);
+}
+
+/******************************************************************************\
+* run_batch: convert many devices at once, on a pool of worker threads         *
+* opt: settings shared by every conversion                                     *
+* drives: the devices (or disk images) to convert                              *
+* jobs: number of worker threads                                               *
+* stats: timings of the run; the I/O counters add up every device              *
+* return value: the exit status of the program, EXIT_FAILURE unless every      *
+* device was converted                                                         *
+* Each device is converted independently of the others: the messages of a      *
+* device are printed together once it is done, and one failing doesn't stop    *
+* the rest. A summary table follows, in the order the devices were given.      *
+\******************************************************************************/
+int run_batch(const batch_options &opt, const vector<string> &drives,
+			  unsigned int jobs, RunStats &stats)
+{
+	vector<batch_job> list(drives.size());
+	vector<thread> workers;
+	atomic<size_t> next(0);
+	mutex print_lock;
+	size_t width = 6, failed = 0;
+
+	stats.phase("batch");
+	jobs = (unsigned int)max<size_t>(1, min<size_t>(jobs, drives.size()));
+	cout << "Converting " << drives.size() << " device(s) with " << jobs
+		 << " worker(s)..." << endl << endl;
+
+	for (size_t i = 0; i < drives.size(); i++) {
+		list[i].drive = drives[i];
+		width = max(width, drives[i].length());
+	}
+
+	for (unsigned int t = 0; t < jobs; t++) {
+		workers.push_back(thread([&]() {
+			job_buffers bufs;
+
+			for (size_t i = next++; i < list.size(); i = next++) {
+				chrono::steady_clock::time_point start =
+					chrono::steady_clock::now();
+				ostringstream log;
+
+				convert_job(opt, list[i], log, bufs);
+				list[i].ms = chrono::duration<double, milli>(
+					chrono::steady_clock::now() - start).count();
+
+				lock_guard<mutex> guard(print_lock);
+				cout << "== " << list[i].drive << " ==" << endl << log.str()
+					 << endl;
+			}
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	cout << left << setw(width) << "Device" << "  " << setw(8) << "Result"
+		 << right << setw(6) << "Parts" << setw(11) << "Time (ms)" << "  "
+		 << "Details" << endl;
+	for (size_t i = 0; i < list.size(); i++) {
+		const batch_job &job = list[i];
+		const io_stats &io = job.io;
+
+		cout << left << setw(width) << job.drive << "  " << setw(8)
+			 << (job.status == BATCH_OK ? "OK" :
+				 job.status == BATCH_SKIPPED ? "SKIPPED" : "FAILED")
+			 << right << setw(6) << job.parts << setw(11) << fixed
+			 << setprecision(1) << job.ms << "  " << job.reason << endl;
+		if (job.status != BATCH_OK)
+			failed++;
+		add_io_stats(stats.stream, io);
+	}
+	cout.unsetf(ios_base::floatfield);
+	cout << setprecision(6) << endl << list.size() - failed << " of "
+		 << list.size() << " device(s) "
+		 << (opt.write ? "converted." : "can be converted (run again with -w "
+			 "to write).") << endl;
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/******************************************************************************\
+* group_disk: one member disk of a --group conversion                          *
+\******************************************************************************/
+struct group_disk {
+	batch_job job;
+	prepared_job p;
+	job_buffers bufs;
+	ostringstream log;
+	vector<char> old[2]; // what the primary and secondary GPT overwrite
+	bool touched[2]; // whether a write of each was attempted
+#ifdef GPTGEN_TEST_FAULTS
+	bool fail_primary; // GPTGEN_TEST_FAIL_PRIMARY, to test the rollback
+#endif
+};
+
+// The two extents of a member's write plan, in plan order.
+enum group_copy {
+	GROUP_PRIMARY = 0,
+	GROUP_SECONDARY = 1
+};
+
+static const char *group_copy_names[] = {"primary", "secondary"};
+
+/******************************************************************************\
+* group_each: run a step on every member of a group at once                    *
+* list: the members                                                            *
+* step: called with each member on a thread of its own, returns -1 on failure  *
+* return value: the number of members the step failed for                      *
+* Returns only once the step is done on every member, so it is a barrier too.  *
+\******************************************************************************/
+template <class Step>
+size_t group_each(vector<group_disk> &list, Step step)
+{
+	vector<thread> workers;
+	atomic<size_t> failed(0);
+
+	for (size_t i = 0; i < list.size(); i++) {
+		group_disk &m = list[i];
+
+		workers.push_back(thread([&failed, &m, step]() {
+			if (step(m) < 0)
+				failed++;
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	return failed;
+}
+
+/******************************************************************************\
+* group_differs: compare the partitions of two members of a group              *
+* a, b: the members, their partitions sorted by start                          *
+* return value: how b differs from a, empty if it doesn't                      *
+\******************************************************************************/
+string group_differs(const prepared_job &a, const prepared_job &b)
+{
+	ostringstream why;
+
+	if (a.block_size != b.block_size) {
+		why << b.block_size << "-byte blocks, not " << a.block_size;
+		return why.str();
+	}
+	if (a.parts.size() != b.parts.size()) {
+		why << b.parts.size() << " partition(s), not " << a.parts.size();
+		return why.str();
+	}
+	for (size_t i = 0; i < a.parts.size(); i++) {
+		const part &x = a.parts[i], &y = b.parts[i];
+
+		if (x.start != y.start || x.len != y.len || x.type != y.type ||
+			x.active != y.active) {
+			why << "partition " << i+1 << " is type 0x" << hex
+				<< (int)y.type << dec << " at sector " << y.start << " for "
+				<< y.len << " sectors" << (y.active ? " (boot)" : "")
+				<< ", not type 0x" << hex << (int)x.type << dec
+				<< " at sector " << x.start << " for " << x.len << " sectors"
+				<< (x.active ? " (boot)" : "");
+			return why.str();
+		}
+	}
+	return "";
+}
+
+/******************************************************************************\
+* group_write: write one GPT copy of a member, and flush it                    *
+* m: the member                                                                *
+* copy: which copy                                                             *
+* sync: flush barrier                                                          *
+* Built with -DUSE_TEST_FAULTS=ON, the primary GPT of the member numbered by   *
+* GPTGEN_TEST_FAIL_PRIMARY (1 for the first) fails without being written, so   *
+* test.sh can check the rollback. Other builds have no such hook.              *
+\******************************************************************************/
+int group_write(group_disk &m, group_copy copy, sync_mode sync)
+{
+	m.touched[copy] = true;
+#ifdef GPTGEN_TEST_FAULTS
+	if (copy == GROUP_PRIMARY && m.fail_primary) {
+		m.log << "Failed to write the " << group_copy_names[copy]
+			  << " GPT! (GPTGEN_TEST_FAIL_PRIMARY)" << endl;
+		return -1;
+	}
+#endif
+	if (m.p.dev.write_extent(m.p.plan.extents()[copy]) < 0 ||
+		m.p.dev.flush(sync) < 0) {
+		m.log << "Failed to write the " << group_copy_names[copy]
+			  << " GPT!" << endl;
+		return -1;
+	}
+	return 0;
+}
+
+/******************************************************************************\
+* group_rollback: put back what a group conversion wrote to a member           *
+* m: the member                                                                *
+* opt: settings of the group                                                   *
+* Every copy a write was attempted for is restored (a failed write may still   *
+* have reached part of the disk), flushed and read back to check it.           *
+\******************************************************************************/
+int group_rollback(group_disk &m, const batch_options &opt)
+{
+	BlockDevice &dev = m.p.dev;
+	int block_size = m.p.block_size;
+
+	if (!m.touched[GROUP_PRIMARY] && !m.touched[GROUP_SECONDARY])
+		return 0;
+
+	// The device may have been reopened read-only, to verify it.
+	dev.close();
+	if (dev.open(m.job.drive, true, opt.direct) < 0) {
+		m.log << "Unable to reopen the disk to roll it back!" << endl;
+		return -1;
+	}
+	dev.set_block_size(block_size);
+
+	for (int c = GROUP_PRIMARY; c <= GROUP_SECONDARY; c++) {
+		const plan_extent &e = m.p.plan.extents()[c];
+		WritePlan undo;
+		vector<char> now(m.old[c].size());
+
+		if (!m.touched[c])
+			continue;
+		undo.begin(e.lba);
+		undo.add(&m.old[c][0], m.old[c].size());
+		if (dev.write_extent(undo.extents()[0]) < 0 ||
+			dev.flush(opt.sync) < 0 ||
+			dev.read_blocks(e.lba, e.len/block_size, &now[0]) < 0 ||
+			memcmp(&now[0], &m.old[c][0], now.size())) {
+			m.log << "Failed to roll back the " << group_copy_names[c]
+				  << " GPT!" << endl;
+			return -1;
+		}
+	}
+	m.log << "Rolled back, the disk is as it was." << endl;
+	return 0;
+}
+
+/******************************************************************************\
+* print_group_logs: print the messages of every member not yet printed         *
+\******************************************************************************/
+void print_group_logs(vector<group_disk> &list)
+{
+	for (size_t i = 0; i < list.size(); i++) {
+		if (!list[i].log.str().length())
+			continue;
+		cout << "== " << list[i].job.drive << " ==" << endl
+			 << list[i].log.str() << endl;
+		list[i].log.str("");
+	}
+}
+
+/******************************************************************************\
+* run_group: convert the members of a RAID1/RAID10 array together              *
+* opt: settings of the conversion                                              *
+* drives: the member devices (or disk images)                                  *
+* journal: prefix of the undo journals to save, one per member (<journal>.1    *
+* and on), empty for none                                                      *
+* stats: timings of the run; the I/O counters add up every member              *
+* return value: the exit status of the program                                 *
+* The GPT of every member is built at once, and only written if every member   *
+* can be converted and all of them have the same partitions. The commit has    *
+* two phases: first the secondary GPT of every member is written and flushed,  *
+* which leaves each member an MBR disk still; once all of them are, the        *
+* primary GPT of every member is. If any write (or, with --verify, any check)  *
+* fails, every member written to is rolled back to what it was.                *
+\******************************************************************************/
+int run_group(const batch_options &opt, const vector<string> &drives,
+			  string journal, RunStats &stats)
+{
+	vector<group_disk> list(drives.size());
+#ifdef GPTGEN_TEST_FAULTS
+	const char *fail = getenv("GPTGEN_TEST_FAIL_PRIMARY");
+#endif
+	size_t failed = 0, have_gpt = 0;
+
+	stats.phase("prepare");
+	for (size_t i = 0; i < list.size(); i++) {
+		list[i].job.drive = drives[i];
+		list[i].touched[GROUP_PRIMARY] = false;
+		list[i].touched[GROUP_SECONDARY] = false;
+#ifdef GPTGEN_TEST_FAULTS
+		list[i].fail_primary = fail && atoi(fail) == (int)i+1;
+#endif
+	}
+	cout << "Reading the " << list.size() << " members of the group..."
+		 << endl << endl;
+
+	failed = group_each(list, [&opt](group_disk &m) {
+		if (prepare_job(opt, m.job, m.log, m.bufs, m.p) < 0)
+			return -1;
+		sort(m.p.parts.begin(), m.p.parts.end(), cmp);
+		for (int c = GROUP_PRIMARY; c <= GROUP_SECONDARY; c++) {
+			const plan_extent &e = m.p.plan.extents()[c];
+
+			m.old[c].resize(e.len);
+			if (m.p.dev.read_blocks(e.lba, e.len/m.p.block_size,
+									&m.old[c][0]) < 0) {
+				m.job.reason = "block read failed";
+				return -1;
+			}
+		}
+		m.job.status = BATCH_OK;
+		return 0;
+	});
+	for (size_t i = 0; i < list.size(); i++) {
+		group_disk &m = list[i];
+
+		if (m.job.status != BATCH_OK)
+			m.log << "Can't be converted: " << m.job.reason << "." << endl;
+		for (size_t j = 0; j < m.p.parts.size(); j++) {
+			if (lookup_type(m.p.parts[j].type).action == TYPE_GPT) {
+				have_gpt++;
+				break;
+			}
+		}
+	}
+	print_group_logs(list);
+	if (have_gpt && have_gpt < list.size()) {
+		cout << "Only " << have_gpt << " of the " << list.size() << " members "
+			 << "have a GPT: an earlier conversion of the group" << endl
+			 << "was interrupted. Put them back with --undo and its "
+			 << "journals, then convert the" << endl << "group again."
+			 << endl;
+	}
+	if (failed) {
+		cout << failed << " of the " << list.size() << " members can't be "
+			 << "converted, nothing was written." << endl;
+		return EXIT_FAILURE;
+	}
+
+	stats.phase("compare");
+	for (size_t i = 1; i < list.size(); i++) {
+		string why = group_differs(list[0].p, list[i].p);
+
+		if (why.length()) {
+			cout << list[i].job.drive << " differs from "
+				 << list[0].job.drive << ": " << why << "." << endl;
+			failed++;
+		}
+	}
+	if (failed) {
+		cout << "The partition tables of the members have drifted apart, "
+			 << "nothing was written." << endl;
+		return EXIT_FAILURE;
+	}
+	cout << "All " << list.size() << " members have the same "
+		 << list[0].p.parts.size() << " partition(s)." << endl;
+	if (!opt.write) {
+		cout << "The group can be converted (run again with -w to write)."
+			 << endl;
+		return EXIT_SUCCESS;
+	}
+
+	if (journal.length()) {
+		stats.phase("journal");
+		cout << "Saving undo journals to " << journal << ".1 to "
+			 << journal << "." << list.size() << "..." << endl;
+		for (size_t i = 0; i < list.size(); i++) {
+			string name = journal + "." + to_string(i+1);
+
+			if (save_journal(name, list[i].p.dev, list[i].p.disk_len,
+							 list[i].p.block_size, list[i].p.plan) < 0) {
+				cout << "Failed to write " << name << "!" << endl;
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	stats.phase("secondary");
+	cout << "Writing the secondary GPT of every member..." << endl;
+	failed = group_each(list, [&opt](group_disk &m) {
+		return group_write(m, GROUP_SECONDARY, opt.sync);
+	});
+	if (!failed) {
+		stats.phase("primary");
+		cout << "Writing the primary GPT of every member..." << endl;
+		failed = group_each(list, [&opt](group_disk &m) {
+			return group_write(m, GROUP_PRIMARY, opt.sync);
+		});
+	}
+	if (!failed && opt.verify) {
+		stats.phase("verify");
+		cout << "Verifying every member..." << endl;
+		failed = group_each(list, [&opt](group_disk &m) {
+			BlockDevice &dev = m.p.dev;
+			int ret;
+
+			dev.close();
+			if (dev.open(m.job.drive, false, true) < 0) {
+				m.log << "Unable to reopen the disk to verify it!" << endl;
+				return -1;
+			}
+			dev.set_block_size(m.p.block_size);
+			ret = verify_disk(dev, m.p.disk_len, opt.record_count, &m.p.plan,
+							  m.p.block_size, &m.bufs.verify);
+			if (ret) {
+				if (ret > 0)
+					print_verify_errors(ret, m.log);
+				m.log << "Verification failed!" << endl;
+				return -1;
+			}
+			return 0;
+		});
+	}
+
+	if (failed) {
+		stats.phase("rollback");
+		cout << failed << " of the " << list.size() << " members failed, "
+			 << "rolling the group back..." << endl << endl;
+		failed = group_each(list, [&opt](group_disk &m) {
+			return group_rollback(m, opt);
+		});
+		print_group_logs(list);
+		if (failed) {
+			cout << "ROLLBACK FAILED on " << failed << " member(s)! ";
+			if (journal.length())
+				cout << "Put them back with --undo " << journal << ".n.";
+			cout << endl;
+		} else {
+			cout << "Every member is back as it was." << endl;
+		}
+		for (size_t i = 0; i < list.size(); i++)
+			add_io_stats(stats.stream, list[i].p.dev.stats());
+		return EXIT_FAILURE;
+	}
+
+	print_group_logs(list);
+	for (size_t i = 0; i < list.size(); i++)
+		add_io_stats(stats.stream, list[i].p.dev.stats());
+	cout << "Success! Converted all " << list.size() << " members"
+		 << (opt.verify ? ", and verified them." : ".") << endl;
+	return EXIT_SUCCESS;
+}
+
+/******************************************************************************\
+* read_manifest: read the list of devices of a batch from a file               *
+* name: name of the file, - for stdin; one device per line, blank lines and    *
+* lines starting with # are ignored                                            *
+* drives: the devices are appended to this                                     *
+\******************************************************************************/
+int read_manifest(string name, vector<string> &drives)
+{
+	ifstream file;
+	istream &in = (name == "-") ? cin : file;
+	string line;
+
+	if (name != "-") {
+		file.open(name.c_str());
+		if (!file)
+			return -1;
+	}
+	while (getline(in, line)) {
+		size_t start = line.find_first_not_of(" \t\r");
+		size_t end = line.find_last_not_of(" \t\r");
+
+		if (start == string::npos || line[start] == '#')
+			continue;
+		drives.push_back(line.substr(start, end - start + 1));
+	}
+
+	return in.bad() ? -1 : 0;
+}
+
+// Reads kept in flight at once by the io_uring scan.
+#define SCAN_QUEUE_DEPTH 256
+
+// Threads the scan falls back to without io_uring, at most one per device.
+#define SCAN_THREADS_MAX 64
+
+/******************************************************************************\
+* scan_status: how ready a device is for conversion                            *
+\******************************************************************************/
+enum scan_status {
+	SCAN_READY, // converts as it is
+	SCAN_BOOT, // converts, but has boot partitions (needs -k)
+	SCAN_BLOCKED, // can't be converted as it is, see the reason
+	SCAN_FAILED // couldn't be read
+};
+
+/******************************************************************************\
+* scan_job: one device of a fleet scan                                         *
+\******************************************************************************/
+struct scan_job {
+	string drive;
+	BlockDevice dev;
+	int block_size;
+	uint64_t disk_len;
+	EbrWalk walk;
+	vector<part> parts;
+	vector<char> buf; // the boot record being read
+	uint64_t lba; // and its address
+	uint64_t head, tail; // blocks free before and after the partitions
+	unsigned int table_len;
+	scan_status status;
+	string reason; // one line for the report
+};
+
+/******************************************************************************\
+* list_block_devices: find the whole-disk block devices of the system          *
+* drives: the devices are appended to this                                     *
+* Devices that are empty, or are RAM disks or optical drives, are left out.    *
+\******************************************************************************/
+int list_block_devices(vector<string> &drives)
+{
+#ifdef __linux__
+	DIR *dir = opendir("/sys/block");
+	struct dirent *ent;
+
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir)) != NULL) {
+		string name = ent->d_name;
+		ifstream size(("/sys/block/" + name + "/size").c_str());
+		uint64_t sectors = 0;
+
+		if (name[0] == '.' || !name.compare(0, 3, "ram") ||
+			!name.compare(0, 4, "zram") || !name.compare(0, 2, "sr"))
+			continue;
+		if (!(size >> sectors) || !sectors)
+			continue;
+		drives.push_back("/dev/" + name);
+	}
+	closedir(dir);
+	sort(drives.begin(), drives.end());
+	return 0;
+#else
+	(void)drives;
+	return -1;
+#endif
+}
+
+/******************************************************************************\
+* scan_open: open a device of a scan and find its geometry                     *
+* job: the device; its status and reason are set if this fails                 *
+* block_size: block size to use, 0 to ask the device                           *
+* max_ebrs: limit on the EBR chain                                             *
+\******************************************************************************/
+int scan_open(scan_job &job, unsigned int block_size, uint32_t max_ebrs)
+{
+	job.status = SCAN_FAILED;
+	if (job.dev.open(job.drive, false) < 0) {
+		job.reason = "unable to open";
+		return -1;
+	}
+	job.block_size = block_size ? block_size : job.dev.get_block_size();
+	if (job.block_size < 512) {
+		job.reason = "unknown block size, use --block-size";
+		return -1;
+	}
+	job.dev.set_block_size(job.block_size);
+	job.disk_len = job.dev.get_capacity()/job.block_size;
+	if (!job.disk_len) {
+		job.reason = "unknown capacity";
+		return -1;
+	}
+	job.walk = EbrWalk(max_ebrs);
+	job.buf.resize(job.block_size);
+	job.lba = 0;
+	job.status = SCAN_READY;
+	return 0;
+}
+
+/******************************************************************************\
+* scan_block: parse the boot record just read for a device                     *
+* job: the device; job.buf holds the block at job.lba                          *
+* return value: true if another boot record must be read (job.lba is set to    *
+* its address), false once the chain has been followed to its end              *
+\******************************************************************************/
+bool scan_block(scan_job &job)
+{
+	const struct mbrpart *tbl = (const struct mbrpart *)&job.buf[446];
+	uint32_t next;
+
+	next = job.lba ? job.walk.step(tbl, job.parts) :
+					 job.walk.start(tbl, job.parts);
+	job.lba = next;
+	return next > 0;
+}
+
+/******************************************************************************\
+* scan_sync: read the boot records of a device with blocking reads             *
+* job: the device, opened by scan_open()                                       *
+\******************************************************************************/
+void scan_sync(scan_job &job)
+{
+	do {
+		if (job.dev.read_block(job.lba, &job.buf[0]) < 0) {
+			job.status = SCAN_FAILED;
+			job.reason = "block read failed";
+			return;
+		}
+	} while (scan_block(job));
+}
+
+#ifdef USE_IO_URING
+/******************************************************************************\
+* scan_uring: read the boot records of many devices through one io_uring       *
+* list: the devices; those that can't take raw reads are read with scan_sync() *
+* io: receives the io_uring_enter calls, which are shared by all devices       *
+* return value: -1 if io_uring isn't available (nothing has been read then)    *
+* If the ring fails part way, the devices not yet done are marked as failed.   *
+* The MBRs of all devices are read at once, then the first EBR of every        *
+* device that has one, and so on: each chain is followed one link at a time,   *
+* but the chains of all devices advance together, keeping up to                *
+* SCAN_QUEUE_DEPTH reads in flight.                                            *
+\******************************************************************************/
+int scan_uring(vector<scan_job> &list, io_stats &io)
+{
+	IoRing ring;
+	vector<size_t> ready;
+	vector<bool> busy(list.size()); // a read is in flight
+	unsigned int inflight = 0;
+
+	if (ring.init(SCAN_QUEUE_DEPTH) < 0)
+		return -1;
+
+	for (size_t i = 0; i < list.size(); i++) {
+		if (list[i].status == SCAN_FAILED)
+			continue;
+		if (list[i].dev.raw_fd() < 0)
+			scan_sync(list[i]);
+		else
+			ready.push_back(i);
+	}
+
+	while (ready.size() || inflight) {
+		while (ready.size() && inflight < ring.depth()) {
+			scan_job &job = list[ready.back()];
+
+			if (!ring.prep(IORING_OP_READ, job.dev.raw_fd(), &job.buf[0],
+						   job.block_size, job.lba*job.block_size,
+						   ready.back()))
+				break;
+			busy[ready.back()] = true;
+			ready.pop_back();
+			inflight++;
+		}
+		io.submits++;
+		if (ring.submit(1) < 0) {
+			for (size_t i = 0; i < ready.size(); i++)
+				busy[ready[i]] = true;
+			for (size_t i = 0; i < list.size(); i++) {
+				if (busy[i]) {
+					list[i].status = SCAN_FAILED;
+					list[i].reason = "block read failed";
+				}
+			}
+			break;
+		}
+
+		uint64_t i;
+		int res;
+		while (ring.reap(&i, &res)) {
+			scan_job &job = list[i];
+
+			inflight--;
+			busy[i] = false;
+			if (res != job.block_size) {
+				job.status = SCAN_FAILED;
+				job.reason = "block read failed";
+				continue;
+			}
+			job.dev.count_ring_read(res);
+			if (scan_block(job))
+				ready.push_back((size_t)i);
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/******************************************************************************\
+* scan_verdict: decide whether a scanned device can be converted               *
+* job: the device, with its boot records read                                  *
+* record_count: number of entries of the GPT it would get                      *
+\******************************************************************************/
+void scan_verdict(scan_job &job, uint32_t record_count)
+{
+	vector<string> why;
+	uint64_t first = job.disk_len, end = 0;
+	int layout, generic = 0;
+	bool boot = false;
+
+	job.table_len = gpt_table_len(record_count, job.block_size);
+	for (size_t i = 0; i < job.parts.size(); i++) {
+		const part &p = job.parts[i];
+
+		first = min<uint64_t>(first, p.start);
+		end = max<uint64_t>(end, (uint64_t)p.start + p.len);
+		boot = boot || p.active;
+		switch (lookup_type(p.type).action) {
+		case TYPE_PMAGIC: why.push_back("PartitionMagic partition"); break;
+		case TYPE_DYNAMIC: why.push_back("dynamic disk"); break;
+		case TYPE_GPT: why.push_back("already GPT"); break;
+		case TYPE_GENERIC: generic++; break;
+		case TYPE_MAP: break;
+		}
+	}
+	job.head = first;
+	job.tail = job.disk_len > end ? job.disk_len - end : 0;
+
+	if (job.walk.error() == GPTGEN_CHAIN_LIMIT)
+		why.push_back("too many EBRs, use --max-ebrs");
+	else if (job.walk.error())
+		why.push_back("damaged EBR chain");
+	layout = check_layout(job.parts, job.disk_len, job.table_len,
+						  record_count);
+	if (layout & GPTGEN_LAYOUT_HEAD)
+		why.push_back("no room for the primary GPT");
+	if (layout & GPTGEN_LAYOUT_TAIL)
+		why.push_back("no room for the secondary GPT");
+	if (layout & GPTGEN_LAYOUT_COUNT)
+		why.push_back("too many partitions, use -c");
+
+	if (why.size()) {
+		job.status = SCAN_BLOCKED;
+	} else {
+		job.status = boot ? SCAN_BOOT : SCAN_READY;
+		if (boot)
+			why.push_back("boot partition(s), use -k");
+		if (generic)
+			why.push_back(to_string(generic) + " of unknown type");
+		if (!why.size())
+			why.push_back("ready");
+	}
+	for (size_t i = 0; i < why.size(); i++)
+		job.reason += (i ? ", " : "") + why[i];
+}
+
+/******************************************************************************\
+* run_scan: report which of many devices can be converted, without writing     *
+* drives: the devices (or disk images) to scan                                 *
+* record_count, block_size, max_ebrs: as for a conversion                      *
+* uring: read through io_uring if available, rather than on threads            *
+* stats: timings of the run; the I/O counters add up every device              *
+* return value: the exit status of the program, EXIT_FAILURE unless every      *
+* device can be converted                                                      *
+* Only the MBR and the EBRs of each device are read, through io_uring where    *
+* the system has it and on a pool of threads where it doesn't. The layout      *
+* checks of a conversion are then run on every device.                         *
+\******************************************************************************/
+int run_scan(const vector<string> &drives, uint32_t record_count,
+			 unsigned int block_size, uint32_t max_ebrs, bool uring,
+			 RunStats &stats)
+{
+	vector<scan_job> list(drives.size());
+	size_t width = 6, ready = 0;
+	const char *engine = "io_uring";
+
+	stats.phase("open");
+	for (size_t i = 0; i < list.size(); i++) {
+		list[i].drive = drives[i];
+		width = max(width, drives[i].length());
+		scan_open(list[i], block_size, max_ebrs);
+	}
+
+	stats.phase("read");
+#ifdef USE_IO_URING
+	if (!uring || scan_uring(list, stats.stream) < 0)
+#else
+	(void)uring;
+#endif
+	{
+		vector<thread> workers;
+		atomic<size_t> next(0);
+		size_t threads = max<size_t>(1, min<size_t>(SCAN_THREADS_MAX,
+													list.size()));
+
+		engine = "threads";
+		for (size_t t = 0; t < threads; t++) {
+			workers.push_back(thread([&]() {
+				for (size_t i = next++; i < list.size(); i = next++) {
+					if (list[i].status != SCAN_FAILED)
+						scan_sync(list[i]);
+				}
+			}));
+		}
+		for (size_t t = 0; t < workers.size(); t++)
+			workers[t].join();
+	}
+	cout << "Scanned " << list.size() << " device(s) with " << engine << "."
+		 << endl << endl;
+
+	stats.phase("check");
+	cout << left << setw(width) << "Device" << "  " << setw(8) << "Result"
+		 << right << setw(6) << "Parts" << setw(14) << "Head" << setw(14)
+		 << "Tail" << "  " << "Details" << endl;
+	for (size_t i = 0; i < list.size(); i++) {
+		scan_job &job = list[i];
+
+		if (job.status != SCAN_FAILED)
+			scan_verdict(job, record_count);
+		cout << left << setw(width) << job.drive << "  " << setw(8)
+			 << (job.status == SCAN_READY ? "READY" :
+				 job.status == SCAN_BOOT ? "BOOT" :
+				 job.status == SCAN_BLOCKED ? "BLOCKED" : "FAILED")
+			 << right << setw(6) << job.parts.size();
+		if (job.status == SCAN_FAILED) {
+			cout << setw(14) << "-" << setw(14) << "-";
+		} else {
+			cout << setw(14) << (to_string(job.head) + "/" +
+								 to_string(job.table_len+2))
+				 << setw(14) << (to_string(job.tail) + "/" +
+								 to_string(job.table_len+1));
+		}
+		cout << "  " << job.reason << endl;
+		if (job.status == SCAN_READY || job.status == SCAN_BOOT)
+			ready++;
+		add_io_stats(stats.stream, job.dev.stats());
+	}
+	cout << endl << "Head and tail are the blocks free before the first "
+		 << "and after the last partition," << endl << "and the blocks "
+		 << "the GPT needs there." << endl << ready << " of " << list.size()
+		 << " device(s) can be converted." << endl;
+
+	return ready == list.size() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#ifndef WINDOWS_BUILD
+// Set by SIGINT and SIGTERM, to stop --serve.
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_signal(int)
+{
+	serve_stop = 1;
+}
+
+// Names of the serve_op values, for the JSON messages.
+static const char *serve_op_names[] = {"", "scan", "plan", "convert", "verify"};
+
+/******************************************************************************\
+* serve_io: read or write a whole buffer on a socket                           *
+* fd: the socket                                                               *
+* buf, len: the buffer                                                         *
+* write: write the buffer, rather than read into it                            *
+* return value: the number of bytes transferred, less than len only if the     *
+* other end closed the connection; -1 on error                                 *
+\******************************************************************************/
+ssize_t serve_io(int fd, void *buf, size_t len, bool write)
+{
+	char *p = (char *)buf;
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = write ? ::write(fd, p + done, len - done) :
+							::read(fd, p + done, len - done);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (!n)
+			break;
+		done += n;
+	}
+
+	return (ssize_t)done;
+}
+
+/******************************************************************************\
+* serve_send: send one message of the --serve protocol                         *
+* fd: the socket                                                               *
+* type, status: as for serve_msg                                               *
+* payload: the message                                                         *
+\******************************************************************************/
+int serve_send(int fd, uint32_t type, uint32_t status, const string &payload)
+{
+	serve_msg msg = {SERVE_MAGIC, type, status, (uint32_t)payload.length(),
+					 0};
+	string out((const char *)&msg, sizeof(msg));
+
+	out += payload;
+	return serve_io(fd, &out[0], out.length(), true) == (ssize_t)out.length() ?
+		   0 : -1;
+}
+
+/******************************************************************************\
+* ServeLog: a stream buffer that sends every line written to it as a progress  *
+* event of the --serve protocol, as soon as the line is complete               *
+\******************************************************************************/
+class ServeLog : public streambuf {
+public:
+	ServeLog(int fd) : fd(fd) {}
+
+protected:
+	int_type overflow(int_type c)
+	{
+		if (c == traits_type::eof())
+			return traits_type::not_eof(c);
+		if (c != '\n') {
+			line += (char)c;
+			return c;
+		}
+		// A client that went away doesn't stop the job; it still finishes.
+		serve_send(fd, SERVE_PROGRESS, 0, "{\"event\": \"log\", \"text\": " +
+				   json_string(line) + "}");
+		line.clear();
+		return c;
+	}
+
+private:
+	int fd;
+	string line;
+};
+
+/******************************************************************************\
+* serve_job: run one request of the --serve protocol, and answer it            *
+* fd: the socket of the client                                                 *
+* op: the serve_op requested                                                   *
+* opt: settings of the job                                                     *
+* job: the device; receives the outcome                                        *
+* bufs: working storage of the worker                                          *
+\******************************************************************************/
+void serve_job(int fd, uint32_t op, const batch_options &opt, batch_job &job,
+			   job_buffers &bufs)
+{
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	ServeLog buf(fd);
+	ostream log(&buf);
+	ostringstream out;
+	uint32_t status;
+
+	serve_send(fd, SERVE_PROGRESS, 0, string("{\"event\": \"start\", ") +
+			   "\"op\": \"" + serve_op_names[op] + "\", \"device\": " +
+			   json_string(job.drive) + "}");
+	if (op == SERVE_VERIFY)
+		verify_job(opt, job, log, bufs);
+	else
+		convert_job(opt, job, log, bufs);
+	job.ms = chrono::duration<double, milli>(chrono::steady_clock::now() -
+											 start).count();
+
+	status = job.status == BATCH_OK ? SERVE_OK :
+			 job.status == BATCH_SKIPPED ? SERVE_SKIPPED : SERVE_FAILED;
+	out << fixed << setprecision(3);
+	out << "{\"op\": \"" << serve_op_names[op] << "\", \"device\": "
+		<< json_string(job.drive) << ", \"status\": \""
+		<< (status == SERVE_OK ? "ok" : status == SERVE_SKIPPED ? "skipped" :
+			"failed") << "\", \"reason\": " << json_string(job.reason)
+		<< ", \"parts\": " << job.parts << ", \"ms\": " << job.ms
+		<< ", \"io\": {\"reads\": " << job.io.reads << ", \"writes\": "
+		<< job.io.writes << ", \"syncs\": " << job.io.syncs
+		<< ", \"read_bytes\": " << job.io.read_bytes << ", \"write_bytes\": "
+		<< job.io.write_bytes << "}}";
+	serve_send(fd, SERVE_RESULT, status, out.str());
+}
+
+/******************************************************************************\
+* serve_connection: answer the requests of one client, until it hangs up       *
+* fd: the socket of the client                                                 *
+* defaults: settings of the daemon, for whatever a request leaves out          *
+* bufs: working storage of the worker                                          *
+* total: receives the I/O counters of every job                                *
+* lock: guards total                                                           *
+* A malformed request fails, and ends the connection: there's no telling       *
+* where the next message would start.                                          *
+\******************************************************************************/
+void serve_connection(int fd, const batch_options &defaults,
+					  job_buffers &bufs, io_stats &total, mutex &lock)
+{
+	static const char magic[8] = SERVE_MAGIC;
+
+	for (;;) {
+		serve_msg msg;
+		serve_request req;
+		batch_options opt = defaults;
+		batch_job job;
+		string payload;
+		ssize_t n = serve_io(fd, &msg, sizeof(msg), false);
+
+		if (!n)
+			return; // the client is done
+		if (n != (ssize_t)sizeof(msg) || memcmp(msg.magic, magic, 8) ||
+			msg.type != SERVE_REQUEST || msg.len < sizeof(req) ||
+			msg.len > SERVE_MSG_MAX) {
+			serve_send(fd, SERVE_RESULT, SERVE_FAILED,
+					   "{\"status\": \"failed\", \"reason\": "
+					   "\"malformed request\"}");
+			return;
+		}
+		payload.resize(msg.len);
+		if (serve_io(fd, &payload[0], msg.len, false) != (ssize_t)msg.len)
+			return;
+		memcpy(&req, payload.data(), sizeof(req));
+		if (req.op < SERVE_SCAN || req.op > SERVE_VERIFY ||
+			(uint64_t)sizeof(req) + req.path_len + req.file_len != msg.len ||
+			!req.path_len || (req.op == SERVE_PLAN) != (req.file_len > 0) ||
+			(req.block_size && req.block_size < 512)) {
+			serve_send(fd, SERVE_RESULT, SERVE_FAILED,
+					   "{\"status\": \"failed\", \"reason\": "
+					   "\"malformed request\"}");
+			return;
+		}
+
+		job.drive = payload.substr(sizeof(req), req.path_len);
+		job.plan_file = payload.substr(sizeof(req) + req.path_len);
+		opt.write = req.op == SERVE_CONVERT;
+		opt.keepmbr = defaults.keepmbr || (req.flags & SERVE_KEEPMBR);
+		// A scan reports boot partitions, as --scan does, rather than
+		// skipping the disk.
+		opt.bootnofail = defaults.bootnofail || (req.flags & SERVE_BOOT) ||
+						 req.op == SERVE_SCAN;
+		opt.verify = opt.write &&
+					 (defaults.verify || (req.flags & SERVE_CHECK));
+		opt.direct = defaults.direct || (req.flags & SERVE_DIRECT);
+		if (req.record_count)
+			opt.record_count = req.record_count;
+		if (req.block_size)
+			opt.block_size = req.block_size;
+		if (req.max_ebrs)
+			opt.max_ebrs = req.max_ebrs;
+
+		serve_job(fd, req.op, opt, job, bufs);
+
+		lock_guard<mutex> guard(lock);
+		add_io_stats(total, job.io);
+	}
+}
+
+/******************************************************************************\
+* run_serve: serve conversion jobs over a Unix domain socket until stopped     *
+* path: the socket to create                                                   *
+* defaults: settings of the daemon, for whatever a request leaves out          *
+* jobs: number of worker threads, each serving one connection at a time        *
+* stats: timings of the run; the I/O counters add up every job                 *
+* return value: the exit status of the program                                 *
+* The socket is only accessible to its owner. Each worker keeps its working    *
+* storage (see job_buffers) from one job to the next. SIGINT or SIGTERM stops  *
+* the daemon once the jobs running have finished, and removes the socket.      *
+\******************************************************************************/
+int run_serve(string path, const batch_options &defaults, unsigned int jobs,
+			  RunStats &stats)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct stat st;
+	sigset_t block, orig;
+	deque<int> queue; // accepted connections, waiting for a worker
+	vector<int> active; // connections being served
+	vector<thread> workers;
+	condition_variable ready;
+	mutex lock;
+	bool stopping = false;
+	mode_t mask;
+	int sock, ret;
+
+	stats.phase("serve");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.length() >= sizeof(addr.sun_path)) {
+		cout << "The socket path " << path << " is too long." << endl;
+		return EXIT_FAILURE;
+	}
+	strcpy(addr.sun_path, path.c_str());
+
+	// Take over a stale socket, but not one another daemon is serving on.
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) {
+		cout << "Unable to create a socket!" << endl;
+		return EXIT_FAILURE;
+	}
+	if (!connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		cout << "Another daemon is already serving on " << path << "."
+			 << endl;
+		close(sock);
+		return EXIT_FAILURE;
+	}
+	close(sock);
+	if (!lstat(path.c_str(), &st) && S_ISSOCK(st.st_mode))
+		unlink(path.c_str());
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	mask = umask(0177);
+	ret = sock < 0 ? -1 : bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0 || listen(sock, SOMAXCONN) < 0) {
+		cout << "Unable to listen on " << path << ", check permissions!"
+			 << endl;
+		if (sock >= 0)
+			close(sock);
+		return EXIT_FAILURE;
+	}
+
+	// Only this thread takes the stop signals (the workers inherit the mask),
+	// and only while it waits for a connection.
+	signal(SIGPIPE, SIG_IGN);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serve_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &block, &orig);
+
+	for (unsigned int t = 0; t < jobs; t++) {
+		workers.push_back(thread([&]() {
+			job_buffers bufs;
+
+			for (;;) {
+				int fd;
+
+				{
+					unique_lock<mutex> guard(lock);
+
+					ready.wait(guard, [&]() {
+						return stopping || queue.size();
+					});
+					if (stopping)
+						return;
+					fd = queue.front();
+					queue.pop_front();
+					active.push_back(fd);
+				}
+				serve_connection(fd, defaults, bufs, stats.stream, lock);
+				{
+					lock_guard<mutex> guard(lock);
+
+					active.erase(find(active.begin(), active.end(), fd));
+				}
+				close(fd);
+			}
+		}));
+	}
+	cout << "Serving on " << path << " with " << jobs << " worker(s)..."
+		 << endl;
+
+	while (!serve_stop) {
+		fd_set fds;
+		int fd;
+
+		FD_ZERO(&fds);
+		FD_SET(sock, &fds);
+		if (pselect(sock+1, &fds, NULL, NULL, NULL, &orig) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0)
+			continue;
+		lock_guard<mutex> guard(lock);
+		queue.push_back(fd);
+		ready.notify_one();
+	}
+
+	// Let the jobs running finish, but read no more requests.
+	{
+		lock_guard<mutex> guard(lock);
+
+		stopping = true;
+		for (size_t i = 0; i < active.size(); i++)
+			shutdown(active[i], SHUT_RD);
+		for (size_t i = 0; i < queue.size(); i++)
+			close(queue[i]);
+		queue.clear();
+	}
+	ready.notify_all();
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+
+	close(sock);
+	unlink(path.c_str());
+	pthread_sigmask(SIG_SETMASK, &orig, NULL);
+	cout << "Stopped serving on " << path << "." << endl;
+	return serve_stop ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+#endif
+
+/******************************************************************************\
+* usage: print usage information.                                              *
+* name: name of the program, call with argv[0]                                 *
+\******************************************************************************/
+void usage(char *name)
+{
+	cout << "Usage: " << name << " [<arguments>] <device_path>" << endl;
+	cout << "       " << name << " --batch [<arguments>] <device_path>..."
+		 << endl;
+	cout << "       " << name << " --group [<arguments>] <device_path> "
+		 << "<device_path>..." << endl;
+	cout << "       " << name << " --scan [<arguments>] [<device_path>...]"
+		 << endl;
+	cout << "where device_path is the full path to the device file," << endl;
+	cout << "e.g. "
+#ifdef WINDOWS_BUILD
+		 << "\\\\.\\physicaldrive0."
+#elif MACOS_BUILD
+		 << "/dev/disk0"
 #else
 		 << "/dev/sda or /dev/mmcblk0."
 #endif
 		 << endl << endl;
 	cout << "Available arguments (no \"-wm\"-style "
 		 << "argument combining support):" << endl;
+	cout << "--apply <file>: write a plan saved with --plan, if the disk "
+		 << "hasn't changed" << endl
+		 << "  since it was made" << endl;
 	cout << "-b <file>, --backup <file>: write a backup "
 		 << "of the original MBR to <file>" << endl;
+	cout << "--block-size nnn: use a block size of nnn bytes, don't ask the "
+		 << "disk (or the" << endl
+		 << "  user)" << endl;
+	cout << "--clone <file>: write the GPT to a reflinked copy "
+		 << "of the disk image, <file>" << endl;
 	cout << "-c nnn, --count nnn: build a "
 		 << "GPT containing nnn entries (default=128)" << endl;
+	cout << "-d, --direct: bypass the OS cache "
+		 << "(O_DIRECT) for all disk reads and writes" << endl;
+	cout << "--batch: convert every drive given, at once, without asking "
+		 << "anything (-k" << endl
+		 << "  converts disks with boot partitions, they are skipped "
+		 << "otherwise); without -w," << endl
+		 << "  only check them" << endl;
+	cout << "--group: convert the drives given, the members of a RAID1/RAID10 "
+		 << "array," << endl
+		 << "  together: only if they all have the same partitions, secondary "
+		 << "GPTs first," << endl
+		 << "  rolled back if any member fails; without -w, only check "
+		 << "them" << endl;
+	cout << "--guids <mode>: disk and partition GUIDs, zero "
+		 << "(default) or random (version 4)" << endl;
+	cout << "--guid-key <key>: derive the GUIDs from <key>, the disk's serial "
+		 << "number (or" << endl
+		 << "  path) and the entry, so that the same disk always gets the same "
+		 << "GUIDs" << endl;
+	cout << "--guid-id <id>: with --guid-key, derive the GUIDs from "
+		 << "<id> instead of the disk" << endl;
 	cout << "-h, --help, --usage: display this help message" << endl;
+	cout << "--edit n: change entry n (from 1) of the GPT already on the disk, "
+		 << "as the" << endl
+		 << "  --type, --flags and --name after it say; only the blocks "
+		 << "changed are" << endl
+		 << "  rewritten" << endl;
+	cout << "--flags <hex>: with --edit, the new attribute flags "
+		 << "of the entry" << endl;
+	cout << "--io-engine <engine>: issue disk I/O with posix calls (default) "
+		 << "or batched" << endl
+		 << "  through io_uring (the default for --scan)" << endl;
+	cout << "--io-min nnn, --io-opt nnn: use a minimum (RAID chunk) and "
+		 << "optimal (stripe) I/O" << endl
+		 << "  size of nnn bytes to check partition alignment, don't ask the "
+		 << "disk" << endl;
+	cout << "-j n, --jobs n: convert up to n drives of a batch at once "
+		 << "(default=number of" << endl
+		 << "  CPUs)" << endl;
+	cout << "--journal <file>: before -w, --clone, --apply or --edit write, "
+		 << "save what they" << endl
+		 << "  overwrite to <file>" << endl;
 	cout << "-k, --keep-going: don't ask user if a "
 		 << "boot partition is found" << endl;
+	cout << "--manifest <file>: a batch of the drives listed in <file>, one "
+		 << "per line" << endl
+		 << "  (- for stdin)" << endl;
 	cout << "-m, --keepmbr: keep the existing MBR, "
 		 << "don't write a protective MBR" << endl;
+	cout << "--max-ebrs n: refuse disks with more than n EBRs (logical "
+		 << "partitions," << endl
+		 << "  default=" << GPTGEN_EBR_LIMIT_DEFAULT << ")" << endl;
+	cout << "--name <name>: with --edit, the new name of the entry (up to 36 "
+		 << "ASCII" << endl
+		 << "  characters)" << endl;
+	cout << "--physical-block-size nnn: use a physical block size of nnn "
+		 << "bytes, don't ask" << endl
+		 << "  the disk" << endl;
+	cout << "--plan <file>: save what would be written, and the state it "
+		 << "depends on, to" << endl
+		 << "  <file>" << endl;
+	cout << "-p, --pipe: read a disk image from stdin, write "
+		 << "the GPT to stdout as frames" << endl;
+	cout << "--scan: report which of the drives given (all of the system's, if "
+		 << "none are) can" << endl
+		 << "  be converted, reading them all at once; only reads" << endl;
+	cout << "--serve <socket>: serve scan, plan, convert and verify requests "
+		 << "on the Unix" << endl
+		 << "  domain socket <socket> with -j workers, until stopped; other "
+		 << "arguments are" << endl
+		 << "  the defaults" << endl;
+	cout << "--selftest: check the CRC32 engines against "
+		 << "the reference implementation" << endl;
+	cout << "--stats <file>: write timings and I/O counters "
+		 << "as JSON to <file> (- for stderr)" << endl;
+	cout << "--sync <mode>: flush barrier at the end of -w, fsync (default), "
+		 << "fdatasync or" << endl
+		 << "  none" << endl;
+	cout << "--type <type>: with --edit, the new type of the entry, as a GUID "
+		 << "or an" << endl
+		 << "  MBR type ID" << endl;
+	cout << "--undo <file>: put back what a conversion saved with --journal "
+		 << "overwrote, and" << endl
+		 << "  check it" << endl;
+	cout << "--verify: after -w or --clone, read both GPT copies back "
+		 << "(bypassing the cache)" << endl
+		 << "  and check them" << endl;
+	cout << "--verify-only: check the GPT already on the disk, "
+		 << "don't convert anything" << endl;
 	cout << "-w, --write: write directly to the disk, "
 		 << "not to separate files" << endl;
 	return;
 }
 
 /******************************************************************************\
-* main: do the actual conversion from MBR to GPT                               *
+* convert_disk: do the actual conversion from MBR to GPT                       *
+* argc, argv: the command line                                                 *
+* dev: the device to convert, not yet opened                                   *
+* stats: timings of the run, enabled by --stats                                *
+* return value: the exit status of the program                                 *
 \******************************************************************************/
-int main(int argc, char *argv[])
+int convert_disk(int argc, char *argv[], BlockDevice &dev, RunStats &stats)
 {
 	ofstream fout;
-	struct mbrpart curr[4];
+	char mbr[446];
+	vector<struct part> parts;
 	vector<struct gptpart> gptparts;
-	struct gptpart *gpttable;
-	string drive, yesno, backup = "";
+	string drive, yesno, backup = "", clone = "", plan_file = "", apply = "",
+		   journal = "", undo = "", serve = "";
+	vector<uint64_t> sources; // the MBR and EBRs the GPT is derived from
+	vector<string> drives;
+	vector<entry_edit> edits;
+	guid_source guids = {GUIDS_ZERO, {0, 0}, ""};
+	__guid disk_guid = empty_record.id;
+	io_hints hints = {0, 0, 0}, overrides = {0, 0, 0};
+	gpt_area area;
 	uint64_t disk_len;
-	uint32_t first_ebr = 0, curr_ebr = 0;
-	bool write = false, badlayout = false, boot = false, keepmbr = false,
-		 bootnofail = false;
-	unsigned int table_len = 0, record_count = 128, block_size = 0;
+	bool write = false, boot = false, keepmbr = false,
+		 bootnofail = false, direct = false, pipe = false,
+		 verify = false, verify_only = false, batch = false, scan = false,
+		 group = false;
+	sync_mode sync = SYNC_FSYNC;
+	io_engine engine = ENGINE_AUTO;
+	unsigned int table_len = 0, record_count = 128, block_size = 0,
+				 jobs = max(thread::hardware_concurrency(), 1U),
+				 max_ebrs = GPTGEN_EBR_LIMIT_DEFAULT;
+	int layout;
 
-	setup_endian();
+	crc32_init();
 
-	memset((void *)curr, 0, 64);
+	// In pipe mode stdout carries the generated GPT, so every message
+	// goes to stderr instead.
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--pipe"))
+			pipe = true;
+	}
+	if (pipe)
+		cout.rdbuf(cerr.rdbuf());
 
 	cout << argv[0] << ": Partition table converter "
 		 << "v1.3" << endl;
@@ -694,6 +5839,8 @@ int main(int argc, char *argv[])
 			keepmbr = true;
 		} else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "--keep-going")) {
 			bootnofail = true;
+		} else if (!strcmp(argv[i], "--selftest")) {
+			return crc32_selftest() ? EXIT_SUCCESS : EXIT_FAILURE;
 		} else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help") ||
 				   !strcmp(argv[i], "--usage")) {
 			usage(argv[0]);
@@ -704,11 +5851,246 @@ int main(int argc, char *argv[])
 				cout << "Missing argument for -c (--count)." << endl;
 				return EXIT_FAILURE;
 			}
-			record_count = atoi(argv[i]);
-			if (record_count <= 0) {
-				cout << "Invalid argument for -c (--count)." << endl;
+			record_count = atoi(argv[i]);
+			if (record_count <= 0) {
+				cout << "Invalid argument for -c (--count)." << endl;
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--direct")) {
+			direct = true;
+		} else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--pipe")) {
+			pipe = true;
+		} else if (!strcmp(argv[i], "--plan")) {
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for --plan." << endl;
+				return EXIT_FAILURE;
+			}
+			plan_file = string(argv[i]);
+		} else if (!strcmp(argv[i], "--apply")) {
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for --apply." << endl;
+				return EXIT_FAILURE;
+			}
+			apply = string(argv[i]);
+		} else if (!strcmp(argv[i], "--journal")) {
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for --journal." << endl;
+				return EXIT_FAILURE;
+			}
+			journal = string(argv[i]);
+		} else if (!strcmp(argv[i], "--undo")) {
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for --undo." << endl;
+				return EXIT_FAILURE;
+			}
+			undo = string(argv[i]);
+		} else if (!strcmp(argv[i], "--edit")) {
+			entry_edit ed;
+			char *end;
+			unsigned long n;
+
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for --edit." << endl;
+				return EXIT_FAILURE;
+			}
+			n = strtoul(argv[i], &end, 10);
+			if (*end || !n || n > 0xFFFFFFFFUL) {
+				cout << "Invalid argument for --edit." << endl;
+				return EXIT_FAILURE;
+			}
+			memset(&ed, 0, sizeof(ed));
+			ed.index = (uint32_t)(n - 1);
+			edits.push_back(ed);
+		} else if (!strcmp(argv[i], "--type") || !strcmp(argv[i], "--flags") ||
+				   !strcmp(argv[i], "--name")) {
+			const char *opt = argv[i];
+			char *end;
+
+			i++;
+			if (i >= argc) {
+				cout << "Missing argument for " << opt << "." << endl;
+				return EXIT_FAILURE;
+			}
+			if (!edits.size()) {
+				cout << opt << " changes the entry selected by the --edit "
+					 << "before it." << endl;
+				return EXIT_FAILURE;
+			}
+			entry_edit &ed = edits.back();
+			bool ok;
+
+			if (!strcmp(opt, "--type")) {
+				ok = ed.set_type = !parse_type(argv[i], ed.type);
+			} else if (!strcmp(opt, "--flags")) {
+				ed.flags = strtoull(argv[i], &end, 16);
+				ok = ed.set_flags = argv[i][0] && !*end;
+			} else {
+				ok = ed.set_name = !parse_name(argv[i], ed.name);
+			}
+			if (!ok) {
+				cout << "Invalid argument for " << opt << "." << endl;
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "--serve")) {
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for --serve." << endl;
+				return EXIT_FAILURE;
+			}
+			serve = string(argv[i]);
+		} else if (!strcmp(argv[i], "--batch")) {
+			batch = true;
+		} else if (!strcmp(argv[i], "--scan")) {
+			scan = true;
+		} else if (!strcmp(argv[i], "--group")) {
+			group = true;
+		} else if (!strcmp(argv[i], "--manifest")) {
+			i++;
+			if (i >= argc || (argv[i][0] == '-' && argv[i][1])) {
+				cout << "Missing argument for --manifest." << endl;
+				return EXIT_FAILURE;
+			}
+			if (read_manifest(argv[i], drives) < 0) {
+				cout << "Unable to read the manifest " << argv[i] << "."
+					 << endl;
+				return EXIT_FAILURE;
+			}
+			batch = true;
+		} else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for -j (--jobs)." << endl;
+				return EXIT_FAILURE;
+			}
+			if (atoi(argv[i]) <= 0) {
+				cout << "Invalid argument for -j (--jobs)." << endl;
+				return EXIT_FAILURE;
+			}
+			jobs = atoi(argv[i]);
+		} else if (!strcmp(argv[i], "--verify")) {
+			verify = true;
+		} else if (!strcmp(argv[i], "--verify-only")) {
+			verify_only = true;
+		} else if (!strcmp(argv[i], "--block-size")) {
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for --block-size." << endl;
+				return EXIT_FAILURE;
+			}
+			block_size = atoi(argv[i]);
+			if (block_size < 512) {
+				cout << "Invalid argument for --block-size." << endl;
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "--max-ebrs")) {
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for --max-ebrs." << endl;
+				return EXIT_FAILURE;
+			}
+			max_ebrs = atoi(argv[i]);
+			if (!max_ebrs) {
+				cout << "Invalid argument for --max-ebrs." << endl;
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "--physical-block-size") ||
+				   !strcmp(argv[i], "--io-min") ||
+				   !strcmp(argv[i], "--io-opt")) {
+			const char *opt = argv[i];
+			unsigned long n;
+			char *end;
+
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for " << opt << "." << endl;
+				return EXIT_FAILURE;
+			}
+			n = strtoul(argv[i], &end, 10);
+			if (*end || n < 512 || n > 0x80000000UL) {
+				cout << "Invalid argument for " << opt << "." << endl;
+				return EXIT_FAILURE;
+			}
+			if (!strcmp(opt, "--physical-block-size"))
+				overrides.physical = (uint32_t)n;
+			else if (!strcmp(opt, "--io-min"))
+				overrides.io_min = (uint32_t)n;
+			else
+				overrides.io_opt = (uint32_t)n;
+		} else if (!strcmp(argv[i], "--io-engine")) {
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for --io-engine." << endl;
+				return EXIT_FAILURE;
+			}
+			if (!strcmp(argv[i], "posix")) {
+				engine = ENGINE_POSIX;
+			} else if (!strcmp(argv[i], "io_uring")) {
+				engine = ENGINE_URING;
+#ifndef USE_IO_URING
+				cout << "WARNING: Built without io_uring support, using "
+					 << "POSIX I/O instead." << endl;
+#endif
+			} else {
+				cout << "Invalid argument for --io-engine." << endl;
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "--guids")) {
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for --guids." << endl;
+				return EXIT_FAILURE;
+			}
+			if (!strcmp(argv[i], "zero")) {
+				guids.mode = GUIDS_ZERO;
+			} else if (!strcmp(argv[i], "random")) {
+				guids.mode = GUIDS_RANDOM;
+			} else {
+				cout << "Invalid argument for --guids." << endl;
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "--guid-key")) {
+			i++;
+			if (i >= argc) {
+				cout << "Missing argument for --guid-key." << endl;
+				return EXIT_FAILURE;
+			}
+			guids.mode = GUIDS_KEYED;
+			guid_key(argv[i], guids.key);
+		} else if (!strcmp(argv[i], "--guid-id")) {
+			i++;
+			if (i >= argc || !argv[i][0]) {
+				cout << "Missing argument for --guid-id." << endl;
+				return EXIT_FAILURE;
+			}
+			guids.id = argv[i];
+		} else if (!strcmp(argv[i], "--sync")) {
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for --sync." << endl;
+				return EXIT_FAILURE;
+			}
+			if (!strcmp(argv[i], "fsync")) {
+				sync = SYNC_FSYNC;
+			} else if (!strcmp(argv[i], "fdatasync")) {
+				sync = SYNC_FDATASYNC;
+			} else if (!strcmp(argv[i], "none")) {
+				sync = SYNC_NONE;
+			} else {
+				cout << "Invalid argument for --sync." << endl;
+				return EXIT_FAILURE;
+			}
+		} else if (!strcmp(argv[i], "--clone")) {
+			i++;
+			if (i >= argc || argv[i][0] == '-') {
+				cout << "Missing argument for --clone." << endl;
 				return EXIT_FAILURE;
 			}
+			clone = string(argv[i]);
 		} else if (!strcmp(argv[i], "-b") || !strcmp(argv[i], "--backup")) {
 			i++;
 			if (i >= argc || argv[i][0] == '-') {
@@ -716,26 +6098,190 @@ int main(int argc, char *argv[])
 				return EXIT_FAILURE;
 			}
 			backup = string(argv[i]);
+		} else if (!strcmp(argv[i], "--stats")) {
+			i++;
+			if (i >= argc || (argv[i][0] == '-' && argv[i][1])) {
+				cout << "Missing argument for --stats." << endl;
+				return EXIT_FAILURE;
+			}
+			stats.enable(argv[i]);
 		} else if (argv[i][0] == '-') {
 			usage(argv[0]);
 			cout << argv[0] << ": Invalid argument: " << argv[i] << "." << endl;
 			return EXIT_FAILURE;
 		} else {
-			if (!drive.length()) {
-				drive = argv[i];
-			} else {
-				usage(argv[0]);
-				cout << argv[0] << ": Too many arguments ("
-					 << argc << ")." << endl;
-				return EXIT_FAILURE;
-			}
+			drives.push_back(argv[i]);
 		}
 	}
 
+	if (drives.size() > 1 && !batch && !scan && !group) {
+		usage(argv[0]);
+		cout << argv[0] << ": Too many arguments ("
+			 << argc << ")." << endl;
+		return EXIT_FAILURE;
+	}
+	if (drives.size() && !batch)
+		drive = drives[0];
+
 	if (argc <= 1) {
 		usage(argv[0]);
 		return EXIT_SUCCESS;
 	}
+	dev.set_engine(engine);
+
+	if (pipe) {
+		gptgen_geometry geom = {0, block_size ? block_size : 512,
+								record_count, keepmbr, max_ebrs, make_guid,
+								&guids, gpt_alignment(overrides, block_size ?
+													  block_size : 512)};
+
+		if (drive.length() || write || direct || clone.length() || verify ||
+			verify_only || plan_file.length() || apply.length() || batch ||
+			scan || journal.length() || undo.length() || edits.size() ||
+			serve.length() || group) {
+			usage(argv[0]);
+			cout << argv[0] << ": -p (--pipe) takes no drive, and can't be "
+				 << "combined with -w, -d, --clone, --verify, --plan, "
+				 << "--apply, --journal, --undo, --edit, --batch, --scan, "
+				 << "--serve or --group." << endl;
+			return EXIT_FAILURE;
+		}
+		if (guids.mode == GUIDS_KEYED && !guids.id.length()) {
+			usage(argv[0]);
+			cout << argv[0] << ": The stream has no name to derive the GUIDs "
+				 << "from, --guid-key needs --guid-id here." << endl;
+			return EXIT_FAILURE;
+		}
+		stats.set_device("-");
+		return run_pipe(geom, bootnofail, backup, stats);
+	}
+
+	if (group) {
+		batch_options opt = {write, keepmbr, bootnofail, direct, verify, sync,
+							 record_count, block_size, max_ebrs, engine,
+							 guids.mode, {guids.key[0], guids.key[1]},
+							 overrides};
+
+		if (clone.length() || backup.length() || plan_file.length() ||
+			apply.length() || verify_only || (verify && !write) ||
+			undo.length() || edits.size() || batch || scan ||
+			serve.length()) {
+			usage(argv[0]);
+			cout << argv[0] << ": --group can't be combined with --clone, -b, "
+				 << "--plan, --apply, --verify-only, --undo, --edit, --batch, "
+				 << "--scan or --serve, and --verify needs -w." << endl;
+			return EXIT_FAILURE;
+		}
+		if (guids.id.length()) {
+			usage(argv[0]);
+			cout << argv[0] << ": --guid-id would give every member of the "
+				 << "group the same GUIDs." << endl;
+			return EXIT_FAILURE;
+		}
+		if (drives.size() < 2) {
+			usage(argv[0]);
+			cout << argv[0] << ": A group needs at least two drives." << endl;
+			return EXIT_FAILURE;
+		}
+		for (size_t i = 0; i < drives.size(); i++) {
+			if (find(drives.begin(), drives.begin() + i, drives[i]) !=
+				drives.begin() + i) {
+				usage(argv[0]);
+				cout << argv[0] << ": " << drives[i] << " is given twice."
+					 << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		stats.set_device("(group)");
+		return run_group(opt, drives, journal, stats);
+	}
+
+	if (serve.length()) {
+		batch_options opt = {false, keepmbr, bootnofail, direct, verify, sync,
+							 record_count, block_size, max_ebrs, engine,
+							 guids.mode, {guids.key[0], guids.key[1]},
+							 overrides};
+
+		if (drives.size() || write || clone.length() || backup.length() ||
+			plan_file.length() || apply.length() || verify_only || batch ||
+			scan || journal.length() || undo.length() || edits.size()) {
+			usage(argv[0]);
+			cout << argv[0] << ": --serve takes its drives from the requests, "
+				 << "and can't be combined with -w, --clone, -b, --plan, "
+				 << "--apply, --verify-only, --journal, --undo, --edit, "
+				 << "--batch or --scan." << endl;
+			return EXIT_FAILURE;
+		}
+		if (guids.id.length()) {
+			usage(argv[0]);
+			cout << argv[0] << ": --guid-id would give every drive served the "
+				 << "same GUIDs." << endl;
+			return EXIT_FAILURE;
+		}
+#ifdef WINDOWS_BUILD
+		cout << argv[0] << ": --serve needs Unix domain sockets, which this "
+			 << "build doesn't support." << endl;
+		return EXIT_FAILURE;
+#else
+		stats.set_device("(serve)");
+		return run_serve(serve, opt, jobs, stats);
+#endif
+	}
+
+	if (scan) {
+		if (write || clone.length() || backup.length() || plan_file.length() ||
+			apply.length() || verify || verify_only || journal.length() ||
+			undo.length() || edits.size()) {
+			usage(argv[0]);
+			cout << argv[0] << ": --scan only reads, and can't be combined "
+				 << "with -w, --clone, -b, --plan, --apply, --journal, --undo, "
+				 << "--edit or --verify." << endl;
+			return EXIT_FAILURE;
+		}
+		if (!drives.size() && list_block_devices(drives) < 0) {
+			usage(argv[0]);
+			cout << argv[0] << ": No drives specified, and the block devices "
+				 << "of this system can't be listed." << endl;
+			return EXIT_FAILURE;
+		}
+		if (!drives.size()) {
+			cout << "No block devices found." << endl;
+			return EXIT_FAILURE;
+		}
+		stats.set_device(drives.size() == 1 ? drives[0] : "(scan)");
+		return run_scan(drives, record_count, block_size, max_ebrs,
+						engine != ENGINE_POSIX, stats);
+	}
+
+	if (batch) {
+		batch_options opt = {write, keepmbr, bootnofail, direct, verify, sync,
+							 record_count, block_size, max_ebrs, engine,
+							 guids.mode, {guids.key[0], guids.key[1]},
+							 overrides};
+
+		if (clone.length() || backup.length() || plan_file.length() ||
+			apply.length() || verify_only || (verify && !write) ||
+			journal.length() || undo.length() || edits.size()) {
+			usage(argv[0]);
+			cout << argv[0] << ": --batch can't be combined with --clone, -b, "
+				 << "--plan, --apply, --journal, --undo, --edit or "
+				 << "--verify-only, and --verify needs -w." << endl;
+			return EXIT_FAILURE;
+		}
+		if (guids.id.length()) {
+			usage(argv[0]);
+			cout << argv[0] << ": --guid-id would give every drive of the "
+				 << "batch the same GUIDs." << endl;
+			return EXIT_FAILURE;
+		}
+		if (!drives.size()) {
+			usage(argv[0]);
+			cout << argv[0] << ": No drives specified." << endl;
+			return EXIT_FAILURE;
+		}
+		stats.set_device(drives.size() == 1 ? drives[0] : "(batch)");
+		return run_batch(opt, drives, jobs, stats);
+	}
 
 	if (!drive.length()) {
 		usage(argv[0]);
@@ -743,241 +6289,190 @@ int main(int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	block_size = get_block_size(drive);
-	if (!block_size) {
-		cout << "Unable to auto-determine the block size of the disk." << endl;
-		cout << "Please enter the block size by hand to continue." << endl
-			 << ">";
-		cin >> block_size;
+	if (undo.length()) {
+		if (write || clone.length() || backup.length() || plan_file.length() ||
+			apply.length() || journal.length() || verify || verify_only ||
+			edits.size()) {
+			usage(argv[0]);
+			cout << argv[0] << ": --undo only restores the journal, and can't "
+				 << "be combined with -w, --clone, -b, --plan, --apply, "
+				 << "--journal, --edit or --verify." << endl;
+			return EXIT_FAILURE;
+		}
+		stats.set_device(drive);
+		return run_undo(dev, drive, undo, direct, sync, stats);
 	}
 
-	// read and parse the MBR
-	if (read_tbl(drive, curr_ebr, block_size, (char *)curr) < 0) {
-		cout << "Block read failed, check permissions!" << endl;
+	// Editing writes to the disk as it is, so it takes no -w.
+	if (edits.size()) {
+		if (write || clone.length() || backup.length() || plan_file.length() ||
+			apply.length() || verify_only) {
+			usage(argv[0]);
+			cout << argv[0] << ": --edit changes the GPT already on the disk, "
+				 << "and can't be combined with -w, --clone, -b, --plan, "
+				 << "--apply or --verify-only." << endl;
+			return EXIT_FAILURE;
+		}
+		for (size_t i = 0; i < edits.size(); i++) {
+			if (!edits[i].set_type && !edits[i].set_flags &&
+				!edits[i].set_name) {
+				usage(argv[0]);
+				cout << argv[0] << ": --edit " << edits[i].index+1
+					 << " needs --type, --flags or --name after it." << endl;
+				return EXIT_FAILURE;
+			}
+		}
+		stats.set_device(drive);
+		return run_edit(dev, drive, edits, block_size, direct, sync, verify,
+						journal, stats);
+	}
+
+	if (journal.length() && !write && !clone.length() && !apply.length()) {
+		usage(argv[0]);
+		cout << argv[0] << ": --journal saves what -w, --clone, --apply or "
+			 << "--edit overwrite, and needs one of them." << endl;
 		return EXIT_FAILURE;
 	}
-	first_ebr = parse_tbl(curr, 0, 0);
-	curr_ebr = first_ebr;
 
-	// read and parse the EBR chain, if present
-	while (curr_ebr > 0) {
-		if (read_tbl(drive, curr_ebr, block_size, (char *)curr) < 0) {
-			cout << "Block read failed, check permissions!" << endl;
+	if (write && clone.length()) {
+		usage(argv[0]);
+		cout << argv[0] << ": --clone writes to the clone, and can't be "
+			 << "combined with -w." << endl;
+		return EXIT_FAILURE;
+	}
+
+	if (verify && !write && !clone.length() && !apply.length()) {
+		usage(argv[0]);
+		cout << argv[0] << ": --verify checks what -w, --clone or --apply "
+			 << "wrote; use --verify-only to check a disk as it is." << endl;
+		return EXIT_FAILURE;
+	}
+
+	if (plan_file.length() && (write || clone.length() || verify_only ||
+		apply.length())) {
+		usage(argv[0]);
+		cout << argv[0] << ": --plan only writes the plan, and can't be "
+			 << "combined with -w, --clone, --verify-only or --apply." << endl;
+		return EXIT_FAILURE;
+	}
+
+	if (apply.length()) {
+		if (clone.length() || verify_only || backup.length()) {
+			usage(argv[0]);
+			cout << argv[0] << ": --apply writes the plan as it is, and can't "
+				 << "be combined with --clone, --verify-only or -b." << endl;
 			return EXIT_FAILURE;
 		}
-		curr_ebr = parse_tbl(curr, curr_ebr, first_ebr);
-	};
+		stats.set_device(drive);
+		return run_apply(dev, drive, apply, direct, sync, verify, journal,
+						 stats);
+	}
+
+	// Verifying reads what reached the disk, not what the OS has cached.
+	if (verify_only) {
+		if (write || clone.length() || verify) {
+			usage(argv[0]);
+			cout << argv[0] << ": --verify-only doesn't convert, and can't be "
+				 << "combined with -w, --clone or --verify." << endl;
+			return EXIT_FAILURE;
+		}
+		direct = true;
+	}
+
+	stats.set_device(drive);
+	stats.phase("open");
+	if (dev.open(drive, write, direct) < 0) {
+		cout << "Unable to open " << drive << ", check permissions!" << endl;
+		return EXIT_FAILURE;
+	}
+
+	stats.phase("geometry");
+	if (!block_size)
+		block_size = dev.get_block_size();
+	if (!block_size) {
+		cout << "Unable to auto-determine the block size of the disk." << endl;
+		cout << "Please enter the block size by hand to continue." << endl
+			 << ">";
+		cin >> block_size;
+	}
+	dev.set_block_size(block_size);
 
-	disk_len = get_capacity(drive)/block_size;
+	table_len = gpt_table_len(record_count, block_size);
+
+	disk_len = dev.get_capacity()/block_size;
 	if (!disk_len) {
 		cout << "Unable to auto-determine the capacity of the disk." << endl;
 		cout << "Please enter the LBA capacity by hand to continue." << endl
 			 << ">";
 		cin >> disk_len;
 	}
+	dev.get_io_hints(hints);
+	override_hints(hints, overrides);
 
-	table_len = (int)ceil((double)(record_count * sizeof(gptpart)) /
-						  (double)block_size);
+	if (verify_only)
+		return run_verify(dev, drive, disk_len, record_count, NULL,
+						  block_size, stats);
 
-	if (parts.size() && parts[0].start < table_len+2) {
-		cout << "Not enough space at the beginning of the disk (need at least "
-			 << table_len+2 << " sectors before "
-			 << "the start of the first partition)."
-			 << endl << "Re-partition the disk to meet this requirement, and "
-			 << "run this utility again." << endl;
-		badlayout = true;
+	// Map the regions of a disk image that will be read or rewritten. Any of
+	// these may fail (e.g. if the image is shorter than disk_len), in which
+	// case those blocks simply go through the file handle instead.
+	stats.phase("map");
+	if (dev.is_image()) {
+		dev.map_region(0, table_len+2, true);
+		if (disk_len > table_len+1)
+			dev.map_region(disk_len-(table_len+1), table_len+1, true);
 	}
 
-	if (parts.size() &&
-		parts[parts.size()-1].start + parts[parts.size()-1].len >
-		disk_len - (table_len+2)) {
-		if (badlayout) cout << endl;
-		cout << "Not enough space at the end of the disk (need at least "
-			 << table_len+1 << " sectors after "
-			 << "the end of the last partition)."
-			 << endl << "Re-partition the disk to meet this requirement, and "
-			 << "run this utility again." << endl;
-		badlayout = true;
+	// read and parse the MBR and the EBR chain
+	stats.phase("ebr_walk");
+	EbrWalk walk(max_ebrs);
+	if (read_chain(dev, block_size, parts, sources, walk) < 0) {
+		cout << "Block read failed, check permissions!" << endl;
+		return EXIT_FAILURE;
+	}
+	if (walk.error()) {
+		print_chain_error(walk.error(), walk.failed_lba(), walk.limit());
+		return EXIT_FAILURE;
 	}
 
-	if (badlayout)
+	stats.phase("layout");
+	layout = check_layout(parts, disk_len, table_len, record_count);
+	print_layout_errors(layout, parts.size(), table_len, record_count);
+	if (layout)
 		return EXIT_FAILURE;
 
 	sort(parts.begin(), parts.end(), cmp);
 
 	for (unsigned int i = 0; i < parts.size(); i++) {
-		struct gptpart gptout;
-
 		cout << "Boot: " << parts[i].active << ", Type: 0x"
 			 << hex << (int)parts[i].type << dec
 			 << ", Start: sector " << parts[i].start
 			 << ", Length: " << parts[i].len << " sectors" << endl;
 		if (parts[i].active) boot = true;
-		{
-			__guid gtmp = NULL_GUID;
-			gptout.id = gtmp;
-		}
-		gptout.flags = 0;
-		switch (parts[i].type) {
-		case 0x11:
-		case 0x12: // Acer/Lenovo hidden recovery partition
-		case 0x14:
-		case 0x16:
-		case 0x17:
-		case 0x1B:
-		case 0x1C:
-		case 0x1E:
-		case 0xBB: // MS partition hidden by Acronis OS selector
-		case 0xBC: // Acronis Secure Zone, in fact hidden FAT32
-		case 0xFE:
-			gptout.flags |= cpu_to_le64(PART_FLAG_HIDDEN);
-			// fallthrough
-		case 0x01:
-		case 0x04:
-		case 0x06:
-		case 0x07:
-		case 0x0B:
-		case 0x0C:
-		case 0x0E:
-			{
-				__guid gtmp = MS_DATA_GUID;
-				gptout.type = gtmp;
-			}
-			break;
-		case 0x27: // Also Acer hidden recovery partition - close enough
-			{
-				__guid gtmp = MS_WINRE_GUID;
-				gptout.type = gtmp;
-			}
-			gptout.flags |= cpu_to_le64(PART_FLAG_HIDDEN);
-			break;
-		case 0x3C:
-			cout << "ERROR: PartitionMagic work partition (ID 0x3C) detected."
-				 << endl
-				 << "This is a sign of an interrupted PartitionMagic session."
-				 << endl
-				 << "Correct this error, and run this utility again." << endl;
-			return EXIT_FAILURE;
-		case 0x42:
-			cout << "FATAL: Dynamic disk detected. Support for dynamic disks is"
-				 << endl
-				 << "not yet implemented. Writing a GPT to a dynamic disk is"
-				 << endl
-				 << "dangerous. Operation aborted." << endl;
-			return EXIT_FAILURE;
-#if 0
-			/*
-			 * TODO: Find the metadata table at the end of the disk, and make it
-			 * into an MS_META_GUID partition. This will probably require moving
-			 * the metadata table to a different location on the disk. This may
-			 * well be beyond the scope of this tool, but patches are welcome.
-			 */
-			{
-				__guid gtmp = MS_DYN_GUID;
-				gptout.type = gtmp;
-			}
-#endif
-		case 0xC3:
-			gptout.flags |= cpu_to_le64(PART_FLAG_HIDDEN);
-			// fallthrough
-		case 0x82:
-			{
-				__guid gtmp = LINUX_SWAP_GUID;
-				gptout.type = gtmp;
-			}
-			break;
-		case 0x93:
-		case 0xC2:
-			gptout.flags |= cpu_to_le64(PART_FLAG_HIDDEN);
-			// fallthrough
-		case 0x81: // XXX not sure if this is correct...
-		case 0x83:
-			{
-				__guid gtmp = LINUX_DATA_GUID;
-				gptout.type = gtmp;
-			}
-			break;
-		case 0x86:
-		case 0xFD:
-			{
-				__guid gtmp = LINUX_RAID_GUID;
-				gptout.type = gtmp;
-			}
-			break;
-		case 0x8E:
-			{
-				__guid gtmp = LINUX_LVM_GUID;
-				gptout.type = gtmp;
-			}
-			break;
-		case 0xA8:
-			{
-				__guid gtmp = APPLE_UFS_GUID;
-				gptout.type = gtmp;
-			}
-			break;
-		case 0xAB:
-			{
-				__guid gtmp = APPLE_BOOT_GUID;
-				gptout.type = gtmp;
-			}
-			break;
-		case 0xAF:
-			{
-				__guid gtmp = APPLE_HFS_GUID;
-				gptout.type = gtmp;
-			}
-			break;
-		case 0xBE:
-			{
-				__guid gtmp = SUN_BOOT_GUID;
-				gptout.type = gtmp;
-			}
-			break;
-		case 0xBF:
-			{
-				__guid gtmp = SUN_ROOT_GUID;
-				gptout.type = gtmp;
-			}
-			break;
-		case 0xEE: // protective MBR
-			cout << "ERROR: This drive already has a GUID partition table."
-				 << endl
-				 << "There is no need to run this utility "
-				 << "on this drive again." << endl;
+		switch (lookup_type(parts[i].type).action) {
+		case TYPE_PMAGIC:
+		case TYPE_DYNAMIC:
+		case TYPE_GPT:
+			print_type_error(lookup_type(parts[i].type).action);
 			return EXIT_FAILURE;
-		case 0xEF:
-			{
-				__guid gtmp = EFI_SYS_GUID;
-				gptout.type = gtmp;
-			}
-			break;
-		default:
+		case TYPE_GENERIC:
 			cout << "WARNING: Unknown partition type in record " << i
 			<< " (0x" << hex << (int)parts[i].type << dec << ")." << endl;
 			cout << "A generic GUID will be used." << endl;
-			{
-				__guid gtmp = MBR2GUID(parts[i].type);
-				gptout.type = gtmp;
-			}
-		}
-		{
-			__guid gtmp = NULL_GUID;
-			gptout.id = gtmp;
+			break;
+		case TYPE_MAP:
+			break;
 		}
-		gptout.start = cpu_to_le64((uint64_t)le32_to_cpu(parts[i].start));
-		gptout.end = cpu_to_le64(((uint64_t)le32_to_cpu(parts[i].start) +
-								 (uint64_t)le32_to_cpu(parts[i].len) - 1));
-		memset(gptout.name, 0, 72);
-		memcpy(gptout.name, "B\0a\0s\0i\0c\0 \0d\0a\0t\0a\0 \0p\0a\0r\0t\0i\0t\0i\0o\0n\0", 40);
-		gptparts.push_back(gptout);
+		gptparts.push_back(make_gptpart(parts[i]));
 	}
+	print_alignment(parts, block_size, hints);
 
 	if (boot) {
 		cout << endl << "WARNING: Boot partition(s) found. This tool cannot "
 			 << "guarantee that" << endl << "such partitions will remain "
 			 << "bootable after conversion." << endl;
 		if (!bootnofail) {
+			stats.phase("prompt");
 			cout << "Do you want to continue? [Y/N] ";
 			cin >> yesno;
 			if (yesno != "y" && yesno != "Y")
@@ -985,76 +6480,50 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	cout << endl;
-
-	gpttable = (struct gptpart *)calloc(record_count, sizeof(gptpart));
-	/* Generate a complete partition array */
-	for (unsigned int i = 0; i < parts.size(); i++)
-		gpttable[i] = gptparts[i];
-	for (unsigned int i = parts.size(); i < record_count; i++)
-		gpttable[i] = empty_record;
-
-	int table_crc = crc32((unsigned char *)gpttable,
-						  sizeof(gptpart) * record_count);
+	// The GPT is built for the clone, if there is one, so keyed GUIDs are
+	// derived from its name rather than the original's.
+	if (guids.mode != GUIDS_ZERO) {
+		stats.phase("guids");
+		if (guids.mode == GUIDS_KEYED && !guids.id.length())
+			guids.id = disk_identity(clone.length() ? clone : drive);
+		bool ok = !guid_for(guids, 0, &disk_guid);
+		for (size_t i = 0; ok && i < gptparts.size(); i++)
+			ok = !guid_for(guids, (uint32_t)i+1, &gptparts[i].id);
+		if (!ok) {
+			cout << "Unable to get random bytes for the GUIDs from the OS."
+				 << endl;
+			return EXIT_FAILURE;
+		}
+		cout << "Disk GUID: " << format_guid(disk_guid) << endl;
+	}
 
-	struct gpthdr hdr1 = {
-		GPT_MAGIC,
-		GPT_V1,
-		cpu_to_le32(92),
-		0,
-		0,
-		cpu_to_le64(1ULL),
-		cpu_to_le64(disk_len-1),
-		cpu_to_le64(table_len+2ULL),
-		cpu_to_le64(disk_len-(table_len+2)),
-		NULL_GUID,
-		cpu_to_le64(2ULL),
-		cpu_to_le32(record_count),
-		cpu_to_le32(sizeof(gptpart)),
-		static_cast<uint32_t>(table_crc)
-	};
+	// Keep the GPT's own structures off the partitions' physical blocks.
+	plan_area(parts, disk_len, table_len, gpt_alignment(hints, block_size),
+			  &area);
+	if (gpt_alignment(hints, block_size) > 1) {
+		cout << "Usable area: LBA " << area.data_start << " to "
+			 << area.data_end << " (aligned to " << hints.physical
+			 << " bytes where the partitions allow)." << endl;
+	}
 
-	struct gpthdr hdr2 = {
-		GPT_MAGIC,
-		GPT_V1,
-		cpu_to_le32(92),
-		0,
-		0,
-		cpu_to_le64(disk_len-1),
-		cpu_to_le64(1ULL),
-		cpu_to_le64(table_len+2ULL),
-		cpu_to_le64(disk_len-(table_len+2)),
-		NULL_GUID,
-		cpu_to_le64(disk_len-(table_len+1)),
-		cpu_to_le32(record_count),
-		cpu_to_le32(sizeof(gptpart)),
-		static_cast<uint32_t>(table_crc)
-	};
+	cout << endl;
 
-	hdr1.hdrsum = cpu_to_le32(crc32((unsigned char *)&hdr1, 92));
-	hdr2.hdrsum = cpu_to_le32(crc32((unsigned char *)&hdr2, 92));
+	stats.phase("crc"); // the partition entry array and its CRC32
+	PartitionArray table(gptparts, record_count, block_size);
 
-	struct mbrpart prot_mbr = {
-		0,
-		0,
-		2,
-		0,
-		0xEE,
-		0xFF,
-		0xFF,
-		0xFF,
-		1,
-		static_cast<uint32_t>((disk_len-1 < 0xFFFFFFFF) ? disk_len-1 : 0xFFFFFFFF)
-	};
+	if (!table.ok()) {
+		cout << "Out of memory!" << endl;
+		return EXIT_FAILURE;
+	}
 
 	if (backup != "") {
+		stats.phase("backup");
 		cout << "Backing up original MBR to file " << backup << "..." << endl;
 
 		char *bakbuf = (char *)malloc(block_size);
 
-		if (read_block(drive, 0, block_size, bakbuf) < 0) {
+		if (dev.read_block(0, bakbuf) < 0) {
 			cout << "Block read failed!" << endl;
-			free(gpttable);
 			free(bakbuf);
 			return EXIT_FAILURE;
 		}
@@ -1065,110 +6534,151 @@ int main(int argc, char *argv[])
 		free(bakbuf);
 	}
 
-	if (write) { // FIXME Write-to-disk could be improved...
+	// grab the MBR loader code to put into the protective MBR
+	stats.phase("assemble");
+	if (!keepmbr && read_mbr(dev, 0, block_size, mbr) < 0) {
+		cout << "Block read failed!" << endl;
+		return EXIT_FAILURE;
+	}
+
+	AlignedBuffer headbuf(2*block_size, io_align(block_size));
+	AlignedBuffer tailbuf(block_size, io_align(block_size));
+	WritePlan plan;
+
+	if (!headbuf.get() || !tailbuf.get()) {
+		cout << "Out of memory!" << endl;
+		return EXIT_FAILURE;
+	}
+	build_gpt(table, mbr, keepmbr, disk_len, record_count, block_size,
+			  disk_guid, &area, headbuf.get(), tailbuf.get(), plan);
+
+	const plan_extent &primary = plan.extents()[0];
+	const plan_extent &secondary = plan.extents()[1];
+
+	// Clone the image only now that the conversion is known to succeed, and
+	// carry on writing to the clone instead of the original.
+	if (clone.length()) {
+		stats.phase("clone");
+		cout << "Cloning " << drive << " to " << clone << "..." << endl;
+		dev.close();
+		switch (clone_image(drive, clone)) {
+		case CLONE_REFLINK:
+			cout << "Created a reflink, no data was copied." << endl;
+			break;
+		case CLONE_COPY:
+			cout << "Reflinks not supported, copied the data extents." << endl;
+			break;
+		default:
+			cout << "Unable to clone " << drive << " to " << clone
+				 << " (the original must be a disk image, and the clone "
+				 << "a different file)!" << endl;
+			return EXIT_FAILURE;
+		}
+		if (dev.open(clone, true, direct) < 0) {
+			cout << "Unable to open " << clone << ", check permissions!"
+				 << endl;
+			return EXIT_FAILURE;
+		}
+		write = true;
+	}
+
+	if (journal.length()) {
+		stats.phase("journal");
+		cout << "Saving an undo journal to " << journal << "..." << endl;
+		if (save_journal(journal, dev, disk_len, block_size, plan) < 0) {
+			cout << "Failed to write " << journal << "!" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	stats.phase("write");
+	if (write) {
 		cout << "Writing primary GPT ";
 		if (!keepmbr) cout << "and protective MBR ";
 		cout << "to LBA address " << (keepmbr ? "1" : "0") << "..." << endl;
+		if (dev.write_extent(primary) < 0) {
+			cout << "Failed to write primary GPT!" << endl;
+			return EXIT_FAILURE;
+		}
+
+		cout << "Writing secondary GPT to LBA address "
+			 << secondary.lba << "..." << endl;
+		if (dev.write_extent(secondary) < 0) {
+			cout << "Failed to write secondary GPT!" << endl;
+			return EXIT_FAILURE;
+		}
+
+		stats.phase("flush");
+		if (dev.flush(sync) < 0) {
+			cout << "Failed to flush GPT to disk!" << endl;
+			return EXIT_FAILURE;
+		}
+		cout << "Success!" << endl;
 
-		char *outbuf = (char *)malloc(block_size*(table_len+2));
-		memset((char *)outbuf, 0, block_size*(table_len+2));
+		if (verify) {
+			string target = clone.length() ? clone : drive;
 
-		if (!keepmbr) {
-			// grab the MBR loader code and put it into the protective MBR
-			if (read_mbr(drive, 0, block_size, outbuf) < 0) {
-				cout << "Block read failed!" << endl;
-				free(gpttable);
-				free(outbuf);
-				return EXIT_FAILURE;
-			}
-			memcpy((char *)outbuf+446, (char *)&prot_mbr,
-					sizeof(struct mbrpart));
-			outbuf[510] = 0x55;
-			outbuf[511] = 0xAA;
-			memcpy((char *)outbuf+block_size, (char *)&hdr1,
-					sizeof(struct gpthdr));
-			memset((char *)outbuf+block_size+92, 0, block_size-92);
-			memcpy((char *)outbuf+(block_size*2), (char *)gpttable,
-					record_count*sizeof(gptpart));
-			if (write_data(drive, 0, block_size, outbuf, table_len+2) < 0) {
-				cout << "Failed to write primary GPT!" << endl;
-				free(gpttable);
-				free(outbuf);
+			dev.close();
+			if (dev.open(target, false, true) < 0) {
+				cout << "Unable to reopen " << target << " to verify it!"
+					 << endl;
 				return EXIT_FAILURE;
 			}
-		} else {
-			memcpy((char *)outbuf, (char *)&hdr1, sizeof(struct gpthdr));
-			memset((char *)outbuf+92, 0, block_size-92);
-			memcpy((char *)outbuf+block_size, (char *)gpttable,
-					record_count*sizeof(gptpart));
-			if (write_data(drive, 1, block_size, outbuf, table_len+1) < 0) {
-				cout << "Failed to write primary GPT!" << endl;
-				free(gpttable);
-				free(outbuf);
+			dev.set_block_size(block_size);
+			if (run_verify(dev, target, disk_len, record_count, &plan,
+						   block_size, stats) != EXIT_SUCCESS)
 				return EXIT_FAILURE;
-			}
 		}
-
-		cout << "Writing secondary GPT to LBA address "
-			 << disk_len-(table_len+1) << "..." << endl;
-		memset((char *)outbuf, 0, block_size*(table_len+2));
-		memcpy((char *)outbuf, (char *)gpttable, record_count*sizeof(gptpart));
-		memcpy((char *)outbuf+record_count*sizeof(gptpart), (char *)&hdr2,
-				sizeof(struct gpthdr));
-		memset((char *)outbuf+record_count*sizeof(gptpart)+92, 0,
-				block_size-92);
-		if (write_data(drive, disk_len-(table_len+1), block_size,
-				(char *)outbuf, table_len+1) < 0) {
-			cout << "Failed to write secondary GPT!" << endl;
-			free(gpttable);
-			free(outbuf);
+		print_io_stats(dev);
+	} else if (plan_file.length()) {
+		cout << "Writing the conversion plan to " << plan_file << "..."
+			 << endl;
+		if (save_plan(plan_file, dev, sources, disk_len, record_count,
+					  block_size, plan) < 0) {
+			cout << "Failed to write " << plan_file << "!" << endl;
 			return EXIT_FAILURE;
 		}
-		free(outbuf);
 		cout << "Success!" << endl;
+		cout << "Run " << argv[0] << " --apply " << plan_file << " " << drive
+			 << " to write the GPT." << endl;
+		print_io_stats(dev);
 	} else {
 		cout << "Writing primary GPT ";
 		if (!keepmbr) cout << "and protective MBR ";
 		cout << "to primary.img..." << endl;
-
-		fout.open("primary.img", ios_base::binary);
-		if (!keepmbr) {
-			char mbrbuf[446];
-
-			// grab the MBR loader code and put it into the protective MBR
-			if (read_mbr(drive, 0, block_size, mbrbuf) < 0) {
-				cout << "Block read failed!" << endl;
-				free(gpttable);
-				return EXIT_FAILURE;
-			}
-			fout.write(mbrbuf, 446);
-			fout.write((char *)&prot_mbr, sizeof(struct mbrpart));
-			for (int i = 0; i < 48; i++)
-				fout << '\0';
-			fout << (char)0x55 << (char)0xAA;
-			for (unsigned int i = 512; i < block_size; i++)
-				fout << '\0';
-		}
-		fout.write((char *)&hdr1, sizeof(struct gpthdr));
-		for (unsigned int i = 92; i < block_size; i++)
-			fout << '\0';
-		fout.write((char *)gpttable, record_count*sizeof(gptpart));
-		fout.close();
+		if (write_plan_file("primary.img", primary) < 0) {
+			cout << "Failed to write primary.img!" << endl;
+			return EXIT_FAILURE;
+		}
 
 		cout << "Writing secondary GPT to secondary.img..." << endl;
-		fout.open("secondary.img", ios_base::binary);
-		fout.write((char *)gpttable, record_count*sizeof(gptpart));
-		fout.write((char *)&hdr2, sizeof(struct gpthdr));
-		for (unsigned int i = 92; i < block_size; i++)
-			fout << '\0';
-		fout.close();
+		if (write_plan_file("secondary.img", secondary) < 0) {
+			cout << "Failed to write secondary.img!" << endl;
+			return EXIT_FAILURE;
+		}
 
 		cout << "Success!" << endl;
 		cout << "Write primary.img to LBA address "
 			 << (keepmbr ? "1." : "0.") << endl;
-		cout << "Write secondary.img to LBA address " << disk_len-(table_len+1)
-			 << "." << endl;
+		cout << "Write secondary.img to LBA address " << secondary.lba << "."
+			 << endl;
+		print_io_stats(dev);
 	}
-	free(gpttable);
 	return EXIT_SUCCESS;
 }
+
+/******************************************************************************\
+* main: convert the disk, then write out the statistics if asked to            *
+\******************************************************************************/
+int main(int argc, char *argv[])
+{
+	BlockDevice dev;
+	RunStats stats;
+	int ret = convert_disk(argc, argv, dev, stats);
+
+	if (stats.enabled() && stats.write(ret, dev.stats()) < 0) {
+		cout << "Failed to write the statistics!" << endl;
+		return EXIT_FAILURE;
+	}
+	return ret;
+}
@@ -0,0 +1,102 @@
+/******************************************************************************\
+* gptgen_serve                                                                 *
+* The protocol spoken over the Unix domain socket of gptgen --serve.           *
+*                                                                              *
+* Permission to use, copy, modify, and/or distribute this software for any     *
+* purpose with or without fee is hereby granted, provided that the above       *
+* copyright notice and this permission notice appear in all copies.            *
+*                                                                              *
+* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES     *
+* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF             *
+* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR      *
+* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES       *
+* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN        *
+* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF      *
+* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.               *
+\******************************************************************************/
+
+#ifndef GPTGEN_SERVE_H
+#define GPTGEN_SERVE_H
+
+#include <stdint.h>
+
+// Both ends of the socket are on the same machine, so every field is in host
+// byte order.
+
+// Marker at the start of every message, in both directions.
+#define SERVE_MAGIC {'G', 'P', 'T', 'G', 'E', 'N', 'S', '1'}
+
+// Largest payload of a message, in bytes.
+#define SERVE_MSG_MAX (64*1024)
+
+/******************************************************************************\
+* serve_msg_type: the kinds of message                                         *
+* A client sends requests, one at a time, on as many connections as it likes.  *
+* The daemon answers each request with any number of progress messages and     *
+* then exactly one result, before it reads the next request.                   *
+\******************************************************************************/
+enum serve_msg_type {
+	SERVE_REQUEST = 1, // client: a serve_request, the device, then the file
+	SERVE_PROGRESS = 2, // daemon: a JSON object, one event of the job
+	SERVE_RESULT = 3 // daemon: a JSON object, the outcome of the job
+};
+
+/******************************************************************************\
+* serve_status: outcome of a job, in the header of its SERVE_RESULT            *
+\******************************************************************************/
+enum serve_status {
+	SERVE_OK = 0, // done (or, for SERVE_SCAN, the disk can be converted)
+	SERVE_SKIPPED = 1, // left alone, e.g. boot partitions without SERVE_BOOT
+	SERVE_FAILED = 2 // an error, or a malformed request
+};
+
+/******************************************************************************\
+* serve_msg: header of every message, followed by len bytes of payload         *
+\******************************************************************************/
+struct serve_msg {
+	char magic[8]; // SERVE_MAGIC
+	uint32_t type; // serve_msg_type
+	uint32_t status; // serve_status of a SERVE_RESULT, 0 otherwise
+	uint32_t len; // at most SERVE_MSG_MAX
+	uint32_t reserved; // 0
+};
+
+/******************************************************************************\
+* serve_op: what a request asks for                                            *
+* A scan reports boot partitions in the reason of its result, as --scan does,  *
+* rather than skipping the disk like the other requests do without SERVE_BOOT. *
+\******************************************************************************/
+enum serve_op {
+	SERVE_SCAN = 1, // check whether the disk can be converted, read only
+	SERVE_PLAN = 2, // save what a conversion would write to the file
+	SERVE_CONVERT = 3, // convert the disk
+	SERVE_VERIFY = 4 // check the GPT already on the disk
+};
+
+/******************************************************************************\
+* serve_flags: options of a request, as on the command line                    *
+\******************************************************************************/
+enum serve_flags {
+	SERVE_KEEPMBR = 1, // -m
+	SERVE_BOOT = 2, // -k: convert disks with boot partitions
+	SERVE_CHECK = 4, // --verify: read a conversion back and check it
+	SERVE_DIRECT = 8 // -d
+};
+
+/******************************************************************************\
+* serve_request: payload of a SERVE_REQUEST                                    *
+* The device path (path_len bytes) and the file (file_len bytes, the plan to   *
+* save for SERVE_PLAN, empty otherwise) follow, neither NUL-terminated.        *
+\******************************************************************************/
+struct serve_request {
+	uint32_t op; // serve_op
+	uint32_t flags; // serve_flags
+	uint32_t record_count; // entries of the GPT, 0 for the daemon's -c
+	uint32_t block_size; // 0 for the daemon's --block-size (or the device's)
+	uint32_t max_ebrs; // 0 for the daemon's --max-ebrs
+	uint32_t path_len;
+	uint32_t file_len;
+	uint32_t reserved; // 0
+};
+
+#endif // GPTGEN_SERVE_H
@@ -0,0 +1,1757 @@
+/******************************************************************************\
+* libgptgen                                                                    *
+* Reentrant library for converting MBR/MSDOS partition tables                  *
+* to GUID Partition Table.                                                     *
+*                                                                              *
+* Copyright (c) 2009-2012, Gabor A. Stefanik <netrolller.3d@gmail.com>         *
+*                                                                              *
+* Permission to use, copy, modify, and/or distribute this software for any     *
+* purpose with or without fee is hereby granted, provided that the above       *
+* copyright notice and this permission notice appear in all copies.            *
+*                                                                              *
+* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES     *
+* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF             *
+* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR      *
+* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES       *
+* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN        *
+* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF      *
+* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.               *
+\******************************************************************************/
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#ifdef WINDOWS_BUILD
+#include <malloc.h>
+#endif
+
+#include "libgptgen_internal.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define HAVE_PCLMUL
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define ATTRIBUTE_TARGET(x) __attribute__((target(x)))
+#else
+#define ATTRIBUTE_TARGET(x)
+#endif
+
+using namespace std;
+
+/******************************************************************************\
+* map_type: map an MBR partition type to its GPT equivalent                    *
+* type: the MBR partition type ID                                              *
+* Only used at compile time, to generate type_table.                           *
+\******************************************************************************/
+constexpr type_map map_type(unsigned char type)
+{
+	switch (type) {
+	case 0x11:
+	case 0x12: // Acer/Lenovo hidden recovery partition
+	case 0x14:
+	case 0x16:
+	case 0x17:
+	case 0x1B:
+	case 0x1C:
+	case 0x1E:
+	case 0xBB: // MS partition hidden by Acronis OS selector
+	case 0xBC: // Acronis Secure Zone, in fact hidden FAT32
+	case 0xFE:
+		return {MS_DATA_GUID, cpu_to_le64(PART_FLAG_HIDDEN), TYPE_MAP};
+	case 0x01:
+	case 0x04:
+	case 0x06:
+	case 0x07:
+	case 0x0B:
+	case 0x0C:
+	case 0x0E:
+		return {MS_DATA_GUID, 0, TYPE_MAP};
+	case 0x27: // Also Acer hidden recovery partition - close enough
+		return {MS_WINRE_GUID, cpu_to_le64(PART_FLAG_HIDDEN), TYPE_MAP};
+	case 0x3C:
+		return {NULL_GUID, 0, TYPE_PMAGIC};
+	case 0x42:
+		/*
+		 * TODO: Find the metadata table at the end of the disk, and make it
+		 * into an MS_META_GUID partition (and the rest MS_DYN_GUID). This will
+		 * probably require moving the metadata table to a different location
+		 * on the disk. This may well be beyond the scope of this tool, but
+		 * patches are welcome.
+		 */
+		return {NULL_GUID, 0, TYPE_DYNAMIC};
+	case 0xC3:
+		return {LINUX_SWAP_GUID, cpu_to_le64(PART_FLAG_HIDDEN), TYPE_MAP};
+	case 0x82:
+		return {LINUX_SWAP_GUID, 0, TYPE_MAP};
+	case 0x93:
+	case 0xC2:
+		return {LINUX_DATA_GUID, cpu_to_le64(PART_FLAG_HIDDEN), TYPE_MAP};
+	case 0x81: // XXX not sure if this is correct...
+	case 0x83:
+		return {LINUX_DATA_GUID, 0, TYPE_MAP};
+	case 0x86:
+	case 0xFD:
+		return {LINUX_RAID_GUID, 0, TYPE_MAP};
+	case 0x8E:
+		return {LINUX_LVM_GUID, 0, TYPE_MAP};
+	case 0xA8:
+		return {APPLE_UFS_GUID, 0, TYPE_MAP};
+	case 0xAB:
+		return {APPLE_BOOT_GUID, 0, TYPE_MAP};
+	case 0xAF:
+		return {APPLE_HFS_GUID, 0, TYPE_MAP};
+	case 0xBE:
+		return {SUN_BOOT_GUID, 0, TYPE_MAP};
+	case 0xBF:
+		return {SUN_ROOT_GUID, 0, TYPE_MAP};
+	case 0xEE: // protective MBR
+		return {NULL_GUID, 0, TYPE_GPT};
+	case 0xEF:
+		return {EFI_SYS_GUID, 0, TYPE_MAP};
+	default:
+		return {MBR2GUID(type), 0, TYPE_GENERIC};
+	}
+}
+
+struct type_table_t {
+	type_map entry[256];
+};
+
+template <size_t... I>
+constexpr type_table_t make_type_table(index_sequence<I...>)
+{
+	return {{map_type((unsigned char)I)...}};
+}
+
+// MBR partition type ID -> GPT type GUID, flags and action
+static constexpr type_table_t type_table =
+	make_type_table(make_index_sequence<256>());
+
+constexpr bool guid_eq(const __guid &a, const __guid &b)
+{
+	return a.data1 == b.data1 && a.data2 == b.data2 &&
+		   a.data3 == b.data3 && a.data4 == b.data4;
+}
+
+/******************************************************************************\
+* type_table_ok: compile-time consistency check of type_table                  *
+* Every type that gets converted needs a real GUID, only known types may skip  *
+* the generic GUID, and only the aborting types may lack a GUID.               *
+\******************************************************************************/
+constexpr bool type_table_ok()
+{
+	const __guid null_guid = NULL_GUID;
+
+	for (int i = 0; i < 256; i++) {
+		const type_map &m = type_table.entry[i];
+		const __guid generic = MBR2GUID(i);
+
+		if ((m.action == TYPE_MAP || m.action == TYPE_GENERIC) &&
+			guid_eq(m.type, null_guid))
+			return false;
+		if ((m.action == TYPE_GENERIC) != guid_eq(m.type, generic))
+			return false;
+		if (m.flags & ~cpu_to_le64(PART_FLAG_HIDDEN))
+			return false;
+	}
+	return true;
+}
+
+static_assert(type_table_ok(), "inconsistent MBR type table");
+static_assert(guid_eq(type_table.entry[0x07].type, MS_DATA_GUID) &&
+			  !type_table.entry[0x07].flags, "0x07 must map to MS data");
+static_assert(guid_eq(type_table.entry[0x27].type, MS_WINRE_GUID) &&
+			  type_table.entry[0x27].flags == cpu_to_le64(PART_FLAG_HIDDEN),
+			  "0x27 must map to a hidden WinRE partition");
+static_assert(guid_eq(type_table.entry[0xAF].type, APPLE_HFS_GUID),
+			  "0xAF must map to HFS(+)");
+static_assert(type_table.entry[0xEE].action == TYPE_GPT &&
+			  type_table.entry[0x42].action == TYPE_DYNAMIC &&
+			  type_table.entry[0x3C].action == TYPE_PMAGIC,
+			  "0xEE, 0x42 and 0x3C must abort the conversion");
+
+/******************************************************************************\
+* lookup_type: look up the GPT equivalent of an MBR partition type             *
+* type: the MBR partition type ID                                              *
+\******************************************************************************/
+const type_map &lookup_type(unsigned char type)
+{
+	return type_table.entry[type];
+}
+
+// table for CRC32 calculation, polynomial 0x04C11DB7
+static uint32_t crc32_tbl[256] = {
+	0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
+	0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
+	0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
+	0x90bf1d91L, 0x1db71064L, 0x6ab020f2L, 0xf3b97148L, 0x84be41deL,
+	0x1adad47dL, 0x6ddde4ebL, 0xf4d4b551L, 0x83d385c7L, 0x136c9856L,
+	0x646ba8c0L, 0xfd62f97aL, 0x8a65c9ecL, 0x14015c4fL, 0x63066cd9L,
+	0xfa0f3d63L, 0x8d080df5L, 0x3b6e20c8L, 0x4c69105eL, 0xd56041e4L,
+	0xa2677172L, 0x3c03e4d1L, 0x4b04d447L, 0xd20d85fdL, 0xa50ab56bL,
+	0x35b5a8faL, 0x42b2986cL, 0xdbbbc9d6L, 0xacbcf940L, 0x32d86ce3L,
+	0x45df5c75L, 0xdcd60dcfL, 0xabd13d59L, 0x26d930acL, 0x51de003aL,
+	0xc8d75180L, 0xbfd06116L, 0x21b4f4b5L, 0x56b3c423L, 0xcfba9599L,
+	0xb8bda50fL, 0x2802b89eL, 0x5f058808L, 0xc60cd9b2L, 0xb10be924L,
+	0x2f6f7c87L, 0x58684c11L, 0xc1611dabL, 0xb6662d3dL, 0x76dc4190L,
+	0x01db7106L, 0x98d220bcL, 0xefd5102aL, 0x71b18589L, 0x06b6b51fL,
+	0x9fbfe4a5L, 0xe8b8d433L, 0x7807c9a2L, 0x0f00f934L, 0x9609a88eL,
+	0xe10e9818L, 0x7f6a0dbbL, 0x086d3d2dL, 0x91646c97L, 0xe6635c01L,
+	0x6b6b51f4L, 0x1c6c6162L, 0x856530d8L, 0xf262004eL, 0x6c0695edL,
+	0x1b01a57bL, 0x8208f4c1L, 0xf50fc457L, 0x65b0d9c6L, 0x12b7e950L,
+	0x8bbeb8eaL, 0xfcb9887cL, 0x62dd1ddfL, 0x15da2d49L, 0x8cd37cf3L,
+	0xfbd44c65L, 0x4db26158L, 0x3ab551ceL, 0xa3bc0074L, 0xd4bb30e2L,
+	0x4adfa541L, 0x3dd895d7L, 0xa4d1c46dL, 0xd3d6f4fbL, 0x4369e96aL,
+	0x346ed9fcL, 0xad678846L, 0xda60b8d0L, 0x44042d73L, 0x33031de5L,
+	0xaa0a4c5fL, 0xdd0d7cc9L, 0x5005713cL, 0x270241aaL, 0xbe0b1010L,
+	0xc90c2086L, 0x5768b525L, 0x206f85b3L, 0xb966d409L, 0xce61e49fL,
+	0x5edef90eL, 0x29d9c998L, 0xb0d09822L, 0xc7d7a8b4L, 0x59b33d17L,
+	0x2eb40d81L, 0xb7bd5c3bL, 0xc0ba6cadL, 0xedb88320L, 0x9abfb3b6L,
+	0x03b6e20cL, 0x74b1d29aL, 0xead54739L, 0x9dd277afL, 0x04db2615L,
+	0x73dc1683L, 0xe3630b12L, 0x94643b84L, 0x0d6d6a3eL, 0x7a6a5aa8L,
+	0xe40ecf0bL, 0x9309ff9dL, 0x0a00ae27L, 0x7d079eb1L, 0xf00f9344L,
+	0x8708a3d2L, 0x1e01f268L, 0x6906c2feL, 0xf762575dL, 0x806567cbL,
+	0x196c3671L, 0x6e6b06e7L, 0xfed41b76L, 0x89d32be0L, 0x10da7a5aL,
+	0x67dd4accL, 0xf9b9df6fL, 0x8ebeeff9L, 0x17b7be43L, 0x60b08ed5L,
+	0xd6d6a3e8L, 0xa1d1937eL, 0x38d8c2c4L, 0x4fdff252L, 0xd1bb67f1L,
+	0xa6bc5767L, 0x3fb506ddL, 0x48b2364bL, 0xd80d2bdaL, 0xaf0a1b4cL,
+	0x36034af6L, 0x41047a60L, 0xdf60efc3L, 0xa867df55L, 0x316e8eefL,
+	0x4669be79L, 0xcb61b38cL, 0xbc66831aL, 0x256fd2a0L, 0x5268e236L,
+	0xcc0c7795L, 0xbb0b4703L, 0x220216b9L, 0x5505262fL, 0xc5ba3bbeL,
+	0xb2bd0b28L, 0x2bb45a92L, 0x5cb36a04L, 0xc2d7ffa7L, 0xb5d0cf31L,
+	0x2cd99e8bL, 0x5bdeae1dL, 0x9b64c2b0L, 0xec63f226L, 0x756aa39cL,
+	0x026d930aL, 0x9c0906a9L, 0xeb0e363fL, 0x72076785L, 0x05005713L,
+	0x95bf4a82L, 0xe2b87a14L, 0x7bb12baeL, 0x0cb61b38L, 0x92d28e9bL,
+	0xe5d5be0dL, 0x7cdcefb7L, 0x0bdbdf21L, 0x86d3d2d4L, 0xf1d4e242L,
+	0x68ddb3f8L, 0x1fda836eL, 0x81be16cdL, 0xf6b9265bL, 0x6fb077e1L,
+	0x18b74777L, 0x88085ae6L, 0xff0f6a70L, 0x66063bcaL, 0x11010b5cL,
+	0x8f659effL, 0xf862ae69L, 0x616bffd3L, 0x166ccf45L, 0xa00ae278L,
+	0xd70dd2eeL, 0x4e048354L, 0x3903b3c2L, 0xa7672661L, 0xd06016f7L,
+	0x4969474dL, 0x3e6e77dbL, 0xaed16a4aL, 0xd9d65adcL, 0x40df0b66L,
+	0x37d83bf0L, 0xa9bcae53L, 0xdebb9ec5L, 0x47b2cf7fL, 0x30b5ffe9L,
+	0xbdbdf21cL, 0xcabac28aL, 0x53b39330L, 0x24b4a3a6L, 0xbad03605L,
+	0xcdd70693L, 0x54de5729L, 0x23d967bfL, 0xb3667a2eL, 0xc4614ab8L,
+	0x5d681b02L, 0x2a6f2b94L, 0xb40bbe37L, 0xc30c8ea1L, 0x5a05df1bL,
+	0x2d02ef8dL
+};
+
+// tables for slicing-by-8/16 CRC32 calculation, generated by crc32_select()
+static uint32_t crc32_slice[16][256];
+
+/******************************************************************************\
+* load32: read a little-endian 32-bit word from an unaligned buffer            *
+\******************************************************************************/
+inline uint32_t load32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+		   ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/******************************************************************************\
+* crc32_ref_update: byte-at-a-time CRC32, the reference implementation         *
+* crc: running CRC value (not inverted)                                        *
+* buf: buffer holding the data to be CRCed                                     *
+* len: length of the data                                                      *
+\******************************************************************************/
+static uint32_t crc32_ref_update(uint32_t crc, const unsigned char *buf,
+								 size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		crc = crc32_tbl[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+/******************************************************************************\
+* crc32_slice8_update: slicing-by-8 CRC32, 8 bytes per iteration               *
+\******************************************************************************/
+static uint32_t crc32_slice8_update(uint32_t crc, const unsigned char *buf,
+									size_t len)
+{
+	while (len >= 8) {
+		uint32_t one = load32(buf) ^ crc;
+		uint32_t two = load32(buf+4);
+
+		crc = crc32_slice[7][one & 0xff] ^
+			  crc32_slice[6][(one >> 8) & 0xff] ^
+			  crc32_slice[5][(one >> 16) & 0xff] ^
+			  crc32_slice[4][one >> 24] ^
+			  crc32_slice[3][two & 0xff] ^
+			  crc32_slice[2][(two >> 8) & 0xff] ^
+			  crc32_slice[1][(two >> 16) & 0xff] ^
+			  crc32_slice[0][two >> 24];
+		buf += 8;
+		len -= 8;
+	}
+	return crc32_ref_update(crc, buf, len);
+}
+
+/******************************************************************************\
+* crc32_slice16_update: slicing-by-16 CRC32, 16 bytes per iteration            *
+\******************************************************************************/
+static uint32_t crc32_slice16_update(uint32_t crc, const unsigned char *buf,
+									 size_t len)
+{
+	while (len >= 16) {
+		uint32_t one = load32(buf) ^ crc;
+		uint32_t two = load32(buf+4);
+		uint32_t three = load32(buf+8);
+		uint32_t four = load32(buf+12);
+
+		crc = crc32_slice[15][one & 0xff] ^
+			  crc32_slice[14][(one >> 8) & 0xff] ^
+			  crc32_slice[13][(one >> 16) & 0xff] ^
+			  crc32_slice[12][one >> 24] ^
+			  crc32_slice[11][two & 0xff] ^
+			  crc32_slice[10][(two >> 8) & 0xff] ^
+			  crc32_slice[9][(two >> 16) & 0xff] ^
+			  crc32_slice[8][two >> 24] ^
+			  crc32_slice[7][three & 0xff] ^
+			  crc32_slice[6][(three >> 8) & 0xff] ^
+			  crc32_slice[5][(three >> 16) & 0xff] ^
+			  crc32_slice[4][three >> 24] ^
+			  crc32_slice[3][four & 0xff] ^
+			  crc32_slice[2][(four >> 8) & 0xff] ^
+			  crc32_slice[1][(four >> 16) & 0xff] ^
+			  crc32_slice[0][four >> 24];
+		buf += 16;
+		len -= 16;
+	}
+	return crc32_slice8_update(crc, buf, len);
+}
+
+static bool crc32_always_supported()
+{
+	return true;
+}
+
+#ifdef HAVE_PCLMUL
+/******************************************************************************\
+* crc32_pclmul_fold: fold a buffer into a CRC32 with carry-less multiplication *
+* crc: running CRC value (not inverted)                                        *
+* buf: buffer holding the data to be CRCed                                     *
+* len: length of the data, at least 64 and a multiple of 16                    *
+* This is the algorithm from Intel's "Fast CRC Computation for Generic         *
+* Polynomials Using PCLMULQDQ Instruction" white paper, with the constants for *
+* the bit-reflected 0x04C11DB7 polynomial (as in the Linux kernel).            *
+\******************************************************************************/
+ATTRIBUTE_TARGET("pclmul,sse2")
+static uint32_t crc32_pclmul_fold(uint32_t crc, const unsigned char *buf,
+								  size_t len)
+{
+	const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596LL, 0x154442bd4LL);
+	const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009eLL, 0x1751997d0LL);
+	const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124LL);
+	const __m128i poly = _mm_set_epi64x(0x1f7011641LL, 0x1db710641LL);
+	const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+	__m128i x1, x2, x3, x4, t1, t2, t3, t4;
+
+	x1 = _mm_loadu_si128((const __m128i *)buf);
+	x2 = _mm_loadu_si128((const __m128i *)(buf+16));
+	x3 = _mm_loadu_si128((const __m128i *)(buf+32));
+	x4 = _mm_loadu_si128((const __m128i *)(buf+48));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+	buf += 64;
+	len -= 64;
+
+	// fold 512 bits at a time
+	while (len >= 64) {
+		t1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		t2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		t3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		t4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+						   _mm_loadu_si128((const __m128i *)buf));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, t2),
+						   _mm_loadu_si128((const __m128i *)(buf+16)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, t3),
+						   _mm_loadu_si128((const __m128i *)(buf+32)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, t4),
+						   _mm_loadu_si128((const __m128i *)(buf+48)));
+		buf += 64;
+		len -= 64;
+	}
+
+	// fold the four 128-bit lanes into one
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), x2);
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), x3);
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, t1), x4);
+
+	// fold the remaining 128 bits at a time
+	while (len >= 16) {
+		t1 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, t1),
+						   _mm_loadu_si128((const __m128i *)buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	// reduce 128 bits to 64 bits, then to 32 bits
+	t1 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), t1);
+	t1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_srli_si128(x1, 4);
+	x1 = _mm_xor_si128(x1, _mm_clmulepi64_si128(t1, k5, 0x00));
+
+	// Barrett reduction from 64 bits to the final 32-bit CRC
+	t1 = _mm_and_si128(x1, mask32);
+	t1 = _mm_clmulepi64_si128(t1, poly, 0x10);
+	t1 = _mm_and_si128(t1, mask32);
+	t1 = _mm_clmulepi64_si128(t1, poly, 0x00);
+	x1 = _mm_xor_si128(x1, t1);
+
+	return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+/******************************************************************************\
+* crc32_pclmul_update: CRC32 using PCLMULQDQ folding for the bulk of the data  *
+\******************************************************************************/
+static uint32_t crc32_pclmul_update(uint32_t crc, const unsigned char *buf,
+									size_t len)
+{
+	if (len >= 64) {
+		size_t bulk = len & ~(size_t)15;
+
+		crc = crc32_pclmul_fold(crc, buf, bulk);
+		buf += bulk;
+		len -= bulk;
+	}
+	return crc32_slice16_update(crc, buf, len);
+}
+
+/******************************************************************************\
+* crc32_pclmul_supported: check whether the CPU has PCLMULQDQ                  *
+\******************************************************************************/
+static bool crc32_pclmul_supported()
+{
+#ifdef _MSC_VER
+	int info[4];
+
+	__cpuid(info, 1);
+	return (info[2] & (1 << 1)) && (info[3] & (1 << 26));
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2");
+#endif
+}
+#endif
+
+/******************************************************************************\
+* crc32_impl: one of the available CRC32 implementations                       *
+\******************************************************************************/
+struct crc32_impl {
+	const char *name;
+	uint32_t (*update)(uint32_t crc, const unsigned char *buf, size_t len);
+	bool (*supported)();
+};
+
+// CRC32 implementations, in order of preference
+static const crc32_impl crc32_impls[] = {
+#ifdef HAVE_PCLMUL
+	{"pclmul", crc32_pclmul_update, crc32_pclmul_supported},
+#endif
+	{"slice16", crc32_slice16_update, crc32_always_supported},
+	{"slice8", crc32_slice8_update, crc32_always_supported},
+	{"bytewise", crc32_ref_update, crc32_always_supported},
+};
+
+#define CRC32_IMPL_COUNT (sizeof(crc32_impls)/sizeof(crc32_impls[0]))
+
+/******************************************************************************\
+* crc32_check: cross-check a CRC32 implementation against the reference one    *
+* impl: the implementation to be checked                                       *
+* full: run the exhaustive check rather than the quick one                     *
+* verbose: print every mismatch                                                *
+* The full check runs buffers of every length up to 1 KiB (and a few larger    *
+* ones, such as a full 128-entry GPT array) at every alignment within a        *
+* 16-byte window. The quick check only covers the lengths around each code     *
+* path's block boundaries.                                                     *
+\******************************************************************************/
+static bool crc32_check(const crc32_impl *impl, bool full, bool verbose)
+{
+	static const size_t quick_lens[] = {0, 1, 7, 8, 15, 16, 17, 63, 64, 65,
+										92, 127, 128, 129, 200, 511, 512};
+	static const size_t big_lens[] = {4096, 16384, 65536+13, 128*128+92};
+	vector<unsigned char> data(65536+13+16+92);
+	uint32_t seed = 0x12345678;
+	bool ok = true;
+
+	for (size_t i = 0; i < data.size(); i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = (unsigned char)(seed >> 16);
+	}
+
+	if (impl->update(~0U, (const unsigned char *)"123456789", 9) !=
+		~0xCBF43926U) {
+		if (verbose)
+			cout << "CRC32 engine " << impl->name
+				 << ": check value mismatch" << endl;
+		ok = false;
+	}
+
+	for (size_t off = 0; off < 16; off += (full ? 1 : 5)) {
+		size_t count = full ? 1025 : sizeof(quick_lens)/sizeof(quick_lens[0]);
+
+		for (size_t len = 0; len < count + 4; len++) {
+			size_t l;
+
+			if (len >= count)
+				l = big_lens[len-count];
+			else
+				l = full ? len : quick_lens[len];
+			uint32_t want = crc32_ref_update(~0U, &data[off], l);
+			uint32_t got = impl->update(~0U, &data[off], l);
+
+			if (want != got) {
+				if (verbose)
+					cout << "CRC32 engine " << impl->name << ": mismatch "
+						 << "at offset " << off << ", length " << l << endl;
+				ok = false;
+			}
+		}
+	}
+
+	return ok;
+}
+
+/******************************************************************************\
+* crc32_select: build the slicing tables and pick the fastest CRC32 engine     *
+* Every candidate is cross-checked against the reference implementation before *
+* it is selected, so a miscompiled or misdetected fast path is never used.     *
+\******************************************************************************/
+static const crc32_impl *crc32_select()
+{
+	for (int i = 0; i < 256; i++)
+		crc32_slice[0][i] = crc32_tbl[i];
+	for (int k = 1; k < 16; k++) {
+		for (int i = 0; i < 256; i++) {
+			uint32_t prev = crc32_slice[k-1][i];
+			crc32_slice[k][i] = (prev >> 8) ^ crc32_tbl[prev & 0xff];
+		}
+	}
+
+	for (size_t i = 0; i < CRC32_IMPL_COUNT; i++) {
+		if (crc32_impls[i].supported() && crc32_check(&crc32_impls[i], false, false))
+			return &crc32_impls[i];
+	}
+	return &crc32_impls[CRC32_IMPL_COUNT-1];
+}
+
+/******************************************************************************\
+* crc32_engine: return the CRC32 engine, selecting it on first use             *
+* The selection runs exactly once, even if several threads get here at the     *
+* same time (C++11 guarantees that for function-local statics).                *
+\******************************************************************************/
+static const crc32_impl *crc32_engine()
+{
+	static const crc32_impl *engine = crc32_select();
+
+	return engine;
+}
+
+/******************************************************************************\
+* crc32_init: select the CRC32 engine up front, rather than on first use       *
+\******************************************************************************/
+void crc32_init()
+{
+	crc32_engine();
+}
+
+/******************************************************************************\
+* crc32_engine_name: name of the CRC32 engine in use (e.g. "slice16")          *
+\******************************************************************************/
+const char *crc32_engine_name()
+{
+	return crc32_engine()->name;
+}
+
+/******************************************************************************\
+* crc32_selftest: cross-check every CRC32 engine and report the results        *
+* return value: true if every supported engine matches the reference           *
+\******************************************************************************/
+bool crc32_selftest()
+{
+	bool ok = true;
+
+	crc32_init(); // builds the slicing tables
+	for (size_t i = 0; i < CRC32_IMPL_COUNT; i++) {
+		cout << "CRC32 engine " << crc32_impls[i].name << ": ";
+		if (!crc32_impls[i].supported()) {
+			cout << "unsupported" << endl;
+			continue;
+		}
+		if (crc32_check(&crc32_impls[i], true, true)) {
+			cout << "OK" << endl;
+		} else {
+			cout << "FAILED" << endl;
+			ok = false;
+		}
+	}
+	cout << "Selected CRC32 engine: " << crc32_engine()->name << endl;
+
+	return ok;
+}
+
+/******************************************************************************\
+* crc32: calculate an EFI-style CRC32 checksum                                 *
+* buf: buffer holding the data to be CRCed                                     *
+* len: length of the data                                                      *
+\******************************************************************************/
+uint32_t crc32(const unsigned char *buf, size_t len)
+{
+	return ~crc32_engine()->update(~0U, buf, len);
+}
+
+/******************************************************************************\
+* crc32_multmodp: multiply two polynomials modulo the CRC32 polynomial         *
+* a, b: polynomials in the bit-reflected representation used by the CRC        *
+\******************************************************************************/
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ 0xEDB88320U : b >> 1;
+	}
+	return p;
+}
+
+/******************************************************************************\
+* crc32_x8nmodp: return x^(8*n) modulo the CRC32 polynomial                    *
+* n: number of bytes the result shifts a CRC by                                *
+\******************************************************************************/
+static uint32_t crc32_x8nmodp(uint64_t n)
+{
+	uint32_t p = 1U << 31; // x^0
+	uint32_t sq = 1U << 23; // x^8
+
+	while (n) {
+		if (n & 1)
+			p = crc32_multmodp(sq, p);
+		sq = crc32_multmodp(sq, sq);
+		n >>= 1;
+	}
+	return p;
+}
+
+/******************************************************************************\
+* crc32_zeros: extend a running (not inverted) CRC32 by a run of zero bytes    *
+* crc: running CRC value                                                       *
+* len: number of zero bytes                                                    *
+* This takes O(log len) time, without touching any data.                       *
+\******************************************************************************/
+uint32_t crc32_zeros(uint32_t crc, uint64_t len)
+{
+	return crc32_multmodp(crc32_x8nmodp(len), crc);
+}
+
+/******************************************************************************\
+* crc32_combine: combine the CRC32 checksums of two adjacent buffers           *
+* crc1: EFI-style CRC32 of the first buffer                                    *
+* crc2: EFI-style CRC32 of the second buffer                                   *
+* len2: length of the second buffer                                            *
+* return value: EFI-style CRC32 of the concatenation of both buffers           *
+\******************************************************************************/
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+	return crc32_multmodp(crc32_x8nmodp(len2), crc1) ^ crc2;
+}
+
+/******************************************************************************\
+* crc32_patch: update a CRC32 for a change in the middle of the data           *
+* crc: EFI-style CRC32 of the data before the change                           *
+* old_data, new_data: the changed bytes, before and after                      *
+* len: number of bytes changed                                                 *
+* tail: number of (unchanged) bytes that follow them                           *
+* return value: EFI-style CRC32 of the data after the change                   *
+* The CRC is linear over GF(2), so the change can be CRCed on its own (as      *
+* old^new, from a zero register) and shifted past the tail with crc32_zeros(). *
+* This takes O(len + log tail) time; the unchanged bytes are never read.       *
+\******************************************************************************/
+uint32_t crc32_patch(uint32_t crc, const unsigned char *old_data,
+					 const unsigned char *new_data, size_t len, uint64_t tail)
+{
+	if (!len)
+		return crc;
+
+	vector<unsigned char> delta(len);
+
+	for (size_t i = 0; i < len; i++)
+		delta[i] = old_data[i] ^ new_data[i];
+	return crc ^ crc32_zeros(crc32_engine()->update(0, &delta[0], len), tail);
+}
+
+// Buffers at least this large are checksummed in chunks on several threads.
+#define CRC32_PARALLEL_CHUNK (1024*1024)
+
+/******************************************************************************\
+* crc32_parallel: calculate an EFI-style CRC32 checksum on several threads     *
+* buf: buffer holding the data to be CRCed                                     *
+* len: length of the data                                                      *
+* The buffer is split into one chunk per hardware thread, every chunk is CRCed *
+* independently and the results are merged with crc32_combine(). Small         *
+* buffers, or machines with a single hardware thread, use crc32() directly.    *
+\******************************************************************************/
+uint32_t crc32_parallel(const unsigned char *buf, size_t len)
+{
+	size_t nthreads = thread::hardware_concurrency();
+	size_t chunk;
+	vector<uint32_t> crcs;
+	vector<thread> workers;
+	uint32_t ret;
+
+	if (nthreads > len / CRC32_PARALLEL_CHUNK)
+		nthreads = len / CRC32_PARALLEL_CHUNK;
+	if (nthreads < 2)
+		return crc32(buf, len);
+
+	chunk = len / nthreads;
+	crcs.resize(nthreads);
+	for (size_t i = 0; i < nthreads; i++) {
+		size_t n = (i == nthreads-1) ? len - i*chunk : chunk;
+		uint32_t *out = &crcs[i];
+		const unsigned char *p = buf + i*chunk;
+
+		workers.push_back(thread([out, p, n]() { *out = crc32(p, n); }));
+	}
+	for (size_t i = 0; i < nthreads; i++)
+		workers[i].join();
+
+	ret = crcs[0];
+	for (size_t i = 1; i < nthreads; i++)
+		ret = crc32_combine(ret, crcs[i],
+							(i == nthreads-1) ? len - i*chunk : chunk);
+	return ret;
+}
+
+// Size of the shared zero buffer that zero runs in a write plan point at.
+// It is page aligned, so that it can be handed to direct I/O as it is.
+#define PLAN_ZERO_CHUNK (64*1024)
+
+alignas(4096) static const char plan_zeros[PLAN_ZERO_CHUNK] = {0};
+
+/******************************************************************************\
+* io_align: return the buffer alignment needed for direct I/O on a device      *
+* block_size: logical block size of the device                                 *
+* return value: block_size rounded up to a power of two (at least 512)         *
+\******************************************************************************/
+size_t io_align(int block_size)
+{
+	size_t align = 512;
+
+	while (align < (size_t)block_size)
+		align <<= 1;
+	return align;
+}
+
+/******************************************************************************\
+* AlignedBuffer::alloc: (re)allocate the buffer                                *
+* len: size of the buffer in bytes                                             *
+* align: alignment of the buffer, a power of two (see io_align)                *
+\******************************************************************************/
+bool AlignedBuffer::alloc(size_t len, size_t align)
+{
+	void *p = NULL;
+
+	release();
+#ifdef WINDOWS_BUILD
+	p = _aligned_malloc(len ? len : 1, align);
+	if (!p)
+		return false;
+#else
+	if (posix_memalign(&p, align, len ? len : 1))
+		return false;
+#endif
+	memset(p, 0, len);
+	buf = (char *)p;
+	this->len = len;
+
+	return true;
+}
+
+/******************************************************************************\
+* AlignedBuffer::reserve: make sure the buffer holds at least len bytes        *
+* Unlike alloc(), this keeps a buffer that is already large enough and         *
+* aligned, contents and all, so that one buffer can serve many requests.       *
+\******************************************************************************/
+bool AlignedBuffer::reserve(size_t len, size_t align)
+{
+	if (buf && this->len >= len && !((uintptr_t)buf % align))
+		return true;
+	return alloc(len, align);
+}
+
+/******************************************************************************\
+* AlignedBuffer::release: free the buffer                                      *
+\******************************************************************************/
+void AlignedBuffer::release()
+{
+#ifdef WINDOWS_BUILD
+	_aligned_free(buf);
+#else
+	free(buf);
+#endif
+	buf = NULL;
+	len = 0;
+}
+
+/******************************************************************************\
+* WritePlan::begin: start a new extent                                         *
+* lba: logical address of the first block of the extent                        *
+\******************************************************************************/
+void WritePlan::begin(uint64_t lba)
+{
+	plan_extent e;
+
+	e.lba = lba;
+	e.len = 0;
+	ext.push_back(e);
+}
+
+/******************************************************************************\
+* WritePlan::add: append a buffer to the current extent                        *
+* buf: data to be written, which must stay valid until the plan is executed    *
+* len: length of the data                                                      *
+\******************************************************************************/
+void WritePlan::add(const char *buf, size_t len)
+{
+	plan_seg s;
+
+	if (!len)
+		return;
+	s.buf = buf;
+	s.len = len;
+	ext.back().segs.push_back(s);
+	ext.back().len += len;
+}
+
+/******************************************************************************\
+* WritePlan::add_zeros: append a run of zero bytes to the current extent       *
+* len: length of the run                                                       *
+\******************************************************************************/
+void WritePlan::add_zeros(uint64_t len)
+{
+	while (len) {
+		size_t n = (size_t)min<uint64_t>(len, PLAN_ZERO_CHUNK);
+
+		add(plan_zeros, n);
+		len -= n;
+	}
+}
+
+
+/******************************************************************************\
+* plan_copy: copy one extent of a write plan into a flat buffer                *
+* e: the extent                                                                *
+* out: buffer receiving the data, at least e.len bytes long                    *
+\******************************************************************************/
+void plan_copy(const plan_extent &e, char *out)
+{
+	for (size_t i = 0; i < e.segs.size(); i++) {
+		memcpy(out, e.segs[i].buf, e.segs[i].len);
+		out += e.segs[i].len;
+	}
+}
+
+/******************************************************************************\
+* PartitionArray::PartitionArray: set up the array and calculate its CRC       *
+* entries: the populated entries                                               *
+* record_count: total number of entries in the array                           *
+* block_size: size of a block on the device the array is written to            *
+* If the array can't be allocated, ok() is false and the array must not be     *
+* used.                                                                        *
+\******************************************************************************/
+PartitionArray::PartitionArray(const vector<gptpart> &entries,
+							   uint32_t record_count, int block_size)
+	: used(entries.size()*sizeof(gptpart)), record_count(record_count),
+	  table_crc(0)
+{
+	size_t padded = (used + block_size - 1) / block_size * block_size;
+
+	if (!this->entries.alloc(padded, io_align(block_size)))
+		return;
+	if (used)
+		memcpy(this->entries.get(), &entries[0], used);
+
+	// empty_record is all zeroes, so the tail of the array is a zero run
+	table_crc = crc32_parallel((const unsigned char *)this->entries.get(),
+							   used);
+	table_crc = ~crc32_zeros(~table_crc, size() - used);
+}
+
+/******************************************************************************\
+* PartitionArray::plan: append the array to the current extent of a plan       *
+* plan: the write plan                                                         *
+* len: number of bytes to append; anything past the end of the array is zero   *
+*      padding, so whole blocks can be planned                                 *
+\******************************************************************************/
+void PartitionArray::plan(WritePlan &plan, uint64_t len) const
+{
+	uint64_t n = min<uint64_t>(entries.size(), len);
+
+	plan.add(entries.get(), (size_t)n);
+	plan.add_zeros(len - n);
+}
+
+/******************************************************************************\
+* cmp: compare the starting offsets of two partitions                          *
+* a, b: the partitions to be compared                                          *
+* Primarily for internal use for sorting the partition vector.                 *
+\******************************************************************************/
+bool cmp(part a, part b)
+{
+	return a.start < b.start;
+}
+
+/******************************************************************************\
+* parse_tbl: parse an MSDOS-style partition table extracted from a boot record *
+* curr: buffer holding the partition table data                                *
+* curr_lba: logical address of the block holding the table being parsed        *
+* first_ebr_lba: logical addr. of the first EBR on the drive, 0 if parsing MBR *
+* parts: receives the partitions found in the table                            *
+* return value if an EBR is found: logical address of the next EBR             *
+* return value if no EBR is found: 0                                           *
+\******************************************************************************/
+uint32_t parse_tbl(const struct mbrpart *curr, uint32_t curr_lba,
+				   uint32_t first_ebr_lba, vector<part> &parts)
+{
+	struct part tmp;
+	uint64_t ret = 0;
+
+	for (int i = 0; i < 4; i++) {
+		if (curr[i].type == 0x0f || curr[i].type == 0x05) {
+			ret = first_ebr_lba + curr[i].start;
+		}
+		else if (curr[i].type != 0x00) {
+			tmp.active = (curr[i].active == 0x80 ? true : false);
+			tmp.type = curr[i].type;
+			tmp.start = curr[i].start + curr_lba;
+			tmp.len = curr[i].len;
+			parts.push_back(tmp);
+		}
+	}
+	return ret;
+}
+
+/******************************************************************************\
+* find_extended: find the extended partition in an MSDOS-style partition table *
+* curr: buffer holding the partition table data (of the MBR, not of an EBR)    *
+* start, len: receive the extent of the extended partition, in blocks          *
+* return value: true if an extended partition was found                        *
+\******************************************************************************/
+bool find_extended(const struct mbrpart *curr, uint32_t *start, uint32_t *len)
+{
+	for (int i = 0; i < 4; i++) {
+		if (curr[i].type == 0x0f || curr[i].type == 0x05) {
+			*start = curr[i].start;
+			*len = curr[i].len;
+			return true;
+		}
+	}
+	return false;
+}
+
+/******************************************************************************\
+* EbrWalk::EbrWalk: prepare a walk                                             *
+* max_ebrs: largest number of EBRs accepted in the chain, 0 for the default    *
+\******************************************************************************/
+EbrWalk::EbrWalk(uint32_t max_ebrs) :
+	max_ebrs(max_ebrs ? max_ebrs : GPTGEN_EBR_LIMIT_DEFAULT), ext_start(0),
+	ext_len(0), first_ebr(0), curr_ebr(0), err(GPTGEN_CHAIN_OK), bad_lba(0)
+{
+}
+
+/******************************************************************************\
+* EbrWalk::check: vet the link to the next EBR                                 *
+* next: logical address of the next EBR, 0 at the end of the chain             *
+* return value: next if the walk may continue there, 0 otherwise               *
+\******************************************************************************/
+uint32_t EbrWalk::check(uint32_t next)
+{
+	curr_ebr = 0;
+	if (!next)
+		return 0;
+	if (next < ext_start || next - ext_start >= ext_len)
+		err = GPTGEN_CHAIN_BOUNDS;
+	else if (!visited.insert(next).second)
+		err = GPTGEN_CHAIN_LOOP;
+	else if (visited.size() > max_ebrs)
+		err = GPTGEN_CHAIN_LIMIT;
+	if (err) {
+		bad_lba = next;
+		return 0;
+	}
+	return curr_ebr = next;
+}
+
+/******************************************************************************\
+* EbrWalk::start: begin the walk at the MBR                                    *
+* mbr: partition table of the MBR                                              *
+* parts: receives the primary partitions                                       *
+* return value: logical address of the first EBR, 0 if there is none or the    *
+*               link is bad (see error())                                      *
+\******************************************************************************/
+uint32_t EbrWalk::start(const struct mbrpart *mbr, vector<part> &parts)
+{
+	visited.clear();
+	err = GPTGEN_CHAIN_OK;
+	bad_lba = 0;
+	if (!find_extended(mbr, &ext_start, &ext_len))
+		ext_start = ext_len = 0;
+	first_ebr = parse_tbl(mbr, 0, 0, parts);
+	return check(first_ebr);
+}
+
+/******************************************************************************\
+* EbrWalk::step: parse the EBR returned by the last call                       *
+* ebr: partition table of that EBR                                             *
+* parts: receives its logical partition                                        *
+* return value: logical address of the next EBR, 0 at the end of the chain or  *
+*               if the link is bad (see error())                               *
+\******************************************************************************/
+uint32_t EbrWalk::step(const struct mbrpart *ebr, vector<part> &parts)
+{
+	if (!curr_ebr)
+		return 0;
+	return check(parse_tbl(ebr, curr_ebr, first_ebr, parts));
+}
+
+/******************************************************************************\
+* gpt_table_len: size of a GPT partition entry array, in blocks                *
+* record_count: number of entries in the array                                 *
+* block_size: size of a block on the disk                                      *
+\******************************************************************************/
+unsigned int gpt_table_len(uint32_t record_count, int block_size)
+{
+	return (unsigned int)(((uint64_t)record_count*sizeof(gptpart) +
+						   block_size - 1) / block_size);
+}
+
+/******************************************************************************\
+* check_layout: check that the partitions leave room for both GPT copies       *
+* parts: the partitions, in any order                                          *
+* disk_len: capacity of the disk, in blocks                                    *
+* table_len: size of the partition entry array, in blocks                      *
+* record_count: number of entries in the partition entry array                 *
+* return value: a gptgen_layout_error bitmask, 0 if the layout can be          *
+* converted                                                                    *
+\******************************************************************************/
+int check_layout(const vector<part> &parts, uint64_t disk_len,
+				 unsigned int table_len, uint32_t record_count)
+{
+	uint64_t first = UINT64_MAX, last = 0;
+	int ret = 0;
+
+	for (size_t i = 0; i < parts.size(); i++) {
+		first = min<uint64_t>(first, parts[i].start);
+		last = max<uint64_t>(last, (uint64_t)parts[i].start + parts[i].len);
+	}
+
+	if (parts.size() && first < table_len+2)
+		ret |= GPTGEN_LAYOUT_HEAD;
+	if (parts.size() && last + table_len+2 > disk_len)
+		ret |= GPTGEN_LAYOUT_TAIL;
+	if (parts.size() > record_count)
+		ret |= GPTGEN_LAYOUT_COUNT;
+	return ret;
+}
+
+/******************************************************************************\
+* check_alignment: check where a partition starts against the disk topology    *
+* start: LBA of the first block of the partition                               *
+* block_size: size of a block on the disk                                      *
+* hints: the topology of the disk                                              *
+* return value: the worst align_penalty the start incurs                       *
+\******************************************************************************/
+int check_alignment(uint64_t start, int block_size, const io_hints &hints)
+{
+	uint64_t off = start*block_size;
+
+	if (hints.physical > (uint32_t)block_size && off % hints.physical)
+		return ALIGN_PHYSICAL;
+	if (hints.io_min > (uint32_t)block_size && off % hints.io_min)
+		return ALIGN_CHUNK;
+	if (hints.io_opt > (uint32_t)block_size && off % hints.io_opt)
+		return ALIGN_STRIPE;
+	return ALIGN_OK;
+}
+
+/******************************************************************************\
+* gpt_alignment: the boundary the usable area of a GPT should be aligned to    *
+* hints: the topology of the disk                                              *
+* block_size: size of a block on the disk                                      *
+* return value: the physical block size, in blocks; 1 if it is unknown, no     *
+* larger than a block, not a multiple of one or larger than GPT_ALIGN_MAX      *
+\******************************************************************************/
+uint32_t gpt_alignment(const io_hints &hints, int block_size)
+{
+	if (hints.physical <= (uint32_t)block_size ||
+		hints.physical % block_size || hints.physical > GPT_ALIGN_MAX)
+		return 1;
+	return hints.physical / block_size;
+}
+
+/******************************************************************************\
+* plan_area: place the usable area and the secondary array of a GPT            *
+* parts: the partitions, in any order                                          *
+* disk_len: capacity of the disk, in blocks                                    *
+* table_len: size of the partition entry array, in blocks                      *
+* align: boundary to align to, in blocks (see gpt_alignment())                 *
+* area: receives the placement                                                 *
+* The usable area starts right after the primary array, and ends right before  *
+* the secondary array, which sits right before the secondary header. Where the *
+* partitions leave room, the start of the usable area is rounded up to the     *
+* boundary, and the secondary array down to it, so that neither end of the     *
+* usable area (nor the secondary array) splits a physical block. Each end is   *
+* aligned on its own, if only one has room.                                    *
+\******************************************************************************/
+void plan_area(const vector<part> &parts, uint64_t disk_len,
+			   unsigned int table_len, uint32_t align, gpt_area *area)
+{
+	uint64_t first = UINT64_MAX, last = 0, start, array;
+
+	area->data_start = table_len+2;
+	area->data_end = disk_len-(table_len+2);
+	area->second_array = disk_len-(table_len+1);
+	if (align <= 1)
+		return;
+
+	for (size_t i = 0; i < parts.size(); i++) {
+		first = min<uint64_t>(first, parts[i].start);
+		last = max<uint64_t>(last, (uint64_t)parts[i].start + parts[i].len);
+	}
+
+	start = (area->data_start + align-1) / align * align;
+	array = area->second_array / align * align;
+	if (array <= start)
+		return; // the disk is too small to bother
+	if (start <= first)
+		area->data_start = start;
+	if (array >= last) {
+		area->second_array = array;
+		area->data_end = array-1;
+	}
+}
+
+/******************************************************************************\
+* make_gptpart: build the GPT entry of a partition                             *
+* p: the partition, as parsed from the MBR/EBR chain                           *
+* The caller is expected to have checked lookup_type(p.type).action first.     *
+\******************************************************************************/
+gptpart make_gptpart(const part &p)
+{
+	const type_map &m = lookup_type(p.type);
+	struct gptpart gptout;
+
+	gptout.type = m.type;
+	gptout.flags = m.flags;
+	{
+		__guid gtmp = NULL_GUID;
+		gptout.id = gtmp;
+	}
+	gptout.start = cpu_to_le64((uint64_t)le32_to_cpu(p.start));
+	gptout.end = cpu_to_le64(((uint64_t)le32_to_cpu(p.start) +
+							 (uint64_t)le32_to_cpu(p.len) - 1));
+	memset(gptout.name, 0, 72);
+	memcpy(gptout.name, "B\0a\0s\0i\0c\0 \0d\0a\0t\0a\0 \0p\0a\0r\0t\0i\0t\0i\0o\0n\0", 40);
+	return gptout;
+}
+
+#define SIP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) do { \
+	v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+	v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+} while (0)
+
+/******************************************************************************\
+* siphash128: SipHash-2-4 with a 128-bit output                                *
+* key: the 128-bit key, as two 64-bit halves                                   *
+* buf, len: the message                                                        *
+* out: receives the 16-byte hash                                               *
+* A keyed hash, so the same message hashes differently under other keys, and   *
+* can't be reproduced without the key.                                         *
+\******************************************************************************/
+void siphash128(const uint64_t key[2], const unsigned char *buf, size_t len,
+				unsigned char *out)
+{
+	uint64_t v0 = 0x736F6D6570736575ULL ^ key[0];
+	uint64_t v1 = 0x646F72616E646F6DULL ^ key[1] ^ 0xEE;
+	uint64_t v2 = 0x6C7967656E657261ULL ^ key[0];
+	uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+	uint64_t m, h[2];
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&m, buf + i, 8);
+		m = le64_to_cpu(m);
+		v3 ^= m;
+		SIP_ROUND(v0, v1, v2, v3);
+		SIP_ROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	m = (uint64_t)len << 56;
+	for (size_t j = 0; i + j < len; j++)
+		m |= (uint64_t)buf[i + j] << (8*j);
+	v3 ^= m;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xEE;
+	for (i = 0; i < 4; i++)
+		SIP_ROUND(v0, v1, v2, v3);
+	h[0] = cpu_to_le64(v0 ^ v1 ^ v2 ^ v3);
+	v1 ^= 0xDD;
+	for (i = 0; i < 4; i++)
+		SIP_ROUND(v0, v1, v2, v3);
+	h[1] = cpu_to_le64(v0 ^ v1 ^ v2 ^ v3);
+	memcpy(out, h, 16);
+}
+
+/******************************************************************************\
+* guid_from_bytes: make an RFC 4122 GUID out of 16 random or hashed bytes      *
+* bytes: the bytes, in the order the GUID is written out in                    *
+* version: the version to mark the GUID with, 4 (random) or 8 (custom)         *
+* return value: the GUID, in on-disk byte order                                *
+\******************************************************************************/
+__guid guid_from_bytes(const unsigned char *bytes, unsigned int version)
+{
+	unsigned char b[16];
+	uint32_t d1;
+	uint16_t d2, d3;
+	uint64_t d4;
+	__guid guid;
+
+	memcpy(b, bytes, sizeof(b));
+	b[6] = (unsigned char)((b[6] & 0x0F) | (version << 4));
+	b[8] = (unsigned char)((b[8] & 0x3F) | 0x80); // the RFC 4122 variant
+
+	memcpy(&d1, b, 4);
+	memcpy(&d2, b + 4, 2);
+	memcpy(&d3, b + 6, 2);
+	memcpy(&d4, b + 8, 8);
+	guid.data1 = cpu_to_le32(be32_to_cpu(d1));
+	guid.data2 = cpu_to_le16(be16_to_cpu(d2));
+	guid.data3 = cpu_to_le16(be16_to_cpu(d3));
+	guid.data4 = d4; // already big-endian, as it is stored
+	return guid;
+}
+
+/******************************************************************************\
+* build_gpt: lay out both GPT copies (and the protective MBR) as a write plan  *
+* table: the partition entry array                                             *
+* mbr: the 446 bytes of MBR boot code to keep, unused if keepmbr is set        *
+* keepmbr: leave the MBR alone instead of writing a protective MBR             *
+* disk_len: capacity of the disk, in blocks                                    *
+* record_count: number of entries in the partition entry array                 *
+* block_size: size of a block on the disk                                      *
+* disk_guid: the disk GUID, in on-disk byte order                              *
+* area: where the usable area and secondary array go, NULL to put them right   *
+*       after the primary array and right before the secondary header          *
+* headbuf: buffer for the MBR and primary header, 2 blocks long                *
+* tailbuf: buffer for the secondary header, 1 block long                       *
+* plan: receives two extents, the primary GPT and the secondary GPT            *
+* The plan points into table, headbuf and tailbuf, which must outlive it. If   *
+* the area moves the secondary array down, the secondary extent zeroes the     *
+* blocks between it and the header.                                            *
+\******************************************************************************/
+void build_gpt(const PartitionArray &table, const char *mbr, bool keepmbr,
+			   uint64_t disk_len, uint32_t record_count, int block_size,
+			   const __guid &disk_guid, const gpt_area *area, char *headbuf,
+			   char *tailbuf, WritePlan &plan)
+{
+	unsigned int table_len = gpt_table_len(record_count, block_size);
+	uint32_t table_crc = table.crc();
+	gpt_area classic;
+
+	if (!area) {
+		classic.data_start = table_len+2;
+		classic.data_end = disk_len-(table_len+2);
+		classic.second_array = disk_len-(table_len+1);
+		area = &classic;
+	}
+
+	struct gpthdr hdr1 = {
+		GPT_MAGIC,
+		GPT_V1,
+		cpu_to_le32(92),
+		0,
+		0,
+		cpu_to_le64(1ULL),
+		cpu_to_le64(disk_len-1),
+		cpu_to_le64(area->data_start),
+		cpu_to_le64(area->data_end),
+		disk_guid,
+		cpu_to_le64(2ULL),
+		cpu_to_le32(record_count),
+		cpu_to_le32(sizeof(gptpart)),
+		cpu_to_le32(table_crc)
+	};
+
+	struct gpthdr hdr2 = {
+		GPT_MAGIC,
+		GPT_V1,
+		cpu_to_le32(92),
+		0,
+		0,
+		cpu_to_le64(disk_len-1),
+		cpu_to_le64(1ULL),
+		cpu_to_le64(area->data_start),
+		cpu_to_le64(area->data_end),
+		disk_guid,
+		cpu_to_le64(area->second_array),
+		cpu_to_le32(record_count),
+		cpu_to_le32(sizeof(gptpart)),
+		cpu_to_le32(table_crc)
+	};
+
+	hdr1.hdrsum = cpu_to_le32(crc32((unsigned char *)&hdr1, 92));
+	hdr2.hdrsum = cpu_to_le32(crc32((unsigned char *)&hdr2, 92));
+
+	struct mbrpart prot_mbr = {
+		0,
+		0,
+		2,
+		0,
+		0xEE,
+		0xFF,
+		0xFF,
+		0xFF,
+		1,
+		static_cast<uint32_t>((disk_len-1 < 0xFFFFFFFF) ? disk_len-1 : 0xFFFFFFFF)
+	};
+
+	// Lay out the protective MBR (unless keepmbr) and both headers in their
+	// own blocks; everything else in the plan points at the shared partition
+	// entries or at the zero buffer.
+	memset(headbuf, 0, 2*block_size);
+	memset(tailbuf, 0, block_size);
+	if (!keepmbr) {
+		// put the MBR loader code into the protective MBR
+		memcpy(headbuf, mbr, 446);
+		memcpy(headbuf+446, (char *)&prot_mbr, sizeof(struct mbrpart));
+		headbuf[510] = 0x55;
+		headbuf[511] = (char)0xAA;
+	}
+	memcpy(headbuf+block_size, (char *)&hdr1, sizeof(struct gpthdr));
+	memcpy(tailbuf, (char *)&hdr2, sizeof(struct gpthdr));
+
+	plan.begin(keepmbr ? 1 : 0);
+	if (!keepmbr)
+		plan.add(headbuf, block_size);
+	plan.add(headbuf+block_size, block_size);
+	table.plan(plan, (uint64_t)table_len*block_size);
+	plan.begin(area->second_array);
+	table.plan(plan, (uint64_t)table_len*block_size);
+	plan.add_zeros((disk_len-1 - (area->second_array+table_len))*block_size);
+	plan.add(tailbuf, block_size);
+}
+
+/******************************************************************************\
+* load_gpt_header: check a GPT header block and copy out the header            *
+* block: the header block                                                      *
+* block_size: size of a block on the disk                                      *
+* hdr: receives the header, as it is on the disk                               *
+* return value: 0 if the magic, version, size and CRC are valid, -1 otherwise  *
+\******************************************************************************/
+int load_gpt_header(const char *block, int block_size, gpthdr *hdr)
+{
+	static const unsigned char magic[8] = GPT_MAGIC;
+	static const unsigned char version[4] = GPT_V1;
+	uint32_t hdrlen;
+
+	memcpy(hdr, block, sizeof(*hdr));
+	hdrlen = le32_to_cpu(hdr->hdrlen);
+	if (memcmp(hdr->magic, magic, sizeof(magic)) ||
+		memcmp(hdr->version, version, sizeof(version)) ||
+		hdrlen < sizeof(*hdr) || hdrlen > (uint32_t)block_size)
+		return -1;
+
+	// the CRC covers hdrlen bytes, with the CRC field itself zeroed
+	std::vector<unsigned char> copy(block, block + hdrlen);
+	memset(&copy[offsetof(gpthdr, hdrsum)], 0, sizeof(hdr->hdrsum));
+	return crc32(&copy[0], hdrlen) == le32_to_cpu(hdr->hdrsum) ? 0 : -1;
+}
+
+/******************************************************************************\
+* seal_gpt_header: give a GPT header a new array CRC, and recompute its own    *
+* block: the header block, already checked with load_gpt_header()              *
+* part_sum: CRC32 of the partition entry array                                 *
+\******************************************************************************/
+void seal_gpt_header(char *block, uint32_t part_sum)
+{
+	struct gpthdr hdr;
+	uint32_t hdrlen;
+
+	memcpy(&hdr, block, sizeof(hdr));
+	hdrlen = le32_to_cpu(hdr.hdrlen);
+	hdr.part_sum = cpu_to_le32(part_sum);
+	hdr.hdrsum = 0;
+	memcpy(block, &hdr, sizeof(hdr));
+	hdr.hdrsum = cpu_to_le32(crc32((unsigned char *)block, hdrlen));
+	memcpy(block, &hdr, sizeof(hdr));
+}
+
+/******************************************************************************\
+* verify_hdr: check one GPT header and the partition array it describes        *
+* hdr: the header block                                                        *
+* array: the partition array read from where the header should point           *
+* array_len: size of the array read, in bytes                                  *
+* block_size: size of a block on the disk                                      *
+* hdr_error, array_error: the verify_error bits to report the two problems as  *
+* return value: 0 if both are valid, hdr_error if the header's magic, version, *
+* size or CRC is wrong, else array_error if the entries it claims don't fit    *
+* or fail the CRC                                                              *
+\******************************************************************************/
+static int verify_hdr(const char *hdr, const char *array, uint64_t array_len,
+					  int block_size, int hdr_error, int array_error)
+{
+	struct gpthdr h;
+
+	if (load_gpt_header(hdr, block_size, &h) < 0)
+		return hdr_error;
+
+	uint64_t len = (uint64_t)le32_to_cpu(h.entry_cnt) *
+				   le32_to_cpu(h.entry_len);
+	if (le32_to_cpu(h.entry_len) < sizeof(gptpart) || len > array_len ||
+		crc32((const unsigned char *)array, len) != le32_to_cpu(h.part_sum))
+		return array_error;
+
+	return 0;
+}
+
+/******************************************************************************\
+* verify_gpt: check a GPT read back from a disk                                *
+* primary: the primary header block, followed by table_len blocks of entries   *
+* secondary: the blocks from secondary_lba to the end of the disk: table_len   *
+*            blocks of entries, any gap, and the secondary header              *
+* secondary_lba: where the secondary array was read from                       *
+* disk_len: capacity of the disk, in blocks                                    *
+* block_size: size of a block on the disk                                      *
+* table_len: size of each partition entry array read, in blocks                *
+* return value: a verify_error bitmask, 0 if the GPT is valid                  *
+* Both headers and arrays must pass their CRCs, point at each other and at     *
+* their own arrays, and agree with each other, and the usable area must lie    *
+* between the two arrays and hold every partition.                             *
+\******************************************************************************/
+int verify_gpt(const char *primary, const char *secondary,
+			   uint64_t secondary_lba, uint64_t disk_len, int block_size,
+			   unsigned int table_len)
+{
+	const char *parray = primary + block_size;
+	const char *shdr = secondary + (disk_len-1 - secondary_lba)*block_size;
+	uint64_t array_len = (uint64_t)table_len*block_size;
+	struct gpthdr h1, h2;
+	int ret = 0;
+
+	ret |= verify_hdr(primary, parray, array_len, block_size,
+					  VERIFY_PRIMARY, VERIFY_PRIMARY_ARRAY);
+	ret |= verify_hdr(shdr, secondary, array_len, block_size,
+					  VERIFY_SECONDARY, VERIFY_SECONDARY_ARRAY);
+	if (ret & (VERIFY_PRIMARY | VERIFY_SECONDARY))
+		return ret; // nothing else in a broken header can be trusted
+
+	memcpy(&h1, primary, sizeof(h1));
+	memcpy(&h2, shdr, sizeof(h2));
+
+	if (le64_to_cpu(h1.this_hdr) != 1 ||
+		le64_to_cpu(h1.other_hdr) != disk_len-1 ||
+		le64_to_cpu(h1.first_entry) != 2 ||
+		le64_to_cpu(h2.this_hdr) != disk_len-1 ||
+		le64_to_cpu(h2.other_hdr) != 1 ||
+		le64_to_cpu(h2.first_entry) != secondary_lba ||
+		secondary_lba + table_len > disk_len-1)
+		ret |= VERIFY_LOCATION;
+
+	if (h1.data_start != h2.data_start || h1.data_end != h2.data_end ||
+		memcmp(&h1.guid, &h2.guid, sizeof(h1.guid)) ||
+		h1.entry_cnt != h2.entry_cnt || h1.entry_len != h2.entry_len ||
+		h1.part_sum != h2.part_sum)
+		ret |= VERIFY_COPIES;
+
+	uint64_t data_start = le64_to_cpu(h1.data_start);
+	uint64_t data_end = le64_to_cpu(h1.data_end);
+	uint32_t entry_len = le32_to_cpu(h1.entry_len);
+	uint64_t len = (uint64_t)le32_to_cpu(h1.entry_cnt) * entry_len;
+
+	if (data_start < 2+table_len || data_end >= secondary_lba ||
+		data_start > data_end)
+		ret |= VERIFY_BOUNDS;
+
+	if (ret & (VERIFY_PRIMARY_ARRAY | VERIFY_SECONDARY_ARRAY))
+		return ret;
+	if (memcmp(parray, secondary, len))
+		ret |= VERIFY_COPIES;
+
+	for (uint64_t off = 0; off < len; off += entry_len) {
+		struct gptpart e;
+
+		memcpy(&e, parray + off, sizeof(e));
+		if (!memcmp(&e.type, &empty_record.type, sizeof(e.type)))
+			continue;
+		if (le64_to_cpu(e.start) < data_start ||
+			le64_to_cpu(e.end) > data_end ||
+			le64_to_cpu(e.start) > le64_to_cpu(e.end))
+			ret |= VERIFY_BOUNDS;
+	}
+
+	return ret;
+}
+
+/******************************************************************************\
+* sector_index: the caller-supplied boot records, sorted by address            *
+\******************************************************************************/
+typedef vector<pair<uint64_t, const unsigned char *> > sector_index;
+
+/******************************************************************************\
+* find_sector: find a caller-supplied boot record by its address               *
+* index: the boot records supplied                                             *
+* lba: logical address of the block wanted                                     *
+* return value: the data of the block, NULL if it wasn't supplied              *
+\******************************************************************************/
+static const unsigned char *find_sector(const sector_index &index, uint64_t lba)
+{
+	sector_index::const_iterator it =
+		lower_bound(index.begin(), index.end(),
+					make_pair(lba, (const unsigned char *)NULL));
+
+	return (it != index.end() && it->first == lba) ? it->second : NULL;
+}
+
+/******************************************************************************\
+* call_guid_fn: get one GUID of a conversion from the caller's guid_fn         *
+\******************************************************************************/
+static int call_guid_fn(const gptgen_geometry *geom, uint32_t index,
+						__guid *guid)
+{
+	gptgen_guid g;
+
+	if (geom->guid_fn(geom->guid_ctx, index, &g) < 0)
+		return -1;
+	memcpy(guid, g.bytes, sizeof(g.bytes));
+	return 0;
+}
+
+/******************************************************************************\
+* gptgen_convert: convert an MBR/EBR partition layout to GPT, in memory        *
+* geom: the disk and the GPT to be built                                       *
+* sectors, count: the MBR (LBA 0) and every EBR of the disk, in any order      *
+* res: caller-owned output buffers, and receives the results                   *
+* return value: a gptgen_status                                                *
+* This does no I/O and keeps no state between calls, so any number of          *
+* conversions can run at the same time on different threads. A caller that     *
+* doesn't know where the EBRs are can start with just the MBR, and add the     *
+* sector named by need_lba each time GPTGEN_ENEEDSECTOR is returned; as every  *
+* call walks the chain from the MBR, a gptgen_chain finds them more cheaply.   *
+\******************************************************************************/
+int gptgen_convert(const gptgen_geometry *geom, const gptgen_sector *sectors,
+				   size_t count, gptgen_result *res)
+{
+	vector<part> parts;
+	vector<gptpart> gptparts;
+	const unsigned char *mbr, *ebr;
+	sector_index index;
+	EbrWalk walk(geom->max_ebrs);
+	uint32_t curr_ebr;
+	unsigned int table_len;
+	int bs = (int)geom->block_size;
+
+	res->primary_lba = res->secondary_lba = 0;
+	res->primary_len = res->secondary_len = 0;
+	res->part_count = 0;
+	res->boot = false;
+	res->generic = 0;
+	res->layout = 0;
+	res->bad_part = -1;
+	res->need_lba = 0;
+	res->chain = GPTGEN_CHAIN_OK;
+	res->chain_lba = 0;
+
+	if (geom->block_size < 512 || !geom->record_count)
+		return GPTGEN_EINVAL;
+	table_len = gpt_table_len(geom->record_count, bs);
+	if (geom->disk_len < 2ULL*table_len+3)
+		return GPTGEN_EINVAL;
+
+	// Look the EBRs up in a sorted copy of the list, so that walking a long
+	// chain doesn't take a scan of the whole list per EBR.
+	index.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		index.push_back(make_pair(sectors[i].lba, sectors[i].data));
+	sort(index.begin(), index.end());
+
+	mbr = find_sector(index, 0);
+	if (!mbr)
+		return GPTGEN_EINVAL;
+
+	// parse the MBR and the EBR chain, if present
+	curr_ebr = walk.start((const struct mbrpart *)(mbr+446), parts);
+	while (curr_ebr > 0) {
+		ebr = find_sector(index, curr_ebr);
+		if (!ebr) {
+			res->need_lba = curr_ebr;
+			return GPTGEN_ENEEDSECTOR;
+		}
+		curr_ebr = walk.step((const struct mbrpart *)(ebr+446), parts);
+	}
+	if (walk.error()) {
+		res->chain = walk.error();
+		res->chain_lba = walk.failed_lba();
+		return GPTGEN_ECHAIN;
+	}
+
+	res->part_count = (uint32_t)parts.size();
+	res->layout = check_layout(parts, geom->disk_len, table_len,
+							   geom->record_count);
+	if (res->layout)
+		return GPTGEN_ELAYOUT;
+
+	sort(parts.begin(), parts.end(), cmp);
+
+	for (size_t i = 0; i < parts.size(); i++) {
+		switch (lookup_type(parts[i].type).action) {
+		case TYPE_PMAGIC:
+			res->bad_part = (int)i;
+			return GPTGEN_EPMAGIC;
+		case TYPE_DYNAMIC:
+			res->bad_part = (int)i;
+			return GPTGEN_EDYNAMIC;
+		case TYPE_GPT:
+			res->bad_part = (int)i;
+			return GPTGEN_EGPT;
+		case TYPE_GENERIC:
+			res->generic++;
+			break;
+		case TYPE_MAP:
+			break;
+		}
+		if (parts[i].active)
+			res->boot = true;
+		gptparts.push_back(make_gptpart(parts[i]));
+	}
+
+	gpt_area area;
+
+	plan_area(parts, geom->disk_len, table_len, geom->align, &area);
+	res->primary_len = (size_t)((geom->keepmbr ? 1 : 2) + table_len) * bs;
+	res->secondary_len = (size_t)(geom->disk_len - area.second_array) * bs;
+	if (res->primary_size < res->primary_len ||
+		res->secondary_size < res->secondary_len)
+		return GPTGEN_ENOSPACE;
+
+	__guid disk_guid = NULL_GUID;
+
+	if (geom->guid_fn) {
+		if (call_guid_fn(geom, 0, &disk_guid) < 0)
+			return GPTGEN_EGUID;
+		for (size_t i = 0; i < gptparts.size(); i++) {
+			if (call_guid_fn(geom, (uint32_t)i+1, &gptparts[i].id) < 0)
+				return GPTGEN_EGUID;
+		}
+	}
+
+	PartitionArray table(gptparts, geom->record_count, bs);
+	AlignedBuffer headbuf(2*bs, io_align(bs));
+	AlignedBuffer tailbuf(bs, io_align(bs));
+	WritePlan plan;
+
+	if (!table.ok() || !headbuf.get() || !tailbuf.get())
+		return GPTGEN_ENOMEM;
+	build_gpt(table, (const char *)mbr, geom->keepmbr, geom->disk_len,
+			  geom->record_count, bs, disk_guid, &area, headbuf.get(),
+			  tailbuf.get(), plan);
+
+	const plan_extent &primary = plan.extents()[0];
+	const plan_extent &secondary = plan.extents()[1];
+
+	plan_copy(primary, (char *)res->primary);
+	plan_copy(secondary, (char *)res->secondary);
+	res->primary_lba = primary.lba;
+	res->secondary_lba = secondary.lba;
+
+	return GPTGEN_OK;
+}
+
+/******************************************************************************\
+* gptgen_chain: the state of a walk started by gptgen_chain_new()              *
+\******************************************************************************/
+struct gptgen_chain {
+	explicit gptgen_chain(uint32_t max_ebrs) : walk(max_ebrs), started(false)
+	{
+	}
+
+	EbrWalk walk;
+	vector<part> parts; // the walk needs somewhere to put them
+	bool started; // the MBR has been given
+};
+
+/******************************************************************************\
+* gptgen_chain_new: start a walk along the EBR chain of a disk                 *
+* max_ebrs: limit on the chain, 0 for GPTGEN_EBR_LIMIT_DEFAULT                 *
+* return value: the walk, NULL if out of memory                                *
+\******************************************************************************/
+gptgen_chain *gptgen_chain_new(uint32_t max_ebrs)
+{
+	return new(nothrow) gptgen_chain(max_ebrs);
+}
+
+/******************************************************************************\
+* gptgen_chain_next: take the next boot record of a walk                       *
+* chain: the walk                                                              *
+* block: the MBR on the first call, then the block at next_lba                 *
+* next_lba: receives the address of the next EBR                               *
+* return value: 1 if the EBR at next_lba is wanted next, 0 at the end of the   *
+* chain (or where a malformed chain stops; gptgen_convert() says why)          *
+\******************************************************************************/
+int gptgen_chain_next(gptgen_chain *chain, const unsigned char *block,
+					  uint64_t *next_lba)
+{
+	const struct mbrpart *tbl = (const struct mbrpart *)(block+446);
+	uint32_t next;
+
+	next = chain->started ? chain->walk.step(tbl, chain->parts) :
+			chain->walk.start(tbl, chain->parts);
+	chain->started = true;
+	*next_lba = next;
+	return next ? 1 : 0;
+}
+
+/******************************************************************************\
+* gptgen_chain_free: end a walk                                                *
+\******************************************************************************/
+void gptgen_chain_free(gptgen_chain *chain)
+{
+	delete chain;
+}
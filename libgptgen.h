@@ -0,0 +1,153 @@
+/******************************************************************************\
+* libgptgen                                                                    *
+* Reentrant library for converting MBR/MSDOS partition tables                  *
+* to GUID Partition Table.                                                     *
+*                                                                              *
+* Copyright (c) 2009-2012, Gabor A. Stefanik <netrolller.3d@gmail.com>         *
+*                                                                              *
+* Permission to use, copy, modify, and/or distribute this software for any     *
+* purpose with or without fee is hereby granted, provided that the above       *
+* copyright notice and this permission notice appear in all copies.            *
+*                                                                              *
+* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES     *
+* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF             *
+* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR      *
+* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES       *
+* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN        *
+* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF      *
+* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.               *
+\******************************************************************************/
+
+#ifndef LIBGPTGEN_H
+#define LIBGPTGEN_H
+
+// This is the whole installed interface of the library; the internals it
+// shares with gptgen are in libgptgen_internal.h, which isn't installed.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Default limit on the number of EBRs in an extended partition's chain.
+#define GPTGEN_EBR_LIMIT_DEFAULT 16384
+
+/******************************************************************************\
+* gptgen_chain_error: why an EBR chain was rejected                            *
+\******************************************************************************/
+enum gptgen_chain_error {
+	GPTGEN_CHAIN_OK = 0,
+	GPTGEN_CHAIN_LOOP = 1, // an EBR links back to an EBR already in the chain
+	GPTGEN_CHAIN_BOUNDS = 2, // an EBR lies outside the extended partition
+	GPTGEN_CHAIN_LIMIT = 3 // the chain holds more EBRs than allowed
+};
+
+/******************************************************************************\
+* gptgen_layout_error: why a layout can't be converted, as a bitmask           *
+\******************************************************************************/
+enum gptgen_layout_error {
+	GPTGEN_LAYOUT_HEAD = 1, // first partition starts inside the primary GPT
+	GPTGEN_LAYOUT_TAIL = 2, // last partition ends inside the secondary GPT
+	GPTGEN_LAYOUT_COUNT = 4 // more partitions than GPT entries
+};
+
+/******************************************************************************\
+* gptgen_status: result of gptgen_convert()                                    *
+\******************************************************************************/
+enum gptgen_status {
+	GPTGEN_OK = 0,
+	GPTGEN_EINVAL = -1, // bad geometry, or no sector for LBA 0
+	GPTGEN_ENEEDSECTOR = -2, // an EBR wasn't supplied, see need_lba
+	GPTGEN_ELAYOUT = -3, // see layout (a gptgen_layout_error bitmask)
+	GPTGEN_EPMAGIC = -4, // PartitionMagic work partition, see bad_part
+	GPTGEN_EDYNAMIC = -5, // dynamic disk, see bad_part
+	GPTGEN_EGPT = -6, // the disk already has a GPT, see bad_part
+	GPTGEN_ENOSPACE = -7, // output buffers too small, see *_len
+	GPTGEN_ECHAIN = -8, // the EBR chain is malformed, see chain
+	GPTGEN_EGUID = -9, // the caller's guid_fn failed
+	GPTGEN_ENOMEM = -10 // out of memory
+};
+
+/******************************************************************************\
+* gptgen_guid: a GUID, in on-disk byte order (the first three fields           *
+* little-endian, the last eight bytes as they are)                             *
+\******************************************************************************/
+struct gptgen_guid {
+	unsigned char bytes[16];
+};
+
+/******************************************************************************\
+* gptgen_guid_fn: supplies the GUIDs of a conversion                           *
+* ctx: the guid_ctx of the geometry                                            *
+* index: 0 for the disk GUID, i+1 for the i-th partition entry                 *
+* guid: receives the GUID                                                      *
+* return value: 0 on success, -1 to fail the conversion with GPTGEN_EGUID      *
+\******************************************************************************/
+typedef int (*gptgen_guid_fn)(void *ctx, uint32_t index,
+							  struct gptgen_guid *guid);
+
+/******************************************************************************\
+* gptgen_sector: one boot record (MBR or EBR) read by the caller               *
+\******************************************************************************/
+struct gptgen_sector {
+	uint64_t lba; // logical address of the block
+	const unsigned char *data; // at least the first 512 bytes of the block
+};
+
+/******************************************************************************\
+* gptgen_geometry: the disk and GPT being converted to                         *
+\******************************************************************************/
+struct gptgen_geometry {
+	uint64_t disk_len; // capacity of the disk, in blocks
+	uint32_t block_size; // logical block size of the disk, in bytes
+	uint32_t record_count; // number of GPT entries, 128 is customary
+	bool keepmbr; // don't emit a protective MBR
+	uint32_t max_ebrs; // limit on the EBR chain, 0 for GPTGEN_EBR_LIMIT_DEFAULT
+	gptgen_guid_fn guid_fn; // NULL to leave every GUID zeroed
+	void *guid_ctx; // passed to guid_fn
+	uint32_t align; // blocks to align the usable area to, 0 or 1 for none
+};
+
+/******************************************************************************\
+* gptgen_result: caller-owned output of gptgen_convert()                       *
+* The caller fills in the buffers and their sizes; gptgen_convert() fills in   *
+* everything else. On GPTGEN_ENOSPACE, primary_len and secondary_len hold the  *
+* sizes needed.                                                                *
+\******************************************************************************/
+struct gptgen_result {
+	unsigned char *primary; // primary GPT (and protective MBR)
+	size_t primary_size; // size of the primary buffer
+	unsigned char *secondary; // secondary GPT
+	size_t secondary_size; // size of the secondary buffer
+
+	uint64_t primary_lba; // where the primary buffer goes on the disk
+	size_t primary_len; // bytes of the primary buffer used
+	uint64_t secondary_lba; // where the secondary buffer goes on the disk
+	size_t secondary_len; // bytes of the secondary buffer used
+	uint32_t part_count; // number of partitions found
+	bool boot; // a partition was marked active (bootable)
+	int generic; // partitions that got the generic MBR2GUID type
+	int layout; // gptgen_layout_error bitmask, for GPTGEN_ELAYOUT
+	int bad_part; // partition (by start sector) that aborted the conversion
+	uint64_t need_lba; // EBR to supply, for GPTGEN_ENEEDSECTOR
+	int chain; // gptgen_chain_error, for GPTGEN_ECHAIN
+	uint64_t chain_lba; // the rejected EBR link, for GPTGEN_ECHAIN
+};
+
+int gptgen_convert(const gptgen_geometry *geom, const gptgen_sector *sectors,
+				   size_t count, gptgen_result *res);
+
+/******************************************************************************\
+* gptgen_chain: a walk along the EBR chain, for a caller that reads the boot   *
+* records one at a time (e.g. from a stream) before it calls gptgen_convert()  *
+* gptgen_chain_new() starts a walk; gptgen_chain_next() is given the MBR, and  *
+* then each EBR it asks for, until it returns 0. Each EBR is parsed once, so a *
+* chain of n EBRs costs O(n), against O(n^2) for retrying gptgen_convert()     *
+* after every GPTGEN_ENEEDSECTOR.                                              *
+\******************************************************************************/
+struct gptgen_chain;
+
+struct gptgen_chain *gptgen_chain_new(uint32_t max_ebrs);
+int gptgen_chain_next(struct gptgen_chain *chain, const unsigned char *block,
+					  uint64_t *next_lba);
+void gptgen_chain_free(struct gptgen_chain *chain);
+
+#endif // LIBGPTGEN_H
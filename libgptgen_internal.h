@@ -0,0 +1,455 @@
+/******************************************************************************\
+* libgptgen_internal                                                           *
+* The internals of libgptgen, shared with gptgen and its benchmarks but not    *
+* part of the installed interface (libgptgen.h).                               *
+*                                                                              *
+* Copyright (c) 2009-2012, Gabor A. Stefanik <netrolller.3d@gmail.com>         *
+*                                                                              *
+* Permission to use, copy, modify, and/or distribute this software for any     *
+* purpose with or without fee is hereby granted, provided that the above       *
+* copyright notice and this permission notice appear in all copies.            *
+*                                                                              *
+* THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES     *
+* WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF             *
+* MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR      *
+* ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES       *
+* WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN        *
+* ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF      *
+* OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.               *
+\******************************************************************************/
+
+#ifndef LIBGPTGEN_INTERNAL_H
+#define LIBGPTGEN_INTERNAL_H
+
+#include <cstddef>
+#include <unordered_set>
+#include <vector>
+#include <stdint.h>
+
+#include "libgptgen.h"
+
+// We don't have unistd.h on Windows, so define the missing integer types.
+#ifdef WINDOWS_BUILD
+typedef uint64_t __be64;
+#elif MACOS_BUILD
+typedef uint64_t __u64;
+typedef uint64_t __be64;
+#else
+#include <linux/types.h>
+#endif
+
+#if defined(__GNUC__)
+#define ATTRIBUTE_PACKED __attribute__((packed))
+#elif defined(_MSC_VER)
+#define ATTRIBUTE_PACKED __pragma(pack(pop, r1))
+#else
+#error "Cannot eliminate structure padding"
+#endif
+
+#define GPT_MAGIC {0x45, 0x46, 0x49, 0x20, 0x50, 0x41, 0x52, 0x54} // "EFI PART"
+#define GPT_V1 {0x00, 0x00, 0x01, 0x00}
+
+#define PART_FLAG_SYSTEM (1ULL<<0)
+#define PART_FLAG_RDONLY (1ULL<<60)
+#define PART_FLAG_HIDDEN (1ULL<<62)
+#define PART_FLAG_NOMOUNT (1ULL<<63)
+
+// Host byte order, resolved at compile time. MSVC only targets little-endian
+// platforms; GCC and Clang tell us through __BYTE_ORDER__.
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && \
+	__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_BIG_ENDIAN 1
+#else
+#define HOST_BIG_ENDIAN 0
+#endif
+
+/******************************************************************************\
+* swapXX, cpu_to_XeXX: compile-time endianness helper functions                *
+* These are constexpr, so conversions of constants (e.g. the GUIDs below)      *
+* happen at compile time, and the rest compile to nothing or a single bswap.   *
+\******************************************************************************/
+
+constexpr uint16_t swap16(uint16_t x)
+{
+	return (uint16_t)((x<<8)|(x>>8));
+}
+
+constexpr uint32_t swap32(uint32_t x)
+{
+	return (x<<24) |
+		   ((x<<8) & 0x00FF0000) |
+		   ((x>>8) & 0x0000FF00) |
+		   (x>>24);
+}
+
+constexpr uint64_t swap64(uint64_t x)
+{
+	return (x<<56) |
+		   ((x<<40) & 0x00FF000000000000ULL) |
+		   ((x<<24) & 0x0000FF0000000000ULL) |
+		   ((x<<8)  & 0x000000FF00000000ULL) |
+		   ((x>>8)  & 0x00000000FF000000ULL) |
+		   ((x>>24) & 0x0000000000FF0000ULL) |
+		   ((x>>40) & 0x000000000000FF00ULL) |
+		   (x>>56);
+}
+
+constexpr uint16_t cpu_to_be16(uint16_t x) { return HOST_BIG_ENDIAN ? x : swap16(x); }
+constexpr uint32_t cpu_to_be32(uint32_t x) { return HOST_BIG_ENDIAN ? x : swap32(x); }
+constexpr uint64_t cpu_to_be64(uint64_t x) { return HOST_BIG_ENDIAN ? x : swap64(x); }
+constexpr uint16_t cpu_to_le16(uint16_t x) { return HOST_BIG_ENDIAN ? swap16(x) : x; }
+constexpr uint32_t cpu_to_le32(uint32_t x) { return HOST_BIG_ENDIAN ? swap32(x) : x; }
+constexpr uint64_t cpu_to_le64(uint64_t x) { return HOST_BIG_ENDIAN ? swap64(x) : x; }
+
+#define be16_to_cpu cpu_to_be16
+#define be32_to_cpu cpu_to_be32
+#define be64_to_cpu cpu_to_be64
+#define le16_to_cpu cpu_to_le16
+#define le32_to_cpu cpu_to_le32
+#define le64_to_cpu cpu_to_le64
+
+static_assert(swap32(0x11223344) == 0x44332211, "swap32 is broken");
+static_assert(le32_to_cpu(cpu_to_le32(0x11223344)) == 0x11223344,
+			  "cpu_to_le32 does not round-trip");
+static_assert(be64_to_cpu(cpu_to_be64(0x1122334455667788ULL)) ==
+			  0x1122334455667788ULL, "cpu_to_be64 does not round-trip");
+
+struct __guid {
+	uint32_t data1;
+	uint16_t data2;
+	uint16_t data3;
+	__be64 data4;
+}ATTRIBUTE_PACKED;
+
+static_assert(sizeof(__guid) == sizeof(gptgen_guid),
+			  "__guid and gptgen_guid differ in size");
+
+#define NULL_GUID {0x00000000, 0x0000, 0x0000, 0x0000000000000000}
+#define EFI_SYS_GUID {cpu_to_le32(0xC12A7328), cpu_to_le16(0xF81F),\
+	cpu_to_le16(0x11D2), cpu_to_be64(0xBA4B00A0C93EC93BULL)}
+#define MS_DATA_GUID {cpu_to_le32(0xEBD0A0A2), cpu_to_le16(0xB9E5),\
+	cpu_to_le16(0x4433), cpu_to_be64(0x87C068B6B72699C7ULL)}
+#define MS_META_GUID {cpu_to_le32(0x5808C8AA), cpu_to_le16(0x7E8F),\
+	cpu_to_le16(0x42E0), cpu_to_be64(0x85D2E1E90434CFB3ULL)}
+#define MS_DYN_GUID {cpu_to_le32(0xAF9B60A0), cpu_to_le16(0x1431),\
+	cpu_to_le16(0x4F62), cpu_to_be64(0xBC683311714A69ADULL)}
+#define MS_WINRE_GUID {cpu_to_le32(0xDE94BBA4), cpu_to_le16(0x06D1),\
+	cpu_to_le16(0x4D40), cpu_to_be64(0xA16ABFD50179D6ACULL)}
+#define LINUX_SWAP_GUID {cpu_to_le32(0x0657FD6D), cpu_to_le16(0xA4AB),\
+	cpu_to_le16(0x43C4), cpu_to_be64(0x84E50933C84B4F4FULL)}
+#define LINUX_DATA_GUID {cpu_to_le32(0xEBD0A0A2), cpu_to_le16(0xB9E5),\
+	cpu_to_le16(0x4433), cpu_to_be64(0x87C068B6B72699C7ULL)}
+#define LINUX_RAID_GUID {cpu_to_le32(0xA19D880F), cpu_to_le16(0x05FC),\
+	cpu_to_le16(0x4D3B), cpu_to_be64(0xA006743F0F84911EULL)}
+#define LINUX_LVM_GUID {cpu_to_le32(0xE6D6D379), cpu_to_le16(0xF507),\
+	cpu_to_le16(0x44C2), cpu_to_be64(0xA23C238F2A3DF928ULL)}
+#define APPLE_HFS_GUID {cpu_to_le32(0x48465300), cpu_to_le16(0x0000),\
+	cpu_to_le16(0x11AA), cpu_to_be64(0xAA1100306543ECACULL)}
+#define APPLE_UFS_GUID {cpu_to_le32(0x55465300), cpu_to_le16(0x0000),\
+	cpu_to_le16(0x11AA), cpu_to_be64(0xAA1100306543ECACULL)}
+#define APPLE_BOOT_GUID {cpu_to_le32(0x426F6F74), cpu_to_le16(0x0000),\
+	cpu_to_le16(0x11AA), cpu_to_be64(0xAA1100306543ECACULL)}
+#define SUN_BOOT_GUID {cpu_to_le32(0x6A82CB45), cpu_to_le16(0x1DD2),\
+	cpu_to_le16(0x11B2), cpu_to_be64(0x99A6080020736631ULL)}
+#define SUN_ROOT_GUID {cpu_to_le32(0x6A85CF4D), cpu_to_le16(0x1DD2),\
+	cpu_to_le16(0x11B2), cpu_to_be64(0x99A6080020736631ULL)}
+
+#define MBR2GUID(x) {cpu_to_le32(0x1575DA16), cpu_to_le16(0xF2E2),\
+	cpu_to_le16(0x40DE), (cpu_to_be64(0xB715C6E376663B00ULL + x))}
+
+struct part {
+	unsigned char type;
+	bool active;
+	uint32_t start;
+	uint32_t len;
+};
+
+struct mbrpart {
+	unsigned char active;
+	unsigned char shead; // CHS start value, not used by program
+	unsigned char ssect; // CHS start value, not used by program
+	unsigned char scyl; // CHS start value, not used by program
+	unsigned char type;
+	unsigned char ehead; // CHS end value, not used by program
+	unsigned char esect; // CHS end value, not used by program
+	unsigned char ecyl; // CHS end value, not used by program
+	uint32_t start;
+	uint32_t len;
+}ATTRIBUTE_PACKED;
+
+struct gptpart {
+	struct __guid type;
+	struct __guid id;
+	uint64_t start;
+	uint64_t end;
+	uint64_t flags;
+	char name[72];
+}ATTRIBUTE_PACKED;
+
+const static gptpart empty_record = {
+	NULL_GUID,
+	NULL_GUID,
+	0,
+	0,
+	0,
+	"",
+};
+
+/******************************************************************************\
+* type_action: what to do with a partition of a given MBR type                 *
+\******************************************************************************/
+enum type_action {
+	TYPE_MAP, // convert it to the table's type GUID and flags
+	TYPE_GENERIC, // same, but warn that the generic MBR2GUID GUID is used
+	TYPE_PMAGIC, // abort: interrupted PartitionMagic session
+	TYPE_DYNAMIC, // abort: Windows dynamic disk
+	TYPE_GPT // abort: the disk is already GPT (protective MBR)
+};
+
+/******************************************************************************\
+* type_map: the GPT equivalent of an MBR partition type                        *
+\******************************************************************************/
+struct type_map {
+	__guid type; // type GUID, already in on-disk byte order
+	uint64_t flags; // attribute flags, already in on-disk byte order
+	type_action action;
+};
+
+struct gpthdr {
+	unsigned char magic[8];
+	unsigned char version[4];
+	uint32_t hdrlen;
+	uint32_t hdrsum;
+	uint32_t pad;
+	uint64_t this_hdr;
+	uint64_t other_hdr;
+	uint64_t data_start;
+	uint64_t data_end;
+	struct __guid guid;
+	uint64_t first_entry;
+	uint32_t entry_cnt;
+	uint32_t entry_len;
+	uint32_t part_sum;
+}ATTRIBUTE_PACKED;
+
+/******************************************************************************\
+* lookup_type: look up the GPT equivalent of an MBR partition type             *
+* type: the MBR partition type ID                                              *
+\******************************************************************************/
+const type_map &lookup_type(unsigned char type);
+
+/******************************************************************************\
+* CRC32 (see libgptgen.cpp for the individual functions)                       *
+* The engine is picked on first use, so none of these need any setup;          *
+* crc32_init() only does that work up front.                                   *
+\******************************************************************************/
+void crc32_init();
+const char *crc32_engine_name();
+bool crc32_selftest();
+uint32_t crc32(const unsigned char *buf, size_t len);
+uint32_t crc32_zeros(uint32_t crc, uint64_t len);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+uint32_t crc32_patch(uint32_t crc, const unsigned char *old_data,
+					 const unsigned char *new_data, size_t len, uint64_t tail);
+uint32_t crc32_parallel(const unsigned char *buf, size_t len);
+
+size_t io_align(int block_size);
+
+/******************************************************************************\
+* AlignedBuffer: a zero-filled buffer suitable for direct I/O                  *
+\******************************************************************************/
+class AlignedBuffer {
+public:
+	AlignedBuffer() : buf(NULL), len(0) {}
+	AlignedBuffer(size_t len, size_t align) : buf(NULL), len(0)
+	{
+		alloc(len, align);
+	}
+	~AlignedBuffer() { release(); }
+
+	bool alloc(size_t len, size_t align);
+	bool reserve(size_t len, size_t align);
+	void release();
+
+	char *get() const { return buf; }
+	size_t size() const { return len; }
+
+private:
+	AlignedBuffer(const AlignedBuffer &);
+	AlignedBuffer &operator=(const AlignedBuffer &);
+
+	char *buf;
+	size_t len;
+};
+
+/******************************************************************************\
+* plan_seg: a piece of data to be written, in a buffer owned by someone else   *
+\******************************************************************************/
+struct plan_seg {
+	const char *buf;
+	size_t len;
+};
+
+/******************************************************************************\
+* plan_extent: a contiguous run of blocks to be written, as a gather list      *
+\******************************************************************************/
+struct plan_extent {
+	uint64_t lba; // logical address of the first block
+	uint64_t len; // total length of the segments, in bytes
+	std::vector<plan_seg> segs;
+};
+
+/******************************************************************************\
+* WritePlan: everything a conversion writes, described without copying it      *
+* The plan is a list of extents, each of which gathers its data from buffers   *
+* that are shared with the rest of the program (the populated partition        *
+* entries, the header blocks and a static zero buffer), so the same bytes can  *
+* back both GPT copies. Devices and files execute it with one pwritev per      *
+* extent.                                                                      *
+\******************************************************************************/
+class WritePlan {
+public:
+	void begin(uint64_t lba);
+	void add(const char *buf, size_t len);
+	void add_zeros(uint64_t len);
+
+	const std::vector<plan_extent> &extents() const { return ext; }
+
+private:
+	std::vector<plan_extent> ext;
+};
+
+void plan_copy(const plan_extent &e, char *out);
+
+/******************************************************************************\
+* PartitionArray: a GPT partition entry array, generated on the fly            *
+* Only the populated entries are stored, in a block-aligned buffer padded to a *
+* whole number of blocks (so that the array can go to direct I/O as it is).    *
+* The rest of the array is a run of empty_record entries, which is never       *
+* materialized: it is written from the shared zero buffer of a WritePlan, and  *
+* its share of the array CRC is computed with crc32_zeros() in O(log n) time.  *
+\******************************************************************************/
+class PartitionArray {
+public:
+	PartitionArray(const std::vector<gptpart> &entries, uint32_t record_count,
+				   int block_size);
+
+	// false if the array couldn't be allocated
+	bool ok() const { return entries.get() != NULL; }
+	uint64_t size() const { return (uint64_t)record_count*sizeof(gptpart); }
+	uint32_t crc() const { return table_crc; }
+	void plan(WritePlan &plan, uint64_t len) const;
+
+private:
+	AlignedBuffer entries;
+	uint64_t used; // bytes of populated entries
+	uint32_t record_count;
+	uint32_t table_crc;
+};
+
+/******************************************************************************\
+* verify_error: problems found in a GPT read back from a disk, as a bitmask    *
+\******************************************************************************/
+enum verify_error {
+	VERIFY_PRIMARY = 1, // primary header: bad magic, version, size or CRC
+	VERIFY_SECONDARY = 2, // secondary header: same
+	VERIFY_PRIMARY_ARRAY = 4, // primary partition array fails its CRC
+	VERIFY_SECONDARY_ARRAY = 8, // secondary partition array: same
+	VERIFY_LOCATION = 16, // this_hdr/other_hdr/first_entry point elsewhere
+	VERIFY_BOUNDS = 32, // data_start/data_end overlap the tables or entries
+	VERIFY_COPIES = 64, // the two copies differ
+	VERIFY_MISMATCH = 128 // the disk differs from what was written
+};
+
+/******************************************************************************\
+* io_hints: the I/O topology of a disk, in bytes, 0 where unknown              *
+\******************************************************************************/
+struct io_hints {
+	uint32_t physical; // physical block size
+	uint32_t io_min; // minimum efficient I/O size, e.g. a RAID chunk
+	uint32_t io_opt; // optimal I/O size, e.g. a full RAID stripe
+};
+
+/******************************************************************************\
+* align_penalty: how badly a partition start is misaligned, worst last         *
+\******************************************************************************/
+enum align_penalty {
+	ALIGN_OK = 0,
+	ALIGN_STRIPE = 1, // off io_opt: full-stripe writes span two stripes
+	ALIGN_CHUNK = 2, // off io_min: writes straddle two RAID chunks
+	ALIGN_PHYSICAL = 3 // off the physical block: writes read-modify-write
+};
+
+// Largest boundary the usable area of a GPT is aligned to, in bytes.
+#define GPT_ALIGN_MAX (1024*1024)
+
+/******************************************************************************\
+* gpt_area: where the usable area and the secondary entry array of a GPT go    *
+\******************************************************************************/
+struct gpt_area {
+	uint64_t data_start; // first usable LBA
+	uint64_t data_end; // last usable LBA
+	uint64_t second_array; // LBA of the secondary partition entry array
+};
+
+/******************************************************************************\
+* EbrWalk: a bounded walk along the EBR chain of an MBR disk                   *
+* start() parses the MBR and returns the address of the first EBR, step()      *
+* parses that EBR and returns the address of the next one, and so on until     *
+* either returns 0. Every link is checked before it is returned: it must lie   *
+* inside the extended partition, must not have been visited before (checked    *
+* against a hash set), and the chain may not grow past max_ebrs EBRs. A        *
+* damaged or hostile chain therefore ends the walk with error() set after at   *
+* most max_ebrs reads, instead of being followed forever.                      *
+\******************************************************************************/
+class EbrWalk {
+public:
+	explicit EbrWalk(uint32_t max_ebrs = GPTGEN_EBR_LIMIT_DEFAULT);
+
+	uint32_t start(const struct mbrpart *mbr, std::vector<part> &parts);
+	uint32_t step(const struct mbrpart *ebr, std::vector<part> &parts);
+
+	int error() const { return err; }
+	uint32_t failed_lba() const { return bad_lba; } // the rejected link
+	uint32_t limit() const { return max_ebrs; }
+
+private:
+	uint32_t check(uint32_t next);
+
+	uint32_t max_ebrs;
+	uint32_t ext_start; // extent of the extended partition
+	uint32_t ext_len;
+	uint32_t first_ebr;
+	uint32_t curr_ebr; // the EBR the next step() parses
+	std::unordered_set<uint32_t> visited;
+	int err; // a gptgen_chain_error
+	uint32_t bad_lba;
+};
+
+bool cmp(part a, part b);
+uint32_t parse_tbl(const struct mbrpart *curr, uint32_t curr_lba,
+				   uint32_t first_ebr_lba, std::vector<part> &parts);
+bool find_extended(const struct mbrpart *curr, uint32_t *start,
+				   uint32_t *len);
+unsigned int gpt_table_len(uint32_t record_count, int block_size);
+int check_layout(const std::vector<part> &parts, uint64_t disk_len,
+				 unsigned int table_len, uint32_t record_count);
+int check_alignment(uint64_t start, int block_size, const io_hints &hints);
+uint32_t gpt_alignment(const io_hints &hints, int block_size);
+void plan_area(const std::vector<part> &parts, uint64_t disk_len,
+			   unsigned int table_len, uint32_t align, gpt_area *area);
+gptpart make_gptpart(const part &p);
+void siphash128(const uint64_t key[2], const unsigned char *buf, size_t len,
+				unsigned char *out);
+__guid guid_from_bytes(const unsigned char *bytes, unsigned int version);
+void build_gpt(const PartitionArray &table, const char *mbr, bool keepmbr,
+			   uint64_t disk_len, uint32_t record_count, int block_size,
+			   const __guid &disk_guid, const gpt_area *area, char *headbuf,
+			   char *tailbuf, WritePlan &plan);
+int load_gpt_header(const char *block, int block_size, gpthdr *hdr);
+void seal_gpt_header(char *block, uint32_t part_sum);
+int verify_gpt(const char *primary, const char *secondary,
+			   uint64_t secondary_lba, uint64_t disk_len, int block_size,
+			   unsigned int table_len);
+
+#endif // LIBGPTGEN_INTERNAL_H
@@ -35,13 +35,20 @@ cleanup() {
 		echo "[test] SKIP_CLEANUP=$SKIP_CLEANUP - skipping test cleanup (for debug)"
 	else
 		echo "[test] Cleaning up..."
-		rm -f disk.img primary.img secondary.img
+		rm -f disk.img clone.img primary.img secondary.img stream.bin stats.json \
+			plan.img disk.plan uring.img undo.img undo.jnl \
+			edit.img guid1.img guid2.img align.img serve1.img serve2.img \
+			serve.plan gptgen.sock group1.img group2.img disk.qcow2 qcow2.rc
+	fi
+	if [ -n "$serve_pid" ]; then
+		kill "$serve_pid" 2>/dev/null || true
 	fi
 
 	if [ "$exit_code" != 0 ]; then
 		echo "[test] Error: Test failed! Last command returned: $exit_code"
 	fi
 }
+serve_pid=""
 trap cleanup EXIT INT TERM QUIT
 
 # Some of the utilities we're using, such as parted, may be in sbin because
@@ -81,9 +88,65 @@ do
 	fi
 done
 
+# be_bytes <n> <value>...: print each value as n big-endian bytes
+be_bytes() {
+	n="$1"
+	shift
+	printf "$(for v in "$@"; do
+		i=$((n - 1))
+		while [ "$i" -ge 0 ]; do
+			printf '\\%03o' $(((v >> (8 * i)) & 255))
+			i=$((i - 1))
+		done
+	done)"
+}
+
+# make_qcow2 <raw> <qcow2>: write the raw image (a multiple of 64 KiB, up to
+# 512 MiB) as a qcow2 version 3 image with 64 KiB clusters: the header, then
+# the refcount table, its only refcount block, the L1 table and the only L2
+# table, then the guest clusters in order from host cluster 5 on. The last
+# guest cluster is left unallocated, for gptgen to allocate when it writes the
+# secondary GPT there; it then lands at host cluster 5 on too.
+make_qcow2() {
+	size="$(du -b "$1" | awk '{print $1}')"
+	clusters=$((size / 65536))
+	dd if=/dev/zero of="$2" bs=65536 count=$((clusters + 4)) 2>/dev/null
+	{
+		printf 'QFI\373'
+		be_bytes 4 3 0 0 0 16
+		be_bytes 8 "$size"
+		be_bytes 4 0 1
+		be_bytes 8 $((3 * 65536)) $((1 * 65536))
+		be_bytes 4 1 0
+		be_bytes 8 0 0 0 0
+		be_bytes 4 4 104
+	} | put_cluster "$2" 0
+	be_bytes 8 $((2 * 65536)) | put_cluster "$2" 1
+	qcow2_refcounts $((clusters + 4)) | put_cluster "$2" 2
+	be_bytes 4 $((1 << 31)) $((4 * 65536)) | put_cluster "$2" 3
+	be_bytes 4 $(i=0; while [ "$i" -lt $((clusters - 1)) ]; do
+		echo $((1 << 31)) $(((5 + i) * 65536)); i=$((i + 1)); done) |
+		put_cluster "$2" 4
+	dd if="$1" bs=65536 count=$((clusters - 1)) 2>/dev/null |
+		put_cluster "$2" 5
+}
+
+# put_cluster <file> <n>: write stdin to the file from its 64 KiB cluster n on
+put_cluster() {
+	dd of="$1" bs=65536 seek="$2" conv=notrunc 2>/dev/null
+}
+
+# qcow2_refcounts <n>: a refcount block (16-bit refcounts) of n clusters in use
+qcow2_refcounts() {
+	be_bytes 2 $(i=0; while [ "$i" -lt "$1" ]; do echo 1; i=$((i + 1)); done)
+}
+
 echo "[test] Testing help output..."
 ./gptgen --help
 
+echo "[test] Cross-checking the CRC32 engines..."
+./gptgen --selftest
+
 echo "[test] Creating empty disk image..."
 dd if=/dev/zero of=disk.img bs=1M count=64
 
@@ -143,10 +206,173 @@ if [ "$HEXDUMP_DISK" = "1" ]; then
 	echo "[test] Printing the secondary GPT image (for debugging)..."
 	xxd -a secondary.img
 fi
-rm -f primary.img secondary.img
+
+echo "[test] Converting MBR to GPT from a stream (pipe mode)..."
+./gptgen -p -k --block-size "$block_size" < disk.img > stream.bin
+
+echo "[test] Does the stream hold both GPT images, framed?"
+# three 32-byte frame headers: primary, secondary and the end of the stream
+stream_size="$(du -b stream.bin | awk '{print $1}')"
+images_size="$(cat primary.img secondary.img | wc -c)"
+echo "[test] $stream_size bytes == $images_size + 96 bytes?"
+test "$stream_size" = "$((images_size + 96))"
+test "$(head -c 8 stream.bin)" = "GPTGENF1"
+rm -f primary.img secondary.img stream.bin
+
+echo "[test] Converting MBR to GPT in a clone of the disk image..."
+printf "${block_size}\r" | ./gptgen -k --clone clone.img disk.img
+clone_hash="$(md5sum clone.img | awk '{print $1}')"
+clone_size="$(du -b clone.img | awk '{print $1}')"
+
+echo "[test] Is the original disk image left unmodified?"
+echo "[test] $original_hash == $(md5sum disk.img | awk '{print $1}')?"
+test "$original_hash" = "$(md5sum disk.img | awk '{print $1}')"
+echo "[test] $original_size bytes == $clone_size bytes?"
+test "$original_size" = "$clone_size"
+
+echo "[test] Checking the disk image in batch mode (non-destructive)..."
+./gptgen --batch -k --block-size "$block_size" disk.img
+test "$original_hash" = "$(md5sum disk.img | awk '{print $1}')"
+
+echo "[test] Scanning the disk image for readiness (non-destructive)..."
+./gptgen --scan --block-size "$block_size" disk.img
+test "$original_hash" = "$(md5sum disk.img | awk '{print $1}')"
+
+echo "[test] Is a chain of more EBRs than --max-ebrs allows refused?"
+! ./gptgen -w -k --block-size "$block_size" --max-ebrs 1 disk.img
+test "$original_hash" = "$(md5sum disk.img | awk '{print $1}')"
+
+echo "[test] Planning a conversion, then applying it to a copy..."
+cp disk.img plan.img
+./gptgen -k --block-size "$block_size" --plan disk.plan plan.img
+echo "[test] Is the disk image left unmodified by planning?"
+test "$original_hash" = "$(md5sum plan.img | awk '{print $1}')"
+./gptgen --apply disk.plan plan.img
+plan_hash="$(md5sum plan.img | awk '{print $1}')"
+rm -f disk.plan plan.img
+
+echo "[test] Converting a copy with an undo journal, then undoing it..."
+cp disk.img undo.img
+./gptgen -w -k --block-size "$block_size" --journal undo.jnl undo.img
+./gptgen --undo undo.jnl undo.img
+echo "[test] Is the disk image back as it was?"
+test "$original_hash" = "$(md5sum undo.img | awk '{print $1}')"
+echo "[test] Is undoing again refused?"
+! ./gptgen --undo undo.jnl undo.img
+rm -f undo.img undo.jnl
+
+echo "[test] Converting two copies with the same GUID key..."
+cp disk.img guid1.img
+cp disk.img guid2.img
+./gptgen -w -k --block-size "$block_size" --guid-key test --guid-id disk guid1.img
+./gptgen -w -k --block-size "$block_size" --guid-key test --guid-id disk guid2.img
+echo "[test] Are the keyed GUIDs reproducible?"
+test "$(md5sum guid1.img | awk '{print $1}')" = "$(md5sum guid2.img | awk '{print $1}')"
+cp disk.img guid2.img
+./gptgen -w -k --block-size "$block_size" --guids random --verify guid2.img
+echo "[test] Do random GUIDs differ from the keyed ones?"
+test "$(md5sum guid1.img | awk '{print $1}')" != "$(md5sum guid2.img | awk '{print $1}')"
+rm -f guid1.img guid2.img
+
+echo "[test] Editing an entry of a converted copy in place..."
+cp disk.img edit.img
+./gptgen -w -k --block-size "$block_size" edit.img
+./gptgen --block-size "$block_size" --edit 1 --type 0x83 --name "edited" \
+	--flags 8000000000000000 --verify edit.img
+rm -f edit.img
+
+echo "[test] Converting a copy aligned to 64 KiB physical blocks..."
+cp disk.img align.img
+./gptgen -w -k --block-size "$block_size" --physical-block-size 65536 \
+	--io-opt 1048576 --verify align.img
+echo "[test] Is the moved secondary array found again?"
+./gptgen --block-size "$block_size" --verify-only align.img
+rm -f align.img
+
+echo "[test] Converting two copies as the members of a RAID1 group..."
+cp disk.img group1.img
+cp disk.img group2.img
+./gptgen --group -k --block-size "$block_size" group1.img group2.img
+./gptgen --group -w -k --block-size "$block_size" --verify group1.img group2.img
+group_hash="$(md5sum group1.img | awk '{print $1}')"
+test "$group_hash" = "$(md5sum group2.img | awk '{print $1}')"
+echo "[test] Is a group whose members have drifted apart refused?"
+cp disk.img group1.img
+cp disk.img group2.img
+parted -s group2.img -- type 6 0x8e
+! ./gptgen --group -w -k --block-size "$block_size" group1.img group2.img
+test "$original_hash" = "$(md5sum group1.img | awk '{print $1}')"
+# Failing a write on purpose takes a build with -DUSE_TEST_FAULTS=ON.
+if grep -q GPTGEN_TEST_FAIL_PRIMARY ./gptgen; then
+	echo "[test] Is the group rolled back when a member fails to write?"
+	cp disk.img group2.img
+	! GPTGEN_TEST_FAIL_PRIMARY=2 ./gptgen --group -w -k \
+		--block-size "$block_size" group1.img group2.img
+	test "$original_hash" = "$(md5sum group1.img | awk '{print $1}')"
+	test "$original_hash" = "$(md5sum group2.img | awk '{print $1}')"
+else
+	echo "[test] Skipping the group rollback, gptgen has no USE_TEST_FAULTS"
+fi
+rm -f group1.img group2.img
+
+echo "[test] Converting a qcow2 copy of the disk image..."
+make_qcow2 disk.img disk.qcow2
+./gptgen -w -k --block-size "$block_size" --verify disk.qcow2
+qcow2_hash="$(dd if=disk.qcow2 bs=65536 skip=5 2>/dev/null | md5sum |
+	awk '{print $1}')"
+echo "[test] Was the last cluster allocated, and counted, at the end?"
+test "$(du -b disk.qcow2 | awk '{print $1}')" = "$((original_size + 5 * 65536))"
+dd if=/dev/zero of=qcow2.rc bs=65536 count=1 2>/dev/null
+qcow2_refcounts $((original_size / 65536 + 5)) | put_cluster qcow2.rc 0
+test "$(dd if=disk.qcow2 bs=65536 skip=2 count=1 2>/dev/null | md5sum)" = \
+	"$(md5sum < qcow2.rc)"
+if command -v qemu-img 1>/dev/null 2>&1; then
+	qemu-img check disk.qcow2
+fi
+echo "[test] Is a qcow2 image whose L2 table points at its L1 table refused?"
+make_qcow2 disk.img disk.qcow2
+be_bytes 4 $((1 << 31)) $((3 * 65536)) | put_cluster disk.qcow2 4
+corrupt_hash="$(md5sum < disk.qcow2)"
+! ./gptgen -w -k --block-size "$block_size" disk.qcow2
+test "$corrupt_hash" = "$(md5sum < disk.qcow2)"
+rm -f disk.qcow2 qcow2.rc
+
+serve_hash=""
+if [ -x ./gptgen_client ]; then
+	echo "[test] Converting two copies through a gptgen --serve daemon..."
+	cp disk.img serve1.img
+	cp disk.img serve2.img
+	./gptgen --serve gptgen.sock -j 2 --block-size "$block_size" &
+	serve_pid=$!
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		[ -S gptgen.sock ] && break
+		sleep 1
+	done
+	./gptgen_client gptgen.sock scan serve1.img
+	./gptgen_client -k -o serve.plan gptgen.sock plan serve1.img
+	test -s serve.plan
+	./gptgen_client -k --verify gptgen.sock convert serve1.img serve2.img
+	./gptgen_client gptgen.sock verify serve1.img serve2.img
+	echo "[test] Is verifying an unconverted disk refused?"
+	cp disk.img serve2.img
+	! ./gptgen_client gptgen.sock verify serve2.img
+	echo "[test] Does the daemon stop cleanly, removing its socket?"
+	kill "$serve_pid"
+	wait "$serve_pid"
+	serve_pid=""
+	test ! -e gptgen.sock
+	serve_hash="$(md5sum serve1.img | awk '{print $1}')"
+	rm -f serve1.img serve2.img serve.plan
+fi
+
+echo "[test] Converting a copy through the io_uring engine..."
+cp disk.img uring.img
+./gptgen -w -k --block-size "$block_size" --io-engine io_uring --verify uring.img
+uring_hash="$(md5sum uring.img | awk '{print $1}')"
+rm -f uring.img
 
 echo "[test] Converting MBR to GPT in place (destructively on disk)..."
-printf "${block_size}\r" | ./gptgen -w -b mbr.img -k disk.img
+printf "${block_size}\r" | ./gptgen -w -b mbr.img -k --verify --stats stats.json disk.img
 run2_hash="$(md5sum disk.img | awk '{print $1}')"
 run2_size="$(du -b disk.img | awk '{print $1}')"
 
@@ -161,6 +387,42 @@ test "$original_hash" != "$run2_hash"
 echo "[test] $original_size bytes == $run2_size bytes?"
 test "$original_size" = "$run2_size"
 
+echo "[test] Does the clone match the disk converted in place?"
+echo "[test] $clone_hash == $run2_hash?"
+test "$clone_hash" = "$run2_hash"
+rm -f clone.img
+
+echo "[test] Does the applied plan match the disk converted in place?"
+echo "[test] $plan_hash == $run2_hash?"
+test "$plan_hash" = "$run2_hash"
+
+echo "[test] Does the io_uring conversion match the disk converted in place?"
+echo "[test] $uring_hash == $run2_hash?"
+test "$uring_hash" = "$run2_hash"
+
+echo "[test] Does the qcow2 conversion match the disk converted in place?"
+echo "[test] $qcow2_hash == $run2_hash?"
+test "$qcow2_hash" = "$run2_hash"
+
+echo "[test] Does the group's conversion match the disk converted in place?"
+echo "[test] $group_hash == $run2_hash?"
+test "$group_hash" = "$run2_hash"
+
+if [ -n "$serve_hash" ]; then
+	echo "[test] Does the daemon's conversion match the disk converted in place?"
+	echo "[test] $serve_hash == $run2_hash?"
+	test "$serve_hash" = "$run2_hash"
+fi
+
+echo "[test] Does the GPT written to the disk image verify on its own?"
+./gptgen --verify-only --block-size "$block_size" disk.img
+
+echo "[test] Were the statistics of the run written?"
+grep -q '"status": 0, "failed_phase": null' stats.json
+grep -q '"flush": ' stats.json
+grep -q '"verify": ' stats.json
+rm -f stats.json
+
 echo "[test] Were the primary and secondary GPT images created?"
 test ! -e primary.img
 test ! -e secondary.img